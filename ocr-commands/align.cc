@@ -30,6 +30,7 @@ namespace ocropus {
         autodel<IBookStore> bookstore;
         make_component(bookstore,cbookstore);
         bookstore->setPrefix(argv[1]);
+        autodel<BeamSearchContext> context(make_BeamSearchContext());
 //#pragma omp parallel for
         for(int page=0;page<bookstore->numberOfPages();page++) {
             int nlines = bookstore->linesOnPage(page);
@@ -51,11 +52,11 @@ namespace ocropus {
                 autodel<OcroFST> fst(make_OcroFST());
                 strg path = bookstore->path(page,line,0,"fst");
                 try {
-                    if(!file_exists(path)) {
+                    if(!bookstore->hasLattice(page,line)) {
                         debugf("warn","%s: not found\n",path.c_str());
                         continue;
                     }
-                    fst->load(path);
+                    bookstore->getLattice(*fst,page,line);
                 } catch(const char *error) {
                     fprintf(stderr,"%s: %s\n",path.c_str(),error);
                     if(abort_on_error) abort();
@@ -70,7 +71,7 @@ namespace ocropus {
                 intarray out;
                 floatarray costs;
                 try {
-                    beam_search(v1, v2, in, out, costs,
+                    beam_search(*context, v1, v2, in, out, costs,
                                 *fst, *gt_fst, beam_width);
                     // recolor rseg to cseg
                 } catch(const char *error) {
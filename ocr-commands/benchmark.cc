@@ -0,0 +1,383 @@
+// Project:
+// File: benchmark.cc
+// Purpose: timing of individual OCRopus components
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#define __warn_unused_result__ __far__
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include "colib/colib.h"
+#include "iulib/iulib.h"
+#include "ocropus.h"
+#include "ocr-commands.h"
+#include "fst-heap.h"
+#include "glinerec.h"
+#include "glmlp.h"
+#include "glann.h"
+
+namespace ocropus {
+    using namespace glinerec;
+
+    // Fill the n-best structure the way beam search does it: many
+    // candidates, drawn from a few times more state pairs than the beam
+    // width, most of them rejected.
+    static void benchmark_nbest(int width, int nops) {
+        PriorityQueue nbest(width);
+        intarray ids(nops);
+        floatarray values(nops);
+        for(int i = 0; i < nops; i++) {
+            ids[i] = rand() % (20 * width);
+            values[i] = -rand() / float(RAND_MAX);
+        }
+        double start = now();
+        int changed = 0;
+        for(int i = 0; i < nops; i++) {
+            if(i % (10 * width) == 0)
+                nbest.clear();
+            changed += nbest.add_replacing_id(ids[i], i, values[i]);
+        }
+        double elapsed = now() - start;
+        printf("nbest width %5d: %8.3f s, %10.0f ops/s, %d changes\n",
+               width, elapsed, nops / elapsed, changed);
+    }
+
+    static void benchmark_beam(const char *lattice, const char *lmodel,
+                               int width, int repeat, int threads) {
+        autodel<OcroFST> fst(make_OcroFST());
+        autodel<OcroFST> langmod(make_OcroFST());
+        fst->load(lattice);
+        langmod->load(lmodel);
+        autodel<BeamSearchContext> context(make_BeamSearchContext(threads));
+        intarray v1, v2, in, out;
+        floatarray costs;
+        double start = now();
+        for(int i = 0; i < repeat; i++)
+            beam_search(*context, v1, v2, in, out, costs,
+                        *fst, *langmod, width);
+        double elapsed = (now() - start) / repeat;
+        printf("beam width %5d, %d threads: %8.4f s per search, cost %g\n",
+               width, threads, elapsed, sum(costs));
+    }
+
+    // Time the beam search with each way of matching arcs, and show
+    // which ones the automatic choice used for how many state pairs.
+    static void benchmark_match(const char *lattice, const char *lmodel,
+                                int width, int repeat) {
+        autodel<OcroFST> fst(make_OcroFST());
+        autodel<OcroFST> langmod(make_OcroFST());
+        fst->load(lattice);
+        langmod->load(lmodel);
+        const char *names[] = {"auto", "merge", "gallop", "index"};
+        for(int m = BeamSearchContext::MATCH_AUTO;
+            m <= BeamSearchContext::MATCH_INDEX; m++) {
+            autodel<BeamSearchContext> context(make_BeamSearchContext());
+            context->setMatcher(m);
+            intarray v1, v2, in, out;
+            floatarray costs;
+            double start = now();
+            for(int i = 0; i < repeat; i++)
+                beam_search(*context, v1, v2, in, out, costs,
+                            *fst, *langmod, width);
+            double elapsed = (now() - start) / repeat;
+            intarray counts;
+            context->getMatchCounts(counts);
+            printf("match %-6s: %8.4f s per search, cost %g, "
+                   "merge %d gallop %d index %d\n",
+                   names[m], elapsed, sum(costs),
+                   counts[BeamSearchContext::MATCH_MERGE] / repeat,
+                   counts[BeamSearchContext::MATCH_GALLOP] / repeat,
+                   counts[BeamSearchContext::MATCH_INDEX] / repeat);
+        }
+    }
+
+    static double file_megabytes(const char *path) {
+        struct stat st;
+        if(stat(path,&st)) throwf("%s: cannot stat",path);
+        return st.st_size / 1048576.0;
+    }
+
+    static void benchmark_fstio(const char *path, const char *tmpfile,
+                                int repeat) {
+        autodel<OcroFST> fst(make_OcroFST());
+        fst->load(path);
+        double mb = file_megabytes(path);
+        double start = now();
+        for(int i = 0; i < repeat; i++)
+            fst->load(path);
+        double load = (now() - start) / repeat;
+        start = now();
+        for(int i = 0; i < repeat; i++)
+            fst->save(tmpfile);
+        double save = (now() - start) / repeat;
+        unlink(tmpfile);
+        printf("fstio %s (%.2f MB, %d states, %d arcs)\n",
+               path, mb, fst->nStates(), fst->nArcs());
+        printf("load: %8.4f s, %8.1f MB/s\n", load, mb / load);
+        printf("save: %8.4f s, %8.1f MB/s\n", save, mb / save);
+    }
+
+    // The forward pass as MlpClassifier computed it before the kernels
+    // in glmlp.cc: column by column, with temporary arrays.
+    static void mlp_reference(floatarray &z, floatarray &w1, floatarray &b1,
+                              floatarray &w2, floatarray &b2, floatarray &x) {
+        floatarray y;
+        for(int layer = 0; layer < 2; layer++) {
+            floatarray &w = layer ? w2 : w1;
+            floatarray &b = layer ? b2 : b1;
+            floatarray &in = layer ? y : x;
+            floatarray &out = layer ? z : y;
+            out.resize(w.dim(0));
+            out.fill(0);
+            for(int j = 0; j < w.dim(1); j++) {
+                float value = in(j);
+                if(value == 0) continue;
+                for(int i = 0; i < w.dim(0); i++)
+                    out(i) += w(i,j) * value;
+            }
+            for(int i = 0; i < out.length(); i++)
+                out(i) = 1.0 / (1.0 + exp(-min(max(out(i) + b(i), -20.0f), 20.0f)));
+        }
+    }
+
+    static void mlp_kernels(floatarray &z, floatarray &w1, floatarray &b1,
+                            floatarray &w2, floatarray &b2, floatarray &x,
+                            floatarray &y, bool fast) {
+        y.resize(w1.dim(0));
+        z.resize(w2.dim(0));
+        mlp_affine(y.data, w1.data, b1.data, x.data, w1.dim(0), w1.dim(1));
+        mlp_sigmoid(y.data, y.length(), fast);
+        mlp_affine(z.data, w2.data, b2.data, y.data, w2.dim(0), w2.dim(1));
+        mlp_sigmoid(z.data, z.length(), fast);
+    }
+
+    // Time the MLP forward pass on random weights and inputs, before and
+    // after vectorization, and optionally a whole classifier model, one
+    // sample at a time and in batches.
+    static void benchmark_mlp(const char *model, int ninput, int nhidden,
+                              int noutput, int nsamples, int batch_size) {
+        floatarray w1(nhidden, ninput), b1(nhidden);
+        floatarray w2(noutput, nhidden), b2(noutput);
+        floatarray inputs(nsamples, ninput);
+        for(int i = 0; i < w1.length1d(); i++) w1.at1d(i) = rand() / float(RAND_MAX) - 0.5;
+        for(int i = 0; i < w2.length1d(); i++) w2.at1d(i) = rand() / float(RAND_MAX) - 0.5;
+        for(int i = 0; i < nhidden; i++) b1(i) = rand() / float(RAND_MAX) - 0.5;
+        for(int i = 0; i < noutput; i++) b2(i) = rand() / float(RAND_MAX) - 0.5;
+        for(int i = 0; i < inputs.length1d(); i++) inputs.at1d(i) = rand() / float(RAND_MAX);
+        floatarray x, y, z, ref;
+        const char *names[] = {"reference", "exact", "fast"};
+        for(int k = 0; k < 3; k++) {
+            double start = now();
+            for(int i = 0; i < nsamples; i++) {
+                rowget(x, inputs, i);
+                if(k == 0) mlp_reference(z, w1, b1, w2, b2, x);
+                else mlp_kernels(z, w1, b1, w2, b2, x, y, k == 2);
+            }
+            double elapsed = now() - start;
+            mlp_reference(ref, w1, b1, w2, b2, x);
+            double error = 0;
+            for(int i = 0; i < noutput; i++)
+                error = max(error, double(fabs(z(i) - ref(i))));
+            printf("mlp %-9s %4d-%d-%d: %10.0f chars/s, max error %g\n",
+                   names[k], ninput, nhidden, noutput, nsamples / elapsed, error);
+        }
+        printf("mlp kernels: %s\n", mlp_kernel_name());
+        if(!model) return;
+        autodel<IModel> classifier;
+        classifier = dynamic_cast<IModel*>(load_component(stdio(model, "r")));
+        CHECK_ARG(!!classifier);
+        ninput = classifier->nfeatures();
+        if(ninput < 0) throwf("%s: model does not report its number of features", model);
+        floatarray samples(nsamples, ninput);
+        for(int i = 0; i < samples.length1d(); i++) samples.at1d(i) = rand() / float(RAND_MAX);
+        OutputVector ov;
+        double start = now();
+        for(int i = 0; i < nsamples; i++) {
+            rowget(x, samples, i);
+            classifier->xoutputs(ov, x);
+        }
+        double elapsed = now() - start;
+        printf("mlp %s (%s): %10.0f chars/s\n",
+               model, classifier->name(), nsamples / elapsed);
+        narray<OutputVector> ovs;
+        floatarray costs, batch;
+        start = now();
+        for(int i = 0; i < nsamples; i += batch_size) {
+            int n = min(batch_size, nsamples - i);
+            batch.resize(n, ninput);
+            for(int j = 0; j < batch.length1d(); j++) batch.at1d(j) = samples.at1d(i * ninput + j);
+            classifier->xoutputs_batch(ovs, costs, batch);
+        }
+        elapsed = now() - start;
+        printf("mlp %s (%s), batches of %d: %10.0f chars/s\n",
+               model, classifier->name(), batch_size, nsamples / elapsed);
+    }
+
+    // Train the automatic MLP on a dataset one sample at a time and
+    // with mini-batches, and compare the throughput and the error.
+    static void benchmark_mlptrain(const char *path, const char *cdataset) {
+        autodel<IDataset> ds;
+        make_component(cdataset, ds);
+        ds->load(path);
+        printf("mlptrain %s: %d samples, %d features, %d classes\n",
+               path, ds->nsamples(), ds->nfeatures(), ds->nclasses());
+        int batches[] = {1, 8, 32};
+        for(int i = 0; i < 3; i++) {
+            autodel<IModel> model;
+            make_component("mlp", model);
+            model->pset("batch", batches[i]);
+            double start = now();
+            model->xtrain(*ds);
+            double elapsed = now() - start;
+            double presentations = model->pgetf("%presentations");
+            printf("mlptrain batch %3d: %8.1f s, %10.0f samples/s, error %g\n",
+                   batches[i], elapsed, presentations / elapsed,
+                   model->pgetf("%error"));
+        }
+    }
+
+    // Classify a held-out dataset with a model and its int8 quantized
+    // copy, and compare error rates and throughput.
+    static void benchmark_qmlp(const char *model, const char *path,
+                               const char *cdataset) {
+        autodel<IDataset> ds;
+        make_component(cdataset, ds);
+        ds->load(path);
+        autodel<IModel> models[2];
+        for(int k = 0; k < 2; k++) {
+            models[k] = dynamic_cast<IModel*>(load_component(stdio(model, "r")));
+            CHECK_ARG(!!models[k]);
+        }
+        quantize_model(models[1]);
+        const char *names[] = {"float32", "int8"};
+        int n = ds->nsamples();
+        intarray predicted(2, n);
+        floatarray v;
+        OutputVector ov;
+        for(int k = 0; k < 2; k++) {
+            int errors = 0;
+            double elapsed = 0;
+            for(int i = 0; i < n; i++) {
+                ds->input(v, i);
+                double start = now();
+                models[k]->xoutputs(ov, v);
+                elapsed += now() - start;
+                predicted(k, i) = ov.argmax();
+                if(predicted(k, i) != ds->cls(i)) errors++;
+            }
+            printf("qmlp %-7s (%s): %10.0f chars/s, error %g (%d/%d)\n",
+                   names[k], models[k]->name(), n / elapsed,
+                   errors / float(n), errors, n);
+        }
+        int agree = 0;
+        for(int i = 0; i < n; i++)
+            agree += (predicted(0, i) == predicted(1, i));
+        printf("qmlp agreement %g, kernels %s\n", agree / float(n), mlp_kernel_name_i8());
+    }
+
+    // Nearest neighbors of the last nqueries samples of a dataset among
+    // (up to) the first nsamples: build time of the HNSW index, and
+    // queries/s and recall@k against the exhaustive scan for several
+    // search widths.
+    static void benchmark_ann(const char *path, const char *cdataset,
+                              int nsamples, int nqueries, int k) {
+        autodel<IDataset> ds;
+        make_component(cdataset, ds);
+        ds->load(path);
+        int total = ds->nsamples();
+        CHECK_ARG(nqueries > 0 && nqueries < total);
+        int n = min(nsamples, total - nqueries);
+        floatarray data, queries, v;
+        for(int i = 0; i < n; i++) {
+            ds->input1d(v, i);
+            rowpush(data, v);
+        }
+        for(int i = total - nqueries; i < total; i++) {
+            ds->input1d(v, i);
+            rowpush(queries, v);
+        }
+        RowPoints points(data);
+        autodel<INearestIndex> scan(make_ScanIndex());
+        autodel<INearestIndex> hnsw(make_HnswIndex());
+        scan->build(points);
+        double start = now();
+        hnsw->build(points);
+        printf("ann %d points, %d dims, build %.2fs\n",
+               n, data.dim(1), now() - start);
+        narray<intarray> truth(nqueries);
+        intarray ids;
+        floatarray distances;
+        start = now();
+        for(int q = 0; q < nqueries; q++) {
+            rowget(v, queries, q);
+            scan->search(truth(q), distances, points, v, k);
+        }
+        printf("ann scan     %10.0f queries/s\n", nqueries / (now() - start));
+        int efs[] = {10, 20, 50, 100, 200};
+        for(int e = 0; e < 5; e++) {
+            int found = 0, wanted = 0;
+            start = now();
+            for(int q = 0; q < nqueries; q++) {
+                rowget(v, queries, q);
+                hnsw->search(ids, distances, points, v, k, efs[e]);
+                for(int i = 0; i < truth(q).length(); i++)
+                    for(int j = 0; j < ids.length(); j++)
+                        if(ids(j) == truth(q)(i)) { found++; break; }
+                wanted += truth(q).length();
+            }
+            double elapsed = now() - start;
+            printf("ann hnsw ef=%-3d %10.0f queries/s, recall@%d %.4f\n",
+                   efs[e], nqueries / elapsed, k, found / float(wanted));
+        }
+    }
+
+    int main_benchmark(int argc,char **argv) {
+        param_int repeat("repeat",10,"number of repetitions");
+        param_int nops("nops",10000000,"number of operations for synthetic benchmarks");
+        param_int threads("threads",1,"threads per beam search");
+        param_int ninput("ninput",800,"inputs of the synthetic MLP");
+        param_int nhidden("nhidden",100,"hidden units of the synthetic MLP");
+        param_int noutput("noutput",100,"outputs of the synthetic MLP");
+        param_int nsamples("nsamples",10000,"samples for classifier benchmarks");
+        param_int batch_size("batch",64,"samples per batch for classifier benchmarks");
+        param_int nqueries("nqueries",1000,"queries for the nearest neighbor benchmark");
+        param_int knn("knn",10,"neighbors per query for the nearest neighbor benchmark");
+        param_string cdataset("cdataset","rowdataset8","dataset component");
+        param_string tmpfile("tmpfile","/tmp/ocropus-benchmark.fst","scratch file for writing benchmarks");
+        if(argc<2) throw "usage: ocropus benchmark what ...";
+        const char *what = argv[1];
+        int widths[] = {100, 1000, 5000};
+        if(!strcmp(what,"nbest")) {
+            for(int i=0;i<3;i++)
+                benchmark_nbest(widths[i],nops);
+        } else if(!strcmp(what,"beam")) {
+            if(argc!=4) throw "usage: ocropus benchmark beam lattice.fst lmodel.fst";
+            for(int i=0;i<3;i++)
+                benchmark_beam(argv[2],argv[3],widths[i],repeat,threads);
+        } else if(!strcmp(what,"match")) {
+            if(argc!=4) throw "usage: ocropus benchmark match lattice.fst lmodel.fst";
+            benchmark_match(argv[2],argv[3],widths[1],repeat);
+        } else if(!strcmp(what,"fstio")) {
+            if(argc!=3) throw "usage: ocropus benchmark fstio input.fst";
+            benchmark_fstio(argv[2],tmpfile,repeat);
+        } else if(!strcmp(what,"mlp")) {
+            if(argc>3) throw "usage: ocropus benchmark mlp [model]";
+            benchmark_mlp(argc==3?argv[2]:0,ninput,nhidden,noutput,nsamples,batch_size);
+        } else if(!strcmp(what,"mlptrain")) {
+            if(argc!=3) throw "usage: ocropus benchmark mlptrain dataset";
+            benchmark_mlptrain(argv[2],cdataset);
+        } else if(!strcmp(what,"qmlp")) {
+            if(argc!=4) throw "usage: ocropus benchmark qmlp model dataset";
+            benchmark_qmlp(argv[2],argv[3],cdataset);
+        } else if(!strcmp(what,"ann")) {
+            if(argc!=3) throw "usage: ocropus benchmark ann dataset";
+            benchmark_ann(argv[2],cdataset,nsamples,nqueries,knn);
+        } else {
+            throwf("%s: unknown benchmark",what);
+        }
+        return 0;
+    }
+}
@@ -19,8 +19,27 @@
 #include "glinerec.h"
 #include "bookstore.h"
 #include "ocr-commands.h"
+#include "fst-io.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace ocropus {
+    // The pages are recognized in parallel; with beam_threads>1 every
+    // page also expands its beams on beam_threads threads, which needs
+    // a second active level of parallelism.  Returns the number of
+    // threads for the pages, so that there are no more threads in
+    // total than without beam_threads.
+    static int page_threads(int beam_threads) {
+#ifdef _OPENMP
+        if(beam_threads<=1) return omp_get_max_threads();
+        omp_set_max_active_levels(2);
+        return max(1,omp_get_max_threads()/beam_threads);
+#else
+        return 1;
+#endif
+    }
+
     void store_costs(const char *base, floatarray &costs) {
         stdio stream(base,"w");
         for(int i=0;i<costs.length();i++) {
@@ -85,12 +104,16 @@ namespace ocropus {
         param_string lmodel("lmodel",DEFAULT_DATA_DIR "/default.fst","language model used for recognition");
         param_string cbookstore("bookstore","SmartBookStore","storage abstraction for book");
         param_int beam_width("beam_width", 100, "number of nodes in a beam generation");
+        param_int beam_threads("beam_threads", 1, "threads expanding one beam (for books with few pages)");
         if(argc!=2) throw "usage: lmodel=... ocropus fsts2text dir";
+        // The language model is loaded once and shared by all threads;
+        // it is never modified, the scale is applied by beam_search.
         autodel<OcroFST> langmod;
         try {
             langmod = make_OcroFST();
+            debugf("info","lmodel=%s\n",(const char *)lmodel);
             langmod->load(lmodel);
-            langmod = 0;
+            langmod->sortByInput();
         } catch(const char *s) {
             throwf("%s: failed to load (%s)",(const char*)lmodel,s);
         } catch(...) {
@@ -101,67 +124,162 @@ namespace ocropus {
         make_component(bookstore,cbookstore);
         bookstore->setPrefix(argv[1]);
         debugf("info","langmod_scale = %g\n",float(langmod_scale));
-#pragma omp parallel for private(langmod)
-        for(int page=0;page<bookstore->numberOfPages();page++) {
-            int nlines = bookstore->linesOnPage(page);
-                for(int j=0;j<nlines;j++) {
-                    if(!langmod) {
-                        langmod = make_OcroFST();
-                        debugf("info","lmodel=%s\n",(const char *)lmodel);
-                        langmod->load(lmodel);
-                        scale_fst(*langmod,langmod_scale);
-                        CHECK(!!langmod);
+        int npages = page_threads(beam_threads);
+#pragma omp parallel num_threads(npages)
+        {
+            // per-thread search buffers, reused for every line
+            autodel<BeamSearchContext> context(make_BeamSearchContext(beam_threads));
+#pragma omp for
+            for(int page=0;page<bookstore->numberOfPages();page++) {
+                int nlines = bookstore->linesOnPage(page);
+                    for(int j=0;j<nlines;j++) {
+                        int line = bookstore->getLineId(page,j);
+                        debugf("progress","page %04d %06x\n",page,line);
+                        autodel<OcroFST> fst(make_OcroFST());
+                        try {
+                            bookstore->getLattice(*fst,page,line);
+                            CHECK(!!fst);
+                        } catch(const char *error) {
+                            fprintf(stderr,"%04d %06x: can't load fst: %s\n",page,line,error);
+                            if(abort_on_error) abort();
+                            continue;
+                        }
+                        ustrg str;
+                        try {
+                            intarray v1;
+                            intarray v2;
+                            intarray in;
+                            intarray out;
+                            floatarray costs;
+                            beam_search(*context, v1, v2, in, out, costs,
+                                        *fst, *langmod, beam_width, langmod_scale);
+                            double cost = sum(costs);
+                            remove_epsilons(str, out);
+                            if(cost < 1e10) {
+                                utf8strg utf8Output;
+                                str.utf8EncodeTerm(utf8Output);
+                                debugf("transcript","%04d %06x\t%s\n",page,line, utf8Output.c_str());
+                                try {
+                                    intarray rseg;
+                                    read_image_packed(rseg, bookstore->path(page,line,"rseg","png"));
+                                    make_line_segmentation_black(rseg);
+                                    intarray cseg;
+                                    rseg_to_cseg(cseg, rseg, in);
+                                    ::make_line_segmentation_white(cseg);
+                                    write_image_packed(bookstore->path(page,line,"cseg","png"),cseg);
+                                } catch(const char *err) {
+                                    fprintf(stderr,"ERROR in cseg reconstruction: %s\n",err);
+                                    if(abort_on_error) abort();
+                                }
+                                strg s(bookstore->path(page,line,0,"txt"));
+                                fprintf(stdio(s,"w"),"%s\n",utf8Output.c_str());
+                            } else {
+                                debugf("warn","%04d %06x failed to match language model\n",page,line);
+                            }
+                        } catch(const char *error) {
+                            fprintf(stderr,"ERROR in bestpath: %s\n",error);
+                            if(abort_on_error) abort();
+                        }
                     }
+            }
+        }
+
+        return 0;
+    }
+
+    int main_compilefst(int argc,char **argv) {
+        if(argc!=3) throw "usage: ocropus compilefst input.fst output.cfst";
+        autodel<OcroFST> fst(make_OcroFST());
+        fst->load(argv[1]);
+        // compiled models are mostly used as the second FST in beam_search
+        fst->sortByInput();
+        fst_write_compiled(argv[2],*fst);
+        return 0;
+    }
+
+    int main_fstopt(int argc,char **argv) {
+        param_bool determinize("determinize",1,"determinize the FST (label pairs)");
+        param_bool minimize("minimize",1,"merge equivalent states");
+        param_int max_states("max_states",10000000,"give up determinizing beyond this many states");
+        if(argc!=3) throw "usage: ocropus fstopt input.fst output.fst";
+        autodel<OcroFST> fst(make_OcroFST());
+        fst->load(argv[1]);
+        autodel<OcroFST> result(make_OcroFST());
+        fst_optimize(*result,*fst,determinize,minimize,max_states);
+        debugf("info","%d states, %d arcs -> %d states, %d arcs\n",
+               fst->nStates(),fst->nArcs(),result->nStates(),result->nArcs());
+        result->sortByInput();
+        result->save(argv[2]);
+        return 0;
+    }
+
+    int main_fsts2nbest(int argc,char **argv) {
+        param_bool abort_on_error("abort_on_error",0,"abort recognition if there is an unexpected error");
+        param_float langmod_scale("langmod_scale",0.3,"scale factor for language model");
+        param_string lmodel("lmodel",DEFAULT_DATA_DIR "/default.fst","language model used for recognition (empty for none)");
+        param_string cbookstore("bookstore","SmartBookStore","storage abstraction for book");
+        param_int beam_width("beam_width", 100, "number of nodes in a beam generation");
+        param_int beam_threads("beam_threads", 1, "threads expanding one beam (for books with few pages)");
+        param_int nbest("nbest", 10, "number of transcriptions per line");
+        if(argc!=2) throw "usage: lmodel=... nbest=... ocropus fsts2nbest dir";
+        autodel<OcroFST> langmod;
+        if(strlen(lmodel)>0) {
+            try {
+                langmod = make_OcroFST();
+                debugf("info","lmodel=%s\n",(const char *)lmodel);
+                langmod->load(lmodel);
+                langmod->sortByInput();
+            } catch(const char *s) {
+                throwf("%s: failed to load (%s)",(const char*)lmodel,s);
+            }
+        }
+
+        autodel<IBookStore> bookstore;
+        make_component(bookstore,cbookstore);
+        bookstore->setPrefix(argv[1]);
+        int npages = page_threads(beam_threads);
+#pragma omp parallel num_threads(npages)
+        {
+            autodel<BeamSearchContext> context(make_BeamSearchContext(beam_threads));
+#pragma omp for
+            for(int page=0;page<bookstore->numberOfPages();page++) {
+                int nlines = bookstore->linesOnPage(page);
+                for(int j=0;j<nlines;j++) {
                     int line = bookstore->getLineId(page,j);
                     debugf("progress","page %04d %06x\n",page,line);
                     autodel<OcroFST> fst(make_OcroFST());
                     try {
-                        fst->load(bookstore->path(page,line,0,"fst"));
-                        CHECK(!!fst);
+                        bookstore->getLattice(*fst,page,line);
                     } catch(const char *error) {
                         fprintf(stderr,"%04d %06x: can't load fst: %s\n",page,line,error);
                         if(abort_on_error) abort();
                         continue;
                     }
-                    ustrg str;
                     try {
-                        intarray v1;
-                        intarray v2;
-                        intarray in;
-                        intarray out;
-                        floatarray costs;
-                        beam_search(v1, v2, in, out, costs,
-                                    *fst, *langmod, beam_width);
-                        double cost = sum(costs);
-                        remove_epsilons(str, out);
-                        if(cost < 1e10) {
+                        objlist<intarray> v1, v2, in, out;
+                        objlist<floatarray> costs;
+                        if(!langmod)
+                            nbest_paths(in, v1, out, costs, *fst, nbest);
+                        else
+                            beam_search_nbest(*context, v1, v2, in, out, costs,
+                                              *fst, *langmod, nbest,
+                                              beam_width, langmod_scale);
+                        strg s(bookstore->path(page,line,"nbest","txt"));
+                        stdio stream(s,"w");
+                        for(int k=0;k<out.length();k++) {
+                            ustrg str;
+                            remove_epsilons(str, out[k]);
                             utf8strg utf8Output;
                             str.utf8EncodeTerm(utf8Output);
-                            debugf("transcript","%04d %06x\t%s\n",page,line, utf8Output.c_str());
-                            try {
-                                intarray rseg;
-                                read_image_packed(rseg, bookstore->path(page,line,"rseg","png"));
-                                make_line_segmentation_black(rseg);
-                                intarray cseg;
-                                rseg_to_cseg(cseg, rseg, in);
-                                ::make_line_segmentation_white(cseg);
-                                write_image_packed(bookstore->path(page,line,"cseg","png"),cseg);
-                            } catch(const char *err) {
-                                fprintf(stderr,"ERROR in cseg reconstruction: %s\n",err);
-                                if(abort_on_error) abort();
-                            }
-                            strg s(bookstore->path(page,line,0,"txt"));
-                            fprintf(stdio(s,"w"),"%s\n",utf8Output.c_str());
-                        } else {
-                            debugf("warn","%04d %06x failed to match language model\n",page,line);
+                            fprintf(stream,"%g\t%s\n",sum(costs[k]),utf8Output.c_str());
                         }
                     } catch(const char *error) {
-                        fprintf(stderr,"ERROR in bestpath: %s\n",error);
+                        fprintf(stderr,"ERROR in nbest: %s\n",error);
                         if(abort_on_error) abort();
                     }
                 }
+            }
         }
-
         return 0;
     }
 
@@ -180,7 +298,7 @@ namespace ocropus {
                 debugf("progress","page %04d %06x\n",page,line);
                 autodel<OcroFST> fst(make_OcroFST());
                 try {
-                    fst->load(bookstore->path(page,line,0,"fst"));
+                    bookstore->getLattice(*fst,page,line);
                 } catch(const char *error) {
                     fprintf(stderr,"cannot load %04d %06x: %s\n",page,line,error);
                     if(abort_on_error) abort();
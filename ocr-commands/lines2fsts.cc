@@ -81,10 +81,7 @@ namespace ocropus {
                     }
                     debugf("progress","page %04d line %06x\n",page,line);
                     if(continue_partial) {
-                        strg s;
-                        FILE *stream = bookstore->open("r",page,line,0,"fst");
-                        if(stream) {
-                            fclose(stream);
+                        if(bookstore->hasLattice(page,line)) {
                             // finished++;
                             // eval_lines++;
                             continue;
@@ -122,8 +119,7 @@ namespace ocropus {
 
                     if(save_fsts) {
                         strg s;
-                        s = bookstore->path(page,line,0,"fst");
-                        result->save(s);
+                        bookstore->putLattice(*result,page,line);
                         if(segmentation.length()>0) {
                             dsection("line_segmentation");
                             make_line_segmentation_white(segmentation);
@@ -196,6 +192,8 @@ namespace ocropus {
                     continue;
                 }
             }
+            // with lattice_archive=1, this writes the page's archive
+            bookstore->flushLattices();
         }
 
         debugf("info","rate %g errs %d ntrue %d npred %d lines %d nogt %d\n",
@@ -687,6 +687,62 @@ namespace ocropus {
         return 0;
     }
 
+    int main_trainstream(int argc,char **argv) {
+        param_string cmodel("cmodel","mlp","classifier component");
+        param_string cdataset("cdataset","MmapDataset8","dataset component");
+        if(argc<4) throw "usage: ... model shard... heldout";
+        if(file_exists(argv[1])) throwf("%s: already exists",argv[1]);
+        narray< autodel<IDataset> > shards(argc-2);
+        for(int i=0;i<shards.length();i++) {
+            make_component(cdataset,shards(i));
+            // the shards are read in blocks, and each block is
+            // prefetched explicitly
+            shards(i)->pset("advice","random");
+            shards(i)->load(argv[i+2]);
+            debugf("info","%s: %d nsamples, %d nfeatures, %d nclasses\n",argv[i+2],
+                   shards(i)->nsamples(),shards(i)->nfeatures(),shards(i)->nclasses());
+        }
+        autodel<IModel> model;
+        make_component(cmodel,model);
+        train_streaming(*model,shards);
+        save_component(stdio(argv[1],"w"),model);
+        return 0;
+    }
+
+    int main_dsconvert(int argc,char **argv) {
+        param_string cdataset("cdataset","rowdataset8","dataset component");
+        param_bool pfloat("float",0,"store floats instead of float8 values");
+        if(argc!=3) throw "usage: ... input output";
+        if(file_exists(argv[2])) throwf("%s: already exists",argv[2]);
+        autodel<IDataset> ds;
+        make_component(cdataset,ds);
+        ds->load(argv[1]);
+        debugf("info","%d nsamples, %d nfeatures, %d nclasses\n",
+               ds->nsamples(),ds->nfeatures(),ds->nclasses());
+        if(pfloat) mmap_dataset_write<float>(stdio(argv[2],"wb"),*ds);
+        else mmap_dataset_write<float8>(stdio(argv[2],"wb"),*ds);
+        return 0;
+    }
+
+    int main_quantize(int argc,char **argv) {
+        if(argc!=3) throw "usage: ... input output";
+        if(file_exists(argv[2])) throwf("%s: already exists",argv[2]);
+        autodel<IComponent> component;
+        component = load_component(stdio(argv[1],"r"));
+        CHECK(!!component);
+        if(IModel *model = dynamic_cast<IModel*>(component.ptr())) {
+            autodel<IModel> quantized(model);
+            component.move();
+            quantize_model(quantized);
+            save_component(stdio(argv[2],"w"),quantized);
+        } else {
+            const char *args[] = {"quantize",0};
+            component->command(args);
+            save_component(stdio(argv[2],"w"),component);
+        }
+        return 0;
+    }
+
     int main_bookstore(int argc,char **argv) {
         param_string cbookstore("bookstore","SmartBookStore","storage abstraction for book");
         autodel<IBookStore> bookstore;
@@ -800,6 +856,12 @@ namespace ocropus {
                 "find the best interpretation of the fsts in dir/... without a language model");
         D("fsts2textdir",
                 "find the best interpretation of the fsts in dir/...; lmodel=...");
+        D("fsts2nbest dir",
+                "write the nbest=... best interpretations of the fsts in dir/... with their costs; lmodel=...");
+        D("compilefst input.fst output.cfst",
+                "convert a language model into a compiled FST (sorted, with search heuristics) that is mapped into memory and shared when loaded");
+        D("fstopt input.fst output.fst",
+                "remove epsilons from an FST, determinize and minimize it; determinize=... minimize=...");
         SECTION("evaluation");
         D("evaluate dir",
                 "evaluate the quality of the OCR output in dir/...");
@@ -818,6 +880,12 @@ namespace ocropus {
                 "perform dataset extraction on the book directory and save it");
         D("loadseg model dataset",
                 "perform training on the dataset (saveseg + loadseg is the same as trainseg)");
+        D("trainstream model shard... heldout",
+                "train an MLP (-cmodel) from converted datasets without loading them; the last one is used for cross-validation");
+        D("dsconvert input output",
+                "convert a dataset (-cdataset) for memory mapping (-cdataset MmapDataset8 when training)");
+        D("quantize input output",
+                "replace the MLPs of a classifier or line recognizer model by copies with int8 weights");
         SECTION("other recognizers");
         D("recognize1 logdir model line1 line2...",
                 "recognize images of individual lines of text given on the command line; ocrolog=glr ocrologdir=...");
@@ -830,6 +898,23 @@ namespace ocropus {
                 "output the available parameters for the given component");
         D("cinfo model",
                 "load the classifier model and print information on it");
+        SECTION("benchmarks");
+        D("benchmark nbest",
+                "time the n-best structure of the beam search for beam widths 100, 1000 and 5000");
+        D("benchmark beam lattice.fst lmodel.fst",
+                "time beam search with beam widths 100, 1000 and 5000");
+        D("benchmark match lattice.fst lmodel.fst",
+                "time beam search with each arc matcher (merge, gallop, label index) and count the automatic choices");
+        D("benchmark fstio input.fst",
+                "measure the FST load and save throughput in MB/s");
+        D("benchmark mlptrain dataset",
+                "train an MLP one sample at a time and with mini-batches, and compare samples/s and error");
+        D("benchmark qmlp model dataset",
+                "classify a held-out dataset with the model and its int8 quantized copy; compare error and chars/s");
+        D("benchmark mlp [model]",
+                "time the MLP forward pass before and after vectorization, and the given classifier alone and in batches");
+        D("benchmark ann dataset",
+                "time the HNSW nearest neighbor index against the exhaustive scan and report its recall");
         SECTION("results");
         D("buildhtml dir",
                 "creates an HTML representation of the OCR output in dir/...");
@@ -853,6 +938,10 @@ namespace ocropus {
     extern int main_align(int argc,char **argv);
     extern int main_fsts2text(int argc,char **argv);
     extern int main_fsts2bestpaths(int argc,char **argv);
+    extern int main_compilefst(int argc,char **argv);
+    extern int main_fstopt(int argc,char **argv);
+    extern int main_fsts2nbest(int argc,char **argv);
+    extern int main_benchmark(int argc,char **argv);
 
     void load_extensions(const char *dir) {
 #ifdef DLOPEN
@@ -901,9 +990,15 @@ namespace ocropus {
             if(!strcmp(argv[1],"findconf")) return main_findconf(argc-1,argv+1);
             if(!strcmp(argv[1],"fsts2bestpaths")) return main_fsts2bestpaths(argc-1,argv+1);
             if(!strcmp(argv[1],"fsts2text")) return main_fsts2text(argc-1,argv+1);
+            if(!strcmp(argv[1],"compilefst")) return main_compilefst(argc-1,argv+1);
+            if(!strcmp(argv[1],"fstopt")) return main_fstopt(argc-1,argv+1);
+            if(!strcmp(argv[1],"fsts2nbest")) return main_fsts2nbest(argc-1,argv+1);
             extern int main_lines2fsts(int,char **);
             if(!strcmp(argv[1],"lines2fsts")) return main_lines2fsts(argc-1,argv+1);
             if(!strcmp(argv[1],"trainmodel")) return main_trainmodel(argc-1,argv+1);
+            if(!strcmp(argv[1],"quantize")) return main_quantize(argc-1,argv+1);
+            if(!strcmp(argv[1],"trainstream")) return main_trainstream(argc-1,argv+1);
+            if(!strcmp(argv[1],"dsconvert")) return main_dsconvert(argc-1,argv+1);
             if(!strcmp(argv[1],"align")) return main_align(argc-1,argv+1);
             if(!strcmp(argv[1],"page")) return main_page(argc-1,argv+1);
             if(!strcmp(argv[1],"pages2images")) return main_pages2images(argc-1,argv+1);
@@ -919,6 +1014,7 @@ namespace ocropus {
             if(!strcmp(argv[1],"show")) return main_show(argc-1,argv+1);
             if(!strcmp(argv[1],"showseg")) return main_showseg(argc-1,argv+1);
             if(!strcmp(argv[1],"pageseg")) return main_pageseg(argc-1,argv+1);
+            if(!strcmp(argv[1],"benchmark")) return main_benchmark(argc-1,argv+1);
             usage(argv[0]);
         } catch(const char *s) {
             fprintf(stderr,"FATAL: %s\n",s);
@@ -0,0 +1,335 @@
+// nearest neighbor indexes for the prototype classifiers
+
+#include "glinerec.h"
+#include "glann.h"
+
+namespace glinerec {
+
+    namespace {
+        // binary heap of (distance,id) pairs, nearest on top; a
+        // heap of negated distances keeps the farthest on top
+
+        struct DistHeap {
+            floatarray keys;
+            intarray ids;
+            int length() { return ids.length(); }
+            float topKey() { return keys(0); }
+            int topId() { return ids(0); }
+            void clear() {
+                keys.clear();
+                ids.clear();
+            }
+            void swap(int i,int j) {
+                float k = keys(i); keys(i) = keys(j); keys(j) = k;
+                int d = ids(i); ids(i) = ids(j); ids(j) = d;
+            }
+            void push(float key,int id) {
+                keys.push(key);
+                ids.push(id);
+                int i = ids.length()-1;
+                while(i>0 && keys((i-1)/2)>keys(i)) {
+                    swap(i,(i-1)/2);
+                    i = (i-1)/2;
+                }
+            }
+            void pop() {
+                int n = ids.length()-1;
+                swap(0,n);
+                keys.truncate(n);
+                ids.truncate(n);
+                int i = 0;
+                for(;;) {
+                    int j = 2*i+1;
+                    if(j>=n) break;
+                    if(j+1<n && keys(j+1)<keys(j)) j++;
+                    if(keys(i)<=keys(j)) break;
+                    swap(i,j);
+                    i = j;
+                }
+            }
+        };
+
+        // the points seen by one search (open addressing)
+
+        struct VisitedSet {
+            intarray table;
+            int count;
+            VisitedSet(int size) {
+                int n = 64;
+                while(n<2*size) n *= 2;
+                table.resize(n);
+                table.fill(-1);
+                count = 0;
+            }
+            // true if id was not in the set yet
+            bool insert(int id) {
+                if(2*count>=table.length()) grow();
+                int mask = table.length()-1;
+                int slot = (id*0x9e3779b1u)&mask;
+                while(table(slot)>=0) {
+                    if(table(slot)==id) return false;
+                    slot = (slot+1)&mask;
+                }
+                table(slot) = id;
+                count++;
+                return true;
+            }
+            void grow() {
+                intarray old;
+                old.move(table);
+                table.resize(2*old.length());
+                table.fill(-1);
+                count = 0;
+                for(int i=0;i<old.length();i++)
+                    if(old(i)>=0) insert(old(i));
+            }
+        };
+    }
+
+    ////////////////////////////////////////////////////////////////
+    // exhaustive scan (the exact reference)
+    ////////////////////////////////////////////////////////////////
+
+    struct ScanIndex : INearestIndex {
+        int n;
+        ScanIndex() {
+            n = 0;
+            persist(n,"n");
+        }
+        const char *name() { return "scan"; }
+        int length() { return n; }
+        void clear() { n = 0; }
+        void add(IIndexPoints &points,int i) {
+            CHECK_ARG(i==n);
+            n++;
+        }
+        void search(intarray &ids,floatarray &distances,
+                    IIndexPoints &points,floatarray &v,int k,int ef) {
+            DistHeap best;
+            for(int i=0;i<n;i++) {
+                float d = points.distance(i,v);
+                if(best.length()<k) best.push(-d,i);
+                else if(-d>best.topKey()) {
+                    best.pop();
+                    best.push(-d,i);
+                }
+            }
+            ids.resize(best.length());
+            distances.resize(best.length());
+            for(int i=ids.length()-1;i>=0;i--) {
+                ids(i) = best.topId();
+                distances(i) = -best.topKey();
+                best.pop();
+            }
+        }
+    };
+
+    ////////////////////////////////////////////////////////////////
+    // hierarchical navigable small world graph (Malkov and
+    // Yashunin): every point is on level 0 and, with geometrically
+    // decreasing probability, on the levels above; a search descends
+    // greedily from the top and does a beam search of width ef on
+    // level 0
+    ////////////////////////////////////////////////////////////////
+
+    struct HnswIndex : INearestIndex {
+        intarray levels;                // top level of each point
+        intarray first;                 // links(first(i)+l) are the neighbors of i on level l
+        narray<intarray> links;
+        int entry,top;
+
+        HnswIndex() {
+            pdef("M",16,"neighbors per point and level (twice that on level 0)");
+            pdef("ef_construction",100,"search width when adding points");
+            pdef("ef",50,"search width when searching (recall vs. speed)");
+            persist(levels,"levels");
+            persist(first,"first");
+            persist(links,"links");
+            persist(entry,"entry");
+            persist(top,"top");
+            entry = -1;
+            top = -1;
+        }
+        const char *name() { return "hnsw"; }
+        void info(int depth,FILE *stream) {
+            iprintf(stream,depth,"HNSW index, %d points, %d levels\n",length(),top+1);
+            pprint(stream,depth);
+        }
+        int length() { return levels.length(); }
+        void clear() {
+            levels.clear();
+            first.clear();
+            links.clear();
+            entry = -1;
+            top = -1;
+        }
+
+        intarray &neighbors(int i,int level) {
+            return links(first(i)+level);
+        }
+
+        // greedy descent on one level
+        int closest(IIndexPoints &points,floatarray &v,int start,int level) {
+            int current = start;
+            double d = points.distance(current,v);
+            for(bool changed=true;changed;) {
+                changed = false;
+                intarray &ns = neighbors(current,level);
+                for(int j=0;j<ns.length();j++) {
+                    double dn = points.distance(ns(j),v);
+                    if(dn<d) {
+                        d = dn;
+                        current = ns(j);
+                        changed = true;
+                    }
+                }
+            }
+            return current;
+        }
+
+        // beam search of width ef on one level; the result is
+        // sorted by distance
+        void searchLevel(intarray &ids,floatarray &distances,IIndexPoints &points,
+                         floatarray &v,int start,int ef,int level) {
+            VisitedSet visited(ef*int(pgetf("M"))*2);
+            DistHeap candidates,found;
+            float d = points.distance(start,v);
+            visited.insert(start);
+            candidates.push(d,start);
+            found.push(-d,start);
+            while(candidates.length()>0) {
+                float dc = candidates.topKey();
+                int c = candidates.topId();
+                if(found.length()>=ef && dc>-found.topKey()) break;
+                candidates.pop();
+                intarray &ns = neighbors(c,level);
+                for(int j=0;j<ns.length();j++) {
+                    int n = ns(j);
+                    if(!visited.insert(n)) continue;
+                    float dn = points.distance(n,v);
+                    if(found.length()<ef || dn<-found.topKey()) {
+                        candidates.push(dn,n);
+                        found.push(-dn,n);
+                        if(found.length()>ef) found.pop();
+                    }
+                }
+            }
+            ids.resize(found.length());
+            distances.resize(found.length());
+            for(int i=ids.length()-1;i>=0;i--) {
+                ids(i) = found.topId();
+                distances(i) = -found.topKey();
+                found.pop();
+            }
+        }
+
+        // keep up to m of the sorted candidates, skipping those that
+        // are nearer to an already selected neighbor than to the point
+        // (this keeps links into different directions)
+        void selectNeighbors(intarray &selected,IIndexPoints &points,
+                             intarray &ids,floatarray &distances,int m) {
+            selected.clear();
+            floatarray u;
+            for(int i=0;i<ids.length() && selected.length()<m;i++) {
+                points.get(u,ids(i));
+                bool keep = true;
+                for(int j=0;j<selected.length();j++) {
+                    if(points.distance(selected(j),u)<distances(i)) {
+                        keep = false;
+                        break;
+                    }
+                }
+                if(keep) selected.push(ids(i));
+            }
+        }
+
+        // cut the links of point i on a level down to m, keeping the
+        // nearest ones
+        void shrink(IIndexPoints &points,int i,int level,int m) {
+            intarray &ns = neighbors(i,level);
+            floatarray u,ds(ns.length());
+            points.get(u,i);
+            for(int j=0;j<ns.length();j++)
+                ds(j) = points.distance(ns(j),u);
+            intarray order;
+            quicksort(order,ds);
+            intarray kept;
+            for(int j=0;j<m;j++)
+                kept.push(ns(order(j)));
+            ns.move(kept);
+        }
+
+        void add(IIndexPoints &points,int i) {
+            CHECK_ARG(i==length());
+            int m = pgetf("M");
+            int ef = pgetf("ef_construction");
+            CHECK_ARG(m>=2 && ef>=1);
+            int level = int(-log(1.0-drand48())/log(double(m)));
+            levels.push(level);
+            first.push(links.length());
+            for(int l=0;l<=level;l++)
+                links.push().clear();
+            if(entry<0) {
+                entry = i;
+                top = level;
+                return;
+            }
+            floatarray v;
+            points.get(v,i);
+            int current = entry;
+            for(int l=top;l>level;l--)
+                current = closest(points,v,current,l);
+            intarray ids,selected;
+            floatarray distances;
+            for(int l=min(level,top);l>=0;l--) {
+                searchLevel(ids,distances,points,v,current,ef,l);
+                int mmax = l==0 ? 2*m : m;
+                selectNeighbors(selected,points,ids,distances,m);
+                neighbors(i,l).copy(selected);
+                for(int j=0;j<selected.length();j++) {
+                    int n = selected(j);
+                    neighbors(n,l).push(i);
+                    if(neighbors(n,l).length()>mmax)
+                        shrink(points,n,l,mmax);
+                }
+                current = ids(0);
+            }
+            if(level>top) {
+                entry = i;
+                top = level;
+            }
+        }
+
+        void search(intarray &ids,floatarray &distances,
+                    IIndexPoints &points,floatarray &v,int k,int ef) {
+            ids.clear();
+            distances.clear();
+            if(entry<0) return;
+            if(ef<=0) ef = pgetf("ef");
+            ef = max(k,ef);
+            int current = entry;
+            for(int l=top;l>0;l--)
+                current = closest(points,v,current,l);
+            searchLevel(ids,distances,points,v,current,ef,0);
+            if(ids.length()>k) {
+                ids.truncate(k);
+                distances.truncate(k);
+            }
+        }
+    };
+
+    INearestIndex *make_ScanIndex() {
+        return new ScanIndex();
+    }
+
+    INearestIndex *make_HnswIndex() {
+        return new HnswIndex();
+    }
+
+    void init_glann() {
+        component_register<ScanIndex>("ScanIndex");
+        component_register<HnswIndex>("HnswIndex");
+        component_register<ScanIndex>("scan");
+        component_register<HnswIndex>("hnsw");
+    }
+}
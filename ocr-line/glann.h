@@ -0,0 +1,63 @@
+// -*- C++ -*-
+
+#ifndef glann_h__
+#define glann_h__
+
+namespace glinerec {
+
+    // The points an index is built over.  The index only stores their
+    // numbers; the classifiers own the vectors and the distance, which
+    // need not be a metric (smaller is nearer).
+
+    struct IIndexPoints {
+        virtual ~IIndexPoints() {}
+        virtual int length() = 0;
+        virtual void get(floatarray &v,int i) = 0;
+        virtual double distance(int i,floatarray &v) = 0;
+    };
+
+    // squared Euclidean distances to the rows of a matrix
+
+    struct RowPoints : IIndexPoints {
+        floatarray &data;
+        RowPoints(floatarray &data) : data(data) {}
+        int length() { return data.dim(0); }
+        void get(floatarray &v,int i) { rowget(v,data,i); }
+        double distance(int i,floatarray &v) {
+            int n = data.dim(1);
+            float *p = &data.unsafe_at(i,0);
+            double total = 0.0;
+            for(int j=0;j<n;j++) {
+                float d = p[j]-v.unsafe_at1d(j);
+                total += d*d;
+            }
+            return total;
+        }
+    };
+
+    // Nearest neighbor search over a growing set of points.  Points
+    // are added in order (0, 1, 2, ...); search returns up to k points,
+    // nearest first.  "scan" compares against every point, "hnsw" is a
+    // hierarchical navigable small world graph (approximate), which
+    // searches ef candidates (its "ef" parameter if ef is 0).
+
+    struct INearestIndex : IComponent {
+        virtual const char *interface() { return "INearestIndex"; }
+        virtual int length() = 0;
+        virtual void clear() = 0;
+        virtual void add(IIndexPoints &points,int i) = 0;
+        virtual void search(intarray &ids,floatarray &distances,
+                            IIndexPoints &points,floatarray &v,int k,
+                            int ef=0) = 0;
+        void build(IIndexPoints &points) {
+            clear();
+            for(int i=0;i<points.length();i++)
+                add(points,i);
+        }
+    };
+
+    INearestIndex *make_ScanIndex();
+    INearestIndex *make_HnswIndex();
+}
+
+#endif
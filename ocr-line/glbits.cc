@@ -1,5 +1,9 @@
 #include <unistd.h>
 #include <sys/stat.h>
+#include <limits.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 #include "glinerec.h"
 #ifdef HAVE_GSL
 #include "gsl.h"
@@ -14,28 +18,110 @@ namespace glinerec {
 
     typedef long long uint64;
 
-    int bitcount0(uint64 v) {
-        int total = 0;
-        for(int i=0;i<64;i++) {
-            if(v&1) total++;
-            v>>=1;
-        }
-        return total;
-    }
+    // the popcnt instruction if the compiler targets it (-mpopcnt,
+    // -msse4.2), otherwise a bit-parallel count
 
-    static int counts16[65536];
-    int counts16_init() {
-        for(int i=0;i<65536;i++)
-            counts16[i] = bitcount0(i);
-        return 0;
+    inline int bitcount(uint64 v) {
+#if defined(__POPCNT__)
+        return __builtin_popcountll(v);
+#else
+        unsigned long long x = v;
+        x = x-((x>>1)&0x5555555555555555ULL);
+        x = (x&0x3333333333333333ULL)+((x>>2)&0x3333333333333333ULL);
+        x = (x+(x>>4))&0x0f0f0f0f0f0f0f0fULL;
+        return (x*0x0101010101010101ULL)>>56;
+#endif
     }
 
-    int init_0 = counts16_init();
+    namespace {
+#if defined(__AVX2__)
+        // bit counts of the four 64 bit lanes, looked up a nibble at a
+        // time with a byte shuffle (Mula)
+        inline __m256i bitcount256(__m256i v) {
+            const __m256i table = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                                   0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+            const __m256i nibble = _mm256_set1_epi8(0x0f);
+            __m256i lo = _mm256_shuffle_epi8(table,_mm256_and_si256(v,nibble));
+            __m256i hi = _mm256_shuffle_epi8(table,
+                                             _mm256_and_si256(_mm256_srli_epi16(v,4),nibble));
+            return _mm256_sad_epu8(_mm256_add_epi8(lo,hi),_mm256_setzero_si256());
+        }
+#elif !defined(__POPCNT__)
+        // carry-save adder: h,l = the two bit sum of a, b and c
+        inline void csa(uint64 &h,uint64 &l,uint64 a,uint64 b,uint64 c) {
+            uint64 u = a^b;
+            h = (a&b)|(u&c);
+            l = u^c;
+        }
+#endif
+
+        // the number of differing bits in words [j0,j1) of a and b
+        inline int hamming(const uint64 *a,const uint64 *b,int j0,int j1) {
+            int total = 0;
+            int j = j0;
+#if defined(__AVX2__)
+            __m256i acc = _mm256_setzero_si256();
+            for(;j+4<=j1;j+=4) {
+                __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a+j)),
+                                             _mm256_loadu_si256((const __m256i*)(b+j)));
+                acc = _mm256_add_epi64(acc,bitcount256(x));
+            }
+            __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                                        _mm256_extracti128_si256(acc,1));
+            total = _mm_cvtsi128_si64(sum)+_mm_extract_epi64(sum,1);
+#elif !defined(__POPCNT__)
+            // Harley-Seal: sum eight words at a time with carry-save
+            // adders, so that only the eights need a full bit count
+            uint64 ones = 0, twos = 0, fours = 0;
+            int eights = 0;
+            for(;j+8<=j1;j+=8) {
+                uint64 twosA,twosB,foursA,foursB,eightsA;
+                csa(twosA,ones,ones,a[j]^b[j],a[j+1]^b[j+1]);
+                csa(twosB,ones,ones,a[j+2]^b[j+2],a[j+3]^b[j+3]);
+                csa(foursA,twos,twos,twosA,twosB);
+                csa(twosA,ones,ones,a[j+4]^b[j+4],a[j+5]^b[j+5]);
+                csa(twosB,ones,ones,a[j+6]^b[j+6],a[j+7]^b[j+7]);
+                csa(foursB,twos,twos,twosA,twosB);
+                csa(eightsA,fours,fours,foursA,foursB);
+                eights += bitcount(eightsA);
+            }
+            total = 8*eights+4*bitcount(fours)+2*bitcount(twos)+bitcount(ones);
+#endif
+            for(;j<j1;j++)
+                total += bitcount(a[j]^b[j]);
+            return total;
+        }
+
+        // words compared between checks of the pruning bound
+        const int prune_words = 8;
 
-    int bitcount(uint64 v) {
-        // this is about twice as fast as bitcount1
-        return counts16[v&0xffff]+counts16[(v>>16)&0xffff]+
-            counts16[(v>>32)&0xffff]+counts16[(v>>48)&0xffff];
+        // Hamming distances from q to the four consecutive rows of
+        // nwords words at rows.  Each block of q is compared with all
+        // four rows while it is in the cache; once all four distances
+        // exceed bound the rest is skipped, and the (partial)
+        // distances returned are only known to be larger than bound.
+
+        inline void hamming4(int *d,const uint64 *rows,const uint64 *q,
+                             int nwords,int bound) {
+            const uint64 *r0 = rows, *r1 = rows+nwords;
+            const uint64 *r2 = rows+2*nwords, *r3 = rows+3*nwords;
+            d[0] = d[1] = d[2] = d[3] = 0;
+            for(int j0=0;j0<nwords;j0+=prune_words) {
+                int j1 = min(j0+prune_words,nwords);
+                d[0] += hamming(r0,q,j0,j1);
+                d[1] += hamming(r1,q,j0,j1);
+                d[2] += hamming(r2,q,j0,j1);
+                d[3] += hamming(r3,q,j0,j1);
+                if(d[0]>bound && d[1]>bound && d[2]>bound && d[3]>bound) return;
+            }
+        }
+
+        inline int hamming1(const uint64 *row,const uint64 *q,int nwords,int bound) {
+            int d = 0;
+            for(int j0=0;j0<nwords && d<=bound;j0+=prune_words)
+                d += hamming(row,q,j0,min(j0+prune_words,nwords));
+            return d;
+        }
     }
 
     struct bitvec {
@@ -119,21 +205,19 @@ namespace glinerec {
             return total;
         }
         int dist(bitvec &other) {
-            int total = 0;
-            int n = min(nwords,other.nwords);
-            uint64 *p = data, *q = other.data;
-            for(int i=0;i<n;i++)
-                total += bitcount((*p++) ^ (*q++));
-            return total;
+            return hamming(data,other.data,0,min(nwords,other.nwords));
         }
     };
 
-    void bitvec_write(FILE *stream,bitvec &v) {
+    void bitvec_write(FILE *stream,const uint64 *data,int nwords) {
         magic_write(stream,"BV");
-        CHECK(unsigned(v.nwords)<1000000);
-        scalar_write(stream,v.nwords);
-        CHECK(fwrite(v.data,sizeof *v.data,v.nwords,stream)==
-              unsigned(v.nwords));
+        CHECK(unsigned(nwords)<1000000);
+        scalar_write(stream,nwords);
+        CHECK(fwrite(data,sizeof *data,nwords,stream)==unsigned(nwords));
+    }
+
+    void bitvec_write(FILE *stream,bitvec &v) {
+        bitvec_write(stream,v.data,v.nwords);
     }
 
     void bitvec_read(FILE *stream,bitvec &v) {
@@ -253,47 +337,81 @@ namespace glinerec {
               unsigned(v.nwords));
     }
 
+    // Nearest neighbors by Hamming distance between binarized inputs.
+    // The prototypes are the rows of one contiguous matrix of nwords
+    // words each, scanned four at a time; the search keeps the k best
+    // so far and abandons prototypes as soon as their partial distance
+    // exceeds the k-th best.
+
     struct BitNN : IBatchDense {
         int nfeat;
-        objlist<bitvec> prototypes;
+        int nwords;
+        narray<uint64> bits;
         intarray classes;
+        int ncls;
         BitNN() {
             pdef("k",1,"number of nearest neighbors");
+            pdef("parallel",100000,"split single queries among threads above this many prototypes");
             nfeat = 0;
+            nwords = 0;
+            ncls = 0;
         }
         const char *name() {
             return "bit";
         }
+        int nprotos() {
+            return classes.length();
+        }
+        uint64 *row(int i) {
+            return &bits.unsafe_at1d(i*nwords);
+        }
         void info(int depth,FILE *stream) {
             iprintf(stream,depth,"BitNN\n");
             pprint(stream,depth);
             int k = pgetf("k");
             iprintf(stream,depth,"nfeat %d nprotos %d nclasses %d k %d\n",
-                    nfeat,prototypes.length(),max(classes)+1,k);
+                    nfeat,nprotos(),ncls,k);
         }
         void save(FILE *stream) {
+            pset("%classmap",1);
             psave(stream);
             narray_write(stream,classes);
             for(int i=0;i<classes.length();i++) {
-                bitvec_write(stream,prototypes[i]);
+                bitvec_write(stream,row(i),nwords);
             }
+            narray_write(stream,c2i);
+            narray_write(stream,i2c);
         }
         void load(FILE *stream) {
             pload(stream);
             narray_read(stream,classes);
-            prototypes.resize(classes.length());
+            bits.clear();
+            bitvec v;
             for(int i=0;i<classes.length();i++) {
-                bitvec_read(stream,prototypes[i]);
+                bitvec_read(stream,v);
+                if(i==0) nwords = v.nwords;
+                else CHECK(v.nwords==nwords);
+                for(int j=0;j<nwords;j++)
+                    bits.push(v.data[j]);
             }
+            // older files have no class map, and cannot classify
+            if(pexists("%classmap")) {
+                narray_read(stream,c2i);
+                narray_read(stream,i2c);
+            }
+            ncls = classes.length()>0 ? max(classes)+1 : 0;
+            // files written before %nfeat was saved only give the
+            // number of words; 0 accepts any length that fills them
+            nfeat = pexists("%nfeat") ? int(pgetf("%nfeat")) : 0;
         }
         int nfeatures() {
             return nfeat;
         }
         int nclasses() {
-            return max(classes)+1;
+            return ncls;
         }
         void print() {
-            printf("<BitNN #protos %d>\n",prototypes.length());
+            printf("<BitNN #protos %d>\n",nprotos());
         }
         void train_dense(IDataset &ds) {
             floatarray v;
@@ -303,26 +421,120 @@ namespace glinerec {
             }
         }
         void train1(floatarray &v,int c) {
-            if(nfeat==0) nfeat = v.length();
-            else CHECK(nfeat==v.length());
-            prototypes.push().set(v);
+            if(nfeat==0) {
+                nfeat = v.length();
+                pset("%nfeat",nfeat);
+            } else CHECK(nfeat==v.length());
+            bitvec bv;
+            bv.set(v);
+            if(classes.length()==0) nwords = bv.nwords;
+            CHECK(bv.nwords==nwords);
+            for(int j=0;j<nwords;j++)
+                bits.push(bv.data[j]);
             classes.push(c);
+            if(c>=ncls) ncls = c+1;
+        }
+
+        // the k nearest of prototypes [start,end) to q, added to nbest
+        void search(NBest &nbest,const uint64 *q,int start,int end,int k) {
+            int d[4];
+            int i = start;
+            for(;i+4<=end;i+=4) {
+                int bound = nbest.length()<k ? INT_MAX : int(-nbest.value(k-1));
+                hamming4(d,row(i),q,nwords,bound);
+                for(int r=0;r<4;r++) {
+                    if(nbest.length()<k || d[r]<bound) {
+                        nbest.add(i+r,-d[r]);
+                        bound = nbest.length()<k ? INT_MAX : int(-nbest.value(k-1));
+                    }
+                }
+            }
+            for(;i<end;i++) {
+                int bound = nbest.length()<k ? INT_MAX : int(-nbest.value(k-1));
+                int d1 = hamming1(row(i),q,nwords,bound);
+                if(nbest.length()<k || d1<bound) nbest.add(i,-d1);
+            }
+        }
+
+        // the k nearest prototypes; large sets of prototypes are
+        // split among the threads, each keeping its own k best
+        void nearest(NBest &nbest,bitvec &q,int k) {
+            CHECK_ARG(q.nwords==nwords);
+            int n = nprotos();
+            if(n<pgetf("parallel")) {
+                search(nbest,q.data,0,n,k);
+                return;
+            }
+            intarray ids;
+            floatarray values;
+#pragma omp parallel
+            {
+                int nthreads = OCRO_NTHREADS;
+                int t = OCRO_THREAD;
+#pragma omp single
+                {
+                    ids.resize(nthreads*k);
+                    values.resize(nthreads*k);
+                    ids.fill(-1);
+                }
+                NBest local(k);
+                search(local,q.data,int(n*double(t)/nthreads),
+                       int(n*double(t+1)/nthreads),k);
+                for(int i=0;i<local.length();i++) {
+                    ids(t*k+i) = local[i];
+                    values(t*k+i) = local.value(i);
+                }
+            }
+            for(int i=0;i<ids.length();i++)
+                if(ids(i)>=0) nbest.add(ids(i),values(i));
         }
+
+        // the class posterior from the votes of the neighbors, and
+        // the cost of the nearest
+        float vote(floatarray &result,NBest &nbest) {
+            result.resize(ncls);
+            result.fill(0);
+            for(int i=0;i<nbest.length();i++)
+                result(classes(nbest[i]))++;
+            result /= sum(result);
+            return -nbest.value(0)/10.0;
+        }
+
         float outputs_dense(floatarray &result,floatarray &v) {
-            floatarray p;
+            CHECK_ARG(nfeat==0 || v.length()==nfeat);
             int k = pgetf("k");
             bitvec bv;
             bv.set(v);
-            int n = prototypes.length();
-            floatarray dists(n);
-#pragma omp parallel for
-            for(int j=0;j<n;j++)
-                dists(j) = prototypes[j].dist(bv);
-            knn_posterior(p,classes,dists,k);
-            int nearest = argmin(dists);
-            float cost = dists(nearest)/10.0;
-            result = p;
-            return cost;
+            NBest nbest(k);
+            nearest(nbest,bv,k);
+            return vote(result,nbest);
+        }
+
+        // the queries of a batch are independent, so they are
+        // distributed among the threads whole
+
+        void outputs_dense_batch(floatarray &result,floatarray &costs,
+                                 floatarray &data) {
+            int n = data.dim(0);
+            CHECK_ARG(data.rank()==2);
+            // the words are checked here, since the threads cannot throw
+            if(nfeat==0) CHECK_ARG((data.dim(1)+bitvec::bpw-1)/bitvec::bpw==nwords);
+            else CHECK_ARG(data.dim(1)==nfeat);
+            int k = pgetf("k");
+            result.resize(n,ncls);
+            costs.resize(n);
+#pragma omp parallel for schedule(dynamic,8)
+            for(int i=0;i<n;i++) {
+                floatarray v,p;
+                rowget(v,data,i);
+                bitvec bv;
+                bv.set(v);
+                NBest nbest(k);
+                search(nbest,bv.data,0,nprotos(),k);
+                costs(i) = vote(p,nbest);
+                for(int j=0;j<ncls;j++)
+                    result(i,j) = p(j);
+            }
         }
     };
 
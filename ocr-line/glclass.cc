@@ -3,6 +3,8 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include "glinerec.h"
+#include "glmlp.h"
+#include "glann.h"
 #include "ocr-utils.h"
 #ifdef HAVE_GSL
 #include "gsl.h"
@@ -141,6 +143,18 @@ namespace glinerec {
         return total/double(testing.nsamples());
     }
 
+    // whether a submodel gives the same outputs for its inputs
+    // flattened into rows (see IModel::takesFlatInputs)
+    bool takes_flat_inputs(IModel *model) {
+        return !model || (!model->extractor && model->takesFlatInputs());
+    }
+
+    bool takes_flat_inputs(narray< autodel<IModel> > &models) {
+        for(int i=0;i<models.length();i++)
+            if(!takes_flat_inputs(models(i).ptr())) return false;
+        return true;
+    }
+
     float estimate_errors(IModel &classifier,IDataset &ds,int n=1000000) {
         floatarray v;
         floatarray out;
@@ -312,12 +326,30 @@ namespace glinerec {
 
     // param_int show_knn("show_knn",0,"show knn matches for debugging");
 
+    inline float sqnorm(const float *u,int n) {
+        double total = 0;
+        for(int i=0;i<n;i++) total += u[i]*u[i];
+        return total;
+    }
+
+    // the nearest neighbor index named by the "index" parameter of a
+    // prototype classifier, or null for "none" (exhaustive search); the
+    // classifier passes its "ef" parameter on every search, so that it
+    // can be changed on a loaded model
+
+    INearestIndex *make_index(IComponent &model) {
+        const char *kind = model.pget("index");
+        if(!strcmp(kind,"none")) return 0;
+        return make_component<INearestIndex>(kind);
+    }
+
     struct KnnClassifier : virtual IBatch {
         int ncls;
         floatarray vectors;
         intarray classes;
         int ndim;
         float min_dist;
+        autodel<INearestIndex> index;
 
         KnnClassifier() {
             ncls = 0;
@@ -325,8 +357,11 @@ namespace glinerec {
             ncls = 0;
             min_dist = -1;
             pdef("k",1,"number of nearest neighbors");
+            pdef("index","none","nearest neighbor index (none=exhaustive, hnsw)");
+            pdef("ef",0,"search width of the index (0=index default)");
             persist(vectors,"vectors");
             persist(classes,"classes");
+            persist(index,"index");
         }
         const char *name() {
             return "knn";
@@ -341,11 +376,13 @@ namespace glinerec {
             ncls = 0;
             vectors.clear();
             classes.clear();
+            if(index) index->clear();
         }
         void dealloc() {
             ncls = 0;
             vectors.dealloc();
             classes.dealloc();
+            if(index) index->clear();
         }
         int nfeatures() {
             return vectors.dim(1);
@@ -368,6 +405,43 @@ namespace glinerec {
                 ds.input1d(v,i);
                 train1(v,ds.cls(i));
             }
+            update_index();
+        }
+        // add the vectors trained since the last update to the index
+        void update_index() {
+            if(!index) index = make_index(*this);
+            if(!index) return;
+            RowPoints points(vectors);
+            for(int i=index->length();i<vectors.dim(0);i++)
+                index->add(points,i);
+        }
+        bool indexed() {
+            return index && index->length()==vectors.dim(0);
+        }
+        // the votes of the k nearest vectors found by the index; like
+        // the exhaustive search, vectors nearer than min_dist don't
+        // count, so more are asked for until k are left
+        void index_outputs(OutputVector &result,floatarray &v,int k) {
+            intarray ids;
+            floatarray distances;
+            RowPoints points(vectors);
+            int ef = pgetf("ef");
+            int dropped = 0;
+            for(int want=k;;want=k+dropped) {
+                index->search(ids,distances,points,v,want,ef);
+                dropped = 0;
+                for(int i=0;i<ids.length();i++)
+                    if(sqrt(distances(i))<min_dist) dropped++;
+                if(ids.length()-dropped>=k || ids.length()<want) break;
+            }
+            result.clear();
+            int votes = 0;
+            for(int i=0;i<ids.length() && votes<k;i++) {
+                if(sqrt(distances(i))<min_dist) continue;
+                result(classes[ids(i)])++;
+                votes++;
+            }
+            result.normalize();
         }
         void train1(floatarray &v,int c) {
             CHECK(min(v)>-100 && max(v)<100);
@@ -384,7 +458,12 @@ namespace glinerec {
         float outputs(OutputVector &result,floatarray &v) {
             int k = pgetf("k");
             CHECK(min(v)>-100 && max(v)<100);
-            CHECK(v.dim(0)==ndim);
+            // ndim is not saved with the model, the vectors are
+            CHECK(v.dim(0)==vectors.dim(1));
+            if(indexed()) {
+                index_outputs(result,v,k);
+                return 0.0;
+            }
             NBest nbest(k);
             for(int i=0;i<vectors.dim(0);i++) {
                 double d = rowdist_euclidean(vectors,i,v);
@@ -398,6 +477,57 @@ namespace glinerec {
             result.normalize();
             return 0.0;
         }
+
+        // Distances for a batch come from |u-v|^2 = |u|^2-2u.v+|v|^2,
+        // with the dot products computed by the blocked MLP kernel for
+        // a few rows of data at a time.
+
+        void outputs_batch(narray<OutputVector> &ovs,floatarray &costs,floatarray &data) {
+            enum { block = 32 };
+            int k = pgetf("k");
+            int n = data.dim(0);
+            int nvectors = vectors.dim(0);
+            int m = vectors.dim(1);
+            CHECK_ARG(data.rank()==2 && data.dim(1)==m);
+            CHECK(min(data)>-100 && max(data)<100);
+            if(indexed()) {
+                ovs.resize(n);
+                costs.resize(n);
+                costs = 0;
+                floatarray v;
+                for(int s=0;s<n;s++) {
+                    rowget(v,data,s);
+                    index_outputs(ovs(s),v,k);
+                }
+                return;
+            }
+            floatarray norms(nvectors);
+            for(int i=0;i<nvectors;i++)
+                norms(i) = sqnorm(vectors.data+i*m,m);
+            ovs.resize(n);
+            costs.resize(n);
+            costs = 0;
+            floatarray dots(block,nvectors);
+            for(int start=0;start<n;start+=block) {
+                int count = min(int(block),n-start);
+                mlp_affine_batch(dots.data,vectors.data,0,data.data+start*m,
+                                 nvectors,m,count);
+                for(int s=0;s<count;s++) {
+                    float unorm = sqnorm(data.data+(start+s)*m,m);
+                    NBest nbest(k);
+                    for(int i=0;i<nvectors;i++) {
+                        double d = sqrt(max(0.0,double(norms(i)-2*dots(s,i)+unorm)));
+                        if(fabs(d)<min_dist) continue;
+                        nbest.add(i,-d);
+                    }
+                    OutputVector &result = ovs(start+s);
+                    result.clear();
+                    for(int i=0;i<nbest.length();i++)
+                        result(classes[nbest[i]])++;
+                    result.normalize();
+                }
+            }
+        }
     };
 
 #if 0
@@ -498,6 +628,17 @@ namespace glinerec {
         int dtype;
         float min_dist;
         float offset;
+        autodel<INearestIndex> index;
+
+        // the prototypes as seen by the index (with the classifier's
+        // distance, which for dtype 1 is not a metric)
+        struct Points : IIndexPoints {
+            EnetClassifier &enet;
+            Points(EnetClassifier &enet) : enet(enet) {}
+            int length() { return enet.vectors.length(); }
+            void get(floatarray &v,int i) { v.copy(enet.vectors(i)); }
+            double distance(int i,floatarray &v) { return enet.distance(v,enet.vectors(i)); }
+        };
 
         EnetClassifier() {
             ncls = 0;
@@ -511,8 +652,11 @@ namespace glinerec {
             pdef("dtype",1,"distance type");
             pdef("offset",0.01,"probabilistic offset");
             pdef("fuzz",0.5,"initial smoothing");
+            pdef("index","none","nearest neighbor index (none=exhaustive, hnsw)");
+            pdef("ef",0,"search width of the index (0=index default)");
             persist(vectors,"vectors");
             persist(classes,"classes");
+            persist(index,"index");
         }
         const char *name() {
             return "knn";
@@ -535,12 +679,14 @@ namespace glinerec {
             vectors.clear();
             classes.clear();
             counts.clear();
+            if(index) index->clear();
         }
         void dealloc() {
             ncls = 0;
             vectors.dealloc();
             classes.dealloc();
             counts.dealloc();
+            if(index) index->clear();
         }
         int nfeatures() {
             return vectors(0).length();
@@ -574,12 +720,24 @@ namespace glinerec {
             throw "bad dtype";
         }
         void train_dense(IDataset &ds) {
+            dtype = pgetf("dtype");
+            offset = pgetf("offset");
+            if(!index) index = make_index(*this);
+            if(index && index->length()!=vectors.length()) {
+                Points points(*this);
+                index->build(points);
+            }
             floatarray v;
             for(int i=0;i<ds.nsamples();i++) {
                 ds.input1d(v,i);
                 train1(v,ds.cls(i));
             }
         }
+        // averaging moves the prototypes after they have been added,
+        // so the index only approximates their current positions
+        bool indexed() {
+            return index && index->length()==vectors.length();
+        }
         void check(floatarray &v,int c=99999999) {
             if(dtype==1) {
                 for(int i=0;i<v.length();i++)
@@ -612,7 +770,15 @@ namespace glinerec {
             floatarray distances(vectors.dim(0));
             float eps = pgetf("eps");
             int best = -1;
-            if(vectors.dim(0)>0) {
+            bool use_index = indexed();
+            if(use_index && vectors.dim(0)>0) {
+                intarray ids;
+                floatarray ds;
+                Points points(*this);
+                index->search(ids,ds,points,v,1,int(pgetf("ef")));
+                best = ids(0);
+                distances(best) = ds(0);
+            } else if(vectors.dim(0)>0) {
 #pragma omp parallel for
                 for(int i=0;i<vectors.dim(0);i++)
                     distances(i) = distance(v,vectors(i));
@@ -636,6 +802,10 @@ namespace glinerec {
                 temp /= max(temp);
                 vectors.push() = temp;
                 add_count(classes.push(),counts.push(),c);
+                if(use_index) {
+                    Points points(*this);
+                    index->add(points,vectors.length()-1);
+                }
             }
             if(c>=ncls) ncls = c+1;
             ASSERT(vectors.dim(0)==classes.length());
@@ -645,19 +815,31 @@ namespace glinerec {
             offset = pgetf("offset");
             check(v);
             int k = pgetf("k");
-            floatarray distances(vectors.dim(0));
+            intarray ids;
+            float value;
+            if(indexed()) {
+                floatarray ds;
+                Points points(*this);
+                index->search(ids,ds,points,v,k,int(pgetf("ef")));
+                value = -ds(0);
+            } else {
+                floatarray distances(vectors.dim(0));
 #pragma omp parallel for
-            for(int i=0;i<vectors.dim(0);i++)
-                distances(i) = distance(v,vectors(i));
+                for(int i=0;i<vectors.dim(0);i++)
+                    distances(i) = distance(v,vectors(i));
 
-            NBest nbest(k);
-            for(int i=0;i<vectors.dim(0);i++)
-                nbest.add(i,-distances(i));
+                NBest nbest(k);
+                for(int i=0;i<vectors.dim(0);i++)
+                    nbest.add(i,-distances(i));
+                for(int i=0;i<nbest.length();i++)
+                    ids.push(nbest[i]);
+                value = nbest.value(0);
+            }
 
             result.resize(ncls);
             fill(result,0);
-            for(int i=0;i<nbest.length();i++) {
-                int k = nbest[i];
+            for(int i=0;i<ids.length();i++) {
+                int k = ids(i);
                 for(int j=0;j<classes[k].length();j++)
                     result(classes[k][j]) += counts[k][j];
             }
@@ -666,14 +848,14 @@ namespace glinerec {
             if(dactive()) {
                 int r = sqrt(ndim);
                 floatarray temp;
-                temp = vectors(nbest[0]);
+                temp = vectors(ids(0));
                 if(temp.rank()==1) temp.reshape(r,r);
                 dshown(temp,"d");
                 temp = v;
                 if(temp.rank()==1) temp.reshape(r,r);
                 dshown(temp,"c");
             }
-            return nbest.value(0);
+            return value;
         }
     };
 
@@ -727,6 +909,30 @@ namespace glinerec {
         }
     }
 
+    void transpose_to(floatarray &out,floatarray &a) {
+        int n = a.dim(0);
+        int m = a.dim(1);
+        out.resize(m,n);
+        for(int i=0;i<n;i++)
+            for(int j=0;j<m;j++)
+                out.unsafe_at(j,i) = a.unsafe_at(i,j);
+    }
+
+    // mlp_affine_batch with the rows of x split among the threads
+
+    void affine_parallel(float *y,const float *w,const float *b,
+                         const float *x,int n,int m,int k) {
+#pragma omp parallel
+        {
+            int nthreads = OCRO_NTHREADS;
+            int per = ((k+nthreads-1)/nthreads+3)/4*4;
+            int start = min(k,OCRO_THREAD*per);
+            int end = min(k,start+per);
+            if(end>start)
+                mlp_affine_batch(y+start*n,w,b,x+start*m,n,m,end-start);
+        }
+    }
+
     void matmul(floatarray &out,floatarray &a,floatarray &b) {
         if(a.rank()==2) {
             if(b.rank()==2) {
@@ -819,6 +1025,7 @@ namespace glinerec {
         float cv_error;
         float nn_error;
         bool crossvalidate;
+        double presentations;
 
         MlpClassifier() {
             pdef("eta",0.5,"default learning rate");
@@ -838,9 +1045,12 @@ namespace glinerec {
             pdef("normalization",-1,"kind of normalization of the input");
             pdef("noopt",0,"disable optimization search");
             pdef("crossvalidate",1,"perform crossvalidation");
+            pdef("fast_sigmoid",0,"approximate the sigmoid when recognizing (faster)");
+            pdef("batch",1,"mini-batch size for training (1 = one sample at a time)");
             eta = pgetf("eta");
             cv_error = 1e30;
             nn_error = 1e30;
+            presentations = 0;
             persist(w1,"w1");
             persist(b1,"b1");
             persist(w2,"w2");
@@ -908,10 +1118,58 @@ namespace glinerec {
             b2.copy(other.b2);
         }
 
-        float outputs_dense(floatarray &result,floatarray &x_raw) {
-            CHECK_ARG(x_raw.length()==w1.dim(1));
-            floatarray z;
+        // The hidden layer is computed behind the outputs in result,
+        // so nothing is allocated when result is reused between calls.
+
+        float outputs_dense(floatarray &result,floatarray &x) {
+            CHECK_ARG(x.length()==w1.dim(1));
+            int sparse = pgetf("sparse");
+            if(sparse>0) return outputs_sparse(result,x,sparse);
+            bool fast = pgetf("fast_sigmoid");
+            int ninput = w1.dim(1);
+            int nhidden = w1.dim(0);
+            int noutput = w2.dim(0);
+            result.resize(noutput+nhidden);
+            float *y = result.data+noutput;
+            mlp_affine(y,w1.data,b1.data,x.data,nhidden,ninput);
+            mlp_sigmoid(y,nhidden,fast);
+            mlp_affine(result.data,w2.data,b2.data,y,noutput,nhidden);
+            mlp_sigmoid(result.data,noutput,fast);
+            result.resize(noutput);
+            return fabs(sum(result)-1.0);
+        }
+
+        // The same for a batch: both layers are computed for all rows
+        // of data with the blocked kernel.
+
+        void outputs_dense_batch(floatarray &result,floatarray &costs,floatarray &data) {
             int sparse = pgetf("sparse");
+            if(sparse>0) {
+                IBatchDense::outputs_dense_batch(result,costs,data);
+                return;
+            }
+            CHECK_ARG(data.rank()==2 && data.dim(1)==w1.dim(1));
+            bool fast = pgetf("fast_sigmoid");
+            int n = data.dim(0);
+            int ninput = w1.dim(1);
+            int nhidden = w1.dim(0);
+            int noutput = w2.dim(0);
+            floatarray hidden(n,nhidden);
+            mlp_affine_batch(hidden.data,w1.data,b1.data,data.data,nhidden,ninput,n);
+            mlp_sigmoid(hidden.data,n*nhidden,fast);
+            result.resize(n,noutput);
+            mlp_affine_batch(result.data,w2.data,b2.data,hidden.data,noutput,nhidden,n);
+            mlp_sigmoid(result.data,n*noutput,fast);
+            costs.resize(n);
+            for(int i=0;i<n;i++) {
+                double total = 0;
+                for(int j=0;j<noutput;j++) total += result(i,j);
+                costs(i) = fabs(total-1.0);
+            }
+        }
+
+        float outputs_sparse(floatarray &result,floatarray &x_raw,int sparse) {
+            floatarray z;
             floatarray y,x;
             x.copy(x_raw);
             mvmul0(y,w1,x);
@@ -1027,12 +1285,144 @@ namespace glinerec {
                 b1(i) -= eta * delta1(i);
         }
 
+        struct MinibatchBuffers {
+            floatarray y,d1,d2,w2t,xt,yt,d1t,d2t,g1,g2;
+        };
+
+        // do a gradient descent step for a mini-batch, one sample per
+        // row of x and targets; the gradients of the rows are summed
+        // and the step is eta/sqrt(batch size)
+
+        void trainMinibatch(floatarray &z,floatarray &targets,floatarray &x,
+                            float eta,MinibatchBuffers &buf) {
+            int n = x.dim(0);
+            int ninput = w1.dim(1);
+            int nhidden = this->nhidden();
+            int noutput = nclasses();
+            CHECK_ARG(x.dim(1)==ninput);
+            CHECK_ARG(targets.dim(0)==n && targets.dim(1)==noutput);
+            int sparse = pgetf("sparse");
+            floatarray &y = buf.y, &d1 = buf.d1, &d2 = buf.d2;
+
+            y.resize(n,nhidden);
+            affine_parallel(y.data,w1.data,b1.data,x.data,nhidden,ninput,n);
+            mlp_sigmoid(y.data,n*nhidden,false);
+            if(sparse>0) {
+                floatarray row;
+                for(int s=0;s<n;s++) {
+                    rowget(row,y,s);
+                    sparsify(row,sparse);
+                    rowput(y,s,row);
+                }
+            }
+            z.resize(n,noutput);
+            affine_parallel(z.data,w2.data,b2.data,y.data,noutput,nhidden,n);
+            mlp_sigmoid(z.data,n*noutput,false);
+
+            d2.resize(n,noutput);
+            for(int i=0;i<d2.length1d();i++)
+                d2.at1d(i) = (z.at1d(i)-targets.at1d(i)) * dsigmoidy(z.at1d(i));
+            transpose_to(buf.w2t,w2);
+            d1.resize(n,nhidden);
+            affine_parallel(d1.data,buf.w2t.data,0,d2.data,nhidden,noutput,n);
+            for(int i=0;i<d1.length1d();i++)
+                d1.at1d(i) *= dsigmoidy(y.at1d(i));
+
+            // the summed outer products of the deltas and the layer inputs
+            transpose_to(buf.xt,x);
+            transpose_to(buf.yt,y);
+            transpose_to(buf.d1t,d1);
+            transpose_to(buf.d2t,d2);
+            buf.g1.resize(nhidden,ninput);
+            affine_parallel(buf.g1.data,buf.xt.data,0,buf.d1t.data,ninput,n,nhidden);
+            buf.g2.resize(noutput,nhidden);
+            affine_parallel(buf.g2.data,buf.yt.data,0,buf.d2t.data,nhidden,n,noutput);
+
+            float step = eta/sqrt(float(n));
+#pragma omp parallel for
+            for(int i=0;i<nhidden;i++) {
+                float *w = &w1.unsafe_at(i,0);
+                float *g = &buf.g1.unsafe_at(i,0);
+                for(int j=0;j<ninput;j++) w[j] -= step * g[j];
+                double total = 0;
+                for(int s=0;s<n;s++) total += buf.d1t.unsafe_at(i,s);
+                b1(i) -= step * total;
+            }
+            for(int i=0;i<noutput;i++) {
+                for(int j=0;j<nhidden;j++) w2.unsafe_at(i,j) -= step * buf.g2.unsafe_at(i,j);
+                double total = 0;
+                for(int s=0;s<n;s++) total += buf.d2t.unsafe_at(i,s);
+                b2(i) -= step * total;
+            }
+        }
+
+        // the same number of presentations as train_dense, in batches
+        // of consecutive rows
+
+        void train_minibatch(IDataset &ds,int niters,int batch) {
+            int nclasses = ds.nclasses();
+            int ninput = w1.dim(1);
+            MinibatchBuffers buf;
+            floatarray x,targets,z,target;
+            double err = 0.0;
+            int count = 0;
+            for(int i=0;i<niters;i+=batch) {
+                int n = min(batch,niters-i);
+                x.resize(n,ninput);
+                targets.resize(n,nclasses);
+                for(int s=0;s<n;s++) {
+                    int row = (i+s)%ds.nsamples();
+                    ds.input(&x(s,0),ninput,row);
+                    ds.output(target,row);
+                    rowput(targets,s,target);
+                }
+                trainMinibatch(z,targets,x,eta,buf);
+                for(int k=0;k<z.length1d();k++)
+                    err += sqr(z.at1d(k)-targets.at1d(k));
+                count += n;
+            }
+            err /= count;
+            presentations += count;
+            debugf("training-detail","MlpClassifier n %d niters %d batch %d eta %g err %g\n",
+                   ds.nsamples(),niters,batch,eta,err);
+        }
+
+        // mini-batches of the rows of data listed in order, with dense
+        // classes (for training from a stream of samples)
+
+        void train_rows(floatarray &data,intarray &classes,intarray &order,int batch) {
+            int n = order.length();
+            int ninput = w1.dim(1);
+            int noutput = nclasses();
+            CHECK_ARG(data.dim(1)==ninput && n<=data.dim(0));
+            MinibatchBuffers buf;
+            floatarray x,targets,z;
+            for(int i=0;i<n;i+=batch) {
+                int m = min(batch,n-i);
+                x.resize(m,ninput);
+                targets.resize(m,noutput);
+                targets.fill(0);
+                for(int s=0;s<m;s++) {
+                    int row = order(i+s);
+                    memcpy(&x(s,0),&data(row,0),ninput*sizeof (float));
+                    targets(s,classes(row)) = 1;
+                }
+                trainMinibatch(z,targets,x,eta,buf);
+            }
+            presentations += n;
+        }
+
         void train_dense(IDataset &ds) {
             dsection("mlp");
             int nclasses = ds.nclasses();
             float miters = pgetf("miters");
             int niters = (ds.nsamples() * miters);
             niters = max(1000,min(10000000,niters));
+            int batch = pgetf("batch");
+            if(batch>1) {
+                train_minibatch(ds,niters,batch);
+                return;
+            }
             double err = 0.0;
             floatarray x,z,target(nclasses);
             int count = 0;
@@ -1064,6 +1454,7 @@ namespace glinerec {
                 count++;
             }
             err /= count;
+            presentations += count;
             debugf("training-detail","MlpClassifier n %d niters %d eta %g err %g\n",
                    ds.nsamples(),niters,eta,err);
         }
@@ -1082,6 +1473,10 @@ namespace glinerec {
     struct AutoMlpClassifier : virtual MlpClassifier {
 
         AutoMlpClassifier() {
+            pdef("stream_round",1000000,"samples presented to each net per round when streaming");
+            pdef("stream_block",256,"consecutive samples read from a shard when streaming");
+            pdef("stream_chunk",8192,"samples decoded at a time when streaming");
+            pdef("stream_mb",256,"memory for the decoded samples when streaming (MB)");
         }
 
         void train_dense(IDataset &ds) {
@@ -1136,25 +1531,11 @@ namespace glinerec {
         }
 
         void trainBatch(IDataset &ds,IDataset &ts) {
-            float eta_init = pgetf("eta_init"); // 0.5
-            float eta_varlog = pgetf("eta_varlog"); // 1.5
-            float hidden_varlog = pgetf("hidden_varlog"); // 1.2
-            int hidden_lo = pgetf("hidden_lo");
-            int hidden_hi = pgetf("hidden_hi");
             int rounds = pgetf("rounds");
-            int mlp_noopt = pgetf("noopt");
-            int hidden_min = pgetf("hidden_min");
-            int hidden_max = pgetf("hidden_max");
-            CHECK(hidden_min>1 && hidden_max<1000000);
-            CHECK(hidden_hi>=hidden_lo);
-            CHECK(hidden_max>=hidden_min);
-            CHECK(hidden_lo>=hidden_min && hidden_hi<=hidden_max);
             int nn = pgetf("nensemble");
             objlist<MlpClassifier> nets;
-            nets.resize(nn);
             floatarray errs(nn);
-            floatarray etas(nn);
-            intarray index;
+            floatarray etas;
             float best = 1e30;
             int nclasses = ds.nclasses();
 
@@ -1165,52 +1546,298 @@ namespace glinerec {
             }
             CHECK(ds.nsamples()>=10 && ds.nsamples()<100000000);
 
-            for(int i=0;i<nn;i++) {
-                // nets(i).init(data.dim(1),logspace(i,nn,hidden_lo,hidden_hi),nclasses);
-                if(w1.length()>0) {
-                    nets(i).copy(*this);
-                } else {
-                    nets(i).initData(ds,logspace(i,nn,hidden_lo,hidden_hi));
-                }
-                etas(i) = rlognormal(eta_init,eta_varlog);
-            }
+            initNets(nets,etas,ds);
 
+            // with mini-batches, the nets are trained one after the
+            // other, each of them using all threads
+            int batch = pgetf("batch");
             debugf("info","mlp training n %d nc %d\n",ds.nsamples(),nclasses);
             for(int round=0;round<rounds;round++) {
                 errs.fill(-1);
-#pragma omp parallel for
+#pragma omp parallel for if(batch<=1)
                 for(int i=0;i<nn;i++) {
                     nets(i).pset("eta",etas(i));
+                    nets(i).pset("batch",batch);
                     nets(i).train(ds);
                     errs(i) = estimate_errors(nets(i),ts);
                     debugf("detail","net %d (%d/%d) %g %g %g\n",i,OCRO_THREAD,OCRO_NTHREADS,
                            errs(i),nets(i).complexity(),etas(i));
                 }
-                quicksort(index,errs);
-                if(errs(index(0))<best) {
-                    best = errs(index(0));
-                    cv_error = best;
-                    this->copy(nets(index(0)));
-                    debugf("training-detail","best mlp update error %g %s\n",best,crossvalidate?"cv":"");
-                    fflush(stdout);
-                }
-                if(!mlp_noopt) {
-                    for(int i=0;i<nn/2;i++) {
-                        int j = i+nn/2;
-                        nets(index(j)).copy(nets(index(i)));
-                        int n = nets(index(j)).nhidden();
-                        int nn = min(max(hidden_min,int(rlognormal(n,hidden_varlog))),hidden_max);
-                        nets(index(j)).changeHidden(nn);
-                        etas(index(j)) = rlognormal(etas(index(i)),eta_varlog);
+                selectNets(nets,etas,errs,best);
+                debugf("info","mlp round %d err %g nhidden %d\n",round,best,nhidden());
+                pset("%error",best);
+            }
+            for(int i=0;i<nn;i++)
+                presentations += nets(i).presentations;
+            pset("%presentations",presentations);
+        }
+
+        // Training from shards on disk, read through a ShardStream;
+        // the last shard is held out for cross-validation (at most
+        // cv_max samples of it, kept in memory).  Each net of the
+        // ensemble sees every chunk, and a round ends after
+        // stream_round samples.
+
+        void trainStream(narray< autodel<IDataset> > &shards) {
+            CHECK_ARG(shards.length()>=2);
+            int ntrain = shards.length()-1;
+            IDataset &ts = *shards(ntrain);
+            int nfeatures = shards(0)->nfeatures();
+            CHECK_ARG(nfeatures>0);
+            for(int s=0;s<shards.length();s++)
+                CHECK_ARG(shards(s)->nfeatures()==nfeatures);
+            if(c2i.length()<1) {
+                // only the classes are read here
+                int nc = 0;
+                for(int s=0;s<ntrain;s++)
+                    nc = max(nc,shards(s)->nclasses());
+                intarray counts(nc);
+                counts.fill(0);
+                for(int s=0;s<ntrain;s++) {
+                    IDataset &ds = *shards(s);
+                    for(int i=0;i<ds.nsamples();i++) {
+                        int c = ds.cls(i);
+                        if(c<0) continue;
+                        CHECK(c<nc);
+                        counts(c)++;
                     }
                 }
-                debugf("info","mlp round %d err %g nhidden %d\n",round,best,nhidden());
+                intarray present;
+                for(int c=0;c<nc;c++)
+                    if(counts(c)>0) present.push(c);
+                CHECK_ARG(present.length()>0);
+                classmap(c2i,i2c,present);
+                debugf("info","[mapped %d to %d classes]\n",c2i.length(),i2c.length());
+            }
+
+            // held out samples spread evenly over the last shard;
+            // classes not seen in training are always errors
+            int ntest = min(ts.nsamples(),int(pgetf("cv_max")));
+            intarray rows,tclasses;
+            for(int i=0;i<ntest;i++) {
+                int row = int(i*double(ts.nsamples())/ntest);
+                int c = ts.cls(row);
+                if(c<0) continue;
+                rows.push(row);
+                tclasses.push(c<c2i.length() ? c2i(c) : -1);
+            }
+            CHECK_ARG(rows.length()>0);
+            floatarray tdata(rows.length(),nfeatures);
+            for(int i=0;i<rows.length();i++)
+                ts.input(&tdata(i,0),nfeatures,rows(i));
+            pset("%ntesting",tclasses.length());
+
+            objlist<MlpClassifier> nets;
+            floatarray etas;
+            TranslatedDataset first(*shards(0),c2i);
+            initNets(nets,etas,first);
+            int nn = nets.length();
+            floatarray errs(nn);
+            float best = 1e30;
+            int rounds = pgetf("rounds");
+            int nround = pgetf("stream_round");
+            int batch = max(1,int(pgetf("batch")));
+
+            ShardStream stream(shards,ntrain,c2i,int(pgetf("stream_block")),
+                               int(pgetf("stream_chunk")),pgetf("stream_mb"));
+            stream.start();
+            debugf("info","mlp streaming from %d shards, %d chunks, %d held out\n",
+                   ntrain,stream.chunks.length(),tclasses.length());
+            intarray order;
+            int epoch = 0;
+            for(int round=0;round<rounds;round++) {
+                for(int i=0;i<nn;i++)
+                    nets(i).eta = etas(i);
+                for(int count=0;count<nround;) {
+                    int c = stream.next();
+                    ShardStream::Chunk &chunk = stream.chunks(c);
+                    rpermutation(order,chunk.n);
+#pragma omp parallel for if(batch<=1)
+                    for(int i=0;i<nn;i++)
+                        nets(i).train_rows(chunk.inputs,chunk.classes,order,batch);
+                    count += chunk.n;
+                    epoch = chunk.epoch;
+                    stream.done(c);
+                }
+                for(int i=0;i<nn;i++) {
+                    errs(i) = streamError(nets(i),tdata,tclasses);
+                    debugf("detail","net %d %g %g %g\n",i,errs(i),nets(i).complexity(),etas(i));
+                }
+                selectNets(nets,etas,errs,best);
+                debugf("info","mlp round %d err %g nhidden %d epochs %d\n",
+                       round,best,nhidden(),epoch);
                 pset("%error",best);
             }
+            stream.stop();
+            for(int i=0;i<nn;i++)
+                presentations += nets(i).presentations;
+            pset("%presentations",presentations);
+        }
+
+        float streamError(MlpClassifier &net,floatarray &data,intarray &classes) {
+            floatarray result,costs;
+            net.outputs_dense_batch(result,costs,data);
+            int errors = 0;
+            for(int i=0;i<classes.length();i++) {
+                int pred = 0;
+                for(int j=1;j<result.dim(1);j++)
+                    if(result(i,j)>result(i,pred)) pred = j;
+                if(pred!=classes(i)) errors++;
+            }
+            return errors/float(classes.length());
+        }
+
+        // the starting ensemble: copies of this net if it has been
+        // trained, otherwise nets of different sizes initialized from
+        // samples of ds
+
+        void initNets(objlist<MlpClassifier> &nets,floatarray &etas,IDataset &ds) {
+            float eta_init = pgetf("eta_init"); // 0.5
+            float eta_varlog = pgetf("eta_varlog"); // 1.5
+            int hidden_lo = pgetf("hidden_lo");
+            int hidden_hi = pgetf("hidden_hi");
+            int hidden_min = pgetf("hidden_min");
+            int hidden_max = pgetf("hidden_max");
+            CHECK(hidden_min>1 && hidden_max<1000000);
+            CHECK(hidden_hi>=hidden_lo);
+            CHECK(hidden_max>=hidden_min);
+            CHECK(hidden_lo>=hidden_min && hidden_hi<=hidden_max);
+            int nn = pgetf("nensemble");
+            nets.resize(nn);
+            etas.resize(nn);
+            for(int i=0;i<nn;i++) {
+                // nets(i).init(data.dim(1),logspace(i,nn,hidden_lo,hidden_hi),nclasses);
+                if(w1.length()>0) {
+                    nets(i).copy(*this);
+                } else {
+                    nets(i).initData(ds,logspace(i,nn,hidden_lo,hidden_hi));
+                }
+                etas(i) = rlognormal(eta_init,eta_varlog);
+            }
+        }
+
+        // keep the best net so far and, unless noopt is set, replace
+        // the worse half of the ensemble by mutated copies of the
+        // better half
+
+        void selectNets(objlist<MlpClassifier> &nets,floatarray &etas,
+                        floatarray &errs,float &best) {
+            float eta_varlog = pgetf("eta_varlog");
+            float hidden_varlog = pgetf("hidden_varlog");
+            int mlp_noopt = pgetf("noopt");
+            int hidden_min = pgetf("hidden_min");
+            int hidden_max = pgetf("hidden_max");
+            int nn = nets.length();
+            intarray index;
+            quicksort(index,errs);
+            if(errs(index(0))<best) {
+                best = errs(index(0));
+                cv_error = best;
+                this->copy(nets(index(0)));
+                debugf("training-detail","best mlp update error %g %s\n",best,crossvalidate?"cv":"");
+                fflush(stdout);
+            }
+            if(!mlp_noopt) {
+                for(int i=0;i<nn/2;i++) {
+                    int j = i+nn/2;
+                    nets(index(j)).copy(nets(index(i)));
+                    int n = nets(index(j)).nhidden();
+                    int nh = min(max(hidden_min,int(rlognormal(n,hidden_varlog))),hidden_max);
+                    nets(index(j)).changeHidden(nh);
+                    etas(index(j)) = rlognormal(etas(index(i)),eta_varlog);
+                }
+            }
         }
 
     };
 
+    ////////////////////////////////////////////////////////////////
+    // MLP with int8 weights, made from a trained MLP by
+    // quantize_model; each row of weights has its own scale, and
+    // the inputs of each layer are quantized as they come in
+    ////////////////////////////////////////////////////////////////
+
+    struct QuantizedMlp : virtual IBatchDense {
+        bytearray q1,q2;        // int8 weights
+        floatarray s1,s2;       // scale of each row of weights
+        floatarray b1,b2;
+
+        QuantizedMlp() {
+            pdef("fast_sigmoid",0,"approximate the sigmoid when recognizing (faster)");
+            persist(q1,"q1");
+            persist(s1,"s1");
+            persist(b1,"b1");
+            persist(q2,"q2");
+            persist(s2,"s2");
+            persist(b2,"b2");
+        }
+        const char *name() {
+            return "qmlp";
+        }
+        void info(int depth,FILE *stream) {
+            iprintf(stream,depth,"QuantizedMlp\n");
+            pprint(stream,depth);
+            iprintf(stream,depth,"ninput %d nhidden %d noutput %d\n",nfeatures(),nhidden(),nclasses());
+        }
+        int nfeatures() {
+            return q1.dim(1);
+        }
+        int nhidden() {
+            return q1.dim(0);
+        }
+        int nclasses() {
+            return q2.dim(0);
+        }
+        float complexity() {
+            return q1.dim(0);
+        }
+
+        static void quantize_rows(bytearray &q,floatarray &scales,floatarray &w) {
+            q.resize(w.dim(0),w.dim(1));
+            scales.resize(w.dim(0));
+            for(int i=0;i<w.dim(0);i++)
+                scales(i) = mlp_quantize((signed char *)&q(i,0),&w(i,0),w.dim(1));
+        }
+
+        void quantize(MlpClassifier &mlp) {
+            if(mlp.pgetf("sparse")>0) throw "cannot quantize an MLP with a sparse hidden layer";
+            CHECK_ARG(mlp.w1.length()>0);
+            quantize_rows(q1,s1,mlp.w1);
+            quantize_rows(q2,s2,mlp.w2);
+            b1.copy(mlp.b1);
+            b2.copy(mlp.b2);
+            c2i.copy(mlp.c2i);
+            i2c.copy(mlp.i2c);
+            pset("fast_sigmoid",mlp.pget("fast_sigmoid"));
+            pset("extractor",mlp.pget("extractor"));
+            extractor = mlp.extractor.move();
+        }
+
+        void train_dense(IDataset &ds) {
+            throw "QuantizedMlp cannot be trained; train an MLP and quantize it";
+        }
+
+        float outputs_dense(floatarray &result,floatarray &x) {
+            int ninput = nfeatures();
+            int nhidden = this->nhidden();
+            int noutput = nclasses();
+            CHECK_ARG(x.length()==ninput);
+            bool fast = pgetf("fast_sigmoid");
+            bytearray xq(ninput),yq(nhidden);
+            floatarray y(nhidden);
+            float xscale = mlp_quantize((signed char *)xq.data,x.data,ninput);
+            mlp_affine_i8(y.data,(signed char *)q1.data,s1.data,b1.data,
+                          (signed char *)xq.data,xscale,nhidden,ninput);
+            mlp_sigmoid(y.data,nhidden,fast);
+            float yscale = mlp_quantize((signed char *)yq.data,y.data,nhidden);
+            result.resize(noutput);
+            mlp_affine_i8(result.data,(signed char *)q2.data,s2.data,b2.data,
+                          (signed char *)yq.data,yscale,noutput,nhidden);
+            mlp_sigmoid(result.data,noutput,fast);
+            return fabs(sum(result)-1.0);
+        }
+    };
+
     ////////////////////////////////////////////////////////////////
     // AdaBoost
     ////////////////////////////////////////////////////////////////
@@ -1259,6 +1886,9 @@ namespace glinerec {
                 models[i]->info(depth+1,stream);
             }
         }
+        bool takesFlatInputs() {
+            return takes_flat_inputs(models);
+        }
         int nmodels() {
             return models.length();
         }
@@ -1472,6 +2102,10 @@ namespace glinerec {
             pdef("lrounds",999,"number of rounds to use during classification");
         }
 
+        bool takesFlatInputs() {
+            return takes_flat_inputs(models);
+        }
+
         int nfeatures() {
             return models[0]->nfeatures();
         }
@@ -1558,6 +2192,45 @@ namespace glinerec {
             result /= sum(result);
             return 0.0;
         }
+
+        // Each round classifies the whole batch before the next one,
+        // with the outputs of the previous round appended to the rows.
+
+        void outputs_dense_batch(floatarray &result,floatarray &costs,floatarray &data) {
+            int lrounds = pgetf("lrounds");
+            int n = data.dim(0);
+            floatarray a,p;
+            a.copy(data);
+            narray<OutputVector> ovs;
+            for(int round=0;round<lrounds && round<models.length();round++) {
+                if(round>0) {
+                    floatarray temp(n,a.dim(1)+p.dim(1));
+                    for(int i=0;i<n;i++) {
+                        for(int j=0;j<a.dim(1);j++) temp(i,j) = a(i,j);
+                        for(int j=0;j<p.dim(1);j++) temp(i,a.dim(1)+j) = p(i,j);
+                    }
+                    a.move(temp);
+                }
+                models(round)->xoutputs_batch(ovs,costs,a);
+                int width = 0;
+                for(int i=0;i<n;i++)
+                    for(int k=0;k<ovs(i).nkeys();k++)
+                        width = max(width,ovs(i).keys(k)+1);
+                p.resize(n,width);
+                p = 0;
+                for(int i=0;i<n;i++)
+                    for(int k=0;k<ovs(i).nkeys();k++)
+                        p(i,ovs(i).keys(k)) = ovs(i).values(k);
+            }
+            result.move(p);
+            costs.resize(n);
+            for(int i=0;i<n;i++) {
+                double total = 0;
+                for(int j=0;j<result.dim(1);j++) total += result(i,j);
+                for(int j=0;j<result.dim(1);j++) result(i,j) /= total;
+                costs(i) = 0.0;
+            }
+        }
     };
 
     ////////////////////////////////////////////////////////////////
@@ -1689,6 +2362,37 @@ namespace glinerec {
 
             return 0.0;
         }
+
+        bool takesFlatInputs() {
+            return takes_flat_inputs(charclass.ptr())
+                && takes_flat_inputs(junkclass.ptr())
+                && takes_flat_inputs(ulclass.ptr());
+        }
+
+        void outputs_batch(narray<OutputVector> &ovs,floatarray &costs,floatarray &data) {
+            int n = data.dim(0);
+            charclass->xoutputs_batch(ovs,costs,data);
+            for(int i=0;i<n;i++)
+                CHECK(ovs(i).nkeys()>0);
+            if(pgetf("junk") && junkclass) {
+                narray<OutputVector> jvs;
+                floatarray jcosts,junk;
+                junkclass->xoutputs_batch(jvs,jcosts,data);
+                for(int i=0;i<n;i++) {
+                    OutputVector &result = ovs(i);
+                    result.normalize();
+                    jvs(i).as_array(junk);
+                    for(int k=0;k<result.nkeys();k++)
+                        result.values(k) *= junk(0);
+                    result(jc()) = junk(1);
+                }
+            }
+            if(pgetf("ul") && ulclass) {
+                throw "ulclass not implemented";
+            }
+            costs.resize(n);
+            costs = 0;
+        }
     };
 
     struct RaveledExtractor : virtual IExtractor {
@@ -2218,66 +2922,149 @@ namespace glinerec {
 
     inline float sqr(float x) { return x*x; }
 
+    // Prototypes for clustering, stored as the rows of one contiguous
+    // array.  find returns a prototype within eps of the object:
+    // either the first in order of decreasing counts (the order the
+    // sequential search used) or the nearest.  order is kept sorted by
+    // merge, so it only needs sorting after a load.
+
     struct EuclideanDistances : IDistComp {
-        intarray order;
+        int ndim;
+        floatarray data;                // row i is data[i*ndim..(i+1)*ndim)
         intarray counts_;
-        narray<floatarray> vectors;
+        intarray order;                 // prototypes by decreasing counts
+        intarray rank;                  // order(rank(i))==i
         EuclideanDistances() {
-            persist(vectors,"vectors");
+            ndim = -1;
+            pdef("find","first","first: most frequent prototype within eps, best: nearest within eps");
+            pdef("chunk",256,"prototypes claimed at a time by a thread in find");
+            persist(ndim,"ndim");
+            persist(data,"data");
             persist(counts_,"counts_");
         }
         virtual const char *name() { return "edist"; }
+        float *row(int i) {
+            return &data.unsafe_at1d(i*ndim);
+        }
+        void sort_order() {
+            intarray temp;
+            argsort(temp,counts_);
+            int n = temp.length();
+            order.resize(n);
+            rank.resize(n);
+            for(int k=0;k<n;k++) {
+                order(k) = temp(n-k-1);
+                rank(order(k)) = k;
+            }
+        }
         virtual void add(floatarray &obj) {
-            vectors.push() = obj;
+            if(ndim<0) ndim = obj.length();
+            CHECK_ARG(obj.length()==ndim);
+            if(order.length()!=counts_.length()) sort_order();
+            for(int j=0;j<ndim;j++)
+                data.push(obj(j));
+            int i = counts_.length();
             counts_.push() = 1;
+            rank.push() = order.length();
+            order.push() = i;
         }
         virtual int find(floatarray &obj,float eps) {
-            if(order.length()!=counts_.length()) argsort(order,counts_);
-            int result = -1;
-            int n = obj.length();
-#pragma omp parallel for
-            for(int k=order.length()-1;k>=0;k--) {
-                int i = order[k];
-                double total = 0.0;
-                floatarray &v = vectors[i];
-                if(v.length()!=n) continue;
-                float *p = &obj[0];
-                float *q = &v[0];
-                // we can't break out of OMP loops,
-                // but we just skip the inner loop
-                // after we have found a solution
-                if(result<0) {
-                    for(int j=0;j<n;j++) {
-                        total += sqr(p[j]-q[j]);
-                        if(total>=eps) break;
+            int n = counts_.length();
+            if(n==0 || obj.length()!=ndim) return -1;
+            if(order.length()!=n) sort_order();
+            if(!strcmp(pget("find"),"best")) return find_best(obj,eps);
+            // threads claim chunks of the order; a chunk past the
+            // first match found so far cannot hold an earlier one;
+            // chunks of at most n keep next from overflowing
+            int chunk = int(max(1.0,min(double(n),double(pgetf("chunk")))));
+            float *p = &obj(0);
+            int next = 0;
+            int found = n;
+#pragma omp parallel
+            {
+                for(;;) {
+                    int start,limit;
+#pragma omp atomic capture
+                    { start = next; next += chunk; }
+#pragma omp atomic read
+                    limit = found;
+                    if(start>=limit) break;
+                    int end = min(start+chunk,limit);
+                    for(int k=start;k<end;k++) {
+                        if(sqdist_bounded(p,row(order(k)),ndim,eps)<eps) {
+                            // the compare is serialized; the store is
+                            // atomic because other threads read found
+                            // without the lock
+#pragma omp critical (edist_find)
+                            if(k<found) {
+#pragma omp atomic write
+                                found = k;
+                            }
+                            break;
+                        }
                     }
-                    if(total<eps) result = i;
                 }
             }
-            return result;
+            return found<n ? order(found) : -1;
+        }
+        // per-thread minima, with each thread's best so far as the
+        // bound for its remaining distances
+        int find_best(floatarray &obj,float eps) {
+            int n = counts_.length();
+            float *p = &obj(0);
+            int best = -1;
+            float best_d = eps;
+#pragma omp parallel
+            {
+                int local = -1;
+                float local_d = eps;
+#pragma omp for schedule(static)
+                for(int i=0;i<n;i++) {
+                    float d = sqdist_bounded(p,row(i),ndim,local_d);
+                    if(d<local_d) {
+                        local_d = d;
+                        local = i;
+                    }
+                }
+#pragma omp critical (edist_find)
+                if(local>=0 && (local_d<best_d || (local_d==best_d && local<best))) {
+                    best_d = local_d;
+                    best = local;
+                }
+            }
+            return best;
         }
         virtual void distances(floatarray &ds,floatarray &obj) {
-            int n = obj.length();
-            ds.resize(counts_.length());
+            int n = counts_.length();
+            ds.resize(n);
             ds = 1e38;
+            if(obj.length()!=ndim) return;
+            float *p = &obj(0);
 #pragma omp parallel for
-            for(int i=0;i<vectors.length();i++) {
-                double total = 0.0;
-                floatarray &v = vectors[i];
-                if(v.length()!=n) continue;
-                float *p = &obj[0];
-                float *q = &v[0];
-                for(int j=0;j<n;j++) total += sqr(p[j]-q[j]);
-                ds(i) = total;
-            }
+            for(int i=0;i<n;i++)
+                ds(i) = sqdist_bounded(p,row(i),ndim,1e38);
         }
         virtual void merge(int i,floatarray &obj,float weight) {
             CHECK_ARG(weight>=0.0 && weight<=1.0);
-            CHECK_ARG(vectors(i).length()==obj.length());
-            int n = obj.length();
+            CHECK_ARG(obj.length()==ndim);
+            if(order.length()!=counts_.length()) sort_order();
             float cweight = 1.0-weight;
-            floatarray &v = vectors(i);
-            for(int j=0;j<n;j++) v(j) = cweight*v(j) + weight*obj(j);
+            float *v = row(i);
+            for(int j=0;j<ndim;j++) v[j] = cweight*v[j] + weight*obj(j);
+            // swap i with the first prototype of its count, which
+            // keeps order sorted after the increment
+            int c = counts_(i);
+            int lo = 0, hi = rank(i);
+            while(lo<hi) {
+                int mid = (lo+hi)/2;
+                if(counts_(order(mid))>c) lo = mid+1;
+                else hi = mid;
+            }
+            int j = order(lo);
+            order(lo) = i;
+            order(rank(i)) = j;
+            rank(j) = rank(i);
+            rank(i) = lo;
             counts_(i)++;
         }
         virtual int length() {
@@ -2287,10 +3074,9 @@ namespace glinerec {
             return counts_(i);
         }
         virtual void vector(floatarray &v,int i) {
-            v = vectors(i);
-        }
-        virtual floatarray &vector(int i) {
-            return vectors(i);
+            v.resize(ndim);
+            float *p = row(i);
+            for(int j=0;j<ndim;j++) v(j) = p[j];
         }
     };
 
@@ -2314,16 +3100,32 @@ namespace glinerec {
             this->model = model;
             owned = 0;
         }
+        // the non-empty inputs are classified in batches, one batch
+        // per thread at a time
         void classify() {
             if(!model) throw "no model set";
-            int total = inputs.length();
-#pragma omp parallel for
-            for(int i=0;i<inputs.length();i++) {
-                if(inputs[i].length()<1) continue;
-                model->xoutputs(outputs[i],inputs[i]);
+            enum { batch_size = 100 };
+            intarray todo;
+            for(int i=0;i<inputs.length();i++)
+                if(inputs[i].length()>0) todo.push(i);
+            int total = todo.length();
+            int nbatches = (todo.length()+batch_size-1)/batch_size;
+#pragma omp parallel for schedule(dynamic,1)
+            for(int b=0;b<nbatches;b++) {
+                int start = b*batch_size;
+                int end = min(start+int(batch_size),todo.length());
+                narray<floatarray> batch(end-start);
+                for(int i=start;i<end;i++)
+                    batch(i-start) = inputs(todo(i));
+                narray<OutputVector> ovs;
+                floatarray costs;
+                model->xoutputs_batch(ovs,costs,batch);
+                for(int i=start;i<end;i++)
+                    outputs(todo(i)) = ovs(i-start);
 #pragma omp critical
-                if(total--%1000==0) {
-                    debugf("info","remaining %d\n",total);
+                {
+                    total -= end-start;
+                    if(b%10==0) debugf("info","remaining %d\n",total);
                 }
             }
         }
@@ -2343,6 +3145,51 @@ namespace glinerec {
         }
     };
 
+    void quantize_model(autodel<IModel> &model) {
+        if(!model) return;
+        if(MlpClassifier *mlp = dynamic_cast<MlpClassifier*>(model.ptr())) {
+            QuantizedMlp *quantized = new QuantizedMlp();
+            quantized->quantize(*mlp);
+            model = quantized;
+        } else if(LatinClassifier *latin = dynamic_cast<LatinClassifier*>(model.ptr())) {
+            quantize_model(latin->charclass);
+            quantize_model(latin->junkclass);
+            quantize_model(latin->ulclass);
+        } else if(CascadedMLP *cascaded = dynamic_cast<CascadedMLP*>(model.ptr())) {
+            for(int i=0;i<cascaded->models.length();i++)
+                quantize_model(cascaded->models(i));
+        } else if(AdaBoost *boost = dynamic_cast<AdaBoost*>(model.ptr())) {
+            for(int i=0;i<boost->models.length();i++)
+                quantize_model(boost->models(i));
+        } else {
+            debugf("warn","%s: no MLPs to quantize\n",model->name());
+        }
+    }
+
+    void train_streaming(IModel &model,narray< autodel<IDataset> > &shards) {
+        AutoMlpClassifier *mlp = dynamic_cast<AutoMlpClassifier*>(&model);
+        if(!mlp) throwf("%s: streaming training needs an AutoMlpClassifier",model.name());
+        if(model.extractor) throw "streaming training does not apply feature extractors";
+        mlp->trainStream(shards);
+    }
+
+    void mlp_train_minibatch(floatarray &w1,floatarray &b1,floatarray &w2,floatarray &b2,
+                             floatarray &z,floatarray &targets,floatarray &x,float eta) {
+        CHECK_ARG(w1.rank()==2 && w2.rank()==2);
+        CHECK_ARG(b1.length()==w1.dim(0) && w2.dim(1)==w1.dim(0) && b2.length()==w2.dim(0));
+        MlpClassifier net;
+        net.w1.move(w1);
+        net.b1.move(b1);
+        net.w2.move(w2);
+        net.b2.move(b2);
+        MlpClassifier::MinibatchBuffers buf;
+        net.trainMinibatch(z,targets,x,eta,buf);
+        w1.move(net.w1);
+        b1.move(net.b1);
+        w2.move(net.w2);
+        b2.move(net.b2);
+    }
+
     IOmpClassifier *make_OmpClassifier() {
         return new OmpClassifier();
     }
@@ -2358,12 +3205,14 @@ namespace glinerec {
         component_register<KnnClassifier>("KnnClassifier");
         component_register<EnetClassifier>("EnetClassifier");
         component_register<AutoMlpClassifier>("AutoMlpClassifier");
+        component_register<QuantizedMlp>("QuantizedMlp");
 
 #ifndef OBSOLETE
         component_register<KnnClassifier>("knn");
         component_register<EnetClassifier>("enet");
         component_register<AutoMlpClassifier>("mlp");
         component_register<AutoMlpClassifier>("mappedmlp");
+        component_register<QuantizedMlp>("qmlp");
 #endif
 
         // classifier combination
@@ -2398,8 +3247,11 @@ namespace glinerec {
         // other components
         typedef RowDataset<float8> RowDataset8;
         typedef RaggedDataset<float8> RaggedDataset8;
+        typedef MmapDataset<float8> MmapDataset8;
         component_register<RowDataset8>("RowDataset8");
         component_register<RaggedDataset8>("RaggedDataset8");
+        component_register<MmapDataset8>("MmapDataset8");
+        component_register< MmapDataset<float> >("MmapDataset");
         component_register<SqliteDataset>("SqliteDataset");
         component_register<SqliteBuffer>("SqliteBuffer");
 
@@ -2410,9 +3262,10 @@ namespace glinerec {
         component_register<SqliteBuffer>("sqlitebuffer");
 #endif
 
-        extern void init_glbits(),init_glcuts();
+        extern void init_glbits(),init_glcuts(),init_glann();
         init_glbits();
         init_glcuts();
+        init_glann();
     }
 
     IRecognizeLine *current_recognizer_ = 0;
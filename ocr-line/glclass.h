@@ -168,12 +168,76 @@ namespace glinerec {
             add(temp,c);
         }
         float xoutputs(OutputVector &ov,floatarray &v) {
+            if(!extractor) return outputs(ov,v);
             floatarray temp;
-            if(extractor) extractor->extract(temp,v);
-            else temp = v;
+            extractor->extract(temp,v);
             return outputs(ov,temp);
         }
 
+        // Whether outputs_batch, which gets the inputs flattened into
+        // rows, gives the same results as outputs on the inputs as they
+        // are.  Models that pass their inputs on to submodels with
+        // extractors (which want images) say no.
+        virtual bool takesFlatInputs() {
+            return true;
+        }
+
+        // Classify many inputs at once: ovs[i] and costs[i] are what
+        // xoutputs(ovs[i],inputs[i]) gives.  The inputs are packed into
+        // the rows of one matrix for outputs_batch; inputs of different
+        // sizes, or for a model that does not take flat inputs, are
+        // classified one at a time.
+
+        void xoutputs_batch(narray<OutputVector> &ovs,floatarray &costs,
+                            narray<floatarray> &inputs) {
+            int n = inputs.length();
+            if(n==0) {
+                ovs.clear();
+                costs.clear();
+                return;
+            }
+            bool flat = takesFlatInputs();
+            floatarray data,temp;
+            for(int i=0;i<n;i++) {
+                floatarray *v = &inputs[i];
+                if(extractor) {
+                    extractor->extract(temp,inputs[i]);
+                    v = &temp;
+                }
+                if(i==0) data.resize(n,v->length());
+                if(!flat || v->length()!=data.dim(1)) {
+                    ovs.resize(n);
+                    costs.resize(n);
+                    for(int j=0;j<n;j++)
+                        costs(j) = xoutputs(ovs(j),inputs(j));
+                    return;
+                }
+                for(int j=0;j<v->length();j++)
+                    data(i,j) = v->at1d(j);
+            }
+            outputs_batch(ovs,costs,data);
+        }
+
+        // the same for the rows of a matrix
+
+        void xoutputs_batch(narray<OutputVector> &ovs,floatarray &costs,
+                            floatarray &inputs) {
+            if(!extractor) {
+                outputs_batch(ovs,costs,inputs);
+                return;
+            }
+            floatarray data,v,temp;
+            for(int i=0;i<inputs.dim(0);i++) {
+                rowget(v,inputs,i);
+                extractor->extract(temp,v);
+                if(i==0) data.resize(inputs.dim(0),temp.length());
+                CHECK_ARG(temp.length()==data.dim(1));
+                for(int j=0;j<temp.length();j++)
+                    data(i,j) = temp.at1d(j);
+            }
+            outputs_batch(ovs,costs,data);
+        }
+
         void xtrain(IDataset &ds) {
             if(!extractor) {
                 train(ds);
@@ -192,6 +256,19 @@ namespace glinerec {
         virtual float outputs(OutputVector &ov,floatarray &x) {
             throw Unimplemented();
         }
+        // one input per row of data; models that can classify a batch
+        // faster than one input at a time override this
+        virtual void outputs_batch(narray<OutputVector> &ovs,floatarray &costs,
+                                   floatarray &data) {
+            int n = data.dim(0);
+            ovs.resize(n);
+            costs.resize(n);
+            floatarray v;
+            for(int i=0;i<n;i++) {
+                rowget(v,data,i);
+                costs(i) = outputs(ovs(i),v);
+            }
+        }
         virtual void train(IDataset &ds) {
             floatarray v;
             for(int i=0;i<ds.nsamples();i++) {
@@ -308,6 +385,19 @@ namespace glinerec {
             return cost;
         }
 
+        void outputs_batch(narray<OutputVector> &ovs,floatarray &costs,
+                           floatarray &data) {
+            floatarray out;
+            outputs_dense_batch(out,costs,data);
+            int n = data.dim(0);
+            ovs.resize(n);
+            for(int i=0;i<n;i++) {
+                ovs(i).clear();
+                for(int j=0;j<out.dim(1);j++)
+                    ovs(i)(i2c(j)) = out(i,j);
+            }
+        }
+
         struct TranslatedDataset : virtual IDataset {
             IDataset &ds;
             intarray &c2i;
@@ -320,6 +410,7 @@ namespace glinerec {
             int nfeatures() { return ds.nfeatures(); }
             int nsamples() { return ds.nsamples(); }
             void input(floatarray &v,int i) { ds.input(v,i); }
+            void input(float *out,int n,int i) { ds.input(out,n,i); }
             int cls(int i) { return c2i(ds.cls(i)); }
             int id(int i) { return ds.id(i); }
         };
@@ -346,6 +437,21 @@ namespace glinerec {
         virtual float outputs_dense(floatarray &result,floatarray &v) {
             throw Unimplemented();
         }
+
+        // the dense outputs for each row of data, one row per input
+        virtual void outputs_dense_batch(floatarray &result,floatarray &costs,
+                                         floatarray &data) {
+            int n = data.dim(0);
+            costs.resize(n);
+            floatarray v,out;
+            for(int i=0;i<n;i++) {
+                rowget(v,data,i);
+                costs(i) = outputs_dense(out,v);
+                if(i==0) result.resize(n,out.length());
+                for(int j=0;j<out.length();j++)
+                    result(i,j) = out(j);
+            }
+        }
     };
 
     struct IDistComp : IComponent {
@@ -395,6 +501,23 @@ namespace glinerec {
 
     void least_square(floatarray &xf,floatarray &Af,floatarray &bf);
 
+    // Replace the MLPs in model, directly or inside latin, cascaded
+    // and boosted classifiers, by copies with int8 weights ("qmlp").
+    void quantize_model(autodel<IModel> &model);
+
+    // Train an AutoMlpClassifier from datasets that stay on disk
+    // (MmapDataset8 files), the last of them held out for
+    // cross-validation.
+    void train_streaming(IModel &model,narray< autodel<IDataset> > &shards);
+
+    // One mini-batch step of MLP training on the weights w1,b1,w2,b2,
+    // which are updated: the rows of x are the inputs and those of
+    // targets the wanted outputs, and z gets the outputs before the
+    // step.  The weights move by eta/sqrt(rows) times the gradient of
+    // the summed squared errors (for checking the training).
+    void mlp_train_minibatch(floatarray &w1,floatarray &b1,floatarray &w2,floatarray &b2,
+                             floatarray &z,floatarray &targets,floatarray &x,float eta);
+
     inline IModel *make_model(const char *name) {
         IModel *result = dynamic_cast<IModel*>(component_construct(name));
         CHECK(result!=0);
@@ -3,8 +3,15 @@
 #ifndef gldataset_h__
 #define gldataset_h__
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "colib/narray-binio.h"
 #include "gliovecs.h"
+#include "glmlp.h"
 
 namespace glinerec {
     using namespace narray_io;
@@ -29,6 +36,20 @@ namespace glinerec {
             input(v,i);
             v.reshape(v.length());
         }
+        // the n values of sample i into out; the datasets that store
+        // rows decode them there directly
+        virtual void input(float *out,int n,int i) {
+            floatarray v;
+            input1d(v,i);
+            CHECK_ARG(v.length()==n);
+            for(int j=0;j<n;j++) out[j] = v(j);
+        }
+        // hints for datasets read from disk: samples [from,to) are
+        // about to be read, or will not be read again for a while
+        virtual void prefetch(int from,int to) {
+        }
+        virtual void release(int from,int to) {
+        }
     };
 
     struct IExtDataset : IDataset {
@@ -46,19 +67,60 @@ namespace glinerec {
         signed char val;
         float8() {
         }
+        // rounded like float8_encode, so that decoding and encoding
+        // again is exact
         float8(double v) {
             if(v<-1.2||v>1.2) throw "float8: value out of range";
-            val = (int)(v*100);
+            val = lrintf(float(v)*100.0f);
         }
         float8(float v) {
             if(v<-1.2||v>1.2) throw "float8: value out of range";
-            val = (int)(v*100);
+            val = lrintf(v*100.0f);
         }
         operator float() {
             return val/100.0;
         }
     };
 
+    // Conversions between float rows and stored rows.  Rows are
+    // checked once when they are added to a dataset; after that, the
+    // bulk float8 codecs clamp rather than throw.
+
+    template <class T>
+    inline void row_check(floatarray &v) {
+        CHECK(min(v)>-100 && max(v)<100);
+    }
+    template <>
+    inline void row_check<float8>(floatarray &v) {
+        if(v.length()==0) return;
+        if(min(v)<-1.2 || max(v)>1.2) throw "float8: value out of range";
+    }
+
+    template <class T>
+    inline void row_encode(T *out,const float *in,int n) {
+        for(int j=0;j<n;j++) out[j] = in[j];
+    }
+    template <>
+    inline void row_encode<float8>(float8 *out,const float *in,int n) {
+        float8_encode(&out->val,in,n);
+    }
+
+    // out gets the shape of like (a vector or an image)
+    template <class S,class T>
+    inline void row_shape(narray<S> &out,narray<T> &like) {
+        if(like.rank()==2) out.resize(like.dim(0),like.dim(1));
+        else out.resize(like.length());
+    }
+
+    template <class T>
+    inline void row_decode(float *out,T *in,int n) {
+        for(int j=0;j<n;j++) out[j] = in[j];
+    }
+    template <>
+    inline void row_decode<float8>(float *out,float8 *in,int n) {
+        float8_decode(out,&in->val,n);
+    }
+
     template <class T>
     struct Dataset : IDataset {
         narray<T> &data;
@@ -116,14 +178,17 @@ namespace glinerec {
         }
         void input(floatarray &v,int i) {
             v.resize(data.dim(1));
-            for(int j=0;j<v.dim(0);j++)
-                v(j) = data(i,j);
+            row_decode(v.data,&data(i,0),v.length());
+        }
+        void input(float *out,int n,int i) {
+            CHECK_ARG(n==data.dim(1));
+            row_decode(out,&data(i,0),n);
         }
         int id(int i) {
             return i;
         }
         void add(floatarray &v,int c) {
-            CHECK(min(v)>-100 && max(v)<100);
+            row_check<T>(v);
             CHECK(c>=-1);
             if(c>=nc) nc = c+1;
             if(nf<0) nf = v.length();
@@ -195,17 +260,26 @@ namespace glinerec {
             return classes(i);
         }
         void input(floatarray &v,int i) {
-            v.copy(data(i));
+            narray<T> &row = data(i);
+            row_shape(v,row);
+            row_decode(v.data,row.data,row.length());
+        }
+        void input(float *out,int n,int i) {
+            narray<T> &row = data(i);
+            CHECK_ARG(n==row.length());
+            row_decode(out,row.data,n);
         }
         int id(int i) {
             return i;
         }
         void add(floatarray &v,int c) {
-            CHECK(min(v)>-100 && max(v)<100);
+            row_check<T>(v);
             CHECK(c>=-1);
             if(c>=nc) nc = c+1;
             if(nf<0) nf = v.length();
-            data.push().copy(v);
+            narray<T> &row = data.push();
+            row_shape(row,v);
+            row_encode(row.data,v.data,v.length());
             classes.push() = c;
             CHECK(nc>0);
             CHECK(nf>0);
@@ -275,15 +349,24 @@ namespace glinerec {
             return classes(i);
         }
         void input(floatarray &v,int i) {
-            v.copy(data(i));
+            narray<T> &row = data(i);
+            row_shape(v,row);
+            row_decode(v.data,row.data,row.length());
+        }
+        void input(float *out,int n,int i) {
+            narray<T> &row = data(i);
+            CHECK_ARG(n==row.length());
+            row_decode(out,row.data,n);
         }
         int id(int i) {
             return i;
         }
         void add(floatarray &v,int c) {
-            CHECK(min(v)>-100 && max(v)<100);
+            row_check<T>(v);
             CHECK(c>=-1);
-            data.push() = v;
+            narray<T> &row = data.push();
+            row_shape(row,v);
+            row_encode(row.data,v.data,v.length());
             classes.push() = c;
         }
         void add(floatarray &ds,intarray &cs) {
@@ -298,6 +381,278 @@ namespace glinerec {
         }
     };
 
+    // Datasets too large for memory: a fixed header, the rows (each
+    // starting on a multiple of mmap_dataset_align), and per-sample
+    // tables, all in native byte order with offsets relative to the
+    // header.  The header itself starts on a multiple of
+    // mmap_dataset_align in the file, after zero padding, so that the
+    // rows and tables are aligned in the mapping wherever the dataset
+    // is written.  MmapDataset maps such a file and serves rows and
+    // classes straight from the mapping.
+
+    struct mmap_dataset_header {
+        char magic[8];                  // "mmapds1"
+        int32_t elsize;                 // bytes per value
+        int32_t nsamples;
+        int32_t nclasses;
+        int32_t nfeatures;              // -1 if the rows differ in length
+        int64_t tables;                 // int64 offsets[n], int32 lengths[n], int32 classes[n]
+    };
+
+    enum { mmap_dataset_align = 64 };
+
+    inline void mmap_dataset_pad(FILE *stream,int64_t &pos,int align) {
+        while(pos%align) {
+            CHECK(fputc(0,stream)!=EOF);
+            pos++;
+        }
+    }
+
+    // Writes the samples of ds one at a time, so the dataset need not
+    // fit into memory.
+
+    template <class T>
+    void mmap_dataset_write(FILE *stream,IDataset &ds) {
+        int64_t start = ftell(stream);
+        CHECK_ARG(start>=0);
+        mmap_dataset_pad(stream,start,mmap_dataset_align);
+        mmap_dataset_header header;
+        memset(&header,0,sizeof header);
+        strcpy(header.magic,"mmapds1");
+        header.elsize = sizeof (T);
+        header.nsamples = ds.nsamples();
+        header.nclasses = 0;
+        header.nfeatures = -1;
+        CHECK(fwrite(&header,sizeof header,1,stream)==1);
+        int n = header.nsamples;
+        narray<int64_t> offsets(n);
+        intarray lengths(n),classes(n);
+        int64_t pos = sizeof header;
+        floatarray v;
+        narray<T> row;
+        for(int i=0;i<n;i++) {
+            mmap_dataset_pad(stream,pos,mmap_dataset_align);
+            ds.input1d(v,i);
+            row_check<T>(v);
+            row.resize(v.length());
+            row_encode(row.data,v.data,v.length());
+            if(row.length()>0)
+                CHECK(fwrite(&row(0),sizeof (T),row.length(),stream)==unsigned(row.length()));
+            offsets(i) = pos;
+            lengths(i) = row.length();
+            classes(i) = ds.cls(i);
+            pos += row.length() * sizeof (T);
+            if(i==0) header.nfeatures = lengths(i);
+            else if(header.nfeatures!=lengths(i)) header.nfeatures = -1;
+            if(classes(i)>=header.nclasses) header.nclasses = classes(i)+1;
+        }
+        mmap_dataset_pad(stream,pos,8);
+        header.tables = pos;
+        if(n>0) {
+            CHECK(fwrite(&offsets(0),sizeof offsets(0),n,stream)==unsigned(n));
+            CHECK(fwrite(&lengths(0),sizeof lengths(0),n,stream)==unsigned(n));
+            CHECK(fwrite(&classes(0),sizeof classes(0),n,stream)==unsigned(n));
+        }
+        long end = ftell(stream);
+        CHECK(fseek(stream,start,SEEK_SET)==0);
+        CHECK(fwrite(&header,sizeof header,1,stream)==1);
+        CHECK(fseek(stream,end,SEEK_SET)==0);
+    }
+
+    template <class T>
+    struct MmapDataset : IExtDataset {
+        void *map;
+        size_t mapsize;
+        const char *base;
+        mmap_dataset_header header;
+        const int64_t *offsets;
+        const int32_t *lengths;
+        const int32_t *classes_;
+        bool sequential;
+        size_t window,ahead;
+        // samples added before saving
+        objlist< narray<T> > data;
+        intarray classes;
+
+        MmapDataset() {
+            map = 0;
+            mapsize = 0;
+            pdef("advice","sequential","access pattern (sequential, random, willneed = read all now)");
+            pdef("readahead",16<<20,"bytes to read ahead of sequential access");
+        }
+        ~MmapDataset() {
+            unmap();
+        }
+        const char *name() {
+            return "mmapdataset";
+        }
+        void unmap() {
+            if(map) munmap(map,mapsize);
+            map = 0;
+            mapsize = 0;
+        }
+        void save(FILE *stream) {
+            mmap_dataset_write<T>(stream,*this);
+        }
+        // Reads the header and checks it and every row against the
+        // size of the file (from base), so that input() and the page
+        // hints stay inside the mapping; returns an error or 0.
+        const char *check(size_t size) {
+            memcpy(&header,base,sizeof header);
+            if(strncmp(header.magic,"mmapds1",8)) return "mmapdataset: bad magic";
+            if(header.elsize!=sizeof (T)) return "mmapdataset: wrong element size";
+            int64_t n = header.nsamples;
+            int64_t entry = sizeof *offsets+sizeof *lengths+sizeof *classes_;
+            if(n<0 || header.tables<int64_t(sizeof header) || header.tables%8
+               || header.tables>int64_t(size) || n>(int64_t(size)-header.tables)/entry)
+                return "mmapdataset: truncated";
+            offsets = (const int64_t *)(base+header.tables);
+            lengths = (const int32_t *)(offsets+n);
+            classes_ = lengths+n;
+            // the rows lie between the header and the tables
+            for(int i=0;i<n;i++) {
+                if(lengths[i]<0 || offsets[i]<int64_t(sizeof header)
+                   || offsets[i]>header.tables
+                   || lengths[i]>(header.tables-offsets[i])/int64_t(sizeof (T))
+                   || (header.nfeatures>=0 && lengths[i]!=header.nfeatures)
+                   || classes_[i]<-1 || classes_[i]>=header.nclasses)
+                    return "mmapdataset: bad row";
+            }
+            return 0;
+        }
+        void load(FILE *stream) {
+            unmap();
+            data.clear();
+            classes.clear();
+            long start = ftell(stream);
+            struct stat st;
+            CHECK(start>=0 && fstat(fileno(stream),&st)==0);
+            // skip the padding before the header
+            start = (start+mmap_dataset_align-1)/mmap_dataset_align*mmap_dataset_align;
+            if(size_t(start)+sizeof header>size_t(st.st_size))
+                throw "mmapdataset: file too short";
+            void *p = mmap(0,st.st_size,PROT_READ,MAP_SHARED,fileno(stream),0);
+            if(p==MAP_FAILED) throw "mmapdataset: mmap failed";
+            map = p;
+            mapsize = st.st_size;
+            base = (const char *)map + start;
+            const char *error = check(mapsize-start);
+            if(error) {
+                unmap();
+                throw error;
+            }
+            int n = header.nsamples;
+            size_t end = start+header.tables+n*(sizeof *offsets+sizeof *lengths+sizeof *classes_);
+            const char *advice = pget("advice");
+            sequential = !strcmp(advice,"sequential");
+            window = pgetf("readahead");
+            ahead = 0;
+            if(sequential) madvise(map,mapsize,MADV_SEQUENTIAL);
+            else if(!strcmp(advice,"random")) madvise(map,mapsize,MADV_RANDOM);
+            else if(!strcmp(advice,"willneed")) madvise(map,mapsize,MADV_WILLNEED);
+            else throwf("%s: unknown advice",advice);
+            CHECK(fseek(stream,end,SEEK_SET)==0);
+        }
+        int nsamples() {
+            return map ? header.nsamples : classes.length();
+        }
+        int nclasses() {
+            return map ? header.nclasses : max(classes)+1;
+        }
+        int nfeatures() {
+            if(map) return header.nfeatures;
+            return data.length()>0 ? data(0).length() : -1;
+        }
+        int cls(int i) {
+            if(!map) return classes(i);
+            CHECK_ARG(unsigned(i)<unsigned(header.nsamples));
+            return classes_[i];
+        }
+        int id(int i) {
+            return i;
+        }
+        // ask for the next window of rows once a sequential pass
+        // gets within half a window of the end of the last one; an
+        // offset before the last window starts a new pass (the next
+        // epoch).  input() may be called from several threads, which
+        // at worst ask for the same window twice
+        void readahead(size_t offset) {
+            if(!sequential || window==0) return;
+            size_t last;
+#pragma omp atomic read
+            last = ahead;
+            if(offset+window/2<last && offset+window>=last) return;
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t from = (base-(const char *)map+offset)/page*page;
+            size_t to = from+window<mapsize ? from+window : mapsize;
+            if(to>from) madvise((char *)map+from,to-from,MADV_WILLNEED);
+#pragma omp atomic write
+            ahead = offset+window;
+        }
+        // the pages holding samples [from,to)
+        bool pages(size_t &start,size_t &size,int from,int to) {
+            if(!map || from>=to) return false;
+            CHECK_ARG(from>=0 && to<=header.nsamples);
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t lo = base-(const char *)map+offsets[from];
+            size_t hi = base-(const char *)map+offsets[to-1]+lengths[to-1]*sizeof (T);
+            start = lo/page*page;
+            size = hi-start;
+            return true;
+        }
+        void prefetch(int from,int to) {
+            size_t start,size;
+            if(pages(start,size,from,to))
+                madvise((char *)map+start,size,MADV_WILLNEED);
+        }
+        // the mapping is read-only, so dropped pages are simply read
+        // from the file again when needed
+        void release(int from,int to) {
+            size_t start,size;
+            if(pages(start,size,from,to))
+                madvise((char *)map+start,size,MADV_DONTNEED);
+        }
+        int length(int i) {
+            if(!map) return data(i).length();
+            CHECK_ARG(unsigned(i)<unsigned(header.nsamples));
+            return lengths[i];
+        }
+        void input(float *out,int n,int i) {
+            CHECK_ARG(n==length(i));
+            if(!map) {
+                row_decode(out,data(i).data,n);
+                return;
+            }
+            readahead(offsets[i]);
+            row_decode(out,(T *)(base+offsets[i]),n);
+        }
+        void input(floatarray &v,int i) {
+            v.resize(length(i));
+            input(v.data,v.length(),i);
+        }
+        void add(floatarray &v,int c) {
+            if(map) throw "mmapdataset: cannot add to a mapped dataset";
+            row_check<T>(v);
+            CHECK(c>=-1);
+            narray<T> &row = data.push();
+            row_shape(row,v);
+            row_encode(row.data,v.data,v.length());
+            classes.push() = c;
+        }
+        void add(floatarray &ds,intarray &cs) {
+            floatarray v;
+            for(int i=0;i<ds.dim(0);i++) {
+                rowget(v,ds,i);
+                add(v,cs(i));
+            }
+        }
+        void clear() {
+            unmap();
+            data.clear();
+            classes.clear();
+        }
+    };
+
     struct MappedDataset : IDataset {
         IDataset &ds;
         intarray &classes;
@@ -323,6 +678,9 @@ namespace glinerec {
         void input(floatarray &v,int i) {
             ds.input(v,i);
         }
+        void input(float *out,int n,int i) {
+            ds.input(out,n,i);
+        }
         int id(int i) {
             return ds.id(i);
         }
@@ -351,6 +709,9 @@ namespace glinerec {
         void input(floatarray &v,int i) {
             ds.input(v,samples(i));
         }
+        void input(float *out,int n,int i) {
+            ds.input(out,n,samples(i));
+        }
         int id(int i) {
             return ds.id(samples(i));
         }
@@ -391,6 +752,198 @@ namespace glinerec {
                 augments(i).push() = p(j);
         }
     };
+
+    ////////////////////////////////////////////////////////////////
+    // Samples streamed from datasets on disk ("shards", normally
+    // MmapDataset8 files).  A prefetch thread reads blocks of
+    // consecutive samples, in a new random order over all shards in
+    // each epoch, and decodes them into chunks of several blocks,
+    // which the trainer takes from a queue; only the chunks are held
+    // in memory, and the pages of a block are released once it has
+    // been read.
+    ////////////////////////////////////////////////////////////////
+
+    struct ShardStream {
+        struct Chunk {
+            floatarray inputs;      // one sample per row
+            intarray classes;       // dense classes
+            int n;                  // rows in use
+            int epoch;              // of the last block
+        };
+        narray< autodel<IDataset> > &shards;
+        int nshards;                // the first nshards are read
+        intarray &c2i;
+        int nfeatures,block,nblocks;
+        intarray shard,first;       // the blocks
+        objlist<Chunk> chunks;
+        intarray ready,unused;      // chunk numbers, ready in order
+        int epochs;                 // only seen by the prefetch thread
+        bool stopping,running;
+        char error[1000];
+        unsigned short seed[3];
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+
+        // chunks of about chunk samples, as many as fit into mb
+        // megabytes (at least two, one being filled while the other
+        // is used)
+        ShardStream(narray< autodel<IDataset> > &shards,int nshards,intarray &c2i,
+                    int block,int chunk,float mb)
+            : shards(shards),nshards(nshards),c2i(c2i),block(block) {
+            CHECK_ARG(nshards>0 && nshards<=shards.length());
+            CHECK_ARG(block>0 && chunk>=block);
+            nfeatures = shards(0)->nfeatures();
+            CHECK_ARG(nfeatures>0);
+            for(int s=0;s<nshards;s++)
+                for(int i=0;i<shards(s)->nsamples();i+=block) {
+                    shard.push(s);
+                    first.push(i);
+                }
+            if(shard.length()==0) throw "stream: no samples";
+            nblocks = chunk/block;
+            int rows = nblocks*block;
+            double bytes = rows*(nfeatures+1.0)*sizeof (float);
+            int n = max(2,int(mb*(1<<20)/bytes));
+            if(n*bytes>mb*(1<<20))
+                debugf("warn","stream buffer: need %g MB for two chunks\n",n*bytes/(1<<20));
+            chunks.resize(n);
+            for(int i=0;i<n;i++) {
+                chunks(i).inputs.resize(rows,nfeatures);
+                chunks(i).classes.resize(rows);
+                chunks(i).n = 0;
+                unused.push(i);
+            }
+            epochs = 0;
+            stopping = false;
+            running = false;
+            error[0] = 0;
+            for(int i=0;i<3;i++) seed[i] = lrand48();
+            pthread_mutex_init(&lock,0);
+            pthread_cond_init(&changed,0);
+        }
+        ~ShardStream() {
+            stop();
+            pthread_cond_destroy(&changed);
+            pthread_mutex_destroy(&lock);
+        }
+        void start() {
+            CHECK(!running);
+            if(pthread_create(&thread,0,prefetch_main,this)) throw "stream: cannot start prefetch thread";
+            running = true;
+        }
+        void stop() {
+            if(!running) return;
+            pthread_mutex_lock(&lock);
+            stopping = true;
+            pthread_cond_broadcast(&changed);
+            pthread_mutex_unlock(&lock);
+            pthread_join(thread,0);
+            running = false;
+        }
+
+        // the next chunk for the trainer, which hands it back with
+        // done() when it is finished with it
+        int next() {
+            int c = take(ready);
+            if(c<0) {
+                static char message[sizeof error];
+                strcpy(message,error);
+                throw message;
+            }
+            return c;
+        }
+        void done(int c) {
+            give(unused,c);
+        }
+
+        // the first chunk number on list, waiting for one if there is
+        // none; -1 if the stream stopped or failed
+        int take(intarray &list) {
+            pthread_mutex_lock(&lock);
+            while(list.length()==0 && !stopping && !error[0])
+                pthread_cond_wait(&changed,&lock);
+            int c = -1;
+            if(list.length()>0 && !stopping) {
+                c = list(0);
+                for(int i=1;i<list.length();i++) list(i-1) = list(i);
+                list.truncate(list.length()-1);
+            }
+            pthread_mutex_unlock(&lock);
+            return c;
+        }
+        void give(intarray &list,int c) {
+            pthread_mutex_lock(&lock);
+            list.push(c);
+            pthread_cond_broadcast(&changed);
+            pthread_mutex_unlock(&lock);
+        }
+
+        static void *prefetch_main(void *stream) {
+            ShardStream *self = (ShardStream *)stream;
+            try {
+                self->run();
+            } catch(const char *message) {
+                pthread_mutex_lock(&self->lock);
+                snprintf(self->error,sizeof self->error,"stream: %s",message);
+                pthread_cond_broadcast(&self->changed);
+                pthread_mutex_unlock(&self->lock);
+            }
+            return 0;
+        }
+
+        int last(int b) {
+            return min(first(b)+block,shards(shard(b))->nsamples());
+        }
+
+        void run() {
+            intarray order;
+            // the order is shuffled here rather than with rpermutation
+            // so that the trainer's random numbers are left alone
+            order.resize(shard.length());
+            for(int i=0;i<order.length();i++) order(i) = i;
+            int next = order.length();
+            int labeled = 0;
+            for(;;) {
+                int c = take(unused);
+                if(c<0) return;
+                Chunk &chunk = chunks(c);
+                chunk.n = 0;
+                for(int k=0;k<nblocks;k++) {
+                    if(next==order.length()) {
+                        if(epochs>0 && labeled==0) throw "no labeled samples";
+                        for(int i=order.length()-1;i>0;i--) {
+                            int j = nrand48(seed)%(i+1);
+                            int t = order(i); order(i) = order(j); order(j) = t;
+                        }
+                        next = 0;
+                        labeled = 0;
+                        epochs++;
+                    }
+                    int b = order(next++);
+                    IDataset &ds = *shards(shard(b));
+                    int from = first(b), to = last(b);
+                    // the following block is read in while this one
+                    // is decoded
+                    if(next<order.length()) {
+                        int nb = order(next);
+                        shards(shard(nb))->prefetch(first(nb),last(nb));
+                    }
+                    for(int i=from;i<to;i++) {
+                        int cls = ds.cls(i);
+                        if(cls<0 || cls>=c2i.length() || c2i(cls)<0) continue;
+                        ds.input(&chunk.inputs(chunk.n,0),nfeatures,i);
+                        chunk.classes(chunk.n) = c2i(cls);
+                        chunk.n++;
+                        labeled++;
+                    }
+                    ds.release(from,to);
+                }
+                chunk.epoch = epochs;
+                give(ready,c);
+            }
+        }
+    };
 }
 
 #endif
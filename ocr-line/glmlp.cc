@@ -0,0 +1,335 @@
+// vectorized kernels for the MLP and prototype classifiers
+
+#include <math.h>
+#if defined(__AVX__) || defined(__SSE__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "glmlp.h"
+
+namespace glinerec {
+
+    namespace {
+        // the input range of the sigmoid (as in glclass.cc)
+        const float sigmoid_limit = 20.0;
+
+        inline float clamp(float x) {
+            if(x<-sigmoid_limit) return -sigmoid_limit;
+            if(x>sigmoid_limit) return sigmoid_limit;
+            return x;
+        }
+
+        // 2^t for |t|<126: 2^floor(t) from the exponent bits, 2^f for the
+        // fraction from a least squares polynomial
+
+        inline float fast_exp2(float t) {
+            float fl = floorf(t);
+            float f = t-fl;
+            float p = 1.0f+f*(0.693043384f+f*(0.24125053f+
+                      f*(0.052351295f+f*0.013342501f)));
+            union { float f; int i; } scale;
+            scale.i = (int(fl)+127)<<23;
+            return p*scale.f;
+        }
+
+#if defined(__AVX__)
+        typedef __m256 vfloat;
+        const int vwidth = 8;
+        inline vfloat vzero() { return _mm256_setzero_ps(); }
+        inline vfloat vload(const float *p) { return _mm256_loadu_ps(p); }
+        inline vfloat vsub(vfloat a,vfloat b) { return _mm256_sub_ps(a,b); }
+        inline vfloat vmadd(vfloat a,vfloat b,vfloat c) {
+#if defined(__FMA__)
+            return _mm256_fmadd_ps(a,b,c);
+#else
+            return _mm256_add_ps(c,_mm256_mul_ps(a,b));
+#endif
+        }
+        inline float vsum(vfloat a) {
+            __m128 acc = _mm_add_ps(_mm256_castps256_ps128(a),
+                                    _mm256_extractf128_ps(a,1));
+            acc = _mm_add_ps(acc,_mm_movehl_ps(acc,acc));
+            acc = _mm_add_ss(acc,_mm_shuffle_ps(acc,acc,1));
+            return _mm_cvtss_f32(acc);
+        }
+#elif defined(__SSE__)
+        typedef __m128 vfloat;
+        const int vwidth = 4;
+        inline vfloat vzero() { return _mm_setzero_ps(); }
+        inline vfloat vload(const float *p) { return _mm_loadu_ps(p); }
+        inline vfloat vsub(vfloat a,vfloat b) { return _mm_sub_ps(a,b); }
+        inline vfloat vmadd(vfloat a,vfloat b,vfloat c) {
+            return _mm_add_ps(c,_mm_mul_ps(a,b));
+        }
+        inline float vsum(vfloat acc) {
+            acc = _mm_add_ps(acc,_mm_movehl_ps(acc,acc));
+            acc = _mm_add_ss(acc,_mm_shuffle_ps(acc,acc,1));
+            return _mm_cvtss_f32(acc);
+        }
+#endif
+
+        inline float dot(const float *w,const float *x,int m) {
+            int j = 0;
+            float total = 0;
+#if defined(__AVX__) || defined(__SSE__)
+            vfloat acc0 = vzero(), acc1 = vzero();
+            for(;j+2*vwidth<=m;j+=2*vwidth) {
+                acc0 = vmadd(vload(w+j),vload(x+j),acc0);
+                acc1 = vmadd(vload(w+j+vwidth),vload(x+j+vwidth),acc1);
+            }
+            total = vsum(acc0)+vsum(acc1);
+#else
+            float t0 = 0,t1 = 0,t2 = 0,t3 = 0;
+            for(;j+4<=m;j+=4) {
+                t0 += w[j]*x[j];
+                t1 += w[j+1]*x[j+1];
+                t2 += w[j+2]*x[j+2];
+                t3 += w[j+3]*x[j+3];
+            }
+            total = (t0+t1)+(t2+t3);
+#endif
+            for(;j<m;j++)
+                total += w[j]*x[j];
+            return total;
+        }
+
+        // the dot products of w with four consecutive rows of x,
+        // loading each element of w once
+
+        inline void dot4(float *out,const float *w,const float *x,int m) {
+            const float *x0 = x, *x1 = x+m, *x2 = x+2*m, *x3 = x+3*m;
+            int j = 0;
+            float t0 = 0,t1 = 0,t2 = 0,t3 = 0;
+#if defined(__AVX__) || defined(__SSE__)
+            vfloat a0 = vzero(), a1 = vzero(), a2 = vzero(), a3 = vzero();
+            for(;j+vwidth<=m;j+=vwidth) {
+                vfloat wj = vload(w+j);
+                a0 = vmadd(wj,vload(x0+j),a0);
+                a1 = vmadd(wj,vload(x1+j),a1);
+                a2 = vmadd(wj,vload(x2+j),a2);
+                a3 = vmadd(wj,vload(x3+j),a3);
+            }
+            t0 = vsum(a0); t1 = vsum(a1); t2 = vsum(a2); t3 = vsum(a3);
+#endif
+            for(;j<m;j++) {
+                float wj = w[j];
+                t0 += wj*x0[j];
+                t1 += wj*x1[j];
+                t2 += wj*x2[j];
+                t3 += wj*x3[j];
+            }
+            out[0] = t0; out[1] = t1; out[2] = t2; out[3] = t3;
+        }
+
+        // rows of w per block of the batched product; a block of an
+        // 800 input layer stays in the L2 cache for all samples
+        const int unit_block = 64;
+
+        // elements summed between checks of the distance bound
+        const int dist_block = 64;
+    }
+
+    void mlp_affine(float *y,const float *w,const float *b,
+                    const float *x,int n,int m) {
+        for(int i=0;i<n;i++)
+            y[i] = (b?b[i]:0)+dot(w+i*m,x,m);
+    }
+
+    void mlp_affine_batch(float *y,const float *w,const float *b,
+                          const float *x,int n,int m,int k) {
+#if defined(__AVX__) || defined(__SSE__)
+        int k4 = k-k%4;
+#else
+        int k4 = 0;
+#endif
+        for(int i0=0;i0<n;i0+=unit_block) {
+            int i1 = i0+unit_block<n ? i0+unit_block : n;
+            for(int s=0;s<k4;s+=4) {
+                const float *xs = x+s*m;
+                float *ys = y+s*n;
+                for(int i=i0;i<i1;i++) {
+                    float t[4];
+                    dot4(t,w+i*m,xs,m);
+                    float bias = b?b[i]:0;
+                    ys[i] = bias+t[0];
+                    ys[n+i] = bias+t[1];
+                    ys[2*n+i] = bias+t[2];
+                    ys[3*n+i] = bias+t[3];
+                }
+            }
+        }
+        for(int s=k4;s<k;s++)
+            mlp_affine(y+s*n,w,b,x+s*m,n,m);
+    }
+
+    void mlp_sigmoid(float *y,int n,bool fast) {
+        if(fast) {
+            for(int i=0;i<n;i++)
+                y[i] = 1.0f/(1.0f+fast_exp2(-1.442695041f*clamp(y[i])));
+        } else {
+            for(int i=0;i<n;i++)
+                y[i] = 1.0/(1.0+exp(-clamp(y[i])));
+        }
+    }
+
+    float sqdist_bounded(const float *u,const float *v,int n,float bound) {
+        float total = 0;
+        for(int j0=0;j0<n;j0+=dist_block) {
+            int j1 = j0+dist_block<n ? j0+dist_block : n;
+            int j = j0;
+#if defined(__AVX__) || defined(__SSE__)
+            vfloat acc = vzero();
+            for(;j+vwidth<=j1;j+=vwidth) {
+                vfloat d = vsub(vload(u+j),vload(v+j));
+                acc = vmadd(d,d,acc);
+            }
+            total += vsum(acc);
+#endif
+            for(;j<j1;j++) {
+                float d = u[j]-v[j];
+                total += d*d;
+            }
+            if(total>=bound) break;
+        }
+        return total;
+    }
+
+    namespace {
+        inline int dot_i8(const signed char *w,const signed char *x,int m) {
+            int j = 0;
+            int total = 0;
+#if defined(__AVX2__)
+            __m256i acc = _mm256_setzero_si256();
+            for(;j+16<=m;j+=16) {
+                __m256i wj = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w+j)));
+                __m256i xj = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x+j)));
+                acc = _mm256_add_epi32(acc,_mm256_madd_epi16(wj,xj));
+            }
+            __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                        _mm256_extracti128_si256(acc,1));
+            sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0x4e));
+            sum = _mm_add_epi32(sum,_mm_shuffle_epi32(sum,0xb1));
+            total = _mm_cvtsi128_si32(sum);
+#elif defined(__SSE2__)
+            // sign extension to 16 bits: unpack each byte into the high
+            // half of a word and shift it back down arithmetically
+            __m128i acc = _mm_setzero_si128();
+            for(;j+16<=m;j+=16) {
+                __m128i wj = _mm_loadu_si128((const __m128i*)(w+j));
+                __m128i xj = _mm_loadu_si128((const __m128i*)(x+j));
+                __m128i wlo = _mm_srai_epi16(_mm_unpacklo_epi8(wj,wj),8);
+                __m128i whi = _mm_srai_epi16(_mm_unpackhi_epi8(wj,wj),8);
+                __m128i xlo = _mm_srai_epi16(_mm_unpacklo_epi8(xj,xj),8);
+                __m128i xhi = _mm_srai_epi16(_mm_unpackhi_epi8(xj,xj),8);
+                acc = _mm_add_epi32(acc,_mm_madd_epi16(wlo,xlo));
+                acc = _mm_add_epi32(acc,_mm_madd_epi16(whi,xhi));
+            }
+            acc = _mm_add_epi32(acc,_mm_shuffle_epi32(acc,0x4e));
+            acc = _mm_add_epi32(acc,_mm_shuffle_epi32(acc,0xb1));
+            total = _mm_cvtsi128_si32(acc);
+#endif
+            for(;j<m;j++)
+                total += w[j]*x[j];
+            return total;
+        }
+    }
+
+    float mlp_quantize(signed char *q,const float *x,int n) {
+        float limit = 0;
+        for(int i=0;i<n;i++)
+            if(fabsf(x[i])>limit) limit = fabsf(x[i]);
+        float scale = limit>0 ? limit/127.0f : 1.0f;
+        float inverse = 1.0f/scale;
+        for(int i=0;i<n;i++)
+            q[i] = (signed char)lrintf(x[i]*inverse);
+        return scale;
+    }
+
+    void mlp_affine_i8(float *y,const signed char *w,const float *scale,
+                       const float *b,const signed char *x,float xscale,
+                       int n,int m) {
+        for(int i=0;i<n;i++)
+            y[i] = b[i]+scale[i]*xscale*dot_i8(w+i*m,x,m);
+    }
+
+    namespace {
+        const float float8_limit = 1.2f;
+
+        inline int float8_code(float x) {
+            if(!(x>=-float8_limit)) x = -float8_limit;
+            if(x>float8_limit) x = float8_limit;
+            return lrintf(x*100.0f);
+        }
+    }
+
+    void float8_decode(float *out,const signed char *in,int n) {
+        int j = 0;
+#if defined(__AVX2__)
+        const __m256 scale = _mm256_set1_ps(100.0f);
+        for(;j+8<=n;j+=8) {
+            __m256i q = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(in+j)));
+            _mm256_storeu_ps(out+j,_mm256_div_ps(_mm256_cvtepi32_ps(q),scale));
+        }
+#elif defined(__SSE2__)
+        // sign extension as in dot_i8, then once more to 32 bits
+        const __m128 scale = _mm_set1_ps(100.0f);
+        for(;j+16<=n;j+=16) {
+            __m128i b = _mm_loadu_si128((const __m128i*)(in+j));
+            __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(b,b),8);
+            __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(b,b),8);
+            __m128i q[4];
+            q[0] = _mm_srai_epi32(_mm_unpacklo_epi16(lo,lo),16);
+            q[1] = _mm_srai_epi32(_mm_unpackhi_epi16(lo,lo),16);
+            q[2] = _mm_srai_epi32(_mm_unpacklo_epi16(hi,hi),16);
+            q[3] = _mm_srai_epi32(_mm_unpackhi_epi16(hi,hi),16);
+            for(int k=0;k<4;k++)
+                _mm_storeu_ps(out+j+4*k,_mm_div_ps(_mm_cvtepi32_ps(q[k]),scale));
+        }
+#endif
+        for(;j<n;j++)
+            out[j] = in[j]/100.0f;
+    }
+
+    void float8_encode(signed char *out,const float *in,int n) {
+        int j = 0;
+#if defined(__SSE2__)
+        // max/min return their second operand for NaN, like the
+        // comparisons in float8_code; the conversion rounds to nearest
+        // as lrintf does
+        const __m128 scale = _mm_set1_ps(100.0f);
+        const __m128 lower = _mm_set1_ps(-float8_limit);
+        const __m128 upper = _mm_set1_ps(float8_limit);
+        for(;j+16<=n;j+=16) {
+            __m128i q[4];
+            for(int k=0;k<4;k++) {
+                __m128 x = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in+j+4*k),lower),upper);
+                q[k] = _mm_cvtps_epi32(_mm_mul_ps(x,scale));
+            }
+            __m128i w0 = _mm_packs_epi32(q[0],q[1]);
+            __m128i w1 = _mm_packs_epi32(q[2],q[3]);
+            _mm_storeu_si128((__m128i*)(out+j),_mm_packs_epi16(w0,w1));
+        }
+#endif
+        for(;j<n;j++)
+            out[j] = float8_code(in[j]);
+    }
+
+    const char *mlp_kernel_name() {
+#if defined(__AVX__)
+        return "avx";
+#elif defined(__SSE__)
+        return "sse";
+#else
+        return "scalar";
+#endif
+    }
+
+    const char *mlp_kernel_name_i8() {
+#if defined(__AVX2__)
+        return "avx2";
+#elif defined(__SSE2__)
+        return "sse2";
+#else
+        return "scalar";
+#endif
+    }
+}
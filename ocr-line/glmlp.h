@@ -0,0 +1,64 @@
+// -*- C++ -*-
+
+#ifndef glmlp_h__
+#define glmlp_h__
+
+namespace glinerec {
+
+    // Kernels for the forward pass of the MLP classifiers.  Weight
+    // matrices are row-major with one row per unit, which is how a
+    // colib floatarray w(nunits,ninputs) is stored.  The vector
+    // versions are chosen at compile time (-mavx, -msse), with a
+    // scalar fallback.
+
+    // y[i] = b[i] + sum_j w[i*m+j]*x[j] for i<n; b may be null.
+
+    void mlp_affine(float *y,const float *w,const float *b,
+                    const float *x,int n,int m);
+
+    // mlp_affine for the k rows of x (k x m) at once, giving the rows
+    // of y (k x n).  The products are blocked so that each weight is
+    // loaded once for four samples.
+
+    void mlp_affine_batch(float *y,const float *w,const float *b,
+                          const float *x,int n,int m,int k);
+
+    // y[i] = sigmoid(y[i]) for i<n; with fast, exp() is replaced by a
+    // polynomial approximation (relative error below 1e-5).
+
+    void mlp_sigmoid(float *y,int n,bool fast);
+
+    // The squared Euclidean distance between u and v, summed a block
+    // at a time; once it reaches bound the rest is skipped and the
+    // (partial) sum returned, which is then only known to be >= bound.
+
+    float sqdist_bounded(const float *u,const float *v,int n,float bound);
+
+    // Symmetric int8 quantization of x[0..n): q[i] = round(x[i]/scale)
+    // with the returned scale chosen so that |q[i]| <= 127.
+
+    float mlp_quantize(signed char *q,const float *x,int n);
+
+    // y[i] = b[i] + scale[i]*xscale*sum_j w[i*m+j]*x[j] for int8
+    // weights w (one scale per row) and inputs x, accumulated in int32.
+
+    void mlp_affine_i8(float *y,const signed char *w,const float *scale,
+                       const float *b,const signed char *x,float xscale,
+                       int n,int m);
+
+    // Dataset rows stored as float8 (x = q/100, |x| <= 1.2).  Decoding
+    // gives exactly q/100.0f; encoding rounds to the nearest code and
+    // clamps values outside the range (NaN to the lower end) instead
+    // of failing, so rows must be checked when they are added.
+
+    void float8_decode(float *out,const signed char *in,int n);
+    void float8_encode(signed char *out,const float *in,int n);
+
+    // The instruction set the kernels were compiled for
+    // ("avx", "sse" or "scalar"; "avx2", "sse2" or "scalar" for int8).
+
+    const char *mlp_kernel_name();
+    const char *mlp_kernel_name_i8();
+}
+
+#endif
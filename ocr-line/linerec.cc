@@ -456,6 +456,7 @@ namespace glinerec {
             pdef("maxcost",20.0,"maximum cost of a character to be added to the output");
             pdef("minclass",32,"minimum output class to be added (default=unicode space)");
             pdef("minprob",1e-6,"minimum probability for a character to appear in the output at all");
+            pdef("classify_batch",64,"number of characters passed to the classifier together");
             // segmentation
             pdef("maxrange",5,"maximum number of components that are grouped together");
             // sanity limits on input
@@ -507,6 +508,10 @@ namespace glinerec {
             return "Linerec";
         }
         const char *command(const char *argv[]) {
+            if(!strcmp(argv[0],"quantize")) {
+                quantize_model(classifier);
+                return 0;
+            }
             return classifier->command(argv);
         }
 
@@ -738,7 +743,6 @@ namespace glinerec {
             segmentation_ = segmentation;
             bytearray available;
             floatarray cp,ccosts,props;
-            OutputVector p;
             int ncomponents = grouper->length();
             int minclass = pgetf("minclass");
             float minprob = pgetf("minprob");
@@ -764,79 +768,108 @@ namespace glinerec {
 
             estimateSpaceSize();
 
-#pragma omp parallel for schedule(dynamic,10) private(p,props)
-            for(int i=0;i<ncomponents;i++) {
-                rectangle b;
-                bytearray mask;
-                grouper->getMask(b,mask,i,0);
-                floatarray v;
-                try {
-                    featuremap->extractFeatures(v,b,mask);
-                } catch(const char *msg) {
-                    debugf("warn","feature extraction failed [%d]: %s\n",i,msg);
-                    continue;
-                }
-                float ccost = classifier->xoutputs(p,v);
-#pragma omp critical
-                {
-                    if(use_reject) {
-                        ccost = 0;
-                        float total = sum(p.values);
-                        if(total>1e-11)
-                            p.values /= total;
-                        else
-                            p.values = 0.0;
+            // the components are classified in batches; each thread
+            // collects its classes and space costs without locking, and
+            // passes them to the grouper at the end
+            int batch_size = max(1,int(pgetf("classify_batch")));
+            int nbatches = (ncomponents+batch_size-1)/batch_size;
+#pragma omp parallel private(ccosts,props)
+            {
+            GrouperBuffer classes;
+            narray<floatarray> vs;
+            narray<OutputVector> ps;
+            intarray ids;
+            narray<rectangle> boxes;
+#pragma omp for schedule(dynamic,1)
+            for(int batch=0;batch<nbatches;batch++) {
+                vs.clear();
+                ids.clear();
+                boxes.clear();
+                int end = min(ncomponents,(batch+1)*batch_size);
+                for(int i=batch*batch_size;i<end;i++) {
+                    rectangle b;
+                    bytearray mask;
+                    grouper->getMask(b,mask,i,0);
+                    floatarray v;
+                    try {
+                        featuremap->extractFeatures(v,b,mask);
+                    } catch(const char *msg) {
+                        debugf("warn","feature extraction failed [%d]: %s\n",i,msg);
+                        continue;
                     }
-                    int count = 0;
+                    vs.push().move(v);
+                    ids.push(i);
+                    boxes.push(b);
+                }
+                classifier->xoutputs_batch(ps,ccosts,vs);
+                for(int k=0;k<ids.length();k++) {
+                    int i = ids(k);
+                    rectangle &b = boxes(k);
+                    OutputVector &p = ps(k);
+                    float ccost = ccosts(k);
+                    {
+                        if(use_reject) {
+                            ccost = 0;
+                            float total = sum(p.values);
+                            if(total>1e-11)
+                                p.values /= total;
+                            else
+                                p.values = 0.0;
+                        }
+                        int count = 0;
 #if 0
-                    for(int j=minclass;j<p.length();j++) {
-                        if(j==reject_class) continue;
-                        if(p(j)<minprob) continue;
-                        float pcost = -log(p(j));
-                        debugf("dcost","%3d %10g %c\n",j,pcost+ccost,(j>32?j:'_'));
-                        double total_cost = pcost+ccost;
-                        if(total_cost<maxcost) {
-                            grouper->setClass(i,j,total_cost);
-                            count++;
+                        for(int j=minclass;j<p.length();j++) {
+                            if(j==reject_class) continue;
+                            if(p(j)<minprob) continue;
+                            float pcost = -log(p(j));
+                            debugf("dcost","%3d %10g %c\n",j,pcost+ccost,(j>32?j:'_'));
+                            double total_cost = pcost+ccost;
+                            if(total_cost<maxcost) {
+                                classes.setClass(i,j,total_cost);
+                                count++;
+                            }
                         }
-                    }
 #else
-                    debugf("dcost","output %d\n",p.keys.length());
-                    for(int index=0;index<p.keys.length();index++) {
-                        int j = p.keys[index];
-                        if(j<minclass) continue;
-                        if(j==reject_class) continue;
-                        float value = p.values[index];
-                        if(value<=0.0) continue;
-                        if(value<minprob) continue;
-                        float pcost = -log(value);
-                        debugf("dcost","%3d %10g %c\n",j,pcost+ccost,(j>32?j:'_'));
-                        double total_cost = pcost+ccost;
-                        if(total_cost<maxcost) {
-                            if(use_priors) {
-                                total_cost -= -log(priors(j));
+                        debugf("dcost","output %d\n",p.keys.length());
+                        for(int index=0;index<p.keys.length();index++) {
+                            int j = p.keys[index];
+                            if(j<minclass) continue;
+                            if(j==reject_class) continue;
+                            float value = p.values[index];
+                            if(value<=0.0) continue;
+                            if(value<minprob) continue;
+                            float pcost = -log(value);
+                            debugf("dcost","%3d %10g %c\n",j,pcost+ccost,(j>32?j:'_'));
+                            double total_cost = pcost+ccost;
+                            if(total_cost<maxcost) {
+                                if(use_priors) {
+                                    total_cost -= -log(priors(j));
+                                }
+                                classes.setClass(i,j,total_cost);
+                                count++;
                             }
-                            grouper->setClass(i,j,total_cost);
-                            count++;
                         }
-                    }
-                    debugf("dcost","\n");
+                        debugf("dcost","\n");
 #endif
-                    if(count==0) {
-                        float xheight = 10.0;
-                        if(b.height()<xheight/2 && b.width()<xheight/2) {
-                            grouper->setClass(i,'~',high_cost/2);
-                        } else {
-                            grouper->setClass(i,'#',(b.width()/xheight)*high_cost);
+                        if(count==0) {
+                            float xheight = 10.0;
+                            if(b.height()<xheight/2 && b.width()<xheight/2) {
+                                classes.setClass(i,'~',high_cost/2);
+                            } else {
+                                classes.setClass(i,'#',(b.width()/xheight)*high_cost);
+                            }
                         }
+                        if(grouper->pixelSpace(i)>space_threshold) {
+                            debugf("spaces","space %d\n",grouper->pixelSpace(i));
+                            classes.setSpaceCost(i,space_yes,space_no);
+                        }
+                        // dwait();
                     }
-                    if(grouper->pixelSpace(i)>space_threshold) {
-                        debugf("spaces","space %d\n",grouper->pixelSpace(i));
-                        grouper->setSpaceCost(i,space_yes,space_no);
-                    }
-                    // dwait();
                 }
             }
+#pragma omp critical
+            classes.flush(*grouper);
+            }
             grouper->getLattice(result);
         }
 
@@ -886,6 +919,7 @@ namespace glinerec {
             pdef("maxcost",20.0,"maximum cost of a character to be added to the output");
             pdef("minclass",32,"minimum output class to be added (default=unicode space)");
             pdef("minprob",1e-6,"minimum probability for a character to appear in the output at all");
+            pdef("classify_batch",64,"number of characters passed to the classifier together");
             pdef("invert",1,"invert the input line prior to char extraction");
             // segmentation
             pdef("maxrange",5,"maximum number of components that are grouped together");
@@ -942,6 +976,10 @@ namespace glinerec {
             return "Linerec";
         }
         const char *command(const char *argv[]) {
+            if(!strcmp(argv[0],"quantize")) {
+                quantize_model(classifier);
+                return 0;
+            }
             return classifier->command(argv);
         }
 
@@ -1177,7 +1215,6 @@ namespace glinerec {
             segmentation_ = segmentation;
             bytearray available;
             floatarray cp,ccosts,props;
-            OutputVector p;
             int ncomponents = grouper->length();
             int minclass = pgetf("minclass");
             float minprob = pgetf("minprob");
@@ -1203,77 +1240,106 @@ namespace glinerec {
 
             estimateSpaceSize();
 
-#pragma omp parallel for schedule(dynamic,10) private(p,props)
-            for(int i=0;i<ncomponents;i++) {
-                rectangle b;
-                bytearray mask;
-                grouper->getMask(b,mask,i,0);
-                bytearray cv;
-                grouper->extractWithMask(cv,mask,image,i,0);
-                floatarray v;
-                v = cv;
-                v /= 255.0;
-                float ccost = classifier->xoutputs(p,v);
-#pragma omp critical
-                {
-                    if(use_reject) {
-                        ccost = 0;
-                        float total = sum(p.values);
-                        if(total>1e-11)
-                            p.values /= total;
-                        else
-                            p.values = 0.0;
-                    }
-                    int count = 0;
+            // the components are classified in batches; each thread
+            // collects its classes and space costs without locking, and
+            // passes them to the grouper at the end
+            int batch_size = max(1,int(pgetf("classify_batch")));
+            int nbatches = (ncomponents+batch_size-1)/batch_size;
+#pragma omp parallel private(ccosts,props)
+            {
+            GrouperBuffer classes;
+            narray<floatarray> vs;
+            narray<OutputVector> ps;
+            intarray ids;
+            narray<rectangle> boxes;
+#pragma omp for schedule(dynamic,1)
+            for(int batch=0;batch<nbatches;batch++) {
+                vs.clear();
+                ids.clear();
+                boxes.clear();
+                int end = min(ncomponents,(batch+1)*batch_size);
+                for(int i=batch*batch_size;i<end;i++) {
+                    rectangle b;
+                    bytearray mask;
+                    grouper->getMask(b,mask,i,0);
+                    bytearray cv;
+                    grouper->extractWithMask(cv,mask,image,i,0);
+                    floatarray v;
+                    v = cv;
+                    v /= 255.0;
+                    vs.push().move(v);
+                    ids.push(i);
+                    boxes.push(b);
+                }
+                classifier->xoutputs_batch(ps,ccosts,vs);
+                for(int k=0;k<ids.length();k++) {
+                    int i = ids(k);
+                    rectangle &b = boxes(k);
+                    OutputVector &p = ps(k);
+                    float ccost = ccosts(k);
+                    {
+                        if(use_reject) {
+                            ccost = 0;
+                            float total = sum(p.values);
+                            if(total>1e-11)
+                                p.values /= total;
+                            else
+                                p.values = 0.0;
+                        }
+                        int count = 0;
 #if 0
-                    for(int j=minclass;j<p.length();j++) {
-                        if(j==reject_class) continue;
-                        if(p(j)<minprob) continue;
-                        float pcost = -log(p(j));
-                        debugf("dcost","%3d %10g %c\n",j,pcost+ccost,(j>32?j:'_'));
-                        double total_cost = pcost+ccost;
-                        if(total_cost<maxcost) {
-                            grouper->setClass(i,j,total_cost);
-                            count++;
+                        for(int j=minclass;j<p.length();j++) {
+                            if(j==reject_class) continue;
+                            if(p(j)<minprob) continue;
+                            float pcost = -log(p(j));
+                            debugf("dcost","%3d %10g %c\n",j,pcost+ccost,(j>32?j:'_'));
+                            double total_cost = pcost+ccost;
+                            if(total_cost<maxcost) {
+                                classes.setClass(i,j,total_cost);
+                                count++;
+                            }
                         }
-                    }
 #else
-                    debugf("dcost","output %d\n",p.keys.length());
-                    for(int index=0;index<p.keys.length();index++) {
-                        int j = p.keys[index];
-                        if(j<minclass) continue;
-                        if(j==reject_class) continue;
-                        float value = p.values[index];
-                        if(value<=0.0) continue;
-                        if(value<minprob) continue;
-                        float pcost = -log(value);
-                        debugf("dcost","%3d %10g %c\n",j,pcost+ccost,(j>32?j:'_'));
-                        double total_cost = pcost+ccost;
-                        if(total_cost<maxcost) {
-                            if(use_priors) {
-                                total_cost -= -log(priors(j));
+                        debugf("dcost","output %d\n",p.keys.length());
+                        for(int index=0;index<p.keys.length();index++) {
+                            int j = p.keys[index];
+                            if(j<minclass) continue;
+                            if(j==reject_class) continue;
+                            float value = p.values[index];
+                            if(value<=0.0) continue;
+                            if(value<minprob) continue;
+                            float pcost = -log(value);
+                            debugf("dcost","%3d %10g %c\n",j,pcost+ccost,(j>32?j:'_'));
+                            double total_cost = pcost+ccost;
+                            if(total_cost<maxcost) {
+                                if(use_priors) {
+                                    total_cost -= -log(priors(j));
+                                }
+                                classes.setClass(i,j,total_cost);
+                                count++;
                             }
-                            grouper->setClass(i,j,total_cost);
-                            count++;
                         }
-                    }
-                    debugf("dcost","\n");
+                        debugf("dcost","\n");
 #endif
-                    if(count==0) {
-                        float xheight = 10.0;
-                        if(b.height()<xheight/2 && b.width()<xheight/2) {
-                            grouper->setClass(i,'~',high_cost/2);
-                        } else {
-                            grouper->setClass(i,'#',(b.width()/xheight)*high_cost);
+                        if(count==0) {
+                            float xheight = 10.0;
+                            if(b.height()<xheight/2 && b.width()<xheight/2) {
+                                classes.setClass(i,'~',high_cost/2);
+                            } else {
+                                classes.setClass(i,'#',(b.width()/xheight)*high_cost);
+                            }
                         }
+                        if(grouper->pixelSpace(i)>space_threshold) {
+                            debugf("spaces","space %d\n",grouper->pixelSpace(i));
+                            classes.setSpaceCost(i,space_yes,space_no);
+                        }
+                        // dwait();
                     }
-                    if(grouper->pixelSpace(i)>space_threshold) {
-                        debugf("spaces","space %d\n",grouper->pixelSpace(i));
-                        grouper->setSpaceCost(i,space_yes,space_no);
-                    }
-                    // dwait();
                 }
             }
+#pragma omp critical
+            classes.flush(*grouper);
+            }
             grouper->getLattice(result);
         }
 
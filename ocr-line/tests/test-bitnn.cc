@@ -0,0 +1,157 @@
+// -*- C++ -*-
+
+// Copyright 2006-2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: test-bitnn.cc
+// Purpose: check the Hamming distance search of BitNN against brute force
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include <limits.h>
+#include "ocropus.h"
+#include "glinerec.h"
+
+using namespace colib;
+using namespace ocropus;
+using namespace glinerec;
+
+namespace {
+    // Random 0/1 vectors containing both values, so that BitNN
+    // binarizes them at 1/2 and keeps them as they are.
+    void random_bits(floatarray &v,int nfeat) {
+        v.resize(nfeat);
+        for(int j=0;j<nfeat;j++) v(j) = rand()%2;
+        v(0) = 0;
+        v(nfeat-1) = 1;
+    }
+
+    int hamming(floatarray &protos,int i,floatarray &q) {
+        int total = 0;
+        for(int j=0;j<q.length();j++)
+            total += protos(i,j)!=q(j);
+        return total;
+    }
+
+    // With one class per prototype, the outputs are 1/k for each of
+    // the k nearest prototypes (any of them when distances are tied),
+    // and the cost is the distance of the nearest one over 10.
+    void check_knn(OutputVector &ov,float cost,floatarray &protos,
+                   floatarray &q,int k) {
+        floatarray p;
+        ov.as_array(p);
+        int n = protos.dim(0);
+        int chosen = 0, dmin = INT_MAX, dchosen = -1, dother = INT_MAX;
+        for(int i=0;i<n;i++) {
+            int d = hamming(protos,i,q);
+            dmin = min(dmin,d);
+            float value = i<p.length() ? p(i) : 0;
+            if(value>0) {
+                CHECK_CONDITION(fabs(value-1.0/min(k,n))<1e-5);
+                chosen++;
+                dchosen = max(dchosen,d);
+            } else {
+                dother = min(dother,d);
+            }
+        }
+        CHECK_CONDITION(chosen==min(k,n));
+        CHECK_CONDITION(dchosen<=dother);
+        CHECK_CONDITION(fabs(cost*10-dmin)<1e-3);
+    }
+
+    // single and batch classification of the rows of queries
+    void check_model(IModel &model,floatarray &queries,floatarray &protos,int k) {
+        floatarray v;
+        int nqueries = queries.dim(0);
+        for(int t=0;t<nqueries;t++) {
+            rowget(v,queries,t);
+            OutputVector ov;
+            float cost = model.xoutputs(ov,v);
+            check_knn(ov,cost,protos,v,k);
+        }
+        narray<OutputVector> ovs;
+        floatarray costs;
+        model.xoutputs_batch(ovs,costs,queries);
+        CHECK_CONDITION(ovs.length()==nqueries && costs.length()==nqueries);
+        for(int t=0;t<nqueries;t++) {
+            rowget(v,queries,t);
+            check_knn(ovs(t),costs(t),protos,v,k);
+        }
+    }
+}
+
+// Feature counts cover partial words, the four word blocks of the
+// AVX2 kernel, the eight word Harley-Seal blocks and the pruning
+// interval; 1003 prototypes leave a remainder after the blocks of four.
+void test_bitnn(int nfeat,int nprotos,int k,int parallel) {
+    autodel<IModel> model(make_model("bitnn"));
+    model->pset("k",k);
+    model->pset("parallel",parallel);
+    floatarray protos(nprotos,nfeat),v;
+    for(int i=0;i<nprotos;i++) {
+        random_bits(v,nfeat);
+        rowput(protos,i,v);
+        model->xadd(v,i);
+    }
+    model->updateModel();
+
+    // queries near some prototype, so that the pruning matters, and
+    // unrelated ones
+    int nqueries = 40;
+    floatarray queries(nqueries,nfeat);
+    for(int t=0;t<nqueries;t++) {
+        if(t%2) {
+            rowget(v,protos,rand()%nprotos);
+            for(int flips=rand()%5;flips>0;flips--) {
+                int j = 1+rand()%max(1,nfeat-2);
+                if(j<nfeat-1) v(j) = 1-v(j);
+            }
+        } else {
+            random_bits(v,nfeat);
+        }
+        rowput(queries,t,v);
+    }
+
+    check_model(*model,queries,protos,k);
+
+    // a model read back from disk classifies the same
+    FILE *stream = tmpfile();
+    CHECK_CONDITION(stream!=0);
+    save_component(stream,model);
+    rewind(stream);
+    autodel<IModel> loaded;
+    load_component(stream,loaded);
+    fclose(stream);
+    CHECK_CONDITION(loaded->nfeatures()==nfeat);
+    check_model(*loaded,queries,protos,k);
+}
+
+int main() {
+    init_ocropus_components();
+    init_glclass();
+    srand(21);
+    int nfeats[] = {2,63,64,65,256,700,1003,2100};
+    for(int i=0;i<int(sizeof nfeats/sizeof nfeats[0]);i++) {
+        test_bitnn(nfeats[i],1003,1,100000);
+        test_bitnn(nfeats[i],1003,5,100000);
+        // split single queries among the threads
+        test_bitnn(nfeats[i],1003,5,1);
+    }
+    test_bitnn(700,3,5,100000);
+}
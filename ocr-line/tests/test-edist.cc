@@ -0,0 +1,133 @@
+// -*- C++ -*-
+
+// Copyright 2006-2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: test-edist.cc
+// Purpose: check the parallel EuclideanDistances::find against a
+//          sequential scan
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include "ocropus.h"
+#include "glinerec.h"
+
+using namespace colib;
+using namespace ocropus;
+using namespace glinerec;
+
+namespace {
+    void random_vector(floatarray &v,int ndim) {
+        v.resize(ndim);
+        for(int j=0;j<ndim;j++) v(j) = rand()/float(RAND_MAX);
+    }
+
+    // a query near one of the prototypes, or an unrelated one
+    void random_query(floatarray &q,IDistComp &dc,int ndim) {
+        if(rand()%2) {
+            dc.vector(q,rand()%dc.length());
+            for(int j=0;j<ndim;j++) q(j) += 0.3*(rand()/float(RAND_MAX)-0.5);
+        } else {
+            random_vector(q,ndim);
+        }
+    }
+}
+
+// With find=first, the result is the most frequent prototype within
+// eps (squared distance), or -1 if there is none; the one chosen among
+// equally frequent ones must not depend on how the prototypes are
+// split among the threads.
+void test_find_first(IDistComp &dc,int ndim,float eps) {
+    dc.pset("find","first");
+    floatarray q,ds;
+    for(int t=0;t<200;t++) {
+        random_query(q,dc,ndim);
+        dc.distances(ds,q);
+        int maxcount = -1;
+        for(int i=0;i<ds.length();i++)
+            if(ds(i)<eps) maxcount = max(maxcount,dc.counts(i));
+        dc.pset("chunk",1000000000);
+        int sequential = dc.find(q,eps);
+        if(maxcount<0) {
+            CHECK_CONDITION(sequential==-1);
+        } else {
+            CHECK_CONDITION(sequential>=0);
+            CHECK_CONDITION(ds(sequential)<eps);
+            CHECK_CONDITION(dc.counts(sequential)==maxcount);
+        }
+        int chunks[] = {1,3,7,256};
+        for(int c=0;c<int(sizeof chunks/sizeof chunks[0]);c++) {
+            dc.pset("chunk",chunks[c]);
+            CHECK_CONDITION(dc.find(q,eps)==sequential);
+        }
+    }
+}
+
+// With find=best, the result is the nearest prototype within eps (the
+// first of equally near ones).
+void test_find_best(IDistComp &dc,int ndim,float eps) {
+    dc.pset("find","best");
+    floatarray q,ds;
+    for(int t=0;t<200;t++) {
+        random_query(q,dc,ndim);
+        dc.distances(ds,q);
+        int expected = -1;
+        for(int i=0;i<ds.length();i++)
+            if(ds(i)<eps && (expected<0 || ds(i)<ds(expected))) expected = i;
+        CHECK_CONDITION(dc.find(q,eps)==expected);
+    }
+}
+
+void test_edist(int ndim,int nprotos,float eps) {
+    autodel<IDistComp> dc;
+    make_component("edist",dc);
+    floatarray v;
+    for(int i=0;i<nprotos;i++) {
+        random_vector(v,ndim);
+        dc->add(v);
+    }
+    // merges give the prototypes different counts, and reorder them
+    for(int m=0;m<3*nprotos;m++) {
+        int i = rand()%(m%4==0 ? nprotos : max(1,nprotos/10));
+        dc->vector(v,i);
+        dc->merge(i,v,0.5);
+    }
+    test_find_first(*dc,ndim,eps);
+    test_find_best(*dc,ndim,eps);
+    // adding after merges keeps the order
+    for(int i=0;i<nprotos/2;i++) {
+        random_vector(v,ndim);
+        dc->add(v);
+    }
+    test_find_first(*dc,ndim,eps);
+    test_find_best(*dc,ndim,eps);
+}
+
+int main() {
+    init_ocropus_components();
+    init_glclass();
+#ifdef _OPENMP
+    omp_set_num_threads(4);
+#endif
+    srand(22);
+    test_edist(1,50,0.001);
+    test_edist(10,1000,0.1);
+    test_edist(10,3000,0.4);
+    test_edist(37,2000,2.0);
+}
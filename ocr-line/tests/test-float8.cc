@@ -0,0 +1,124 @@
+// -*- C++ -*-
+
+// Copyright 2006-2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: test-float8.cc
+// Purpose: check the vectorized float8 codecs against the scalar rule
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include "ocropus.h"
+#include "glinerec.h"
+
+using namespace colib;
+using namespace ocropus;
+using namespace glinerec;
+
+namespace {
+    // the code of x: clamped to [-1.2,1.2] (NaN to the lower end),
+    // then rounded to nearest
+    int float8_reference(float x) {
+        if(!(x>=-1.2f)) x = -1.2f;
+        if(x>1.2f) x = 1.2f;
+        return lrintf(x*100.0f);
+    }
+
+    // Encode every prefix of values, so that each value goes through
+    // both the vector loop and the scalar remainder.
+    void check_encode(floatarray &values) {
+        int n = values.length();
+        narray<signed char> codes(n);
+        for(int len=1;len<=n;len++) {
+            float8_encode(&codes(0),&values(0),len);
+            for(int i=0;i<len;i++)
+                CHECK_CONDITION(codes(i)==float8_reference(values(i)));
+        }
+    }
+}
+
+// decoding gives exactly q/100.0f for all 256 codes, with any length
+void test_decode() {
+    narray<signed char> codes(256);
+    for(int i=0;i<256;i++) codes(i) = i-128;
+    floatarray out(256);
+    for(int start=0;start<32;start++) {
+        float8_decode(&out(start),&codes(start),256-start);
+        for(int i=start;i<256;i++)
+            CHECK_CONDITION(out(i)==codes(i)/100.0f);
+    }
+}
+
+// decoded codes in range encode to themselves
+void test_roundtrip() {
+    narray<signed char> codes(241),again(241);
+    for(int i=0;i<241;i++) codes(i) = i-120;
+    floatarray values(241);
+    float8_decode(&values(0),&codes(0),241);
+    float8_encode(&again(0),&values(0),241);
+    for(int i=0;i<241;i++)
+        CHECK_CONDITION(again(i)==codes(i));
+    check_encode(values);
+}
+
+void test_encode_random() {
+    floatarray values(1000);
+    for(int i=0;i<values.length();i++)
+        values(i) = 3.0*(rand()/float(RAND_MAX)-0.5);
+    check_encode(values);
+}
+
+// NaN, infinities, the limits, values just outside them, and values
+// whose scaled value is exactly halfway between two codes
+void test_encode_special() {
+    floatarray values;
+    values.push(NAN);
+    values.push(-NAN);
+    values.push(INFINITY);
+    values.push(-INFINITY);
+    values.push(1e30);
+    values.push(-1e30);
+    values.push(1.2f);
+    values.push(-1.2f);
+    values.push(1.2001f);
+    values.push(-1.2001f);
+    values.push(0.0f);
+    values.push(-0.0f);
+    for(int k=-120;k<120;k++) {
+        float x = (k+0.5f)/100.0f;
+        if(x*100.0f==k+0.5f) values.push(x);
+    }
+    CHECK_CONDITION(values.length()>20);
+    // shuffled, so that the special values land at all vector lanes
+    for(int i=values.length()-1;i>0;i--) {
+        int j = rand()%(i+1);
+        float t = values(i);
+        values(i) = values(j);
+        values(j) = t;
+    }
+    check_encode(values);
+}
+
+int main() {
+    srand(24);
+    test_decode();
+    test_roundtrip();
+    test_encode_random();
+    test_encode_special();
+}
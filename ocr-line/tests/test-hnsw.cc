@@ -0,0 +1,166 @@
+// -*- C++ -*-
+
+// Copyright 2006-2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: test-hnsw.cc
+// Purpose: check the recall of the HNSW index against a scan, and
+//          k-NN classifiers read back from disk with their index
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include "ocropus.h"
+#include "glinerec.h"
+#include "glann.h"
+
+using namespace colib;
+using namespace ocropus;
+using namespace glinerec;
+
+namespace {
+    // points around a few centers, with values float8 keeps exactly
+    void random_points(floatarray &data,int n,int ndim,int ncenters) {
+        floatarray centers(ncenters,ndim);
+        for(int i=0;i<centers.length1d();i++)
+            centers.at1d(i) = (rand()%161-80)/100.0;
+        data.resize(n,ndim);
+        for(int i=0;i<n;i++) {
+            int c = rand()%ncenters;
+            for(int j=0;j<ndim;j++)
+                data(i,j) = centers(c,j)+(rand()%41-20)/100.0;
+        }
+    }
+
+    void save_load(autodel<IComponent> &loaded,IComponent *c) {
+        FILE *stream = tmpfile();
+        CHECK_CONDITION(stream!=0);
+        save_component(stream,c);
+        rewind(stream);
+        loaded = load_component(stream);
+        fclose(stream);
+        CHECK_CONDITION(loaded.ptr()!=0);
+    }
+}
+
+// The index finds most of the k nearest points a scan finds with a
+// high ef, nearest first and with their distances; read back from
+// disk, it finds the same ones.
+void test_recall(int n,int ndim,int k) {
+    floatarray data,queries,v;
+    random_points(data,n+200,ndim,20);
+    RowPoints points(data);
+    autodel<INearestIndex> scan(make_ScanIndex());
+    autodel<INearestIndex> hnsw(make_HnswIndex());
+    for(int i=0;i<n;i++) {
+        scan->add(points,i);
+        hnsw->add(points,i);
+    }
+    CHECK_CONDITION(hnsw->length()==n);
+    autodel<IComponent> copy;
+    save_load(copy,hnsw.ptr());
+    INearestIndex *loaded = dynamic_cast<INearestIndex*>(copy.ptr());
+    CHECK_CONDITION(loaded!=0 && loaded->length()==n);
+
+    intarray expected,ids,ids2;
+    floatarray ed,ds,ds2;
+    int found = 0, total = 0;
+    for(int q=n;q<n+200;q++) {
+        rowget(v,data,q);
+        scan->search(expected,ed,points,v,k);
+        hnsw->search(ids,ds,points,v,k,200);
+        CHECK_CONDITION(expected.length()==min(k,n) && ids.length()==min(k,n));
+        for(int i=0;i<ids.length();i++) {
+            CHECK_CONDITION(ds(i)==float(points.distance(ids(i),v)));
+            if(i>0) CHECK_CONDITION(ds(i-1)<=ds(i));
+            // the first k at the distance of the k-th count as found
+            if(ds(i)<=ed(ed.length()-1)) found++;
+        }
+        total += expected.length();
+        loaded->search(ids2,ds2,points,v,k,200);
+        CHECK_CONDITION(ids2.length()==ids.length());
+        for(int i=0;i<ids.length();i++)
+            CHECK_CONDITION(ids2(i)==ids(i));
+    }
+    CHECK_CONDITION(found>=0.98*total);
+}
+
+// A k-NN classifier read back from disk searches its saved index: with
+// a narrow search, the index gives other votes than an exhaustive
+// search for some queries, and the copy gives the same votes as the
+// original.
+void test_knn(int n,int ndim,int k) {
+    floatarray data,v;
+    random_points(data,n+200,ndim,30);
+    autodel<IModel> exhaustive(make_model("knn"));
+    autodel<IModel> model(make_model("knn"));
+    exhaustive->pset("k",k);
+    model->pset("k",k);
+    model->pset("index","hnsw");
+    model->pset("ef",1);
+    for(int i=0;i<n;i++) {
+        rowget(v,data,i);
+        exhaustive->xadd(v,i%7);
+        model->xadd(v,i%7);
+    }
+    exhaustive->updateModel();
+    model->updateModel();
+    autodel<IComponent> copy;
+    save_load(copy,model.ptr());
+    IModel *loaded = dynamic_cast<IModel*>(copy.ptr());
+    CHECK_CONDITION(loaded!=0 && loaded->nfeatures()==ndim);
+
+    int differ = 0;
+    floatarray p,q,r;
+    for(int t=n;t<n+200;t++) {
+        rowget(v,data,t);
+        OutputVector ov,lv,ev;
+        model->xoutputs(ov,v);
+        loaded->xoutputs(lv,v);
+        exhaustive->xoutputs(ev,v);
+        ov.as_array(p);
+        lv.as_array(q);
+        ev.as_array(r);
+        CHECK_CONDITION(samedims(p,q));
+        for(int i=0;i<p.length();i++)
+            CHECK_CONDITION(p(i)==q(i));
+        if(!samedims(p,r)) {
+            differ++;
+        } else {
+            for(int i=0;i<p.length();i++) {
+                if(p(i)!=r(i)) {
+                    differ++;
+                    break;
+                }
+            }
+        }
+    }
+    CHECK_CONDITION(differ>0);
+}
+
+int main() {
+    init_ocropus_components();
+    init_glclass();
+    srand(20);
+    test_recall(1,8,5);
+    test_recall(50,8,10);
+    test_recall(3000,16,10);
+    test_recall(3000,40,1);
+    test_knn(3000,16,1);
+    test_knn(3000,16,5);
+}
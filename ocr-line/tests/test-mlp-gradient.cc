@@ -0,0 +1,146 @@
+// -*- C++ -*-
+
+// Copyright 2006-2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: test-mlp-gradient.cc
+// Purpose: check the steps of mini-batch MLP training against finite
+//          differences of the error
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include "ocropus.h"
+#include "glinerec.h"
+
+using namespace colib;
+using namespace ocropus;
+using namespace glinerec;
+
+namespace {
+    void random_array(floatarray &a,float range) {
+        for(int i=0;i<a.length1d();i++)
+            a.at1d(i) = range*(2*rand()/float(RAND_MAX)-1);
+    }
+
+    double sigmoid(double x) {
+        return 1.0/(1.0+exp(-x));
+    }
+
+    // the net as the MLP classifiers compute it, in double precision
+    void forward(doublearray &z,floatarray &w1,floatarray &b1,floatarray &w2,
+                 floatarray &b2,floatarray &x) {
+        int n = x.dim(0), nhidden = w1.dim(0), noutput = w2.dim(0);
+        doublearray y(nhidden);
+        z.resize(n,noutput);
+        for(int s=0;s<n;s++) {
+            for(int i=0;i<nhidden;i++) {
+                double total = b1(i);
+                for(int j=0;j<x.dim(1);j++) total += w1(i,j)*x(s,j);
+                y(i) = sigmoid(total);
+            }
+            for(int i=0;i<noutput;i++) {
+                double total = b2(i);
+                for(int j=0;j<nhidden;j++) total += w2(i,j)*y(j);
+                z(s,i) = sigmoid(total);
+            }
+        }
+    }
+
+    // the summed squared errors over the rows, halved
+    double error(floatarray &w1,floatarray &b1,floatarray &w2,floatarray &b2,
+                 floatarray &x,floatarray &targets) {
+        doublearray z;
+        forward(z,w1,b1,w2,b2,x);
+        double total = 0;
+        for(int i=0;i<z.length1d();i++)
+            total += sqr(z.at1d(i)-targets.at1d(i));
+        return total/2;
+    }
+
+    // The central difference of the error in weight i of a, which
+    // is one of w1,b1,w2,b2.
+    double difference(floatarray &a,int i,floatarray &w1,floatarray &b1,
+                      floatarray &w2,floatarray &b2,floatarray &x,
+                      floatarray &targets) {
+        float old = a.at1d(i);
+        float plus = old+1e-3, minus = old-1e-3;
+        a.at1d(i) = plus;
+        double eplus = error(w1,b1,w2,b2,x,targets);
+        a.at1d(i) = minus;
+        double eminus = error(w1,b1,w2,b2,x,targets);
+        a.at1d(i) = old;
+        return (eplus-eminus)/(double(plus)-double(minus));
+    }
+
+    // With eta = sqrt(rows), a step subtracts the gradient itself.
+    void check_step(floatarray &before,floatarray &after,floatarray &w1,
+                    floatarray &b1,floatarray &w2,floatarray &b2,
+                    floatarray &x,floatarray &targets) {
+        CHECK_CONDITION(samedims(before,after));
+        for(int i=0;i<before.length1d();i++) {
+            double gradient = before.at1d(i)-after.at1d(i);
+            double expected = difference(before,i,w1,b1,w2,b2,x,targets);
+            CHECK_CONDITION(fabs(gradient-expected)<1e-4+1e-3*fabs(expected));
+        }
+    }
+}
+
+// The rows cover a single sample, the blocks of four rows of the
+// kernels and their remainders, and more rows than threads.
+void test_gradient(int n,int ninput,int nhidden,int noutput) {
+    floatarray w1(nhidden,ninput),b1(nhidden),w2(noutput,nhidden),b2(noutput);
+    random_array(w1,1.0);
+    random_array(b1,0.5);
+    random_array(w2,1.0);
+    random_array(b2,0.5);
+    floatarray x(n,ninput),targets(n,noutput);
+    random_array(x,1.0);
+    targets = 0;
+    for(int s=0;s<n;s++) targets(s,rand()%noutput) = 1;
+
+    floatarray v1,c1,v2,c2,z;
+    copy(v1,w1);
+    copy(c1,b1);
+    copy(v2,w2);
+    copy(c2,b2);
+    mlp_train_minibatch(v1,c1,v2,c2,z,targets,x,sqrt(float(n)));
+
+    doublearray expected;
+    forward(expected,w1,b1,w2,b2,x);
+    CHECK_CONDITION(z.dim(0)==n && z.dim(1)==noutput);
+    for(int i=0;i<z.length1d();i++)
+        CHECK_CONDITION(fabs(z.at1d(i)-expected.at1d(i))<1e-5);
+
+    check_step(w1,v1,w1,b1,w2,b2,x,targets);
+    check_step(b1,c1,w1,b1,w2,b2,x,targets);
+    check_step(w2,v2,w1,b1,w2,b2,x,targets);
+    check_step(b2,c2,w1,b1,w2,b2,x,targets);
+}
+
+int main() {
+    init_ocropus_components();
+    init_glclass();
+    srand(18);
+    test_gradient(1,13,7,5);
+    test_gradient(3,13,7,5);
+    test_gradient(4,13,7,5);
+    test_gradient(17,13,7,5);
+    test_gradient(64,29,11,3);
+    test_gradient(101,5,23,9);
+}
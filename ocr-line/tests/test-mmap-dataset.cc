@@ -0,0 +1,289 @@
+// -*- C++ -*-
+
+// Copyright 2006-2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: test-mmap-dataset.cc
+// Purpose: check mapped float8 datasets against the datasets they were
+//          written from, and the samples of a ShardStream epoch
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include <stddef.h>
+#include "ocropus.h"
+#include "glinerec.h"
+
+using namespace colib;
+using namespace ocropus;
+using namespace glinerec;
+
+namespace {
+    // what comes before the dataset in the file
+    const char prefix[] = "a preceding record\n";
+    const int prefix_length = sizeof prefix-1;
+    const int trailer = 0x7a7a7a7a;
+
+    // a value that float8 keeps exactly
+    float random_value() {
+        return (rand()%239-119)/100.0;
+    }
+
+    // The dataset preceded by the prefix and followed by the trailer.
+    FILE *write_dataset(IDataset &ds) {
+        FILE *stream = tmpfile();
+        CHECK_CONDITION(stream!=0);
+        CHECK_CONDITION(fwrite(prefix,1,prefix_length,stream)==size_t(prefix_length));
+        mmap_dataset_write<float8>(stream,ds);
+        CHECK_CONDITION(fwrite(&trailer,sizeof trailer,1,stream)==1);
+        fflush(stream);
+        return stream;
+    }
+
+    FILE *write_image(bytearray &image,int length) {
+        FILE *stream = tmpfile();
+        CHECK_CONDITION(stream!=0);
+        if(length>0)
+            CHECK_CONDITION(fwrite(image.data,1,length,stream)==size_t(length));
+        fflush(stream);
+        return stream;
+    }
+
+    void read_image(bytearray &image,FILE *stream) {
+        fseek(stream,0,SEEK_END);
+        image.resize(ftell(stream));
+        rewind(stream);
+        CHECK_CONDITION(fread(image.data,1,image.length(),stream)==size_t(image.length()));
+    }
+
+    // Map the dataset following the prefix; the stream is left after it.
+    void map_dataset(IDataset &mapped,FILE *stream) {
+        CHECK_CONDITION(fseek(stream,prefix_length,SEEK_SET)==0);
+        mapped.load(stream);
+    }
+
+    bool maps(FILE *stream) {
+        MmapDataset<float8> mapped;
+        try {
+            map_dataset(mapped,stream);
+        } catch(const char *error) {
+            return false;
+        }
+        return true;
+    }
+
+    template <class T>
+    void poke(bytearray &image,int64_t pos,T value) {
+        memcpy(&image[pos],&value,sizeof value);
+    }
+
+    // every row and class, in order and in random order
+    void check_rows(IDataset &mapped,IDataset &ds) {
+        CHECK_CONDITION(mapped.nsamples()==ds.nsamples());
+        floatarray v,w;
+        for(int pass=0;pass<3;pass++) {
+            for(int k=0;k<ds.nsamples();k++) {
+                int i = pass<2 ? k : rand()%ds.nsamples();
+                CHECK_CONDITION(mapped.cls(i)==ds.cls(i));
+                mapped.input1d(v,i);
+                ds.input1d(w,i);
+                CHECK_CONDITION(v.length()==w.length());
+                for(int j=0;j<v.length();j++)
+                    CHECK_CONDITION(v(j)==w(j));
+            }
+        }
+    }
+}
+
+// A ragged dataset written after other data maps back row by row, with
+// its header aligned in the file and the stream left after it; a short
+// readahead window makes the passes wrap around several times.
+void test_ragged(int nsamples,const char *advice) {
+    RaggedDataset<float8> ds;
+    floatarray v;
+    int nclasses = 0;
+    for(int i=0;i<nsamples;i++) {
+        v.resize(1+rand()%300);
+        for(int j=0;j<v.length();j++) v(j) = random_value();
+        int c = rand()%10-1;
+        ds.add(v,c);
+        nclasses = max(nclasses,c+1);
+    }
+    FILE *stream = write_dataset(ds);
+    MmapDataset<float8> mapped;
+    mapped.pset("advice",advice);
+    mapped.pset("readahead",4096);
+    map_dataset(mapped,stream);
+    int after;
+    CHECK_CONDITION(fread(&after,sizeof after,1,stream)==1 && after==trailer);
+    CHECK_CONDITION(mapped.nclasses()==nclasses);
+    CHECK_CONDITION((mapped.base-(const char *)mapped.map)%mmap_dataset_align==0);
+    check_rows(mapped,ds);
+    fclose(stream);
+}
+
+// rows of one length give the dataset a number of features
+void test_uniform() {
+    RaggedDataset<float8> ds;
+    floatarray v(37);
+    for(int i=0;i<100;i++) {
+        for(int j=0;j<v.length();j++) v(j) = random_value();
+        ds.add(v,i%7);
+    }
+    FILE *stream = write_dataset(ds);
+    MmapDataset<float8> mapped;
+    map_dataset(mapped,stream);
+    CHECK_CONDITION(mapped.nfeatures()==37);
+    CHECK_CONDITION(mapped.nclasses()==7);
+    check_rows(mapped,ds);
+    fclose(stream);
+}
+
+// Truncated files and damaged headers and tables are rejected.
+void test_corrupt() {
+    RaggedDataset<float8> ds;
+    floatarray v;
+    for(int i=0;i<50;i++) {
+        v.resize(1+rand()%100);
+        for(int j=0;j<v.length();j++) v(j) = random_value();
+        ds.add(v,i%5);
+    }
+    FILE *stream = write_dataset(ds);
+    bytearray good;
+    read_image(good,stream);
+    fclose(stream);
+    // the header follows the prefix after padding
+    int64_t header = (prefix_length+mmap_dataset_align-1)/mmap_dataset_align*mmap_dataset_align;
+    mmap_dataset_header h;
+    memcpy(&h,&good[header],sizeof h);
+    int n = h.nsamples;
+    int64_t tables = header+h.tables;
+    int64_t lengths = tables+n*sizeof (int64_t);
+    int64_t classes = lengths+n*sizeof (int32_t);
+
+    int cuts[] = {
+        int(header)+4,
+        int(header+sizeof h),
+        int(tables),
+        int(classes)
+    };
+    for(int i=0;i<int(sizeof cuts/sizeof cuts[0]);i++) {
+        stream = write_image(good,cuts[i]);
+        CHECK_CONDITION(!maps(stream));
+        fclose(stream);
+    }
+
+    for(int damage=0;damage<11;damage++) {
+        bytearray bad;
+        copy(bad,good);
+        switch(damage) {
+        case 0: bad[header] = 'x'; break;
+        case 1: poke<int32_t>(bad,header+offsetof(mmap_dataset_header,elsize),4); break;
+        case 2: poke<int32_t>(bad,header+offsetof(mmap_dataset_header,nsamples),n+1000); break;
+        case 3: poke<int64_t>(bad,header+offsetof(mmap_dataset_header,tables),h.tables+8*good.length()); break;
+        case 4: poke<int64_t>(bad,header+offsetof(mmap_dataset_header,tables),h.tables+4); break;
+        case 5: poke<int64_t>(bad,tables+8*(n/2),4); break;
+        case 6: poke<int64_t>(bad,tables+8*(n-1),h.tables+1); break;
+        case 7: poke<int32_t>(bad,lengths+4*(n/3),-1); break;
+        case 8: poke<int32_t>(bad,lengths+4*(n-1),1<<20); break;
+        case 9: poke<int32_t>(bad,classes+4*(n/2),h.nclasses); break;
+        case 10: poke<int32_t>(bad,classes+4*(n/4),-2); break;
+        }
+        stream = write_image(bad,bad.length());
+        CHECK_CONDITION(!maps(stream));
+        fclose(stream);
+    }
+
+    stream = write_image(good,good.length());
+    CHECK_CONDITION(maps(stream));
+    fclose(stream);
+}
+
+// One epoch of a ShardStream yields every sample of the streamed shards
+// that has a dense class exactly once, and so does the next one. The
+// first two features of a sample hold its number.
+void test_shard_stream(int block,int chunk) {
+    int nshards = 4, nfeatures = 5;
+    intarray c2i(6);
+    for(int c=0;c<6;c++) c2i(c) = c<3 ? c : c-1;
+    c2i(3) = -1;
+    narray< autodel<IDataset> > shards(nshards);
+    intarray expected;
+    int id = 0;
+    floatarray v(nfeatures);
+    for(int s=0;s<nshards;s++) {
+        RaggedDataset<float8> ds;
+        int n = rand()%3==0 ? 1+rand()%4 : 20+rand()%200;
+        for(int i=0;i<n;i++,id++) {
+            v(0) = (id%100)/100.0;
+            v(1) = (id/100)/100.0;
+            for(int j=2;j<nfeatures;j++) v(j) = random_value();
+            int c = rand()%7-1;
+            ds.add(v,c);
+            // the last shard is held out
+            bool dense = c>=0 && c2i(c)>=0;
+            expected.push(dense && s<nshards-1 ? c2i(c) : -2);
+        }
+        FILE *stream = write_dataset(ds);
+        make_component("MmapDataset8",shards(s));
+        shards(s)->pset("advice","random");
+        map_dataset(*shards(s),stream);
+        fclose(stream);
+    }
+    int total = 0;
+    for(int i=0;i<expected.length();i++)
+        if(expected(i)>=0) total++;
+    if(total==0) return;
+
+    ShardStream stream(shards,nshards-1,c2i,block,chunk,0);
+    stream.start();
+    intarray seen(expected.length());
+    fill(seen,0);
+    int rows = 0;
+    while(rows<2*total) {
+        int c = stream.next();
+        ShardStream::Chunk &ch = stream.chunks(c);
+        for(int r=0;r<ch.n && rows<2*total;r++,rows++) {
+            if(rows==total) fill(seen,0);
+            int i = lrintf(ch.inputs(r,0)*100)+100*lrintf(ch.inputs(r,1)*100);
+            CHECK_CONDITION(i>=0 && i<expected.length());
+            CHECK_CONDITION(ch.classes(r)==expected(i));
+            CHECK_CONDITION(seen(i)==0);
+            seen(i) = 1;
+        }
+        stream.done(c);
+    }
+    stream.stop();
+}
+
+int main() {
+    init_ocropus_components();
+    init_glclass();
+    srand(23);
+    test_ragged(1,"sequential");
+    test_ragged(500,"sequential");
+    test_ragged(500,"random");
+    test_ragged(200,"willneed");
+    test_uniform();
+    test_corrupt();
+    for(int trial=0;trial<10;trial++) {
+        test_shard_stream(1,1);
+        test_shard_stream(7,20);
+        test_shard_stream(64,256);
+    }
+}
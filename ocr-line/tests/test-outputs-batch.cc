@@ -0,0 +1,211 @@
+// -*- C++ -*-
+
+// Copyright 2006-2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: test-outputs-batch.cc
+// Purpose: check that batched classification gives what classifying
+//          one input at a time gives
+// Responsible: tmb
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include "ocropus.h"
+#include "glinerec.h"
+
+using namespace colib;
+using namespace ocropus;
+using namespace glinerec;
+
+namespace {
+    const int junkchar = '~';
+
+    // Samples around one center per class, with values float8 keeps
+    // exactly; with grid>0 they are multiples of 1/grid, so that the
+    // distances of the k-NN classifier come out the same however they
+    // are summed.  Every fifth sample is junk.
+    void make_samples(narray<floatarray> &inputs,intarray &classes,
+                      int n,int nfeatures,int nclasses,int grid=0) {
+        floatarray centers(nclasses,nfeatures);
+        for(int i=0;i<centers.length1d();i++)
+            centers.at1d(i) = (rand()%161-80)/100.0;
+        inputs.resize(n);
+        classes.resize(n);
+        for(int s=0;s<n;s++) {
+            int c = rand()%nclasses;
+            floatarray &v = inputs(s);
+            v.resize(nfeatures);
+            for(int j=0;j<nfeatures;j++) {
+                float value = centers(c,j)+(rand()%41-20)/100.0;
+                if(grid>0) value = rint(value*grid)/grid;
+                v(j) = value;
+            }
+            classes(s) = s%5==4 ? junkchar : 'a'+c;
+        }
+    }
+
+    void train_model(IModel &model,narray<floatarray> &inputs,intarray &classes) {
+        RowDataset<float8> ds;
+        for(int i=0;i<inputs.length();i++)
+            ds.add(inputs(i),classes(i));
+        model.xtrain(ds);
+    }
+
+    void check_same(OutputVector &a,OutputVector &b,float eps) {
+        floatarray p,q;
+        a.as_array(p);
+        b.as_array(q);
+        for(int i=0;i<max(p.length(),q.length());i++) {
+            float x = i<p.length() ? p(i) : 0;
+            float y = i<q.length() ? q(i) : 0;
+            CHECK_CONDITION(fabs(x-y)<=eps);
+        }
+    }
+
+    void check_outputs(IModel &model,narray<OutputVector> &ovs,floatarray &costs,
+                       narray<floatarray> &inputs,float eps) {
+        CHECK_CONDITION(ovs.length()==inputs.length());
+        CHECK_CONDITION(costs.length()==inputs.length());
+        for(int i=0;i<inputs.length();i++) {
+            OutputVector ov;
+            float cost = model.xoutputs(ov,inputs(i));
+            check_same(ov,ovs(i),eps);
+            CHECK_CONDITION(fabs(cost-costs(i))<=eps);
+        }
+    }
+
+    // Both batch entry points against xoutputs; the rows of the
+    // matrix are the (one-dimensional) inputs.
+    void check_batch(IModel &model,narray<floatarray> &inputs,float eps) {
+        narray<OutputVector> ovs;
+        floatarray costs;
+        model.xoutputs_batch(ovs,costs,inputs);
+        check_outputs(model,ovs,costs,inputs,eps);
+        floatarray data(inputs.length(),inputs(0).length());
+        for(int i=0;i<inputs.length();i++)
+            rowput(data,i,inputs(i));
+        model.xoutputs_batch(ovs,costs,data);
+        check_outputs(model,ovs,costs,inputs,eps);
+    }
+
+    // the queries in batches of every size up to a few blocks of rows
+    void check_batches(IModel &model,narray<floatarray> &queries,float eps) {
+        int sizes[] = {1,2,3,4,5,7,31,32,33,queries.length()};
+        for(int i=0;i<int(sizeof sizes/sizeof sizes[0]);i++) {
+            int start = rand()%(queries.length()-sizes[i]+1);
+            narray<floatarray> batch(sizes[i]);
+            for(int j=0;j<sizes[i];j++)
+                batch(j) = queries(start+j);
+            check_batch(model,batch,eps);
+        }
+    }
+}
+
+// The MLPs sum the products in a different order for a batch, so their
+// outputs may differ in the last bits.
+void test_mlp(bool fast) {
+    narray<floatarray> inputs,queries;
+    intarray classes,qclasses;
+    make_samples(inputs,classes,300,23,5);
+    make_samples(queries,qclasses,70,23,5);
+    autodel<IModel> model(make_model("mlp"));
+    model->pset("nensemble",2);
+    model->pset("rounds",2);
+    model->pset("fast_sigmoid",fast);
+    train_model(*model,inputs,classes);
+    check_batches(*model,queries,1e-4);
+}
+
+void test_cascaded() {
+    narray<floatarray> inputs,queries;
+    intarray classes,qclasses;
+    make_samples(inputs,classes,300,17,4);
+    make_samples(queries,qclasses,70,17,4);
+    autodel<IModel> model(make_model("cmlp"));
+    train_model(*model,inputs,classes);
+    check_batches(*model,queries,1e-4);
+}
+
+void test_latin() {
+    narray<floatarray> inputs,queries;
+    intarray classes,qclasses;
+    make_samples(inputs,classes,300,19,4);
+    make_samples(queries,qclasses,70,19,4);
+    autodel<IModel> model(make_model("latin"));
+    train_model(*model,inputs,classes);
+    check_batches(*model,queries,1e-4);
+}
+
+// The k-NN classifier gives the same votes, exhaustively (with ties
+// among the distances) and through the index.
+void test_knn(const char *index,int k) {
+    narray<floatarray> inputs,queries;
+    intarray classes,qclasses;
+    make_samples(inputs,classes,500,13,6,4);
+    make_samples(queries,qclasses,70,13,6,4);
+    for(int i=0;i<queries.length();i+=7)
+        queries(i) = inputs(rand()%inputs.length());
+    autodel<IModel> model(make_model("knn"));
+    model->pset("k",k);
+    model->pset("index",index);
+    model->pset("ef",100);
+    for(int i=0;i<inputs.length();i++)
+        model->xadd(inputs(i),classes(i));
+    model->updateModel();
+    check_batches(*model,queries,0);
+}
+
+// A character classifier that scales images gets them one at a time
+// (the rows of a matrix have lost their shape).  The scaled images
+// have as many pixels as the inputs, which is what the MLP is trained
+// for.
+void test_images() {
+    int w = 10, h = 10;
+    narray<floatarray> inputs,queries;
+    intarray classes,qclasses;
+    make_samples(inputs,classes,200,w*h,3);
+    make_samples(queries,qclasses,40,w*h,3);
+    for(int i=0;i<inputs.length();i++) inputs(i).reshape(w,h);
+    for(int i=0;i<queries.length();i++) queries(i).reshape(w,h);
+    autodel<IModel> model(make_model("latin"));
+    IModel *charclass = make_model("mappedmlp");
+    charclass->setExtractor("scaledfe");
+    charclass->extractor->pset("csize",w);
+    model->setModel(charclass,0);
+    train_model(*model,inputs,classes);
+    CHECK_CONDITION(!model->takesFlatInputs());
+    narray<OutputVector> ovs;
+    floatarray costs;
+    model->xoutputs_batch(ovs,costs,queries);
+    check_outputs(*model,ovs,costs,queries,0);
+}
+
+int main() {
+    init_ocropus_components();
+    init_glclass();
+    srand(17);
+    test_mlp(false);
+    test_mlp(true);
+    test_cascaded();
+    test_latin();
+    test_knn("none",1);
+    test_knn("none",5);
+    test_knn("hnsw",1);
+    test_knn("hnsw",5);
+    test_images();
+}
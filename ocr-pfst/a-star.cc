@@ -38,6 +38,7 @@ namespace {
         float g_accept;     // best cost for accept so far
         int n;              // the number of nodes; also the virtual accept index
         Heap heap;
+        ArcReader reader;
 
     public:
         floatarray g;       // the cost of the best path from the start to here
@@ -49,11 +50,13 @@ namespace {
 
         AStarSearch(IGenericFst &fst): fst(fst),
                                             accepted_from(-1),
-                                            heap(fst.nStates() + 1) {
+                                            heap(fst.nStates() + 1),
+                                            reader(fst) {
             n = fst.nStates();
             came_from.resize(n);
             fill(came_from, -1);
             g.resize(n);
+            fill(g, INFINITY);
 
             // insert the start node
             int s = fst.getStart();
@@ -69,17 +72,14 @@ namespace {
                 return true;  // accept has popped up
 
             // get outbound arcs
-            intarray inputs;
-            intarray targets;
-            intarray outputs;
-            floatarray costs;
-            fst.arcs(inputs, targets, outputs, costs, node);
-            for(int i = 0; i < targets.length(); i++) {
-                int t = targets[i];
-                if(came_from[t] == -1 || g[node] + costs[i] < g[t]) {
+            FstArcs a;
+            reader.get(a, node);
+            for(int i = 0; i < a.length; i++) {
+                int t = a.targets[i];
+                if(came_from[t] == -1 || g[node] + a.costs[i] < g[t]) {
                     // relax the edge
                     came_from[t] = node;
-                    g[t] = g[node] + costs[i];
+                    g[t] = g[node] + a.costs[i];
                     heap.push(t, g[t] + heuristic(t));
                 }
             }
@@ -127,21 +127,18 @@ namespace {
             for(int i = 0; i < n - 1; i++) {
                 int source = vertices[i];
                 int target = vertices[i + 1];
-                intarray out_ins;
-                intarray out_targets;
-                intarray out_outs;
-                floatarray out_costs;
-                fst.arcs(out_ins, out_targets, out_outs, out_costs, source);
+                FstArcs a;
+                reader.get(a, source);
 
                 costs[i] = INFINITY;
 
                 // find the best arc
-                for(int j = 0; j < out_targets.length(); j++) {
-                    if(out_targets[j] != target) continue;
-                    if(out_costs[j] < costs[i]) {
-                        inputs[i] = out_ins[j];
-                        outputs[i] = out_outs[j];
-                        costs[i] = out_costs[j];
+                for(int j = 0; j < a.length; j++) {
+                    if(a.targets[j] != target) continue;
+                    if(a.costs[j] < costs[i]) {
+                        inputs[i] = a.inputs[j];
+                        outputs[i] = a.outputs[j];
+                        costs[i] = a.costs[j];
                     }
                 }
             }
@@ -151,17 +148,272 @@ namespace {
         }
     };
 
-    struct AStarCompositionSearch : AStarSearch {
-        floatarray &g1, &g2; // well, that's against our convention,
-        CompositionFst &c;   // but I let it go since it's so local.
+    /// A* in the composition of two FSTs, creating the state pairs
+    /// only when the search reaches them.
+    ///
+    /// Nodes are numbered in the order of discovery; node 0 is the
+    /// virtual accept node. A hash table finds the node of a state pair.
+    class AStarLazyComposition {
+        OcroFST &fst1, &fst2;
+        floatarray &h1, &h2;
+        float scale2;
+        bool specials2;
+        Heap heap;
+        CompositionArcs arcs;
 
-        virtual double heuristic(int index) {
-            int i1, i2;
-            c.splitIndex(i1, i2, index);
-            return g1[i1] + g2[i2];
+        // per node
+        intarray states1, states2;
+        intarray came_from;     // -1 for the start
+        intarray in_inputs;     // the best arc into the node
+        intarray in_outputs;
+        floatarray in_costs;
+        floatarray g;           // the cost of the best path from the start
+
+        // hash table from state pairs to nodes
+        intarray table;         // node or -1
+        int mask;
+
+        enum { ACCEPT = 0 };
+
+        int hash(int s1, int s2) {
+            return (unsigned(s1) * 2654435761u + unsigned(s2) * 40503u) & mask;
+        }
+
+        void rehash() {
+            int size = table.length() * 2;
+            table.resize(size);
+            fill(table, -1);
+            mask = size - 1;
+            for(int node = 1; node < states1.length(); node++) {
+                int slot = hash(states1[node], states2[node]);
+                while(table[slot] != -1)
+                    slot = (slot + 1) & mask;
+                table[slot] = node;
+            }
+        }
+
+        // Find or create the node of a state pair.
+        int node(int s1, int s2, bool &created) {
+            int slot = hash(s1, s2);
+            for(;;) {
+                int k = table[slot];
+                if(k == -1)
+                    break;
+                if(states1[k] == s1 && states2[k] == s2) {
+                    created = false;
+                    return k;
+                }
+                slot = (slot + 1) & mask;
+            }
+            int k = add(s1, s2);
+            table[slot] = k;
+            if(2 * states1.length() > table.length())
+                rehash();
+            created = true;
+            return k;
+        }
+
+        int add(int s1, int s2) {
+            int k = states1.length();
+            states1.push(s1);
+            states2.push(s2);
+            came_from.push(-1);
+            in_inputs.push(0);
+            in_outputs.push(0);
+            in_costs.push(0);
+            g.push(INFINITY);
+            heap.grow(k + 1);
+            return k;
+        }
+
+        float heuristic(int k) {
+            return h1[states1[k]] + scale2 * h2[states2[k]];
+        }
+
+        // scaled like scale_fst() does it
+        float acceptCost2(int s2) {
+            float cost = fst2.getAcceptCost(s2);
+            if(cost >= 0 && cost < 1e37)
+                cost *= scale2;
+            return cost;
+        }
+
+        void relax(int from, int to, int input, int output, float cost,
+                   bool seen) {
+            float d = g[from] + cost;
+            if(seen && d >= g[to])
+                return;
+            came_from[to] = from;
+            in_inputs[to] = input;
+            in_outputs[to] = output;
+            in_costs[to] = cost;
+            g[to] = d;
+            heap.push(to, to == ACCEPT ? d : d + heuristic(to));
+        }
+
+        bool step() {
+            int k = heap.pop();
+            if(k == ACCEPT)
+                return true;
+            int s1 = states1[k];
+            int s2 = states2[k];
+            arcs.get(fst1, fst2, s1, s2, scale2, specials2);
+            for(int i = 0; i < arcs.length(); i++) {
+                bool created;
+                int t = node(arcs.targets1[i], arcs.targets2[i], created);
+                relax(k, t, arcs.inputs[i], arcs.outputs[i], arcs.costs[i],
+                      !created);
+            }
+            float accept = fst1.getAcceptCost(s1) + acceptCost2(s2);
+            if(accept < INFINITY)
+                relax(k, ACCEPT, 0, 0, accept, came_from[ACCEPT] != -1);
+            return false;
         }
 
-        AStarCompositionSearch(floatarray &g1, floatarray &g2, CompositionFst &c) : AStarSearch(c), g1(g1), g2(g2), c(c) {
+    public:
+        AStarLazyComposition(OcroFST &fst1, floatarray &h1,
+                             OcroFST &fst2, floatarray &h2,
+                             float scale2, bool specials2)
+            : fst1(fst1), fst2(fst2), h1(h1), h2(h2),
+              scale2(scale2), specials2(specials2), heap(0) {
+            CHECK_ARG(h1.length() == fst1.nStates());
+            CHECK_ARG(h2.length() == fst2.nStates());
+            table.resize(1024);
+            fill(table, -1);
+            mask = table.length() - 1;
+            add(-1, -1);        // the accept node
+            bool created;
+            int start = node(fst1.getStart(), fst2.getStart(), created);
+            g[start] = 0;
+            heap.push(start, heuristic(start));
+        }
+
+        bool loop() {
+            while(heap.length()) {
+                if(step())
+                    return true;
+            }
+            return false;
+        }
+
+        /// Same output as AStarSearch::reconstruct_vertices() followed
+        /// by reconstruct_edges(), with the state pairs split.
+        bool reconstruct(intarray &inputs,
+                         intarray &vertices1,
+                         intarray &vertices2,
+                         intarray &outputs,
+                         floatarray &costs) {
+            if(came_from[ACCEPT] == -1)
+                return false;
+            intarray path;
+            for(int k = came_from[ACCEPT]; k != -1; k = came_from[k])
+                path.push(k);
+            int n = path.length();
+            inputs.resize(n);
+            vertices1.resize(n);
+            vertices2.resize(n);
+            outputs.resize(n);
+            costs.resize(n);
+            for(int i = 0; i < n; i++) {
+                int k = path[n - 1 - i];
+                int next = i < n - 1 ? path[n - 2 - i] : ACCEPT;
+                vertices1[i] = states1[k];
+                vertices2[i] = states2[k];
+                inputs[i] = in_inputs[next];
+                outputs[i] = in_outputs[next];
+                costs[i] = in_costs[next];
+            }
+            return true;
+        }
+    };
+
+    /// Best-first enumeration of complete paths (see nbest_paths()).
+    ///
+    /// Every element of the heap is a path, stored as a node of a tree
+    /// pointing to the path's prefix. The node of an accepted path has
+    /// vertex -1. The other nodes keep the arc leading to them.
+    class NBestSearch {
+        OcroFST &fst;
+        floatarray &h;
+        Heap heap;
+
+        // per node
+        intarray parents;
+        intarray vertices;
+        intarray inputs;
+        intarray outputs;
+        floatarray costs;
+        floatarray g;
+
+        // a guard against enumerating zero-cost cycles forever
+        enum { MAX_NODES = 1 << 22 };
+
+        void add(int parent, int vertex, int input, int output, float cost) {
+            float total = (parent == -1 ? 0 : g[parent]) + cost;
+            float estimate = total;
+            if(vertex != -1) {
+                if(h[vertex] == INFINITY)
+                    return; // there is no way to accept from here
+                estimate += h[vertex];
+            }
+            int k = parents.length();
+            parents.push(parent);
+            vertices.push(vertex);
+            inputs.push(input);
+            outputs.push(output);
+            costs.push(cost);
+            g.push(total);
+            heap.grow(k + 1);
+            heap.push(k, estimate);
+        }
+
+    public:
+        NBestSearch(OcroFST &fst) : fst(fst), h(fst.heuristics()), heap(0) {
+            CHECK_ARG(h.length() == fst.nStates());
+            add(-1, fst.getStart(), 0, 0, 0);
+        }
+
+        /// Extend paths until the next best one is accepted.
+        /// \returns the node of the accepted path, or -1
+        int next() {
+            while(heap.length() && parents.length() < MAX_NODES) {
+                int k = heap.pop();
+                int v = vertices[k];
+                if(v == -1)
+                    return k;
+                FstArcs a;
+                fst.arcSpan(a, v);
+                for(int i = 0; i < a.length; i++)
+                    add(k, a.targets[i], a.inputs[i], a.outputs[i], a.costs[i]);
+                float accept = fst.getAcceptCost(v);
+                if(accept < INFINITY)
+                    add(k, -1, 0, 0, accept);
+            }
+            return -1;
+        }
+
+        /// Get an accepted path in the format of a_star().
+        void get(intarray &r_inputs,
+                 intarray &r_vertices,
+                 intarray &r_outputs,
+                 floatarray &r_costs,
+                 int accepted) {
+            int n = 0;
+            for(int k = parents[accepted]; k != -1; k = parents[k])
+                n++;
+            r_inputs.resize(n);
+            r_vertices.resize(n);
+            r_outputs.resize(n);
+            r_costs.resize(n);
+            int next = accepted;
+            for(int i = n - 1; i >= 0; i--) {
+                int k = parents[next];
+                r_vertices[i] = vertices[k];
+                r_inputs[i] = inputs[next];
+                r_outputs[i] = outputs[next];
+                r_costs[i] = costs[next];
+                next = k;
+            }
         }
     };
 
@@ -193,20 +445,18 @@ namespace {
                           intarray &vertices2,
                           intarray &outputs,
                           floatarray &costs,
-                          IGenericFst &fst1,
-                          IGenericFst &fst2,
+                          OcroFST &fst1,
+                          OcroFST &fst2,
                           floatarray &g1,
                           floatarray &g2,
-                          CompositionFst& composition) {
-        intarray vertices;
-        AStarCompositionSearch a(g1, g2, composition);
+                          float scale2,
+                          bool specials2) {
+        fst1.sortByOutput();
+        fst2.sortByInput();
+        AStarLazyComposition a(fst1, g1, fst2, g2, scale2, specials2);
         if(!a.loop())
             return false;
-        if(!a.reconstruct_vertices(vertices))
-            return false;
-        a.reconstruct_edges(inputs, outputs, costs, vertices);
-        composition.splitIndices(vertices1, vertices2, vertices);
-        return true;
+        return a.reconstruct(inputs, vertices1, vertices2, outputs, costs);
     }
 
     /*
@@ -257,6 +507,41 @@ namespace ocropus {
         return true;
     }
 
+    int nbest_paths(objlist<intarray> &inputs,
+                    objlist<intarray> &vertices,
+                    objlist<intarray> &outputs,
+                    objlist<floatarray> &costs,
+                    OcroFST &fst,
+                    int n,
+                    bool unique_outputs) {
+        inputs.clear();
+        vertices.clear();
+        outputs.clear();
+        costs.clear();
+        if(n <= 0)
+            return 0;
+        fst.calculateHeuristics();
+        NBestSearch search(fst);
+        intarray i, v, o;
+        floatarray c;
+        while(outputs.length() < n) {
+            int k = search.next();
+            if(k == -1)
+                break;
+            search.get(i, v, o, c, k);
+            bool seen = false;
+            for(int j = 0; unique_outputs && !seen && j < outputs.length(); j++)
+                seen = same_outputs(outputs[j], o);
+            if(seen)
+                continue;
+            copy(inputs.push(), i);
+            copy(vertices.push(), v);
+            copy(outputs.push(), o);
+            copy(costs.push(), c);
+        }
+        return outputs.length();
+    }
+
     double a_star(ustrg &result, OcroFST &fst) {
         intarray inputs;
         intarray vertices;
@@ -316,25 +601,15 @@ namespace ocropus {
                                intarray &outputs,
                                floatarray &costs,
                                OcroFST &fst1,
-                               OcroFST &fst2) {
-        autodel<CompositionFst> composition(make_CompositionFst(&fst1, &fst2));
-        bool result;
-        try {
-            floatarray g1, g2;
-            fst1.calculateHeuristics();
-            fst2.calculateHeuristics();
-            result = a_star2_internal(inputs, vertices1, vertices2, outputs,
-                                      costs, fst1, fst2,
-                                      fst1.heuristics(),
-                                      fst2.heuristics(), *composition);
-        } catch(...) {
-            composition->move1();
-            composition->move2();
-            throw;
-        }
-        composition->move1();
-        composition->move2();
-        return result;
+                               OcroFST &fst2,
+                               float scale2,
+                               bool specials2) {
+        fst1.calculateHeuristics();
+        fst2.calculateHeuristics();
+        return a_star2_internal(inputs, vertices1, vertices2, outputs, costs,
+                                fst1, fst2,
+                                fst1.heuristics(), fst2.heuristics(),
+                                scale2, specials2);
     }
 
     void a_star_backwards(floatarray &costs_for_all_nodes, IGenericFst &fst) {
@@ -357,20 +632,11 @@ namespace ocropus {
                                OcroFST &fst1,
                                floatarray &g1,
                                OcroFST &fst2,
-                               floatarray &g2) {
-        autodel<CompositionFst> composition(make_CompositionFst(&fst1, &fst2));
-        bool result;
-        try {
-            result = a_star2_internal(inputs, vertices1, vertices2, outputs,
-                                      costs, fst1, fst2, g1, g2, *composition);
-        } catch(...) {
-            composition->move1();
-            composition->move2();
-            throw;
-        }
-        composition->move1();
-        composition->move2();
-        return result;
+                               floatarray &g2,
+                               float scale2,
+                               bool specials2) {
+        return a_star2_internal(inputs, vertices1, vertices2, outputs, costs,
+                                fst1, fst2, g1, g2, scale2, specials2);
     }
 
     double a_star(ustrg &result, OcroFST &fst1, OcroFST &fst2) {
@@ -23,12 +23,58 @@
 
 #include "ocr-pfst.h"
 #include "fst-heap.h"
+#include "lattice.h"
 
 using namespace colib;
 using namespace ocropus;
 
 namespace {
 
+    /// Below this many beam nodes, splitting the traversal
+    /// costs more than it saves.
+    const int min_parallel_beam = 64;
+
+    /// States of fst2 with at least this many arcs get a label index.
+    const int index_min_arcs = 64;
+
+    /// A label index covers at most this many labels per arc.
+    const int index_max_span = 16;
+
+    /// Gallop through the arcs of fst2 when there are this many times
+    /// more of them than arcs of fst1.
+    const int gallop_ratio = 8;
+
+    /// \returns the first position in [begin, n) whose label is
+    ///          at least label, searching from begin with growing steps
+    int gallop(int *labels, int begin, int n, int label) {
+        if(begin >= n || labels[begin] >= label)
+            return begin;
+        int lo = begin, step = 1;
+        while(lo + step < n && labels[lo + step] < label) {
+            lo += step;
+            step *= 2;
+        }
+        int hi = min(lo + step, n);
+        // labels[lo] < label, and labels[hi] >= label if hi < n
+        while(hi - lo > 1) {
+            int mid = (lo + hi) / 2;
+            if(labels[mid] < label) lo = mid; else hi = mid;
+        }
+        return hi;
+    }
+
+    /// Find the range [begin, end) of the given label in sorted labels.
+    void label_range(int &begin, int &end, int *labels, int n, int label) {
+        int lo = 0, hi = n;
+        while(lo < hi) {
+            int mid = (lo + hi) / 2;
+            if(labels[mid] < label) lo = mid + 1; else hi = mid;
+        }
+        begin = lo;
+        while(lo < n && labels[lo] == label) lo++;
+        end = lo;
+    }
+
     /// A SearchTree contains all vertices that were ever touched during the
     /// search, and can produce a prehistory for every ID.
     struct SearchTree {
@@ -54,26 +100,23 @@ namespace {
                  intarray &r_outputs,
                  floatarray &r_costs,
                  int id) {
-            intarray t_v1; // vertices
-            intarray t_v2; // vertices
-            intarray t_i; // inputs
-            intarray t_o; // outputs
-            floatarray t_c; // costs
+            int n = 0;
+            for(int current = id; current != -1; current = parents[current])
+                n++;
+            r_vertices1.resize(n);
+            r_vertices2.resize(n);
+            r_inputs.resize(n);
+            r_outputs.resize(n);
+            r_costs.resize(n);
             int current = id;
-            while(current != -1) {
-                t_v1.push(v1[current]);
-                t_v2.push(v2[current]);
-                t_i.push(inputs[current]);
-                t_o.push(outputs[current]);
-                t_c.push(costs[current]);
+            for(int i = n - 1; i >= 0; i--) {
+                r_vertices1[i] = v1[current];
+                r_vertices2[i] = v2[current];
+                r_inputs[i] = inputs[current];
+                r_outputs[i] = outputs[current];
+                r_costs[i] = costs[current];
                 current = parents[current];
             }
-
-            reverse(r_vertices1, t_v1);
-            reverse(r_vertices2, t_v2);
-            reverse(r_inputs, t_i);
-            reverse(r_outputs, t_o);
-            reverse(r_costs, t_c);
         }
 
         int add(int parent, int vertex1, int vertex2,
@@ -91,13 +134,62 @@ namespace {
         }
     };
 
-    struct BeamSearch {
-        OcroFST &fst1;
-        OcroFST &fst2;
+    /// Arcs leaving a part of the beam, collected by traverse() on one
+    /// thread and relaxed later in the order they were found.
+    struct Candidates {
+        intarray targets1;
+        intarray targets2;
+        intarray inputs;
+        intarray outputs;
+        floatarray costs;
+        intarray trails;
+
+        void clear() {
+            targets1.clear();
+            targets2.clear();
+            inputs.clear();
+            outputs.clear();
+            costs.clear();
+            trails.clear();
+        }
+
+        int length() {
+            return trails.length();
+        }
+
+        int matched[BeamSearchContext::MATCH_INDEX + 1];
+
+        Candidates() {
+            for(int i = 0; i <= BeamSearchContext::MATCH_INDEX; i++)
+                matched[i] = 0;
+        }
+
+        // same signature as BeamSearch::relax()
+        void relax(int f1, int f2, int t1, int t2, double cost,
+                   int arc_id1, int arc_id2,
+                   int input, int intermediate, int output,
+                   double base_cost, int trail_index) {
+            targets1.push(t1);
+            targets2.push(t2);
+            inputs.push(input);
+            outputs.push(output);
+            costs.push(cost);
+            trails.push(trail_index);
+        }
+    };
+
+    /// The beam search. All arrays are kept between searches
+    /// (clear() doesn't free them), so a BeamSearch that is reused
+    /// for many lines stops allocating once it has seen the largest one.
+    struct BeamSearch : BeamSearchContext {
+        OcroFST *fst1;
+        OcroFST *fst2;
         SearchTree stree;
 
         intarray beam; // indices into stree
         floatarray beamcost; // global cost, corresponds to the beam
+        intarray next_beam;
+        floatarray next_beamcost;
 
         PriorityQueue nbest;
         intarray all_inputs;
@@ -112,14 +204,149 @@ namespace {
         float g_accept;   // best cost for accept so far
         int best_so_far;  // ID into stree (-1 for start)
         float best_cost_so_far;
-
-        BeamSearch(OcroFST &fst1, OcroFST &fst2, int beam_width):
-                fst1(fst1),
-                fst2(fst2),
-                nbest(beam_width),
-                beam_width(beam_width),
+        float scale2;     // scale for all costs of fst2
+        bool specials2;   // labels 1..4 of fst2 are the specials -1..-4
+        int nstates2;
+        bool collect;     // keep all accepted paths (for n-best lists)
+        intarray accepted;         // IDs into stree
+        floatarray accepted_costs;
+        int threads;      // number of parts a beam is split into
+        objlist<Candidates> candidates; // one per part
+        int matcher;      // MATCH_AUTO or the matcher to use everywhere
+        int matched[MATCH_INDEX + 1]; // states matched by each matcher
+
+        // Label index of the high fanout states of fst2. For such a state
+        // s, the arcs with label index_lo[s] + i start at arc
+        // index[index_slot[s] + i] (the next entry is where they end).
+        // index_slot[s] is -1 for other states.
+        intarray index_slot;
+        intarray index_lo;
+        intarray index;
+        // what the index was built for
+        int *indexed_offsets;
+        int *indexed_inputs;
+        int indexed_generation;
+        bool indexed_specials;
+
+        // the frozen arc arrays of both FSTs
+        int *offsets1, *targets1, *inputs1, *outputs1;
+        int *offsets2, *targets2, *inputs2, *outputs2;
+        float *costs1, *costs2;
+
+        BeamSearch():
+                fst1(0),
+                fst2(0),
+                nbest(0),
+                beam_width(0),
                 accepted_from1(-1),
-                accepted_from2(-1) {
+                accepted_from2(-1),
+                scale2(1.0),
+                specials2(false),
+                nstates2(0),
+                collect(false),
+                threads(1),
+                matcher(MATCH_AUTO),
+                indexed_offsets(0),
+                indexed_inputs(0),
+                indexed_generation(0),
+                indexed_specials(false) {
+            for(int i = 0; i <= MATCH_INDEX; i++)
+                matched[i] = 0;
+        }
+
+        void setMatcher(int m) {
+            CHECK_ARG(m >= MATCH_AUTO && m <= MATCH_INDEX);
+            matcher = m;
+        }
+
+        void getMatchCounts(intarray &counts) {
+            counts.resize(MATCH_INDEX + 1);
+            for(int i = 0; i <= MATCH_INDEX; i++)
+                counts[i] = matched[i];
+        }
+
+        /// Build the label index for fst2, unless it's still there from
+        /// a previous search of the same arcs with the same specials.
+        /// This happens before the search, so that traverse() can run
+        /// on several threads.
+        void index_fst2() {
+            int generation = fst2->generation();
+            if(indexed_offsets == offsets2 && indexed_inputs == inputs2
+               && indexed_generation == generation
+               && indexed_specials == specials2
+               && index_slot.length() == nstates2)
+                return;
+            indexed_offsets = offsets2;
+            indexed_inputs = inputs2;
+            indexed_generation = generation;
+            indexed_specials = specials2;
+            index_slot.resize(nstates2);
+            index_lo.resize(nstates2);
+            fill(index_slot, -1);
+            index.clear();
+            int first_label = specials2 ? 5 : 1;
+            for(int s = 0; s < nstates2; s++) {
+                int begin = offsets2[s], end = offsets2[s + 1];
+                if(end - begin < index_min_arcs)
+                    continue;
+                int first = begin;
+                while(first < end && inputs2[first] < first_label)
+                    first++;
+                if(first == end)
+                    continue;
+                int lo = inputs2[first];
+                int span = inputs2[end - 1] - lo + 1;
+                if(span > index_max_span * (end - first))
+                    continue;
+                index_slot[s] = index.length();
+                index_lo[s] = lo;
+                int k = first;
+                for(int i = 0; i <= span; i++) {
+                    while(k < end && inputs2[k] < lo + i) k++;
+                    index.push(k);
+                }
+            }
+        }
+
+        /// Prepare for searching the composition of the given FSTs.
+        void bind(OcroFST &f1, OcroFST &f2, int width, float scale,
+                  bool specials) {
+            fst1 = &f1;
+            fst2 = &f2;
+            if(width != beam_width)
+                nbest.resize(width);
+            beam_width = width;
+            accepted_from1 = -1;
+            accepted_from2 = -1;
+            scale2 = scale;
+            specials2 = specials;
+            nstates2 = f2.nStates();
+            offsets1 = f1.arcOffsets();
+            targets1 = f1.arcTargets();
+            inputs1 = f1.arcInputs();
+            outputs1 = f1.arcOutputs();
+            costs1 = f1.arcCosts();
+            offsets2 = f2.arcOffsets();
+            targets2 = f2.arcTargets();
+            inputs2 = f2.arcInputs();
+            outputs2 = f2.arcOutputs();
+            costs2 = f2.arcCosts();
+            index_fst2();
+        }
+
+        // A label of fst2 as make_specials_neg() would leave it.
+        int label2(int label) {
+            if(specials2 && label > 0 && label <= 4)
+                return -label;
+            return label;
+        }
+
+        // Accept cost of fst2, scaled the same way as scale_fst() does it.
+        float acceptCost2(int vertex) {
+            float cost = fst2->getAcceptCost(vertex);
+            if(cost >= 0 && cost < 1e37)
+                cost *= scale2;
+            return cost;
         }
 
         void clear() {
@@ -147,7 +374,7 @@ namespace {
                    int trail_index) {
             //logger.format("relaxing %d %d -> %d %d (bcost %f, cost %f)", f1, f2, t1, t2, base_cost, cost);
 
-            if(!nbest.add_replacing_id(t1 * fst2.nStates() + t2,
+            if(!nbest.add_replacing_id(t1 * nstates2 + t2,
                                        all_costs.length(),
                                        - base_cost - cost))
                 return;
@@ -187,61 +414,70 @@ namespace {
             }
         }
 
-        /// Call relax() for each arc going out of the given node.
-        void traverse(int n1, int n2, double cost, int trail_index) {
+        /// Call sink.relax() for each arc going out of the given node.
+        /// The sink is either the search itself or a Candidates buffer.
+        template<class Sink>
+        void traverse(int n1, int n2, double cost, int trail_index,
+                      Sink &sink) {
             //logger.format("traversing %d %d", n1, n2);
-            intarray &o1 = fst1.outputs(n1);
-            intarray &i1 = fst1.inputs(n1);
-            intarray &t1 = fst1.targets(n1);
-            floatarray &c1 = fst1.costs(n1);
-
-            intarray &o2 = fst2.outputs(n2);
-            intarray &i2 = fst2.inputs(n2);
-            intarray &t2 = fst2.targets(n2);
-            floatarray &c2 = fst2.costs(n2);
-
-            // for optimization
-            int *O1 = o1.data;
-            int *O2 = o2.data;
-            int *I1 = i1.data;
-            int *I2 = i2.data;
-            int *T1 = t1.data;
-            int *T2 = t2.data;
-            float *C1 = c1.data;
-            float *C2 = c2.data;
-
-            // Relax outbound arcs in the composition
-            int k1, k2;
 
+            // both FSTs are frozen, so the arcs of a state are contiguous
+            int begin1 = offsets1[n1];
+            int begin2 = offsets2[n2];
+            int l1 = offsets1[n1 + 1] - begin1;
+            int l2 = offsets2[n2 + 1] - begin2;
+
+            int *O1 = outputs1 + begin1;
+            int *O2 = outputs2 + begin2;
+            int *I1 = inputs1 + begin1;
+            int *I2 = inputs2 + begin2;
+            int *T1 = targets1 + begin1;
+            int *T2 = targets2 + begin2;
+            float *C1 = costs1 + begin1;
+            float *C2 = costs2 + begin2;
+
+            // Relax outbound arcs in the composition.
+            // The arcs are sorted by the stored labels, so the arcs with
+            // one label form a range; with specials2, the specials of fst2
+            // are stored as 1..4 and don't take part in matching.
+            int rho1_begin, rho1_end, eps1_begin, eps1_end;
+            int rho2_begin, rho2_end, eps2_begin, eps2_end;
+            label_range(rho1_begin, rho1_end, O1, l1, L_RHO);
+            label_range(eps1_begin, eps1_end, O1, l1, L_EPSILON);
+            label_range(rho2_begin, rho2_end, I2, l2,
+                        specials2 ? -L_RHO : L_RHO);
+            label_range(eps2_begin, eps2_end, I2, l2, L_EPSILON);
 
             // relaxing fst1 RHO moves
             // these can be rho->rho or x->rho moves
-            for(k1 = 0; k1 < o1.length() && O1[k1]==L_RHO; k1++) {
-                for(int j=0;j<o2.length();j++) {
-                    if(I2[j]<=L_EPSILON) continue;
+            for(int k1 = rho1_begin; k1 < rho1_end; k1++) {
+                for(int j=0;j<l2;j++) {
+                    int in2 = label2(I2[j]);
+                    if(in2<=L_EPSILON) continue;
                     // if it's rho->rho, then pick up the label,
                     // if it's x->rho leave it alone
-                    int in = I1[k1]==L_RHO?I2[j]:I1[k1];
-                    relax(n1, n2,         // from pair
+                    int in = I1[k1]==L_RHO?in2:I1[k1];
+                    sink.relax(n1, n2,         // from pair
                           T1[k1], T2[j],  // to pair
-                          C1[k1] + C2[j], // cost
+                          C1[k1] + scale2 * C2[j], // cost
                           k1, j,         // arc ids
-                          in, I2[j], O2[j],   // input, intermediate, output
+                          in, in2, label2(O2[j]),   // input, intermediate, output
                           cost, trail_index);
                 }
             }
 
             // relaxing fst2 RHO moves
             // these can be rho->rho or rho->x moves
-            for(k2 = 0; k2 < o2.length() && I2[k2]==L_RHO; k2++) {
-                for(int j=0;j<o1.length();j++) {
+            for(int k2 = rho2_begin; k2 < rho2_end; k2++) {
+                for(int j=0;j<l1;j++) {
                     if(O1[j]<=L_EPSILON) continue;
                     // if it's rho->rho, then pick up the label,
                     // if it's rho->x leave it alone
-                    int out = O2[k2]==L_RHO?O1[j]:O2[k2];
-                    relax(n1, n2,       // from pair
+                    int out2 = label2(O2[k2]);
+                    int out = out2==L_RHO?O1[j]:out2;
+                    sink.relax(n1, n2,       // from pair
                           T1[j], T2[k2],   // to pair
-                          C1[j] + C2[k2],       // cost
+                          C1[j] + scale2 * C2[k2], // cost
                           j, k2,       // arc ids
                           I1[j], O1[j], out, // input, intermediate, output
                           cost, trail_index);
@@ -249,8 +485,8 @@ namespace {
             }
 
             // relaxing fst1 EPSILON moves
-            for(k1 = 0; k1 < o1.length() && O1[k1]==L_EPSILON; k1++) {
-                relax(n1, n2,       // from pair
+            for(int k1 = eps1_begin; k1 < eps1_end; k1++) {
+                sink.relax(n1, n2,       // from pair
                       T1[k1], n2,   // to pair
                       C1[k1],       // cost
                       k1, -1,       // arc ids
@@ -259,33 +495,75 @@ namespace {
             }
 
             // relaxing fst2 EPSILON moves
-            for(k2 = 0; k2 < o2.length() && I2[k2]==L_EPSILON; k2++) {
-                relax(n1, n2,       // from pair
+            for(int k2 = eps2_begin; k2 < eps2_end; k2++) {
+                sink.relax(n1, n2,       // from pair
                       n1, T2[k2],   // to pair
-                      C2[k2],       // cost
+                      scale2 * C2[k2], // cost
                       -1, k2,       // arc ids
-                      0, 0, O2[k2], // input, intermediate, output
+                      0, 0, label2(O2[k2]), // input, intermediate, output
                       cost, trail_index);
             }
 
             // relaxing non-epsilon moves
-            while(k1 < o1.length() && k2 < i2.length()) {
-                while(k1 < o1.length() && O1[k1] < I2[k2]) k1++;
-                if(k1 >= o1.length()) break;
-                while(k2 < i2.length() && O1[k1] > I2[k2]) k2++;
-                while(k1 < o1.length() && k2 < i2.length() && O1[k1] == I2[k2]){
-                    for(int j = k2; j < i2.length() && O1[k1] == I2[j]; j++)
-                        relax(n1, n2,           // from pair
-                              T1[k1], T2[j],    // to pair
-                              C1[k1] + C2[j],   // cost
-                              k1, j,            // arc ids
-                              I1[k1], O1[k1], O2[j], // input, intermediate, output
-                              cost, trail_index);
-                    k1++;
+            int k1 = eps1_end;
+            int k2 = eps2_end;
+            if(specials2)
+                while(k2 < l2 && I2[k2] <= 4) k2++;
+            if(k1 >= l1 || k2 >= l2)
+                return;
+            int m = matcher;
+            if(m == MATCH_INDEX && index_slot[n2] < 0)
+                m = MATCH_MERGE;
+            if(m == MATCH_AUTO) {
+                if(index_slot[n2] >= 0)
+                    m = MATCH_INDEX;
+                else if(l2 - k2 >= gallop_ratio * (l1 - k1))
+                    m = MATCH_GALLOP;
+                else
+                    m = MATCH_MERGE;
+            }
+            sink.matched[m]++;
+            while(k1 < l1 && (m == MATCH_INDEX || k2 < l2)) {
+                int label = O1[k1];
+                int end1 = k1 + 1;
+                while(end1 < l1 && O1[end1] == label) end1++;
+                int end2;
+                if(m == MATCH_INDEX) {
+                    int i = label - index_lo[n2];
+                    int span = indexed_span(n2);
+                    if(i < 0 || i >= span || (specials2 && label <= 4)) {
+                        k1 = end1;
+                        continue;
+                    }
+                    k2 = index[index_slot[n2] + i] - begin2;
+                    end2 = index[index_slot[n2] + i + 1] - begin2;
+                } else {
+                    if(m == MATCH_GALLOP)
+                        k2 = gallop(I2, k2, l2, label);
+                    else
+                        while(k2 < l2 && I2[k2] < label) k2++;
+                    end2 = k2;
+                    while(end2 < l2 && I2[end2] == label) end2++;
+                }
+                for(; k1 < end1; k1++) {
+                    for(int j = k2; j < end2; j++)
+                        sink.relax(n1, n2,           // from pair
+                                   T1[k1], T2[j],    // to pair
+                                   C1[k1] + scale2 * C2[j], // cost
+                                   k1, j,            // arc ids
+                                   I1[k1], O1[k1], label2(O2[j]), // input, intermediate, output
+                                   cost, trail_index);
                 }
+                if(m != MATCH_INDEX)
+                    k2 = end2;
             }
         }
 
+        // number of labels covered by the index of state n2
+        int indexed_span(int n2) {
+            return inputs2[offsets2[n2 + 1] - 1] - index_lo[n2] + 1;
+        }
+
         // The main loop iteration.
         void radiate() {
             clear();
@@ -297,10 +575,17 @@ namespace {
             for(int i = 0; i < control_beam_start; i++)
                 try_accept(i);
 
-            // in this loop, traversal may add "control nodes" to the beam
-            for(int i = 0; i < beam.length(); i++) {
-                traverse(stree.v1[beam[i]], stree.v2[beam[i]],
-                         beamcost[i], i);
+            // traversal may add "control nodes" to the beam,
+            // which are traversed in turn
+            for(int start = 0; start < beam.length(); ) {
+                int end = beam.length();
+                if(threads > 1 && end - start >= min_parallel_beam)
+                    traverse_parallel(start, end);
+                else for(int i = start; i < end; i++) {
+                    traverse(stree.v1[beam[i]], stree.v2[beam[i]],
+                             beamcost[i], i, *this);
+                }
+                start = end;
             }
 
             // try accepts from control beam nodes
@@ -309,29 +594,76 @@ namespace {
                 try_accept(i);
 
 
-            intarray new_beam;
-            floatarray new_beamcost;
+            // best candidates first, as in the previous generation
+            nbest.sort();
+            next_beam.clear();
+            next_beamcost.clear();
             for(int i = 0; i < nbest.length(); i++) {
                 int k = nbest.tag(i);
                 if(parent_trails[k] < 0) // skip the control beam nodes
                     continue;
-                new_beam.push(stree.add(beam[parent_trails[k]],
-                                        all_targets1[k], all_targets2[k],
-                                        all_inputs[k], all_outputs[k],
-                                        all_costs[k]));
-                new_beamcost.push(beamcost[parent_trails[k]] + all_costs[k]);
+                next_beam.push(stree.add(beam[parent_trails[k]],
+                                         all_targets1[k], all_targets2[k],
+                                         all_inputs[k], all_outputs[k],
+                                         all_costs[k]));
+                next_beamcost.push(beamcost[parent_trails[k]] + all_costs[k]);
                 //logger.format("to new beam: trail index %d, stree %d, target %d,%d",
-                        //k, new_beam[new_beam.length() - 1], all_targets1[k], all_targets2[k]);
+                        //k, next_beam[next_beam.length() - 1], all_targets1[k], all_targets2[k]);
+            }
+            // copying keeps both buffers allocated for the next generation
+            beam.clear();
+            beamcost.clear();
+            for(int i = 0; i < next_beam.length(); i++) {
+                beam.push(next_beam[i]);
+                beamcost.push(next_beamcost[i]);
+            }
+        }
+
+        // Traverse the beam nodes start..end-1 on several threads.
+        // Each thread collects the arcs of a contiguous part of the beam;
+        // relaxing the parts in order afterwards makes exactly the same
+        // calls as traversing the beam on one thread.
+        void traverse_parallel(int start, int end) {
+            while(candidates.length() < threads)
+                candidates.push();
+            int parts = threads;
+#pragma omp parallel for schedule(static, 1) num_threads(threads)
+            for(int part = 0; part < parts; part++) {
+                Candidates &c = candidates[part];
+                c.clear();
+                int n = end - start;
+                int lo = start + int(n * (long long) part / parts);
+                int hi = start + int(n * (long long) (part + 1) / parts);
+                for(int i = lo; i < hi; i++) {
+                    traverse(stree.v1[beam[i]], stree.v2[beam[i]],
+                             beamcost[i], i, c);
+                }
+            }
+            for(int part = 0; part < parts; part++) {
+                Candidates &c = candidates[part];
+                for(int i = 0; i <= MATCH_INDEX; i++) {
+                    matched[i] += c.matched[i];
+                    c.matched[i] = 0;
+                }
+                for(int k = 0; k < c.length(); k++) {
+                    int i = c.trails[k];
+                    relax(stree.v1[beam[i]], stree.v2[beam[i]],
+                          c.targets1[k], c.targets2[k], c.costs[k],
+                          -1, -1, c.inputs[k], 0, c.outputs[k],
+                          beamcost[i], i);
+                }
             }
-            move(beam, new_beam);
-            move(beamcost, new_beamcost);
         }
 
         // Relax the accept arc from the beam node number i.
         void try_accept(int i) {
-            float a_cost1 = fst1.getAcceptCost(stree.v1[beam[i]]);
-            float a_cost2 = fst2.getAcceptCost(stree.v2[beam[i]]);
+            float a_cost1 = fst1->getAcceptCost(stree.v1[beam[i]]);
+            float a_cost2 = acceptCost2(stree.v2[beam[i]]);
             float candidate = beamcost[i] + a_cost1 + a_cost2;
+            if(collect && candidate < INFINITY) {
+                accepted.push(beam[i]);
+                accepted_costs.push(candidate);
+            }
             if(candidate < best_cost_so_far) {
                 //logger.format("accept from beam #%d (stree %d), cost %f",
                 //              i, beam[i], candidate);
@@ -342,60 +674,147 @@ namespace {
 
         void bestpath(intarray &v1, intarray &v2, intarray &inputs,
                       intarray &outputs, floatarray &costs) {
+            search();
+            stree.get(v1, v2, inputs, outputs, costs, best_so_far);
+            costs.push(fst1->getAcceptCost(stree.v1[best_so_far]) +
+                       acceptCost2(stree.v2[best_so_far]));
+
+            //logger("costs", costs);
+        }
+
+        int nbestpaths(objlist<intarray> &v1, objlist<intarray> &v2,
+                       objlist<intarray> &inputs, objlist<intarray> &outputs,
+                       objlist<floatarray> &costs, int n, bool unique) {
+            v1.clear();
+            v2.clear();
+            inputs.clear();
+            outputs.clear();
+            costs.clear();
+            collect = true;
+            accepted.clear();
+            accepted_costs.clear();
+            search();
+            collect = false;
+            intarray permutation;
+            quicksort(permutation, accepted_costs);
+            intarray pv1, pv2, pin, pout;
+            floatarray pcosts;
+            for(int i = 0; i < permutation.length() && outputs.length() < n; i++) {
+                int id = accepted[permutation[i]];
+                stree.get(pv1, pv2, pin, pout, pcosts, id);
+                bool seen = false;
+                for(int j = 0; unique && !seen && j < outputs.length(); j++)
+                    seen = same_outputs(outputs[j], pout);
+                if(seen)
+                    continue;
+                pcosts.push(fst1->getAcceptCost(stree.v1[id]) +
+                            acceptCost2(stree.v2[id]));
+                copy(v1.push(), pv1);
+                copy(v2.push(), pv2);
+                copy(inputs.push(), pin);
+                copy(outputs.push(), pout);
+                copy(costs.push(), pcosts);
+            }
+            return outputs.length();
+        }
+
+        // Run the search, leaving the best accepted path in best_so_far.
+        void search() {
             stree.clear();
 
-            beam.resize(1);
-            beamcost.resize(1);
-            beam[0] = stree.add(-1, fst1.getStart(), fst2.getStart(), 0, 0, 0);
-            beamcost[0] = 0;
+            beam.clear();
+            beamcost.clear();
+            beam.push(stree.add(-1, fst1->getStart(), fst2->getStart(), 0, 0, 0));
+            beamcost.push(0);
 
             best_so_far = 0;
-            best_cost_so_far = fst1.getAcceptCost(fst1.getStart()) +
-                               fst2.getAcceptCost(fst1.getStart());
+            best_cost_so_far = fst1->getAcceptCost(fst1->getStart()) +
+                               acceptCost2(fst2->getStart());
 
             while(beam.length())
                 radiate();
-
-            stree.get(v1, v2, inputs, outputs, costs, best_so_far);
-            costs.push(fst1.getAcceptCost(stree.v1[best_so_far]) +
-                       fst2.getAcceptCost(stree.v2[best_so_far]));
-
-            //logger("costs", costs);
         }
     };
 
 };
 
 namespace ocropus {
-    void beam_search(intarray &vertices1,
+    BeamSearchContext *make_BeamSearchContext(int threads) {
+        CHECK_ARG(threads >= 1);
+        BeamSearch *b = new BeamSearch();
+        b->threads = threads;
+        return b;
+    }
+
+    void beam_search(BeamSearchContext &context,
+                     intarray &vertices1,
                      intarray &vertices2,
                      intarray &inputs,
                      intarray &outputs,
                      floatarray &costs,
                      OcroFST &fst1,
                      OcroFST &fst2,
-                     int beam_width) {
-        BeamSearch b(fst1, fst2, beam_width);
+                     int beam_width,
+                     float scale2,
+                     bool specials2) {
         CHECK(L_SIGMA<L_EPSILON);
         CHECK(L_RHO<L_PHI);
         CHECK(L_PHI<L_EPSILON);
         CHECK(L_EPSILON<1);
         fst1.sortByOutput();
         fst2.sortByInput();
+        BeamSearch &b = dynamic_cast<BeamSearch &>(context);
+        b.bind(fst1, fst2, beam_width, scale2, specials2);
         //fprintf(stderr,"starting bestpath\n");
         b.bestpath(vertices1, vertices2, inputs, outputs, costs);
         //fprintf(stderr,"finished bestpath\n");
     }
 
+    int beam_search_nbest(BeamSearchContext &context,
+                          objlist<intarray> &vertices1,
+                          objlist<intarray> &vertices2,
+                          objlist<intarray> &inputs,
+                          objlist<intarray> &outputs,
+                          objlist<floatarray> &costs,
+                          OcroFST &fst1,
+                          OcroFST &fst2,
+                          int n,
+                          int beam_width,
+                          float scale2,
+                          bool specials2,
+                          bool unique_outputs) {
+        fst1.sortByOutput();
+        fst2.sortByInput();
+        BeamSearch &b = dynamic_cast<BeamSearch &>(context);
+        b.bind(fst1, fst2, beam_width, scale2, specials2);
+        return b.nbestpaths(vertices1, vertices2, inputs, outputs, costs,
+                            n, unique_outputs);
+    }
+
+    void beam_search(intarray &vertices1,
+                     intarray &vertices2,
+                     intarray &inputs,
+                     intarray &outputs,
+                     floatarray &costs,
+                     OcroFST &fst1,
+                     OcroFST &fst2,
+                     int beam_width,
+                     float scale2,
+                     bool specials2) {
+        BeamSearch b;
+        beam_search(b, vertices1, vertices2, inputs, outputs, costs,
+                    fst1, fst2, beam_width, scale2, specials2);
+    }
+
     double beam_search(ustrg &result, OcroFST &fst1, OcroFST &fst2,
-                       int beam_width) {
+                       int beam_width, float scale2, bool specials2) {
         intarray v1;
         intarray v2;
         intarray i;
         intarray o;
         floatarray c;
         //fprintf(stderr,"starting beam search\n");
-        beam_search(v1, v2, i, o, c, fst1, fst2, beam_width);
+        beam_search(v1, v2, i, o, c, fst1, fst2, beam_width, scale2, specials2);
         //fprintf(stderr,"finished beam search\n");
         remove_epsilons(result, o);
         return sum(c);
@@ -0,0 +1,172 @@
+// Copyright 2009 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project: ocrofst
+// File: fst-archive.cc
+// Purpose: many lattices in one file
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ocr-pfst.h"
+#include "fst-io.h"
+
+using namespace colib;
+using namespace ocropus;
+
+namespace {
+    struct FstArchiveReaderImpl : FstArchiveReader {
+        void *mapping;
+        size_t size;
+        FstArchiveEntry *index;
+        int count;
+
+        FstArchiveReaderImpl(const char *path) : mapping(0), size(0) {
+            int fd = open(path, O_RDONLY);
+            if(fd < 0)
+                throwf("%s: cannot open", path);
+            struct stat st;
+            if(fstat(fd, &st) < 0) {
+                close(fd);
+                throwf("%s: cannot stat", path);
+            }
+            size = st.st_size;
+            void *p = MAP_FAILED;
+            if(size >= sizeof(FstArchiveHeader))
+                p = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if(p == MAP_FAILED)
+                throwf("%s: cannot map", path);
+            mapping = p;
+            FstArchiveHeader &h = *(FstArchiveHeader *) p;
+            count = h.count;
+            index = (FstArchiveEntry *) ((char *) p + sizeof(h));
+            bool valid = h.magic == FST_ARCHIVE_MAGIC
+                      && h.version == FST_ARCHIVE_VERSION
+                      && count >= 0
+                      && sizeof(h) + count * sizeof(FstArchiveEntry) <= size;
+            for(int i = 0; valid && i < count; i++) {
+                valid = index[i].offset >= 0 && index[i].size >= 0
+                     && index[i].offset + index[i].size <= (int64_t) size;
+            }
+            if(!valid) {
+                munmap(mapping, size);
+                throwf("%s: not a valid lattice archive", path);
+            }
+        }
+
+        ~FstArchiveReaderImpl() {
+            munmap(mapping, size);
+        }
+
+        int length() {
+            return count;
+        }
+
+        int lineId(int i) {
+            CHECK_ARG(i >= 0 && i < count);
+            return index[i].line;
+        }
+
+        int find(int line) {
+            // the index is sorted by line
+            int lo = 0, hi = count;
+            while(lo < hi) {
+                int mid = (lo + hi) / 2;
+                if(index[mid].line < line)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if(lo < count && index[lo].line == line)
+                return lo;
+            return -1;
+        }
+
+        void read(IGenericFst &fst, int i) {
+            CHECK_ARG(i >= 0 && i < count);
+            fst_read(fst, (unsigned char *) mapping + index[i].offset,
+                     index[i].size);
+        }
+
+        void record(bytearray &result, int i) {
+            CHECK_ARG(i >= 0 && i < count);
+            result.resize(index[i].size);
+            memcpy(result.data, (char *) mapping + index[i].offset,
+                   index[i].size);
+        }
+    };
+
+    int64_t align8(int64_t pos) {
+        return (pos + 7) & ~int64_t(7);
+    }
+}
+
+namespace ocropus {
+    FstArchiveReader *make_FstArchiveReader(const char *path) {
+        return new FstArchiveReaderImpl(path);
+    }
+
+    void fst_archive_write(const char *path, intarray &lines,
+                           objlist<bytearray> &records) {
+        CHECK_ARG(lines.length() == records.length());
+        int count = lines.length();
+        intarray permutation;
+        quicksort(permutation, lines);
+        for(int i = 1; i < count; i++) {
+            if(lines[permutation[i]] == lines[permutation[i - 1]])
+                throwf("%s: line %d stored twice", path, lines[permutation[i]]);
+        }
+
+        FstArchiveHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = FST_ARCHIVE_MAGIC;
+        header.version = FST_ARCHIVE_VERSION;
+        header.count = count;
+        narray<FstArchiveEntry> index(count);
+        int64_t pos = align8(sizeof(header) + count * sizeof(FstArchiveEntry));
+        for(int i = 0; i < count; i++) {
+            FstArchiveEntry &entry = index[i];
+            memset(&entry, 0, sizeof(entry));
+            entry.line = lines[permutation[i]];
+            entry.offset = pos;
+            entry.size = records[permutation[i]].length();
+            pos = align8(pos + entry.size);
+        }
+
+        stdio stream(path, "wb");
+        bool ok = fwrite(&header, sizeof(header), 1, stream) == 1;
+        if(count > 0)
+            ok = ok && fwrite(&index[0], sizeof(FstArchiveEntry), count, stream) == count;
+        static const char zeros[8] = {0};
+        int64_t written = sizeof(header) + count * sizeof(FstArchiveEntry);
+        for(int i = 0; ok && i < count; i++) {
+            bytearray &record = records[permutation[i]];
+            ok = fwrite(zeros, 1, index[i].offset - written, stream)
+                 == index[i].offset - written;
+            ok = ok && fwrite(record.data, 1, record.length(), stream)
+                       == record.length();
+            written = index[i].offset + record.length();
+        }
+        if(!ok || ferror(stream))
+            throwf("%s: error writing lattice archive", path);
+    }
+}
@@ -29,32 +29,56 @@
 
 namespace ocropus {    
     
+    /// The n best (highest value) ids seen since the last clear().
+    ///
+    /// The elements are kept in a heap with the worst one on top, and an
+    /// open-addressing hash table maps ids to heap positions, so finding
+    /// an id is O(1) and replacing an element is O(log n).
     class PriorityQueue {
         int n;
         int fill;
+        bool sorted;
         intarray ids;
         intarray tags;
         floatarray values;
+        intarray slots;     // hash slot of each heap element
+
+        // hash table from ids to heap positions
+        intarray hkeys;
+        intarray hpos;
+        intarray hstamps;   // a slot is in use iff hstamps[slot] == stamp
+        int stamp;
+        int hmask;
+        int hshift;
+
+        int hash(int id) {
+            return int((unsigned(id) * 2654435761u) >> hshift);
+        }
+        int hash_insert(int id, int pos);
+        void hash_erase(int slot);
+        void set(int pos, int id, int tag, float value, int slot);
+        void sift_up(int pos);
+        void sift_down(int pos, int size);
     public:
         /// constructor for a NBest data structure of size n
-        PriorityQueue(int n):n(n) {
-            ids.resize(n+1);
-            tags.resize(n+1);
-            values.resize(n+1);
-            clear();
+        PriorityQueue(int n):n(0) {
+            resize(n);
         }
 
+        /// change the size of the NBest data structure; this also clears it
+        void resize(int n);
+
         //void log(Logger &logger);
 
         /// remove all elements
         void clear();
 
-        void move_value(int id, int tag, float value, int start, int end);
-
-        /// Add the id with the corresponding value
+        /// Add the id with the corresponding value.
+        /// The id must not be in the queue yet (see add_replacing_id()).
         /// \returns True if the queue was changed
         bool add(int id, int tag, float value);
 
+        /// \returns the index of the id, or -1 if it's not in the queue
         int find_id(int id);
 
         /// This function will move the existing id up
@@ -62,7 +86,13 @@ namespace ocropus {
         /// \returns True if the queue was changed
         bool add_replacing_id(int id, int tag, float value);
 
-        /// get the value corresponding to rank i
+        /// Sort the elements by decreasing value, so that index i
+        /// corresponds to rank i. No elements can be added afterwards
+        /// until the next clear().
+        void sort();
+
+        /// get the value corresponding to index i
+        /// (the rank if sort() was called, heap order otherwise)
         float value(int i) {
             if(unsigned(i)>=unsigned(fill)) throw "range error";
             return values[i];
@@ -71,7 +101,7 @@ namespace ocropus {
             if(unsigned(i)>=unsigned(fill)) throw "range error";
             return tags[i];
         }
-        /// get the id corresponding to rank i
+        /// get the id corresponding to index i
         int operator[](int i) {
             if(unsigned(i)>=unsigned(fill)) throw "range error";
             return ids[i];
@@ -107,6 +137,9 @@ namespace ocropus {
         /// Create a heap storing node indices from 0 to n - 1.
         inline Heap(int n) : heapback(n) { fill(heapback, -1); }
 
+        /// Allow node indices up to n - 1 (for searches creating nodes lazily).
+        inline void grow(int n) { while(heapback.length() < n) heapback.push(-1); }
+
         inline int length() { return heap.length(); }
 
         /// Return the item with the least cost and remove it from the heap.
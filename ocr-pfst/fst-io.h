@@ -24,6 +24,7 @@
 #ifndef fst_io_h_
 #define fst_io_h_
 
+#include <stdint.h>
 #include "ocr-pfst.h"
 
 namespace ocropus {
@@ -35,6 +36,84 @@ namespace ocropus {
     void fst_read(IGenericFst &fst, FILE *stream);
     void fst_write(const char *path, IGenericFst &fst);
     void fst_read(IGenericFst &fst, const char *path);
+    // the same format in memory
+    void fst_write(bytearray &buffer, IGenericFst &fst);
+    void fst_read(IGenericFst &fst, const unsigned char *data, int64_t size);
+
+    // The compiled format is a dump of the frozen arrays of an OcroFST
+    // (native byte order, 8-byte aligned) that OcroFST::load() maps
+    // into memory instead of reading it. It also keeps the heuristics
+    // (flag HAS_HEURISTICS), so a loaded model is ready for searching.
+
+    enum {
+        COMPILED_FST_MAGIC = 0x5446434f, // "OCFT"
+        COMPILED_FST_VERSION = 1
+    };
+
+    struct CompiledFstHeader {
+        int32_t magic;
+        int32_t version;
+        int32_t flags;      // OcroFST flags that hold for the stored arcs
+        int32_t start;
+        int32_t nstates;
+        int32_t narcs;
+        // byte offsets of the arrays from the start of the file
+        int64_t accept_pos;
+        int64_t offsets_pos;
+        int64_t targets_pos;
+        int64_t inputs_pos;
+        int64_t outputs_pos;
+        int64_t costs_pos;
+        int64_t size;       // total file size
+        int64_t heuristics_pos; // 0 unless flags has HAS_HEURISTICS
+        int64_t reserved[3];
+    };
+
+    void fst_write_compiled(const char *path, OcroFST &fst);
+    bool fst_is_compiled(const char *path);
+
+    // A lattice archive keeps the FSTs of many lines (usually of one page)
+    // in a single file: a header, an index sorted by line id, and the
+    // FSTs in the OpenFST format, each starting at an 8-byte boundary.
+    // Readers map the file and decode only the lines they ask for.
+
+    enum {
+        FST_ARCHIVE_MAGIC = 0x4153464f, // "OFSA"
+        FST_ARCHIVE_VERSION = 1
+    };
+
+    struct FstArchiveHeader {
+        int32_t magic;
+        int32_t version;
+        int32_t count;      // number of index entries
+        int32_t reserved;
+    };
+
+    struct FstArchiveEntry {
+        int32_t line;
+        int32_t reserved;
+        int64_t offset;     // from the start of the file
+        int64_t size;
+    };
+
+    struct FstArchiveReader {
+        virtual ~FstArchiveReader() {}
+        virtual int length() = 0;
+        virtual int lineId(int i) = 0;
+        /// \returns the index of the line, or -1
+        virtual int find(int line) = 0;
+        /// Decode the FST of the i-th record.
+        virtual void read(IGenericFst &fst, int i) = 0;
+        /// Get the i-th record without decoding it.
+        virtual void record(bytearray &result, int i) = 0;
+    };
+
+    FstArchiveReader *make_FstArchiveReader(const char *path);
+
+    /// Write an archive of records made by fst_write(bytearray &, ...);
+    /// the records don't need to be sorted by line.
+    void fst_archive_write(const char *path, intarray &lines,
+                           objlist<bytearray> &records);
 
 }
 
@@ -0,0 +1,496 @@
+// Copyright 2009 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project: ocrofst
+// File: fst-optimize.cc
+// Purpose: epsilon removal, determinization and minimization
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
+
+#include "ocr-pfst.h"
+
+using namespace colib;
+using namespace ocropus;
+
+namespace {
+
+    // Costs are compared after rounding them to multiples of this,
+    // so that sums taken in a different order still match.
+    const double cost_quantum = 1.0 / 1024;
+
+    int quantize(double cost) {
+        if(cost >= 1e37)
+            return 0x7fffffff;
+        return int(floor(cost / cost_quantum + 0.5));
+    }
+
+    bool is_epsilon(FstArcs &arcs, int k) {
+        return arcs.inputs[k] == 0 && arcs.outputs[k] == 0;
+    }
+
+    /// Assigns consecutive ids to integer sequences.
+    class SequenceTable {
+        intarray data;
+        intarray offsets;   // sequence i is data[offsets[i]..offsets[i+1]-1]
+        intarray slots;     // open addressing, -1 for an empty slot
+
+        unsigned hash(intarray &key) {
+            unsigned h = 2166136261u;
+            for(int i = 0; i < key.length(); i++)
+                h = (h ^ unsigned(key[i])) * 16777619u;
+            return h;
+        }
+        bool equal(int id, intarray &key) {
+            int begin = offsets[id];
+            if(offsets[id + 1] - begin != key.length())
+                return false;
+            for(int i = 0; i < key.length(); i++)
+                if(data[begin + i] != key[i]) return false;
+            return true;
+        }
+        void rehash(int size) {
+            slots.resize(size);
+            fill(slots, -1);
+            for(int id = 0; id < length(); id++) {
+                intarray key;
+                get(key, id);
+                int slot = hash(key) & (size - 1);
+                while(slots[slot] != -1)
+                    slot = (slot + 1) & (size - 1);
+                slots[slot] = id;
+            }
+        }
+    public:
+        SequenceTable() {
+            offsets.push(0);
+            rehash(1024);
+        }
+        int length() {
+            return offsets.length() - 1;
+        }
+        void get(intarray &key, int id) {
+            int begin = offsets[id];
+            key.resize(offsets[id + 1] - begin);
+            for(int i = 0; i < key.length(); i++)
+                key[i] = data[begin + i];
+        }
+        /// \returns the id of the key, adding it if it's new
+        int find_or_add(intarray &key, bool &added) {
+            int mask = slots.length() - 1;
+            int slot = hash(key) & mask;
+            for(; slots[slot] != -1; slot = (slot + 1) & mask) {
+                if(equal(slots[slot], key)) {
+                    added = false;
+                    return slots[slot];
+                }
+            }
+            int id = length();
+            for(int i = 0; i < key.length(); i++)
+                data.push(key[i]);
+            offsets.push(data.length());
+            slots[slot] = id;
+            if(2 * length() > slots.length())
+                rehash(2 * slots.length());
+            added = true;
+            return id;
+        }
+    };
+
+    /// Sort a permutation by the given keys, the first key being
+    /// the most significant (merge sort, so equal keys keep their order).
+    void lex_sort(intarray &permutation, intarray **keys, int nkeys,
+                  int n) {
+        permutation.resize(n);
+        for(int i = 0; i < n; i++)
+            permutation[i] = i;
+        intarray temp(n);
+        for(int width = 1; width < n; width *= 2) {
+            for(int lo = 0; lo < n; lo += 2 * width) {
+                int mid = min(lo + width, n), hi = min(lo + 2 * width, n);
+                int i = lo, j = mid, k = lo;
+                while(i < mid && j < hi) {
+                    int a = permutation[i], b = permutation[j];
+                    int order = 0;
+                    for(int key = 0; key < nkeys && !order; key++) {
+                        intarray &v = *keys[key];
+                        order = v[a] < v[b] ? -1 : v[a] > v[b] ? 1 : 0;
+                    }
+                    temp[k++] = order <= 0 ? permutation[i++] : permutation[j++];
+                }
+                while(i < mid) temp[k++] = permutation[i++];
+                while(j < hi) temp[k++] = permutation[j++];
+            }
+            move(permutation, temp);
+            temp.resize(n);
+        }
+    }
+
+    /// Copy the states of src that are on some accepted path from the
+    /// start; the others can't change the result of any search.
+    void trim(OcroFST &dst, OcroFST &src) {
+        int n = src.nStates();
+        src.calculateHeuristics();
+        floatarray &h = src.heuristics();
+        intarray renumber(n);
+        fill(renumber, -1);
+        intarray stack;
+        dst.clear();
+        int start = src.getStart();
+        if(n == 0 || h[start] >= 1e37) {
+            dst.setStart(dst.newState());
+            return;
+        }
+        renumber[start] = dst.newState();
+        stack.push(start);
+        FstArcs arcs;
+        while(stack.length()) {
+            int s = stack.pop();
+            src.arcSpan(arcs, s);
+            for(int k = 0; k < arcs.length; k++) {
+                int t = arcs.targets[k];
+                if(h[t] >= 1e37 || renumber[t] >= 0) continue;
+                renumber[t] = dst.newState();
+                stack.push(t);
+            }
+        }
+        for(int s = 0; s < n; s++) {
+            if(renumber[s] < 0) continue;
+            src.arcSpan(arcs, s);
+            for(int k = 0; k < arcs.length; k++) {
+                int t = renumber[arcs.targets[k]];
+                if(t < 0) continue;
+                dst.addTransition(renumber[s], t, arcs.outputs[k],
+                                  arcs.costs[k], arcs.inputs[k]);
+            }
+            float accept = src.getAcceptCost(s);
+            if(accept < 1e37)
+                dst.setAccept(renumber[s], accept);
+        }
+        dst.setStart(renumber[start]);
+    }
+}
+
+namespace ocropus {
+
+    void fst_remove_epsilons(OcroFST &dst, OcroFST &src) {
+        int n = src.nStates();
+        autodel<OcroFST> result(make_OcroFST());
+        for(int s = 0; s < n; s++)
+            result->newState();
+        if(n > 0)
+            result->setStart(src.getStart());
+
+        // epsilon closure of each state, with the cost of the best
+        // epsilon path to every state in it (label-correcting search,
+        // so negative epsilon costs are fine as long as there is no
+        // negative cycle)
+        floatarray dist(n);
+        fill(dist, INFINITY);
+        bytearray queued(n);
+        fill(queued, 0);
+        intarray closure, queue;
+        FstArcs arcs;
+        for(int q = 0; q < n; q++) {
+            closure.clear();
+            queue.clear();
+            dist[q] = 0;
+            closure.push(q);
+            queue.push(q);
+            queued[q] = 1;
+            for(int i = 0; i < queue.length(); i++) {
+                int p = queue[i];
+                queued[p] = 0;
+                src.arcSpan(arcs, p);
+                for(int k = 0; k < arcs.length; k++) {
+                    if(!is_epsilon(arcs, k)) continue;
+                    int t = arcs.targets[k];
+                    float d = dist[p] + arcs.costs[k];
+                    if(d >= dist[t]) continue;
+                    if(dist[t] == INFINITY)
+                        closure.push(t);
+                    dist[t] = d;
+                    if(!queued[t]) {
+                        queued[t] = 1;
+                        queue.push(t);
+                    }
+                }
+                if(queue.length() > 100 * n + 100)
+                    throw "fst_remove_epsilons: negative epsilon cycle";
+            }
+            float accept = INFINITY;
+            for(int i = 0; i < closure.length(); i++) {
+                int p = closure[i];
+                accept = min(accept, dist[p] + src.getAcceptCost(p));
+                src.arcSpan(arcs, p);
+                for(int k = 0; k < arcs.length; k++) {
+                    if(is_epsilon(arcs, k)) continue;
+                    result->addTransition(q, arcs.targets[k], arcs.outputs[k],
+                                          dist[p] + arcs.costs[k],
+                                          arcs.inputs[k]);
+                }
+            }
+            if(accept < 1e37)
+                result->setAccept(q, accept);
+            for(int i = 0; i < closure.length(); i++)
+                dist[closure[i]] = INFINITY;
+        }
+        trim(dst, *result);
+    }
+
+    void fst_determinize(OcroFST &dst, OcroFST &src, int max_states) {
+        int n = src.nStates();
+        FstArcs arcs;
+        for(int s = 0; s < n; s++) {
+            src.arcSpan(arcs, s);
+            for(int k = 0; k < arcs.length; k++)
+                if(is_epsilon(arcs, k))
+                    throw "fst_determinize: remove epsilons first";
+        }
+
+        // A state of the result is a set of states of src, each with
+        // the cost that is still owed on top of the arcs leading to it.
+        // The table keys are (state, quantized residual) pairs sorted by
+        // state; the exact residuals are kept in the same layout.
+        SequenceTable subsets;
+        floatarray residuals;
+        intarray subset_offsets;
+        subset_offsets.push(0);
+        dst.clear();
+        if(n == 0) {
+            dst.setStart(dst.newState());
+            return;
+        }
+
+        intarray key;
+        key.push(src.getStart());
+        key.push(quantize(0));
+        bool added;
+        subsets.find_or_add(key, added);
+        residuals.push(0);
+        subset_offsets.push(1);
+        dst.setStart(dst.newState());
+
+        intarray inputs, outputs, targets, permutation, tperm;
+        floatarray costs;
+        intarray group_targets;
+        floatarray group_costs;
+        intarray *label_keys[2] = {&inputs, &outputs};
+        intarray *target_keys[1] = {&group_targets};
+        for(int current = 0; current < subsets.length(); current++) {
+            intarray members;
+            subsets.get(members, current);
+            int begin = subset_offsets[current];
+            int m = members.length() / 2;
+
+            // gather the arcs of all members
+            inputs.clear();
+            outputs.clear();
+            targets.clear();
+            costs.clear();
+            float accept = INFINITY;
+            for(int i = 0; i < m; i++) {
+                int s = members[2 * i];
+                float r = residuals[begin + i];
+                accept = min(accept, r + src.getAcceptCost(s));
+                src.arcSpan(arcs, s);
+                for(int k = 0; k < arcs.length; k++) {
+                    inputs.push(arcs.inputs[k]);
+                    outputs.push(arcs.outputs[k]);
+                    targets.push(arcs.targets[k]);
+                    costs.push(r + arcs.costs[k]);
+                }
+            }
+            if(accept < 1e37)
+                dst.setAccept(current, accept);
+
+            // one arc of the result for each label pair
+            lex_sort(permutation, label_keys, 2, inputs.length());
+            for(int i = 0; i < permutation.length(); ) {
+                int first = permutation[i];
+                int j = i;
+                float best = INFINITY;
+                group_targets.clear();
+                group_costs.clear();
+                for(; j < permutation.length(); j++) {
+                    int k = permutation[j];
+                    if(inputs[k] != inputs[first] || outputs[k] != outputs[first])
+                        break;
+                    best = min(best, costs[k]);
+                    group_targets.push(targets[k]);
+                    group_costs.push(costs[k]);
+                }
+                lex_sort(tperm, target_keys, 1, group_targets.length());
+                key.clear();
+                floatarray next_residuals;
+                for(int g = 0; g < tperm.length(); g++) {
+                    int t = group_targets[tperm[g]];
+                    float r = group_costs[tperm[g]] - best;
+                    if(key.length() && key[key.length() - 2] == t) {
+                        r = min(r, next_residuals.last());
+                        next_residuals.last() = r;
+                        key.last() = quantize(r);
+                        continue;
+                    }
+                    key.push(t);
+                    key.push(quantize(r));
+                    next_residuals.push(r);
+                }
+                int target = subsets.find_or_add(key, added);
+                if(added) {
+                    if(target >= max_states)
+                        throw "fst_determinize: too many states "
+                              "(the FST may not be determinizable)";
+                    for(int g = 0; g < next_residuals.length(); g++)
+                        residuals.push(next_residuals[g]);
+                    subset_offsets.push(residuals.length());
+                    dst.newState();
+                }
+                dst.addTransition(current, target, outputs[first], best,
+                                  inputs[first]);
+                i = j;
+            }
+        }
+    }
+
+    void fst_minimize(OcroFST &dst, OcroFST &src) {
+        autodel<OcroFST> fst(make_OcroFST());
+        trim(*fst, src);
+        int n = fst->nStates();
+
+        // Push the costs towards the start: afterwards, the cheapest
+        // way to accept from any state costs 0, so equivalent states
+        // have equal arcs and accept costs.
+        floatarray h;
+        fst->calculateHeuristics();
+        copy(h, fst->heuristics());
+        floatarray accept(n);
+        for(int s = 0; s < n; s++)
+            accept[s] = fst->getAcceptCost(s) - h[s];
+        fst->freeze();
+        int *offsets = fst->arcOffsets();
+        int *targets = fst->arcTargets();
+        int *inputs = fst->arcInputs();
+        int *outputs = fst->arcOutputs();
+        float *costs = fst->arcCosts();
+        for(int s = 0; s < n; s++)
+            for(int k = offsets[s]; k < offsets[s + 1]; k++)
+                costs[k] += h[targets[k]] - h[s];
+
+        // Refine the partition of the states until the signatures
+        // (accept cost and arcs to classes) don't split it any further.
+        intarray classes(n);
+        fill(classes, 0);
+        int nclasses = 1;
+        intarray a_in, a_out, a_cost, a_class, permutation, key;
+        intarray *keys[4] = {&a_in, &a_out, &a_cost, &a_class};
+        for(;;) {
+            SequenceTable signatures;
+            intarray next(n);
+            for(int s = 0; s < n; s++) {
+                a_in.clear();
+                a_out.clear();
+                a_cost.clear();
+                a_class.clear();
+                for(int k = offsets[s]; k < offsets[s + 1]; k++) {
+                    a_in.push(inputs[k]);
+                    a_out.push(outputs[k]);
+                    a_cost.push(quantize(costs[k]));
+                    a_class.push(classes[targets[k]]);
+                }
+                lex_sort(permutation, keys, 4, a_in.length());
+                key.clear();
+                key.push(classes[s]);
+                key.push(quantize(accept[s]));
+                for(int i = 0; i < permutation.length(); i++) {
+                    int k = permutation[i];
+                    key.push(a_in[k]);
+                    key.push(a_out[k]);
+                    key.push(a_cost[k]);
+                    key.push(a_class[k]);
+                }
+                bool added;
+                next[s] = signatures.find_or_add(key, added);
+            }
+            move(classes, next);
+            if(signatures.length() == nclasses)
+                break;
+            nclasses = signatures.length();
+        }
+
+        // one state per class, built from its first member
+        dst.clear();
+        for(int c = 0; c < nclasses; c++)
+            dst.newState();
+        intarray done(nclasses);
+        fill(done, 0);
+        for(int s = 0; s < n; s++) {
+            int c = classes[s];
+            if(done[c]) continue;
+            done[c] = 1;
+            for(int k = offsets[s]; k < offsets[s + 1]; k++)
+                dst.addTransition(c, classes[targets[k]], outputs[k],
+                                  costs[k], inputs[k]);
+            if(accept[s] < 1e37)
+                dst.setAccept(c, accept[s]);
+        }
+
+        // The pushed-out cost h[start] goes onto the arcs leaving the
+        // start; if the start can be reentered, it needs its own copy.
+        int start = classes[fst->getStart()];
+        float initial = h[fst->getStart()];
+        if(initial != 0) {
+            bool reentered = false;
+            for(int s = 0; s < n && !reentered; s++)
+                for(int k = offsets[s]; k < offsets[s + 1]; k++)
+                    if(classes[targets[k]] == start) reentered = true;
+            int s0 = start;
+            if(reentered) {
+                s0 = dst.newState();
+                intarray t, in, out;
+                floatarray c;
+                dst.arcs(in, t, out, c, start);
+                for(int k = 0; k < t.length(); k++)
+                    dst.addTransition(s0, t[k], out[k], c[k], in[k]);
+                float a = dst.getAcceptCost(start);
+                if(a < 1e37)
+                    dst.setAccept(s0, a);
+            }
+            floatarray &c0 = dst.costs(s0);
+            for(int k = 0; k < c0.length(); k++)
+                c0[k] += initial;
+            float a = dst.getAcceptCost(s0);
+            if(a < 1e37)
+                dst.setAccept(s0, a + initial);
+            start = s0;
+        }
+        dst.setStart(start);
+    }
+
+    void fst_optimize(OcroFST &dst, OcroFST &src, bool determinize,
+                      bool minimize, int max_states) {
+        autodel<OcroFST> temp(make_OcroFST());
+        fst_remove_epsilons(dst, src);
+        if(determinize) {
+            fst_determinize(*temp, dst, max_states);
+            fst_copy(dst, *temp);
+        }
+        if(minimize) {
+            fst_minimize(*temp, dst);
+            fst_copy(dst, *temp);
+        }
+    }
+}
@@ -29,17 +29,19 @@ using namespace colib;
 using namespace ocropus;
 
 namespace {
-    /// FIXME/mezhirov presort -- ???
     struct CompositionFstImpl : CompositionFst {
-        autodel<IGenericFst> l1, l2;
+        autodel<OcroFST> l1, l2;
         int override_start;
         int override_finish;
+        CompositionArcs buffer;
         virtual const char *description() {return "CompositionLattice";}
-        CompositionFstImpl(IGenericFst *l1, IGenericFst *l2,
+        CompositionFstImpl(OcroFST *l1, OcroFST *l2,
                                int o_s, int o_f) :
             override_start(o_s), override_finish(o_f) {
             CHECK_ARG(l1->nStates() > 0);
             CHECK_ARG(l2->nStates() > 0);
+            l1->sortByOutput();
+            l2->sortByInput();
 
             // this should be here, not in the initializers.
             // (otherwise if CHECKs throw an exception, bad things happen)
@@ -108,57 +110,12 @@ namespace {
                           int node) {
             int n1 = node / l2->nStates();
             int n2 = node % l2->nStates();
-            intarray ids1, ids2;
-            intarray t1, t2;
-            intarray o1, o2;
-            floatarray c1, c2;
-            l1->arcs(ids1, t1, o1, c1, n1);
-            l2->arcs(ids2, t2, o2, c2, n2);
-
-            // sort & permute
-            intarray p1, p2;
-
-            quicksort(p1, o1);
-            permute(ids1, p1);
-            permute(t1, p1);
-            permute(o1, p1);
-            permute(c1, p1);
-
-            quicksort(p2, ids2);
-            permute(ids2, p2);
-            permute(t2, p2);
-            permute(o2, p2);
-            permute(c2, p2);
-
-            int k1, k2;
-            // l1 epsilon moves
-            for(k1 = 0; k1 < o1.length() && !o1[k1]; k1++) {
-                ids.push(ids1[k1]);
-                targets.push(combine(t1[k1], n2));
-                outputs.push(0);
-                costs.push(c1[k1]);
-            }
-            // l2 epsilon moves
-            for(k2 = 0; k2 < o2.length() && !ids2[k2]; k2++) {
-                ids.push(0);
-                targets.push(combine(n1, t2[k2]));
-                outputs.push(o2[k2]);
-                costs.push(c2[k2]);
-            }
-            // non-epsilon moves
-            while(k1 < o1.length() && k2 < ids2.length()) {
-                while(k1 < o1.length() && o1[k1] < ids2[k2]) k1++;
-                if(k1 >= o1.length()) break;
-                while(k2 < ids2.length() && o1[k1] > ids2[k2]) k2++;
-                while(k1 < o1.length() && k2 < ids2.length() && o1[k1] == ids2[k2]){
-                    for(int j = k2; j < ids2.length() && o1[k1] == ids2[j]; j++) {
-                        ids.push(ids1[k1]);
-                        targets.push(combine(t1[k1], t2[j]));
-                        outputs.push(o2[j]);
-                        costs.push(c1[k1] + c2[j]);
-                    }
-                    k1++;
-                }
+            buffer.get(*l1, *l2, n1, n2);
+            for(int i = 0; i < buffer.length(); i++) {
+                ids.push(buffer.inputs[i]);
+                targets.push(combine(buffer.targets1[i], buffer.targets2[i]));
+                outputs.push(buffer.outputs[i]);
+                costs.push(buffer.costs[i]);
             }
         }
 
@@ -177,6 +134,83 @@ namespace ocropus {
                                       override_start, override_finish);
     }
 
+    static inline int special_label(int label, bool specials) {
+        if(specials && label > 0 && label <= 4)
+            return -label;
+        return label;
+    }
+
+    void CompositionArcs::get(OcroFST &fst1, OcroFST &fst2,
+                              int state1, int state2,
+                              float scale2, bool specials2) {
+        CHECK_ARG(fst1.hasFlag(OcroFST::SORTED_BY_OUTPUT));
+        CHECK_ARG(fst2.hasFlag(OcroFST::SORTED_BY_INPUT));
+        FstArcs a1, a2;
+        fst1.arcSpan(a1, state1);
+        fst2.arcSpan(a2, state2);
+        inputs.clear();
+        targets1.clear();
+        targets2.clear();
+        outputs.clear();
+        costs.clear();
+
+        // fst1 epsilon moves
+        for(int i = 0; i < a1.length; i++) {
+            if(a1.outputs[i]) continue;
+            inputs.push(a1.inputs[i]);
+            targets1.push(a1.targets[i]);
+            targets2.push(state2);
+            outputs.push(0);
+            costs.push(a1.costs[i]);
+        }
+        // fst2 epsilon moves
+        for(int j = 0; j < a2.length; j++) {
+            if(a2.inputs[j]) continue;
+            inputs.push(0);
+            targets1.push(state1);
+            targets2.push(a2.targets[j]);
+            outputs.push(special_label(a2.outputs[j], specials2));
+            costs.push(scale2 * a2.costs[j]);
+        }
+        // non-epsilon moves
+        int i = 0, j = 0;
+        while(i < a1.length && j < a2.length) {
+            int label = a1.outputs[i];
+            if(label < a2.inputs[j]) {
+                i++;
+            } else if(label > a2.inputs[j]) {
+                j++;
+            } else {
+                int end = j;
+                while(end < a2.length && a2.inputs[end] == label) end++;
+                bool special = special_label(label, specials2) != label;
+                for(; i < a1.length && a1.outputs[i] == label; i++) {
+                    if(!label || special) continue;
+                    for(int k = j; k < end; k++) {
+                        inputs.push(a1.inputs[i]);
+                        targets1.push(a1.targets[i]);
+                        targets2.push(a2.targets[k]);
+                        outputs.push(special_label(a2.outputs[k], specials2));
+                        costs.push(a1.costs[i] + scale2 * a2.costs[k]);
+                    }
+                }
+                j = end;
+            }
+        }
+    }
+
+    bool same_outputs(intarray &a, intarray &b) {
+        int i = 0, j = 0;
+        for(;;) {
+            while(i < a.length() && !a[i]) i++;
+            while(j < b.length() && !b[j]) j++;
+            if(i == a.length() || j == b.length())
+                return i == a.length() && j == b.length();
+            if(a[i++] != b[j++])
+                return false;
+        }
+    }
+
     void rescore_path(IGenericFst &fst,
                       colib::intarray &inputs,
                       colib::intarray &vertices,
@@ -210,16 +244,13 @@ namespace ocropus {
         for(int i = 0; i < n; i++)
             dst.newState();
         dst.setStart(src.getStart());
+        ArcReader reader(src);
         for(int i = 0; i < n; i++) {
             dst.setAccept(i, src.getAcceptCost(i));
-            intarray targets, outputs, inputs;
-            floatarray costs;
-            src.arcs(inputs, targets, outputs, costs, i);
-            ASSERT(inputs.length() == targets.length());
-            ASSERT(inputs.length() == outputs.length());
-            ASSERT(inputs.length() == costs.length());
-            for(int j = 0; j < inputs.length(); j++)
-                dst.addTransition(i, targets[j], outputs[j], costs[j], inputs[j]);
+            FstArcs a;
+            reader.get(a, i);
+            for(int j = 0; j < a.length; j++)
+                dst.addTransition(i, a.targets[j], a.outputs[j], a.costs[j], a.inputs[j]);
         }
     }
 
@@ -231,16 +262,13 @@ namespace ocropus {
         if(!no_accept)
             dst.setAccept(src.getStart());
         dst.setStart(n);
+        ArcReader reader(src);
         for(int i = 0; i < n; i++) {
             dst.addTransition(n, i, 0, src.getAcceptCost(i), 0);
-            intarray targets, outputs, inputs;
-            floatarray costs;
-            src.arcs(inputs, targets, outputs, costs, i);
-            ASSERT(inputs.length() == targets.length());
-            ASSERT(inputs.length() == outputs.length());
-            ASSERT(inputs.length() == costs.length());
-            for(int j = 0; j < inputs.length(); j++)
-                dst.addTransition(targets[j], i, outputs[j], costs[j], inputs[j]);
+            FstArcs a;
+            reader.get(a, i);
+            for(int j = 0; j < a.length; j++)
+                dst.addTransition(a.targets[j], i, a.outputs[j], a.costs[j], a.inputs[j]);
         }
     }
 
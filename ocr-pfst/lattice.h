@@ -73,6 +73,68 @@ namespace ocropus {
                                         int override_finish = -1);
 
 
+    /// \brief Arc access for algorithms working on any IGenericFst.
+    ///
+    /// For an OcroFST, the arcs are not copied at all. Other FSTs copy
+    /// them into buffers that are reused between calls, so the result
+    /// is only valid until the next call of get().
+    struct ArcReader {
+        IGenericFst &fst;
+        OcroFST *ocrofst;
+        intarray inputs;
+        intarray targets;
+        intarray outputs;
+        floatarray costs;
+
+        ArcReader(IGenericFst &fst) : fst(fst),
+            ocrofst(dynamic_cast<OcroFST *>(&fst)) {
+        }
+
+        void get(FstArcs &result, int from) {
+            if(ocrofst) {
+                ocrofst->arcSpan(result, from);
+                return;
+            }
+            inputs.clear();
+            targets.clear();
+            outputs.clear();
+            costs.clear();
+            fst.arcs(inputs, targets, outputs, costs, from);
+            result.length = targets.length();
+            result.inputs = inputs.data;
+            result.targets = targets.data;
+            result.outputs = outputs.data;
+            result.costs = costs.data;
+        }
+    };
+
+    /// \brief The arcs leaving a state pair of the composition of 2 FSTs.
+    ///
+    /// The first FST must be sorted by output, the second by input;
+    /// matching labels are then found by merging the two arc lists.
+    /// An arc with output 0 in the first FST moves only the first FST,
+    /// an arc with input 0 in the second FST moves only the second.
+    /// The costs of the second FST are multiplied by scale2; with
+    /// specials2, its labels 1..4 are the specials -1..-4 (see
+    /// beam_search()), which are never matched.
+    /// The buffers are reused between calls of get().
+    struct CompositionArcs {
+        intarray inputs;
+        intarray targets1;
+        intarray targets2;
+        intarray outputs;
+        floatarray costs;
+
+        int length() {
+            return targets1.length();
+        }
+        void get(OcroFST &fst1, OcroFST &fst2, int state1, int state2,
+                 float scale2=1.0, bool specials2=false);
+    };
+
+    /// Check whether two label sequences are equal after removing epsilons.
+    bool same_outputs(intarray &a, intarray &b);
+
     /// Reverse the FST's arcs, adding a new start vertex (former accept).
     /// @param no_accept
     void fst_copy_reverse(IGenericFst &dst, IGenericFst &src,
@@ -39,6 +39,18 @@ namespace ocropus {
         L_EPSILON = 0,
     };
 
+    /// \brief A view of the arcs leaving one state of an OcroFST.
+    ///
+    /// The pointers go directly into the FST's storage and stay valid
+    /// until the FST is modified.
+    struct FstArcs {
+        int length;
+        int *inputs;
+        int *targets;
+        int *outputs;
+        float *costs;
+    };
+
     struct OcroFST : IGenericFst {
         virtual intarray &targets(int vertex) = 0;
         virtual intarray &inputs(int vertex) = 0;
@@ -58,7 +70,57 @@ namespace ocropus {
 
         virtual void sortByInput() = 0;
         virtual void sortByOutput() = 0;
+        /// \brief Compute heuristics() unless they are still valid.
+        ///
+        /// The heuristic of a state is the cost of the best path from it
+        /// to an accept state. It is kept until the FST is modified, so
+        /// a loaded language model pays for it once. Call this before
+        /// sharing the FST between threads.
         virtual void calculateHeuristics() = 0;
+
+        /// \brief Pack all arcs into contiguous arrays.
+        ///
+        /// In the frozen form, the arcs leaving state i occupy the range
+        /// [arcOffsets()[i], arcOffsets()[i+1]) of arcTargets(), arcInputs(),
+        /// arcOutputs() and arcCosts(). Adding transitions or asking for
+        /// the per-state arrays (targets() etc.) unpacks the FST again.
+        virtual void freeze() = 0;
+        virtual bool isFrozen() = 0;
+
+        /// \brief Clear the FST and allocate the frozen form for the
+        ///        given number of states and arcs.
+        ///
+        /// The caller fills arcOffsets() (nstates + 1 entries) and the arc
+        /// arrays; all accept costs are INFINITY. This is for readers that
+        /// know the size of the FST in advance.
+        virtual void allocate(int nstates, int narcs) = 0;
+
+        // Access to the frozen form; these freeze the FST if necessary.
+        virtual int nArcs() = 0;
+        virtual int *arcOffsets() = 0;
+        virtual int *arcTargets() = 0;
+        virtual int *arcInputs() = 0;
+        virtual int *arcOutputs() = 0;
+        virtual float *arcCosts() = 0;
+
+        /// Get the arcs leaving the given state without copying them.
+        /// (Freezes the FST if necessary.)
+        virtual void arcSpan(FstArcs &result, int from) = 0;
+
+        /// \brief A number that changes whenever the frozen arrays are
+        ///        replaced or their arcs reordered.
+        ///
+        /// No two FSTs share a generation, so data derived from the
+        /// frozen arrays can be cached under it. Writing into the arrays
+        /// returned by arcInputs() etc. does not change it; call
+        /// arcsModified() afterwards.
+        virtual int generation() = 0;
+
+        /// \brief Declare that the arcs were changed in place.
+        ///
+        /// Clears the flags (the sort order and the heuristics may no
+        /// longer hold) and gives the arcs a new generation().
+        virtual void arcsModified() = 0;
     };
 
     OcroFST *make_OcroFST();
@@ -82,6 +144,36 @@ namespace ocropus {
     /// That causes expansion (storing all arcs explicitly).
     void fst_expand_composition(IGenericFst &out, OcroFST &, OcroFST &);
 
+    /// \brief Remove the arcs with both input and output epsilon.
+    ///
+    /// Every state gets the arcs and accept cost of the states it reaches
+    /// by epsilon arcs; states that are then unreachable are dropped.
+    /// There must be no epsilon cycle of negative cost.
+    /// dst and src must be different FSTs.
+    void fst_remove_epsilons(OcroFST &dst, OcroFST &src);
+
+    /// \brief Weighted determinization (min/+ costs).
+    ///
+    /// An (input, output) pair is treated as one label, so the result has
+    /// at most one arc per label pair leaving each state; the cost of
+    /// every path is kept. Specials (RHO etc.) are ordinary labels here.
+    /// src must be free of epsilons (see fst_remove_epsilons()).
+    /// Throws if more than max_states states are needed, which is what
+    /// happens for FSTs that cannot be determinized.
+    void fst_determinize(OcroFST &dst, OcroFST &src, int max_states=10000000);
+
+    /// \brief Merge equivalent states.
+    ///
+    /// Costs are pushed towards the start first, so states accepting
+    /// the same label pair sequences at the same costs get merged.
+    /// The result is minimal if src is deterministic (see
+    /// fst_determinize()); otherwise it is merely smaller.
+    void fst_minimize(OcroFST &dst, OcroFST &src);
+
+    /// Remove epsilons, then optionally determinize and minimize.
+    void fst_optimize(OcroFST &dst, OcroFST &src, bool determinize=true,
+                      bool minimize=true, int max_states=10000000);
+
 
     /// Randomly sample an FST, assuming any input.
     ///
@@ -118,6 +210,28 @@ namespace ocropus {
     /// \returns total cost
     double a_star(ustrg &result, OcroFST &fst);
 
+    /// \brief Find the n best paths through the FST, best first.
+    ///
+    /// Partial paths are extended best first, with the cost to accept
+    /// (OcroFST::heuristics()) as an exact heuristic. Every path is
+    /// found by extending a prefix of an earlier one, so the search is
+    /// never restarted and a path costs about its length in heap
+    /// operations beyond the first.
+    ///
+    /// Each path is reported like a_star() does it, with the accept
+    /// cost as the last element of its costs.
+    ///
+    /// \param unique_outputs  skip paths whose output (without
+    ///                         epsilons) equals that of a better one
+    /// \returns the number of paths found (at most n)
+    int nbest_paths(objlist<intarray> &inputs,
+                    objlist<intarray> &vertices,
+                    objlist<intarray> &outputs,
+                    objlist<floatarray> &costs,
+                    OcroFST &fst,
+                    int n,
+                    bool unique_outputs=true);
+
     /// \brief Simplified interface for a_star_in_composition().
     ///
     /// \param[out] result      FST output with epsilons removed,
@@ -135,15 +249,25 @@ namespace ocropus {
     /// but returns 2 arrays of vertices.
     ///
     /// This function uses A* on reversed FSTs separately,
-    /// then uses the cost sum as a heuristic.
-    /// No attempt to cache the heuristic is made.
+    /// then uses the cost sum as a heuristic. The heuristics are cached
+    /// in the FSTs (see OcroFST::calculateHeuristics()).
+    ///
+    /// The composition is never expanded: state pairs are created as the
+    /// search reaches them, so the cost depends on the part of the
+    /// composition explored, not on its size. fst1 is sorted by output
+    /// and fst2 by input, as for beam_search().
+    ///
+    /// scale2 and specials2 are applied to fst2 while searching, as in
+    /// beam_search(). The heuristic of fst2 is scaled with its costs.
     bool a_star_in_composition(intarray &inputs,
                                intarray &vertices1,
                                intarray &vertices2,
                                intarray &outputs,
                                floatarray &costs,
                                OcroFST &fst1,
-                               OcroFST &fst2);
+                               OcroFST &fst2,
+                               float scale2=1.0,
+                               bool specials2=false);
 
     bool a_star_in_composition(intarray &inputs,
                                intarray &vertices1,
@@ -153,7 +277,9 @@ namespace ocropus {
                                OcroFST &fst1,
                                floatarray &g1,
                                OcroFST &fst2,
-                               floatarray &g2);
+                               floatarray &g2,
+                               float scale2=1.0,
+                               bool specials2=false);
 
 
     // TODO/mezhirov document return value
@@ -176,6 +302,15 @@ namespace ocropus {
                                OcroFST &fst3);
     */
 
+    /// \brief Search for the best path through the composition of 2 FSTs
+    ///        using beam search.
+    ///
+    /// All costs of fst2 are multiplied by scale2 during the search
+    /// (like scale_fst() would do). With specials2, the labels 1..4 of
+    /// fst2 are read as the specials -1..-4 (like make_specials_neg()
+    /// would do on both sides). Both are applied while searching, so a
+    /// language model can be shared between searches with different
+    /// settings without being modified.
     void beam_search(intarray &vertices1,
                      intarray &vertices2,
                      intarray &inputs,
@@ -183,10 +318,83 @@ namespace ocropus {
                      floatarray &costs,
                      OcroFST &fst1,
                      OcroFST &fst2,
-                     int beam_width=1000);
+                     int beam_width=1000,
+                     float scale2=1.0,
+                     bool specials2=false);
 
     double beam_search(ustrg &result, OcroFST &fst1, OcroFST &fst2,
-                       int beam_width=1000);
+                       int beam_width=1000, float scale2=1.0,
+                       bool specials2=false);
+
+    /// \brief Buffers of beam_search() that can be kept between searches.
+    ///
+    /// A context keeps its search tree and beam arrays allocated, so
+    /// a caller recognizing many lines (one context per thread) does not
+    /// allocate in beam_search() once the buffers have grown.
+    struct BeamSearchContext {
+        /// How the arcs of a state pair are matched: by a linear merge
+        /// of both sorted arc lists, by galloping through the arcs of
+        /// fst2 (when it has many more arcs), or by a label index that
+        /// is built for the states of fst2 with many arcs. MATCH_AUTO
+        /// picks one for each state pair.
+        enum {
+            MATCH_AUTO,
+            MATCH_MERGE,
+            MATCH_GALLOP,
+            MATCH_INDEX
+        };
+        virtual ~BeamSearchContext() {}
+
+        /// Use the given matcher for all state pairs (for benchmarks);
+        /// MATCH_INDEX falls back to MATCH_MERGE for states without index.
+        virtual void setMatcher(int matcher) = 0;
+
+        /// How many state pairs each matcher has handled so far.
+        virtual void getMatchCounts(intarray &counts) = 0;
+    };
+
+    /// With threads > 1, the arcs leaving each beam generation are
+    /// collected on that many threads (if the beam is large enough);
+    /// the result is the same as with one thread.
+    BeamSearchContext *make_BeamSearchContext(int threads=1);
+
+    /// \brief The n best paths through the composition of 2 FSTs,
+    ///        using beam search.
+    ///
+    /// Every path of the beam that can be accepted is a candidate,
+    /// so all n paths come from a single search. Like the best path,
+    /// the alternatives are limited to what survives in the beam: of two
+    /// paths reaching the same pair of states, only the better one is
+    /// kept.
+    ///
+    /// \param unique_outputs  skip paths whose output (without
+    ///                         epsilons) equals that of a better one
+    /// \returns the number of paths found (at most n)
+    int beam_search_nbest(BeamSearchContext &context,
+                          objlist<intarray> &vertices1,
+                          objlist<intarray> &vertices2,
+                          objlist<intarray> &inputs,
+                          objlist<intarray> &outputs,
+                          objlist<floatarray> &costs,
+                          OcroFST &fst1,
+                          OcroFST &fst2,
+                          int n,
+                          int beam_width=1000,
+                          float scale2=1.0,
+                          bool specials2=false,
+                          bool unique_outputs=true);
+
+    void beam_search(BeamSearchContext &context,
+                     intarray &vertices1,
+                     intarray &vertices2,
+                     intarray &inputs,
+                     intarray &outputs,
+                     floatarray &costs,
+                     OcroFST &fst1,
+                     OcroFST &fst2,
+                     int beam_width=1000,
+                     float scale2=1.0,
+                     bool specials2=false);
 
     void scale_fst(OcroFST &fst,float scale);
     void make_specials_neg(OcroFST &fst,bool input,bool output);
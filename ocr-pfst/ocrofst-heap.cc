@@ -31,8 +31,32 @@ namespace {
 }
 
 namespace ocropus {
+    void PriorityQueue::resize(int n) {
+        this->n = n;
+        ids.resize(n+1);
+        tags.resize(n+1);
+        values.resize(n+1);
+        slots.resize(n+1);
+        // keep the hash table at most half full
+        int bits = 4;
+        while((1 << bits) < 2 * (n + 1))
+            bits++;
+        int size = 1 << bits;
+        hkeys.resize(size);
+        hpos.resize(size);
+        hstamps.resize(size);
+        for(int i = 0; i < size; i++)
+            hstamps[i] = 0;
+        hmask = size - 1;
+        hshift = 32 - bits;
+        stamp = 0;
+        clear();
+    }
+
     void PriorityQueue::clear() {
         fill = 0;
+        sorted = false;
+        stamp++;    // invalidates all hash slots at once
     }
 
     /*void PriorityQueue::log(Logger &logger) {
@@ -41,42 +65,93 @@ namespace ocropus {
         logger("values", values);
     }*/
 
-    void PriorityQueue::move_value(int id, int tag, float value, int start, int end) {
-        int i = start;
-        while(i>end) {
-            if(values[i-1]>=value) break;
-            values[i] = values[i-1];
-            tags[i] = tags[i-1];
-            ids[i] = ids[i-1];
-            i--;
+    int PriorityQueue::hash_insert(int id, int pos) {
+        int slot = hash(id);
+        while(hstamps[slot] == stamp)
+            slot = (slot + 1) & hmask;
+        hkeys[slot] = id;
+        hpos[slot] = pos;
+        hstamps[slot] = stamp;
+        return slot;
+    }
+
+    // Linear probing deletion: move later entries of the same cluster
+    // back into the hole unless that would put them before their home slot.
+    void PriorityQueue::hash_erase(int i) {
+        int j = i;
+        while(1) {
+            j = (j + 1) & hmask;
+            if(hstamps[j] != stamp)
+                break;
+            int k = hash(hkeys[j]);
+            bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+            if(stays)
+                continue;
+            hkeys[i] = hkeys[j];
+            hpos[i] = hpos[j];
+            slots[hpos[i]] = i;
+            i = j;
         }
-        values[i] = value;
-        tags[i] = tag;
-        ids[i] = id;
+        hstamps[i] = 0;
     }
 
+    void PriorityQueue::set(int pos, int id, int tag, float value, int slot) {
+        ids[pos] = id;
+        tags[pos] = tag;
+        values[pos] = value;
+        slots[pos] = slot;
+        hpos[slot] = pos;
+    }
 
+    void PriorityQueue::sift_up(int pos) {
+        int id = ids[pos], tag = tags[pos], slot = slots[pos];
+        float value = values[pos];
+        while(pos > 0) {
+            int p = parent(pos);
+            if(values[p] <= value) break;
+            set(pos, ids[p], tags[p], values[p], slots[p]);
+            pos = p;
+        }
+        set(pos, id, tag, value, slot);
+    }
+
+    void PriorityQueue::sift_down(int pos, int size) {
+        int id = ids[pos], tag = tags[pos], slot = slots[pos];
+        float value = values[pos];
+        while(1) {
+            int c = left(pos);
+            if(c >= size) break;
+            if(c + 1 < size && values[c + 1] < values[c]) c++;
+            if(values[c] >= value) break;
+            set(pos, ids[c], tags[c], values[c], slots[c]);
+            pos = c;
+        }
+        set(pos, id, tag, value, slot);
+    }
 
     bool PriorityQueue::add(int id, int tag, float value) {
+        if(sorted) throw "PriorityQueue: add after sort()";
         if(fill == n) {
-            if(values[n-1]>=value) return false;
-            move_value(id, tag, value, n-1, 0);
-        } else if(fill == 0) {
-            values[0] = value;
-            ids[0] = id;
-            tags[0] = tag;
-            fill++;
+            // replace the worst element if the new one is better
+            if(n == 0 || values[0] >= value) return false;
+            hash_erase(slots[0]);
+            set(0, id, tag, value, hash_insert(id, 0));
+            sift_down(0, fill);
         } else {
-            move_value(id, tag, value, fill, 0);
-            fill++;
+            int pos = fill++;
+            set(pos, id, tag, value, hash_insert(id, pos));
+            sift_up(pos);
         }
         return true;
     }
 
     int PriorityQueue::find_id(int id) {
-        for(int i = 0; i < fill; i++) {
-            if(ids[i] == id)
-                return i;
+        if(sorted) throw "PriorityQueue: find_id after sort()";
+        int slot = hash(id);
+        while(hstamps[slot] == stamp) {
+            if(hkeys[slot] == id)
+                return hpos[slot];
+            slot = (slot + 1) & hmask;
         }
         return -1;
     }
@@ -88,10 +163,25 @@ namespace ocropus {
             return add(id, tag, value);
         if(values[former]>=value)
             return false;
-        move_value(id, tag, value, former, 0);
+        // a better value moves the element away from the top
+        tags[former] = tag;
+        values[former] = value;
+        sift_down(former, fill);
         return true;
     }
 
+    void PriorityQueue::sort() {
+        // heapsort; the hash table is not maintained any more
+        for(int size = fill; size > 1; size--) {
+            int id = ids[0], tag = tags[0], slot = slots[0];
+            float value = values[0];
+            set(0, ids[size-1], tags[size-1], values[size-1], slots[size-1]);
+            sift_down(0, size - 1);
+            set(size - 1, id, tag, value, slot);
+        }
+        sorted = true;
+    }
+
     int Heap::rotate(int i) {
         int size = heap.length();
         int j = left(i);
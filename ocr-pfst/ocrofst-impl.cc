@@ -21,40 +21,106 @@
 // Primary Repository:
 // Web Sites: www.iupr.org, www.dfki.de, www.ocropus.org
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "ocr-pfst.h"
 #include "fst-io.h"
 #include "a-star.h"
 
 namespace ocropus {
 
+    // Apply the same permutation to a range of a packed arc array.
+    template <class T>
+    static void permute_range(T *a, intarray &permutation, narray<T> &temp) {
+        int n = permutation.length();
+        temp.resize(n);
+        for(int j = 0; j < n; j++)
+            temp[j] = a[permutation[j]];
+        for(int j = 0; j < n; j++)
+            a[j] = temp[j];
+    }
+
+    // shared by all FSTs, so that a new FST allocated where an old
+    // one was does not get its generation
+    static int fst_generations = 0;
+
+    static int next_generation() {
+        int g;
+#pragma omp atomic capture
+        g = ++fst_generations;
+        return g;
+    }
+
     struct OcroFSTImpl : OcroFST {
+        // unpacked form, convenient for construction
         objlist<intarray> m_targets;
         objlist<intarray> m_inputs;
         objlist<intarray> m_outputs;
         objlist<floatarray> m_costs;
+
+        // frozen form: all arcs in one array, state i owns
+        // the range [a_offsets[i], a_offsets[i+1])
+        bool frozen;
+        intarray f_offsets;
+        intarray f_targets;
+        intarray f_inputs;
+        intarray f_outputs;
+        floatarray f_costs;
+
+        // A compiled FST file mapped privately into memory; its pages are
+        // shared with every other user of the file until they are written.
+        void *mapping;
+        size_t mapping_size;
+        float *mapped_accept;
+        int mapped_nstates;
+
+        // the frozen arrays, pointing either into f_* or into the mapping
+        int *a_offsets;
+        int *a_targets;
+        int *a_inputs;
+        int *a_outputs;
+        float *a_costs;
+        int a_narcs;
+
         floatarray m_heuristics;
         floatarray accept_costs;
         int start;
 
+        float &accept(int vertex) {
+            if(mapping)
+                return mapped_accept[vertex];
+            return accept_costs[vertex];
+        }
+
         virtual intarray &targets(int vertex) {
+            thaw();
+            modified();
             return m_targets[vertex];
         }
         virtual intarray &inputs(int vertex) {
+            thaw();
             return m_inputs[vertex];
         }
         virtual intarray &outputs(int vertex) {
+            thaw();
             return m_outputs[vertex];
         }
         virtual floatarray &costs(int vertex) {
+            thaw();
+            modified();
             return m_costs[vertex];
         }
 
         virtual float acceptCost(int vertex) {
-            return accept_costs[vertex];
+            return accept(vertex);
         }
 
         virtual void setAcceptCost(int vertex, float new_value) {
-            accept_costs[vertex] = new_value;
+            modified();
+            accept(vertex) = new_value;
         }
 
 
@@ -64,13 +130,15 @@ namespace ocropus {
 
         // reading
         virtual int nStates() {
+            if(mapping)
+                return mapped_nstates;
             return accept_costs.length();
         }
         virtual int getStart() {
             return start;
         }
         virtual float getAcceptCost(int node) {
-            return accept_costs[node];
+            return accept(node);
         }
 
         virtual void arcs(intarray &out_inputs,
@@ -78,31 +146,65 @@ namespace ocropus {
                           intarray &out_outputs,
                           floatarray &out_costs,
                           int from) {
-            copy(out_inputs, m_inputs[from]);
-            copy(out_targets, m_targets[from]);
-            copy(out_outputs, m_outputs[from]);
-            copy(out_costs, m_costs[from]);
+            if(!frozen) {
+                copy(out_inputs, m_inputs[from]);
+                copy(out_targets, m_targets[from]);
+                copy(out_outputs, m_outputs[from]);
+                copy(out_costs, m_costs[from]);
+                return;
+            }
+            int begin = a_offsets[from];
+            int n = a_offsets[from + 1] - begin;
+            out_inputs.resize(n);
+            out_targets.resize(n);
+            out_outputs.resize(n);
+            out_costs.resize(n);
+            for(int j = 0; j < n; j++) {
+                out_inputs[j] = a_inputs[begin + j];
+                out_targets[j] = a_targets[begin + j];
+                out_outputs[j] = a_outputs[begin + j];
+                out_costs[j] = a_costs[begin + j];
+            }
         }
 
         virtual void clear() {
+            unmap();
             start = 0;
+            flags = 0;
+            frozen = false;
             m_targets.clear();
             m_inputs.clear();
             m_outputs.clear();
             m_costs.clear();
+            f_offsets.dealloc();
+            f_targets.dealloc();
+            f_inputs.dealloc();
+            f_outputs.dealloc();
+            f_costs.dealloc();
+            bind();
             accept_costs.clear();
         }
 
         // writing
         virtual int newState() {
+            if(mapping)
+                thaw();
+            modified();
             accept_costs.push() = INFINITY;
-            m_targets.push();
-            m_inputs.push();
-            m_outputs.push();
-            m_costs.push();
+            if(frozen) {
+                f_offsets.push(f_offsets.last());
+                bind();
+            } else {
+                m_targets.push();
+                m_inputs.push();
+                m_outputs.push();
+                m_costs.push();
+            }
             return accept_costs.length() - 1;
         }
         virtual void addTransition(int from,int to,int output,float cost,int input) {
+            thaw();
+            modified();
             m_targets[from].push(to);
             m_outputs[from].push(output);
             m_inputs[from].push(input);
@@ -110,6 +212,18 @@ namespace ocropus {
         }
 
         virtual void rescore(int from,int to,int output,float cost,int input) {
+            modified();
+            if(frozen) {
+                for(int j = a_offsets[from]; j < a_offsets[from + 1]; j++) {
+                    if(a_targets[j] == to
+                    && a_inputs[j] == input
+                    && a_outputs[j] == output) {
+                        a_costs[j] = cost;
+                        break;
+                    }
+                }
+                return;
+            }
             intarray &t = m_targets[from];
             intarray &i = m_inputs[from];
             intarray &o = m_outputs[from];
@@ -127,7 +241,8 @@ namespace ocropus {
             start = node;
         }
         virtual void setAccept(int node,float cost=0.0) {
-            accept_costs[node] = cost;
+            modified();
+            accept(node) = cost;
         }
         virtual int special(const char *s) {
             return 0;
@@ -139,11 +254,265 @@ namespace ocropus {
             fst_write(path, *this);
         }
         virtual void load(const char *path) {
+            if(fst_is_compiled(path)) {
+                map(path);
+                return;
+            }
             fst_read(*this, path);
+            freeze();
+        }
+
+        virtual void freeze() {
+            if(frozen)
+                return;
+            int n = nStates();
+            int narcs = 0;
+            for(int i = 0; i < n; i++)
+                narcs += m_targets[i].length();
+            f_offsets.resize(n + 1);
+            f_targets.resize(narcs);
+            f_inputs.resize(narcs);
+            f_outputs.resize(narcs);
+            f_costs.resize(narcs);
+            int k = 0;
+            for(int i = 0; i < n; i++) {
+                f_offsets[i] = k;
+                intarray &t = m_targets[i];
+                intarray &in = m_inputs[i];
+                intarray &o = m_outputs[i];
+                floatarray &c = m_costs[i];
+                for(int j = 0; j < t.length(); j++, k++) {
+                    f_targets[k] = t[j];
+                    f_inputs[k] = in[j];
+                    f_outputs[k] = o[j];
+                    f_costs[k] = c[j];
+                }
+            }
+            f_offsets[n] = k;
+            m_targets.clear();
+            m_inputs.clear();
+            m_outputs.clear();
+            m_costs.clear();
+            frozen = true;
+            bind();
+        }
+
+        virtual bool isFrozen() {
+            return frozen;
+        }
+
+        virtual void allocate(int nstates, int narcs) {
+            CHECK_ARG(nstates >= 0 && narcs >= 0);
+            clear();
+            accept_costs.resize(nstates);
+            fill(accept_costs, INFINITY);
+            f_offsets.resize(nstates + 1);
+            fill(f_offsets, 0);
+            f_targets.resize(narcs);
+            f_inputs.resize(narcs);
+            f_outputs.resize(narcs);
+            f_costs.resize(narcs);
+            frozen = true;
+            bind();
+        }
+
+        virtual int nArcs() {
+            freeze();
+            return a_narcs;
+        }
+        virtual int *arcOffsets() {
+            freeze();
+            return a_offsets;
+        }
+        virtual int *arcTargets() {
+            freeze();
+            return a_targets;
+        }
+        virtual int *arcInputs() {
+            freeze();
+            return a_inputs;
+        }
+        virtual int *arcOutputs() {
+            freeze();
+            return a_outputs;
+        }
+        virtual float *arcCosts() {
+            freeze();
+            return a_costs;
+        }
+
+        virtual int generation() {
+            return m_generation;
+        }
+
+        virtual void arcSpan(FstArcs &result, int from) {
+            freeze();
+            int begin = a_offsets[from];
+            result.length = a_offsets[from + 1] - begin;
+            result.inputs = a_inputs + begin;
+            result.targets = a_targets + begin;
+            result.outputs = a_outputs + begin;
+            result.costs = a_costs + begin;
         }
 
     private:
         int flags;
+        int m_generation;
+
+        // The heuristics depend on the costs and on the graph;
+        // the order of the arcs does not matter.
+        void modified() {
+            flags &= ~HAS_HEURISTICS;
+        }
+
+        // Point the frozen arrays at the f_* storage.
+        void bind() {
+            a_offsets = f_offsets.data;
+            a_targets = f_targets.data;
+            a_inputs = f_inputs.data;
+            a_outputs = f_outputs.data;
+            a_costs = f_costs.data;
+            a_narcs = f_targets.length();
+            m_generation = next_generation();
+        }
+
+        // Whether count elements of the given size at pos are aligned
+        // and lie inside the file after the header.
+        static bool fits(int64_t pos, int64_t count, int64_t elsize, int64_t size) {
+            return pos >= (int64_t) sizeof(CompiledFstHeader)
+                && pos <= size
+                && pos % elsize == 0
+                && count >= 0
+                && count <= (size - pos) / elsize;
+        }
+
+        // Check everything the search relies on once, so that a
+        // truncated or corrupt file is rejected instead of being read
+        // out of bounds: the array ranges, the offsets (from 0 to narcs,
+        // never decreasing), the start state and the arc targets.
+        static bool valid_compiled(CompiledFstHeader &h, char *base, size_t size) {
+            if(h.magic != COMPILED_FST_MAGIC
+            || h.version != COMPILED_FST_VERSION
+            || h.size > (int64_t) size
+            || h.nstates < 0 || h.narcs < 0)
+                return false;
+            int64_t n = h.nstates, m = h.narcs;
+            if(!fits(h.accept_pos, n, sizeof(float), h.size)
+            || !fits(h.offsets_pos, n + 1, sizeof(int), h.size)
+            || !fits(h.targets_pos, m, sizeof(int), h.size)
+            || !fits(h.inputs_pos, m, sizeof(int), h.size)
+            || !fits(h.outputs_pos, m, sizeof(int), h.size)
+            || !fits(h.costs_pos, m, sizeof(float), h.size)
+            || ((h.flags & HAS_HEURISTICS)
+                && !fits(h.heuristics_pos, n, sizeof(float), h.size)))
+                return false;
+            if(h.start < 0 || (n > 0 && h.start >= n))
+                return false;
+            int *offsets = (int *) (base + h.offsets_pos);
+            if(offsets[0] != 0 || offsets[n] != m)
+                return false;
+            for(int i = 0; i < n; i++)
+                if(offsets[i + 1] < offsets[i])
+                    return false;
+            int *targets = (int *) (base + h.targets_pos);
+            for(int k = 0; k < m; k++)
+                if(targets[k] < 0 || targets[k] >= n)
+                    return false;
+            return true;
+        }
+
+        // Point the frozen arrays into a compiled FST file.
+        void map(const char *path) {
+            clear();
+            int fd = open(path, O_RDONLY);
+            if(fd < 0)
+                throwf("%s: cannot open", path);
+            struct stat st;
+            if(fstat(fd, &st) < 0) {
+                close(fd);
+                throwf("%s: cannot stat", path);
+            }
+            size_t size = st.st_size;
+            void *p = MAP_FAILED;
+            if(size >= sizeof(CompiledFstHeader))
+                p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if(p == MAP_FAILED)
+                throwf("%s: cannot map", path);
+            CompiledFstHeader &h = *(CompiledFstHeader *) p;
+            if(!valid_compiled(h, (char *) p, size)) {
+                munmap(p, size);
+                throwf("%s: not a valid compiled FST", path);
+            }
+            char *base = (char *) p;
+            mapping = p;
+            mapping_size = size;
+            mapped_nstates = h.nstates;
+            mapped_accept = (float *) (base + h.accept_pos);
+            a_offsets = (int *) (base + h.offsets_pos);
+            a_targets = (int *) (base + h.targets_pos);
+            a_inputs = (int *) (base + h.inputs_pos);
+            a_outputs = (int *) (base + h.outputs_pos);
+            a_costs = (float *) (base + h.costs_pos);
+            a_narcs = h.narcs;
+            start = h.start;
+            m_generation = next_generation();
+            flags = h.flags & (SORTED_BY_INPUT | SORTED_BY_OUTPUT);
+            if(h.flags & HAS_HEURISTICS) {
+                float *heuristics = (float *) (base + h.heuristics_pos);
+                m_heuristics.resize(h.nstates);
+                memcpy(m_heuristics.data, heuristics, h.nstates * sizeof(float));
+                flags |= HAS_HEURISTICS;
+            }
+            frozen = true;
+        }
+
+        void unmap() {
+            if(!mapping)
+                return;
+            munmap(mapping, mapping_size);
+            mapping = 0;
+            mapping_size = 0;
+            mapped_accept = 0;
+            mapped_nstates = 0;
+        }
+
+        // Go back from the frozen form to the per-state arrays.
+        void thaw() {
+            if(!frozen)
+                return;
+            int n = nStates();
+            if(mapping) {
+                accept_costs.resize(n);
+                for(int i = 0; i < n; i++)
+                    accept_costs[i] = mapped_accept[i];
+            }
+            m_targets.clear();
+            m_inputs.clear();
+            m_outputs.clear();
+            m_costs.clear();
+            for(int i = 0; i < n; i++) {
+                intarray &t = m_targets.push();
+                intarray &in = m_inputs.push();
+                intarray &o = m_outputs.push();
+                floatarray &c = m_costs.push();
+                for(int j = a_offsets[i]; j < a_offsets[i + 1]; j++) {
+                    t.push(a_targets[j]);
+                    in.push(a_inputs[j]);
+                    o.push(a_outputs[j]);
+                    c.push(a_costs[j]);
+                }
+            }
+            unmap();
+            f_offsets.dealloc();
+            f_targets.dealloc();
+            f_inputs.dealloc();
+            f_outputs.dealloc();
+            f_costs.dealloc();
+            bind();
+            frozen = false;
+        }
+
         void achieve(int flag) {
             CHECK_ARG(flag == SORTED_BY_INPUT
                    || flag == SORTED_BY_OUTPUT
@@ -154,21 +523,31 @@ namespace ocropus {
 
             if(flag == HAS_HEURISTICS) {
                 a_star_backwards(m_heuristics, *this);
+                flags |= HAS_HEURISTICS;
                 return;
             }
 
+            // sorting is done on the frozen form
+            freeze();
+            intarray keys, permutation, itemp;
+            floatarray ftemp;
+            int *key = flag == SORTED_BY_INPUT ? a_inputs : a_outputs;
             for(int node = 0; node < nStates(); node++) {
-                intarray permutation;
-                if(flag == OcroFST::SORTED_BY_INPUT)
-                    quicksort(permutation, m_inputs[node]);
-                else
-                    quicksort(permutation, m_outputs[node]);
-                permute(m_inputs[node], permutation);
-                permute(m_outputs[node], permutation);
-                permute(m_targets[node], permutation);
-                permute(m_costs[node], permutation);
+                int begin = a_offsets[node];
+                int n = a_offsets[node + 1] - begin;
+                if(n < 2) continue;
+                keys.resize(n);
+                for(int j = 0; j < n; j++)
+                    keys[j] = key[begin + j];
+                quicksort(permutation, keys);
+                permute_range(a_inputs + begin, permutation, itemp);
+                permute_range(a_outputs + begin, permutation, itemp);
+                permute_range(a_targets + begin, permutation, itemp);
+                permute_range(a_costs + begin, permutation, ftemp);
             }
+            flags &= ~(SORTED_BY_INPUT | SORTED_BY_OUTPUT);
             flags |= flag;
+            m_generation = next_generation();
         }
     public:
         virtual void sortByInput() {
@@ -197,14 +576,29 @@ namespace ocropus {
             m_inputs(max_size),
             m_outputs(max_size),
             m_costs(max_size),
+            frozen(false),
+            mapping(0),
+            mapping_size(0),
+            mapped_accept(0),
+            mapped_nstates(0),
             accept_costs(max_size),
             start(0), flags(0) {
+            bind();
+        }
+
+        virtual ~OcroFSTImpl() {
+            unmap();
         }
 
         virtual void clearFlags() {
             flags = 0;
         }
 
+        virtual void arcsModified() {
+            flags = 0;
+            m_generation = next_generation();
+        }
+
     };
 
     OcroFST *make_OcroFST() {
@@ -212,40 +606,39 @@ namespace ocropus {
     };
 
     void scale_fst(OcroFST &fst,float scale) {
-        using namespace narray_ops;
         if(fabs(scale-1.0)<1e-6) return;
+        int narcs = fst.nArcs();
+        float *costs = fst.arcCosts();
+        for(int j=0;j<narcs;j++)
+            costs[j] *= scale;
         for(int i=0;i<fst.nStates();i++) {
-            fst.costs(i) *= scale;
             float accept = fst.acceptCost(i);
             if(accept>=0 && accept<1e37)
                 fst.setAcceptCost(i,accept*scale);
         }
     }
 
-    static void make_neg(intarray &a) {
-        for(int i=0;i<a.length();i++)
+    static void make_neg(int *a,int n) {
+        for(int i=0;i<n;i++)
             if(a[i]>0&&a[i]<=4) a[i] = -a[i];
     }
 
-    static void make_pos(intarray &a) {
-        for(int i=0;i<a.length();i++)
+    static void make_pos(int *a,int n) {
+        for(int i=0;i<n;i++)
             if(a[i]>=-40&&a[i]<0) a[i] = -a[i];
     }
 
     void make_specials_neg(OcroFST &fst,bool input,bool output) {
-        using namespace narray_ops;
-        for(int i=0;i<fst.nStates();i++) {
-            if(input) make_neg(fst.inputs(i));
-            if(output) make_neg(fst.outputs(i));
-        }
+        int narcs = fst.nArcs();
+        if(input) make_neg(fst.arcInputs(),narcs);
+        if(output) make_neg(fst.arcOutputs(),narcs);
+        fst.arcsModified();
     }
 
     void make_specials_pos(OcroFST &fst,bool input,bool output) {
-        using namespace narray_ops;
-        for(int i=0;i<fst.nStates();i++) {
-            if(input) make_pos(fst.inputs(i));
-            if(output) make_pos(fst.outputs(i));
-        }
+        int narcs = fst.nArcs();
+        if(input) make_pos(fst.arcInputs(),narcs);
+        if(output) make_pos(fst.arcOutputs(),narcs);
+        fst.arcsModified();
     }
 }
-
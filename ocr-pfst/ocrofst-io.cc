@@ -24,7 +24,10 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "ocr-pfst.h"
+#include "fst-io.h"
 
 using namespace colib;
 using namespace ocropus;
@@ -41,196 +44,340 @@ enum {
     PROPERTIES = 3 // expanded, mutable
 };
 
-static int32_t read_int32_LE(FILE *stream) {
-    int n = fgetc(stream);
-    n |= fgetc(stream) << 8;
-    n |= fgetc(stream) << 16;
-    n |= fgetc(stream) << 24;
-    return n;
+// The whole file is decoded from (or encoded into) one buffer, so reading
+// or writing an FST costs one system call instead of a few per arc.
+
+namespace {
+    /// Little-endian decoding from a buffer, with bounds checking.
+    struct Input {
+        const unsigned char *p;
+        const unsigned char *end;
+
+        Input(const unsigned char *data, int64_t size) : p(data),
+                                                         end(data + size) {
+        }
+        void need(int64_t n) {
+            if(n < 0 || end - p < n)
+                throw "unexpected EOF";
+        }
+        int32_t int32() {
+            need(4);
+            int32_t n = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+            p += 4;
+            return n;
+        }
+        int64_t int64() {
+            int64_t n = uint32_t(int32());
+            n |= int64_t(int32()) << 32;
+            return n;
+        }
+        // This is probably not a good way but that's what OpenFST does anyway.
+        float float32() {
+            need(4);
+            float result;
+            memcpy(&result, p, sizeof(result));
+            p += 4;
+            return result;
+        }
+        void skip(int64_t n) {
+            need(n);
+            p += n;
+        }
+        void skip_string() {
+            skip(int32());
+        }
+        bool magic_string(const char *s) {
+            int n = int32();
+            if(strlen(s) != n)
+                return false;
+            need(n);
+            bool result = !memcmp(p, s, n);
+            p += n;
+            return result;
+        }
+    };
+
+    /// Little-endian encoding into a buffer of the right size.
+    struct Output {
+        unsigned char *p;
+
+        Output(bytearray &buffer) : p(buffer.data) {
+        }
+        void int32(int32_t n) {
+            p[0] = n;
+            p[1] = n >> 8;
+            p[2] = n >> 16;
+            p[3] = n >> 24;
+            p += 4;
+        }
+        void int64(int64_t n) {
+            int32(n);
+            int32(n >> 32);
+        }
+        void float32(float f) {
+            memcpy(p, &f, sizeof(f));
+            p += 4;
+        }
+        void string(const char *s) {
+            int n = strlen(s);
+            int32(n);
+            memcpy(p, s, n);
+            p += n;
+        }
+    };
+
+    // the encoded sizes
+    enum {
+        NODE_SIZE = 4 + 8,      // accept cost, number of arcs
+        ARC_SIZE = 4 + 4 + 4 + 4
+    };
+
+    void read_all(bytearray &buffer, FILE *stream) {
+        buffer.clear();
+        struct stat st;
+        long pos = ftell(stream);
+        if(pos >= 0 && !fstat(fileno(stream), &st) && S_ISREG(st.st_mode)) {
+            // a regular file: one read of the known size
+            buffer.resize(st.st_size > pos ? st.st_size - pos : 0);
+            size_t n = fread(buffer.data, 1, buffer.length(), stream);
+            if(n != buffer.length())
+                throw "unexpected EOF";
+        } else {
+            unsigned char block[65536];
+            size_t n;
+            while((n = fread(block, 1, sizeof(block), stream)) > 0) {
+                buffer.reserve(n);
+                for(size_t i = 0; i < n; i++)
+                    buffer.push(block[i]);
+            }
+        }
+        if(ferror(stream))
+            throw "error in the stream";
+    }
 }
 
-static void write_int32_LE(FILE *stream, int32_t n) {
-    fputc(n, stream);
-    fputc(n >> 8, stream);
-    fputc(n >> 16, stream);
-    fputc(n >> 24, stream);
+static int64_t align8(int64_t pos) {
+    return (pos + 7) & ~int64_t(7);
 }
 
-static int64_t read_int64_LE(FILE *stream) {
-    int64_t n = read_int32_LE(stream);
-    n |= int64_t(read_int32_LE(stream)) << 32;
-    return n;
+static void write_block(FILE *stream, int64_t pos, const void *data, size_t n) {
+    if(fseek(stream, pos, SEEK_SET) || fwrite(data, 1, n, stream) != n)
+        throw "error writing compiled FST";
 }
 
-static void write_int64_LE(FILE *stream, int64_t n) {
-    write_int32_LE(stream, n);
-    write_int32_LE(stream, n >> 32);
-}
+// _______________________   high-level functions   ___________________________
 
-static bool read_magic_string(FILE *stream, const char *s) {
-    int n = read_int32_LE(stream);
-    if(strlen(s) != n)
+static bool skip_symbol_table(Input &in) {
+    if(in.int32() != OPENFST_SYMBOL_TABLE_MAGIC)
         return false;
-    for(int i = 0; i < n; i++) {
-        if(fgetc(stream) != s[i])
-            return false;
+    in.skip_string(); // name
+    in.int64(); // available key
+    int64_t n = in.int64();
+    for(int64_t i = 0; i < n; i++) {
+        in.skip_string();   // key
+        in.int64();         // value
     }
     return true;
 }
 
-static void skip_string(FILE *stream) {
-    int n = read_int32_LE(stream);
-    fseek(stream, n, SEEK_CUR);
-}
+static const char *read_header_and_symbols(int64_t &start, int64_t &nstates,
+                                           Input &in) {
+    if(in.int32() != OPENFST_MAGIC)
+        return "invalid magic number";
+    in.magic_string("vector");
+    in.magic_string("standard");
+    int version = in.int32();
+    if(version < MIN_VERSION)
+        return "file has too old version";
+    int flags = in.int32();
+    in.int64(); // properties
+    start = in.int64();
+    nstates = in.int64();
+    // to prevent creating 2^31 nodes in case of a broken file
+    if(nstates < 0 || nstates > in.end - in.p)
+        return "invalid number of states";
+    in.int64(); // narcs (we count them ourselves)
 
-static void write_string(FILE *stream, const char *s) {
-    int n = strlen(s);
-    write_int32_LE(stream, n);
-    for(int i = 0; i < n; i++)
-        fputc(s[i], stream);
+    if(flags & FLAG_HAS_ISYMBOLS)
+        skip_symbol_table(in);
+    if(flags & FLAG_HAS_OSYMBOLS)
+        skip_symbol_table(in);
+    return NULL;
 }
 
-// This is probably not a good way but that's what OpenFST does anyway.
-static bool write_float(FILE *stream, float f) {
-    return fwrite(&f, 1, sizeof(f), stream) == sizeof(f);
+static void write_header_and_symbols(Output &out, IGenericFst &fst,
+                                     int64_t narcs) {
+    out.int32(OPENFST_MAGIC);
+    out.string("vector");
+    out.string("standard");
+    out.int32(MIN_VERSION);
+    out.int32(/* flags: */ 0);
+    out.int64(PROPERTIES);
+    out.int64(fst.getStart());
+    out.int64(fst.nStates());
+    out.int64(narcs);
 }
 
-static float read_float(FILE *stream) {
-    float result;
-    if(fread(&result, 1, sizeof(result), stream) != sizeof(result)) {
-        // cry
-    }
-    return result;
+static int header_size() {
+    return 4 + (4 + strlen("vector")) + (4 + strlen("standard"))
+         + 4 + 4 + 8 + 8 + 8 + 8;
 }
 
-// _______________________   high-level functions   ___________________________
-
-static bool skip_symbol_table(FILE *stream) {
-    if(read_int32_LE(stream) != OPENFST_SYMBOL_TABLE_MAGIC)
-        return false;
-    skip_string(stream); // name
-    read_int64_LE(stream); // available key
-    int64_t n = read_int64_LE(stream);
-    for(int i = 0; i < n; i++) {
-        skip_string(stream);    // key
-        read_int64_LE(stream);  // value
-    }
-    return !ferror(stream) && !feof(stream);
+// By convention, anything larger than 1e37 is treated
+// as infinite accept cost (=no final state) in OCRopus.
+// This makes such files look right in the OpenFST tools.
+static float accept_for_writing(float cost) {
+    if(cost>1e37) cost = INFINITY;
+    return cost;
 }
 
-static const char *read_header_and_symbols(IGenericFst &fst, FILE *stream) {
-    if(read_int32_LE(stream) != OPENFST_MAGIC)
-        return "invalid magic number";
-    read_magic_string(stream, "vector");
-    read_magic_string(stream, "standard");
-    int version = read_int32_LE(stream);
-    if(version < MIN_VERSION)
-        return "file has too old version";
-    int flags = read_int32_LE(stream);
-    read_int64_LE(stream); // properties
-    int64_t start = read_int64_LE(stream);
-    int64_t nstates = read_int64_LE(stream);
-    if(nstates < 0)
-        return nullptr;   // to prevent creating 2^31 nodes in case of sudden EOF
-    fst.clear();
-    for(int i = 0; i < nstates; i++)
-        fst.newState();
-    fst.setStart(start);
-
-    read_int64_LE(stream); // narcs
-
-    if(flags & FLAG_HAS_ISYMBOLS)
-        skip_symbol_table(stream);
-    if(flags & FLAG_HAS_OSYMBOLS)
-        skip_symbol_table(stream);
-
-    if(ferror(stream))
-        return "error in the stream";
-    if(feof(stream))
-        return "unexpected EOF";
-    return NULL;
+static void encode(bytearray &buffer, OcroFST &fst) {
+    int nstates = fst.nStates();
+    int64_t narcs = fst.nArcs();
+    buffer.resize(header_size() + nstates * NODE_SIZE + narcs * ARC_SIZE);
+    Output out(buffer);
+    write_header_and_symbols(out, fst, narcs);
+    for(int i = 0; i < nstates; i++) {
+        FstArcs a;
+        fst.arcSpan(a, i);
+        out.float32(accept_for_writing(fst.getAcceptCost(i)));
+        out.int64(a.length);
+        for(int j = 0; j < a.length; j++) {
+            out.int32(a.inputs[j]);
+            out.int32(a.outputs[j]);
+            out.float32(a.costs[j]);
+            out.int32(a.targets[j]);
+        }
+    }
 }
 
-/*static int64_t narcs(IGenericFst &fst) {
+static void encode(bytearray &buffer, IGenericFst &fst) {
+    OcroFST *ocrofst = dynamic_cast<OcroFST *>(&fst);
+    if(ocrofst) {
+        encode(buffer, *ocrofst);
+        return;
+    }
+    int nstates = fst.nStates();
     intarray inputs;
     intarray targets;
     intarray outputs;
     floatarray costs;
-    int64_t result = 0;
-    for(int i = 0; i < fst.nStates(); i++) {
+    int64_t narcs = 0;
+    for(int i = 0; i < nstates; i++) {
+        fst.arcs(inputs, targets, outputs, costs, i);
+        narcs += targets.length();
+    }
+    buffer.resize(header_size() + nstates * NODE_SIZE + narcs * ARC_SIZE);
+    Output out(buffer);
+    write_header_and_symbols(out, fst, narcs);
+    for(int i = 0; i < nstates; i++) {
         fst.arcs(inputs, targets, outputs, costs, i);
-        result += targets.length();
-    }
-    return result;
-}*/
-
-static void write_header_and_symbols(FILE *stream, IGenericFst &fst) {
-    write_int32_LE(stream, OPENFST_MAGIC);
-    write_string(stream, "vector");
-    write_string(stream, "standard");
-    write_int32_LE(stream, MIN_VERSION);
-    write_int32_LE(stream, /* flags: */ 0);
-    write_int64_LE(stream, PROPERTIES);
-    write_int64_LE(stream, fst.getStart());
-    write_int64_LE(stream, fst.nStates());
-    write_int64_LE(stream, /* narcs (seems to be unused): */ 0);
+        out.float32(accept_for_writing(fst.getAcceptCost(i)));
+        out.int64(targets.length());
+        for(int j = 0; j < targets.length(); j++) {
+            out.int32(inputs[j]);
+            out.int32(outputs[j]);
+            out.float32(costs[j]);
+            out.int32(targets[j]);
+        }
+    }
 }
 
-static void write_node(FILE *stream, IGenericFst &fst, int index) {
-    intarray inputs;
-    intarray targets;
-    intarray outputs;
-    floatarray costs;
-    fst.arcs(inputs, targets, outputs, costs, index);
-    int narcs = targets.length();
-
-    // By convention, anything larger than 1e37 is treated
-    // as infinite accept cost (=no final state) in OCRopus.
-    // This makes such files look right in the OpenFST tools.
-
-    float cost = fst.getAcceptCost(index);
-    if(cost>1e37) cost = INFINITY;
-    write_float(stream,cost);
+// We don't bother undoing the "inf" from the binary FST files;
+// the OCRopus search algorithms should deal fine with them.
+
+static void decode(IGenericFst &fst, const unsigned char *data,
+                   int64_t size) {
+    Input in(data, size);
+    int64_t start, nstates;
+    const char *errmsg = read_header_and_symbols(start, nstates, in);
+    if(errmsg)
+        throw errmsg;
+
+    // count the arcs first, so that an OcroFST is allocated only once
+    Input nodes = in;
+    int64_t narcs = 0;
+    for(int64_t i = 0; i < nstates; i++) {
+        in.skip(4);
+        int64_t n = in.int64();
+        in.skip(n * ARC_SIZE);
+        narcs += n;
+    }
+    if(nstates >= INT_MAX || narcs >= INT_MAX)
+        throw "FST too large";
+    // the searches index the states with these without checking
+    // (only an empty FST may have no start state)
+    if(nstates > 0 ? start < 0 || start >= nstates : start < -1)
+        throw "FST start state out of range";
+    in = nodes;
+
+    OcroFST *ocrofst = dynamic_cast<OcroFST *>(&fst);
+    if(!ocrofst) {
+        fst.clear();
+        for(int i = 0; i < nstates; i++)
+            fst.newState();
+        fst.setStart(start);
+        for(int i = 0; i < nstates; i++) {
+            fst.setAccept(i, in.float32());
+            int n = in.int64();
+            for(int j = 0; j < n; j++) {
+                int input = in.int32();
+                int output = in.int32();
+                float cost = in.float32();
+                int target = in.int32();
+                if(target < 0 || target >= nstates)
+                    throw "FST arc target out of range";
+                fst.addTransition(i, target, output, cost, input);
+            }
+        }
+        return;
+    }
 
-    write_int64_LE(stream, narcs);
-    for(int i = 0; i < narcs; i++) {
-        write_int32_LE(stream, inputs[i]);
-        write_int32_LE(stream, outputs[i]);
-        write_float(stream, costs[i]);
-        write_int32_LE(stream, targets[i]);
+    ocrofst->allocate(nstates, narcs);
+    ocrofst->setStart(start);
+    int *offsets = ocrofst->arcOffsets();
+    int *targets = ocrofst->arcTargets();
+    int *inputs = ocrofst->arcInputs();
+    int *outputs = ocrofst->arcOutputs();
+    float *costs = ocrofst->arcCosts();
+    int k = 0;
+    for(int i = 0; i < nstates; i++) {
+        offsets[i] = k;
+        ocrofst->setAccept(i, in.float32());
+        int n = in.int64();
+        for(int j = 0; j < n; j++, k++) {
+            inputs[k] = in.int32();
+            outputs[k] = in.int32();
+            costs[k] = in.float32();
+            targets[k] = in.int32();
+            if(targets[k] < 0 || targets[k] >= nstates)
+                throw "FST arc target out of range";
+        }
     }
+    offsets[nstates] = k;
 }
 
-static void read_node(FILE *stream, IGenericFst &fst, int index) {
-
-    // We don't bother undoing the "inf" from the binary FST files;
-    // the OCRopus search algorithms should deal fine with them.
+namespace ocropus {
 
-    fst.setAccept(index, read_float(stream));
-    int narcs = read_int64_LE(stream);
-    for(int i = 0; i < narcs; i++) {
-        int input = read_int32_LE(stream);
-        int output = read_int32_LE(stream);
-        float cost = read_float(stream);
-        int target = read_int32_LE(stream);
-        fst.addTransition(index, target, output, cost, input);
+    void fst_write(bytearray &buffer, IGenericFst &fst) {
+        encode(buffer, fst);
     }
-}
 
-namespace ocropus {
+    void fst_read(IGenericFst &fst, const unsigned char *data, int64_t size) {
+        decode(fst, data, size);
+    }
 
     void fst_write(FILE *stream, IGenericFst &fst) {
-        write_header_and_symbols(stream, fst);
-        for(int i = 0; i < fst.nStates(); i++)
-            write_node(stream, fst, i);
+        bytearray buffer;
+        encode(buffer, fst);
+        if(fwrite(buffer.data, 1, buffer.length(), stream) != buffer.length())
+            throw "error writing FST";
     }
 
     void fst_read(IGenericFst &fst, FILE *stream) {
-        const char *errmsg = read_header_and_symbols(fst, stream);
-        if(errmsg)
-            throw errmsg;
-        for(int i = 0; i < fst.nStates(); i++)
-            read_node(stream, fst, i);
+        bytearray buffer;
+        read_all(buffer, stream);
+        decode(fst, buffer.data, buffer.length());
     }
 
     void fst_write(const char *path, IGenericFst &fst) {
@@ -240,4 +387,72 @@ namespace ocropus {
     void fst_read(IGenericFst &fst, const char *path) {
         fst_read(fst, stdio(path, "rb"));
     }
+
+    bool fst_is_compiled(const char *path) {
+        stdio stream(path, "rb");
+        int32_t magic = 0;
+        if(fread(&magic, 1, sizeof(magic), stream) != sizeof(magic))
+            return false;
+        return magic == COMPILED_FST_MAGIC;
+    }
+
+    void fst_write_compiled(const char *path, OcroFST &fst) {
+        fst.calculateHeuristics();
+        int nstates = fst.nStates();
+        int narcs = fst.nArcs();
+        floatarray accept(nstates);
+        for(int i = 0; i < nstates; i++)
+            accept[i] = fst.getAcceptCost(i);
+
+        CompiledFstHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = COMPILED_FST_MAGIC;
+        header.version = COMPILED_FST_VERSION;
+        if(fst.hasFlag(OcroFST::SORTED_BY_INPUT))
+            header.flags |= OcroFST::SORTED_BY_INPUT;
+        if(fst.hasFlag(OcroFST::SORTED_BY_OUTPUT))
+            header.flags |= OcroFST::SORTED_BY_OUTPUT;
+        header.flags |= OcroFST::HAS_HEURISTICS;
+        header.start = fst.getStart();
+        header.nstates = nstates;
+        header.narcs = narcs;
+        int64_t pos = align8(sizeof(header));
+        header.accept_pos = pos;
+        pos = align8(pos + nstates * sizeof(float));
+        header.offsets_pos = pos;
+        pos = align8(pos + (nstates + 1) * sizeof(int));
+        header.targets_pos = pos;
+        pos = align8(pos + narcs * sizeof(int));
+        header.inputs_pos = pos;
+        pos = align8(pos + narcs * sizeof(int));
+        header.outputs_pos = pos;
+        pos = align8(pos + narcs * sizeof(int));
+        header.costs_pos = pos;
+        pos = align8(pos + narcs * sizeof(float));
+        header.heuristics_pos = pos;
+        pos = align8(pos + nstates * sizeof(float));
+        header.size = pos;
+
+        stdio stream(path, "wb");
+        write_block(stream, 0, &header, sizeof(header));
+        write_block(stream, header.accept_pos, accept.data,
+                    nstates * sizeof(float));
+        write_block(stream, header.offsets_pos, fst.arcOffsets(),
+                    (nstates + 1) * sizeof(int));
+        write_block(stream, header.targets_pos, fst.arcTargets(),
+                    narcs * sizeof(int));
+        write_block(stream, header.inputs_pos, fst.arcInputs(),
+                    narcs * sizeof(int));
+        write_block(stream, header.outputs_pos, fst.arcOutputs(),
+                    narcs * sizeof(int));
+        write_block(stream, header.costs_pos, fst.arcCosts(),
+                    narcs * sizeof(float));
+        write_block(stream, header.heuristics_pos, fst.heuristics().data,
+                    nstates * sizeof(float));
+        // pad the file to its full size
+        for(int64_t end = ftell(stream); end < header.size; end++)
+            fputc(0, stream);
+        if(ferror(stream))
+            throw "error writing compiled FST";
+    }
 }
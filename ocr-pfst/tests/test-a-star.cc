@@ -0,0 +1,193 @@
+// -*- C++ -*-
+
+// Copyright 2008-2009 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project: ocrofst
+// File: test-a-star.cc
+// Purpose: check the lazy a_star_in_composition() against A* on the
+//          fully expanded composition
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include "ocropus.h"
+
+using namespace colib;
+using namespace ocropus;
+
+namespace {
+    float random_cost() {
+        return rand()/float(RAND_MAX);
+    }
+
+    // labels 1..4 are specials with specials2
+    int random_label() {
+        return rand()%6==0 ? 0 : 1+rand()%7;
+    }
+
+    // a small FST with cycles and epsilons; the start state doesn't
+    // accept, so that paths have arcs
+    void random_fst(OcroFST &fst,int nstates,int narcs) {
+        for(int i=0;i<nstates;i++) fst.newState();
+        fst.setStart(0);
+        for(int k=0;k<narcs;k++)
+            fst.addTransition(rand()%nstates,rand()%nstates,random_label(),
+                              random_cost(),random_label());
+        for(int i=1;i<nstates;i++)
+            if(rand()%3==0) fst.setAccept(i,random_cost());
+    }
+
+    int special(int label,bool specials2) {
+        return specials2 && label>0 && label<=4 ? -label : label;
+    }
+
+    // The composition, state pair (i1,i2) becoming state i1*n2+i2,
+    // built directly from its definition: epsilon outputs of fst1 and
+    // epsilon inputs of fst2 move one FST alone, equal labels move
+    // both, and the specials of fst2 are never matched.
+    void expand(OcroFST &result,OcroFST &fst1,OcroFST &fst2,
+                float scale2,bool specials2) {
+        int n1 = fst1.nStates(), n2 = fst2.nStates();
+        for(int i=0;i<n1*n2;i++) result.newState();
+        result.setStart(fst1.getStart()*n2+fst2.getStart());
+        for(int i1=0;i1<n1;i1++) {
+            for(int i2=0;i2<n2;i2++) {
+                int from = i1*n2+i2;
+                float accept1 = fst1.getAcceptCost(i1);
+                float accept2 = fst2.getAcceptCost(i2);
+                if(accept1<INFINITY && accept2<INFINITY)
+                    result.setAccept(from,accept1+scale2*accept2);
+                FstArcs a1,a2;
+                fst1.arcSpan(a1,i1);
+                fst2.arcSpan(a2,i2);
+                for(int j=0;j<a1.length;j++)
+                    if(!a1.outputs[j])
+                        result.addTransition(from,a1.targets[j]*n2+i2,0,
+                                             a1.costs[j],a1.inputs[j]);
+                for(int k=0;k<a2.length;k++)
+                    if(!a2.inputs[k])
+                        result.addTransition(from,i1*n2+a2.targets[k],
+                                             special(a2.outputs[k],specials2),
+                                             scale2*a2.costs[k],0);
+                for(int j=0;j<a1.length;j++) {
+                    int label = a1.outputs[j];
+                    if(!label || special(label,specials2)!=label) continue;
+                    for(int k=0;k<a2.length;k++) {
+                        if(a2.inputs[k]!=label) continue;
+                        result.addTransition(from,a1.targets[j]*n2+a2.targets[k],
+                                             special(a2.outputs[k],specials2),
+                                             a1.costs[j]+scale2*a2.costs[k],
+                                             a1.inputs[j]);
+                    }
+                }
+            }
+        }
+    }
+
+    void remove_eps(intarray &result,intarray &labels) {
+        result.clear();
+        for(int i=0;i<labels.length();i++)
+            if(labels[i]) result.push(labels[i]);
+    }
+
+    bool same(intarray &a,intarray &b) {
+        if(a.length()!=b.length()) return false;
+        for(int i=0;i<a.length();i++)
+            if(a[i]!=b[i]) return false;
+        return true;
+    }
+}
+
+// The lazy search finds a path of the best cost, with the output of
+// the best path of the expanded composition (unless another output
+// is about as cheap), and its vertices are a path of both FSTs.
+void test_a_star(float scale2,bool specials2) {
+    autodel<OcroFST> fst1(make_OcroFST()), fst2(make_OcroFST());
+    random_fst(*fst1,2+rand()%8,5+rand()%30);
+    random_fst(*fst2,2+rand()%8,5+rand()%30);
+
+    intarray inputs,vertices1,vertices2,outputs;
+    floatarray costs;
+    bool found = a_star_in_composition(inputs,vertices1,vertices2,outputs,
+                                       costs,*fst1,*fst2,scale2,specials2);
+
+    autodel<OcroFST> expanded(make_OcroFST());
+    expand(*expanded,*fst1,*fst2,scale2,specials2);
+    ustrg s;
+    double best = a_star(s,*expanded);
+    CHECK_CONDITION(found==(best<INFINITY));
+    if(!found) return;
+    CHECK_CONDITION(fabs(sum(costs)-best)<1e-4);
+
+    int n2 = fst2->nStates();
+    int len = vertices1.length();
+    CHECK_CONDITION(vertices2.length()==len);
+    CHECK_CONDITION(vertices1[0]==fst1->getStart());
+    CHECK_CONDITION(vertices2[0]==fst2->getStart());
+    float accept = expanded->getAcceptCost(vertices1[len-1]*n2+vertices2[len-1]);
+    CHECK_CONDITION(fabs(costs[len-1]-accept)<1e-5);
+    for(int i=0;i+1<len;i++) {
+        FstArcs a;
+        expanded->arcSpan(a,vertices1[i]*n2+vertices2[i]);
+        bool found_arc = false;
+        for(int j=0;j<a.length;j++)
+            found_arc = found_arc ||
+                (a.targets[j]==vertices1[i+1]*n2+vertices2[i+1] &&
+                 a.inputs[j]==inputs[i] && a.outputs[j]==outputs[i] &&
+                 fabs(a.costs[j]-costs[i])<1e-5);
+        CHECK_CONDITION(found_arc);
+    }
+
+    objlist<intarray> ninputs,nvertices,noutputs;
+    objlist<floatarray> ncosts;
+    nbest_paths(ninputs,nvertices,noutputs,ncosts,*expanded,2,false);
+    CHECK_CONDITION(noutputs.length()>=1);
+    if(noutputs.length()==2 && sum(ncosts[1])-sum(ncosts[0])<1e-4) return;
+    intarray a,b;
+    remove_eps(a,outputs);
+    remove_eps(b,noutputs[0]);
+    CHECK_CONDITION(same(a,b));
+}
+
+// fst_expand_composition() builds the same composition
+void test_expand_composition() {
+    autodel<OcroFST> fst1(make_OcroFST()), fst2(make_OcroFST());
+    random_fst(*fst1,2+rand()%8,5+rand()%30);
+    random_fst(*fst2,2+rand()%8,5+rand()%30);
+    fst1->sortByOutput();
+    fst2->sortByInput();
+    autodel<OcroFST> expanded(make_OcroFST()), reference(make_OcroFST());
+    fst_expand_composition(*expanded,*fst1,*fst2);
+    expand(*reference,*fst1,*fst2,1.0,false);
+    ustrg s;
+    double cost = a_star(s,*expanded);
+    double lazy = a_star(s,*fst1,*fst2);
+    double expected = a_star(s,*reference);
+    CHECK_CONDITION(cost==expected || fabs(cost-expected)<1e-4);
+    CHECK_CONDITION(lazy==expected || fabs(lazy-expected)<1e-4);
+}
+
+int main() {
+    srand(6);
+    for(int trial=0;trial<300;trial++) {
+        test_a_star(1.0,false);
+        test_a_star(0.3,false);
+        test_a_star(2.0,true);
+        test_expand_composition();
+    }
+}
@@ -0,0 +1,216 @@
+// -*- C++ -*-
+
+// Copyright 2008-2009 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project: ocrofst
+// File: test-beam-search.cc
+// Purpose: check that the ways of running beam_search() agree
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include "ocropus.h"
+
+using namespace colib;
+using namespace ocropus;
+
+namespace {
+    // labels of the lattices and language models
+    const int first_label = 'a';
+    const int nlabels = 80;
+
+    float random_cost() {
+        return rand()/float(RAND_MAX);
+    }
+
+    int random_label() {
+        return first_label+rand()%nlabels;
+    }
+
+    // A line lattice: arcs from each position to the next one or the
+    // one after, and a few epsilon arcs. Some arcs have the labels
+    // 1..4, which match the language model only without specials2.
+    void random_lattice(OcroFST &fst,int length,int alternatives,
+                        int specials_per_100=5) {
+        for(int i=0;i<=length;i++) fst.newState();
+        fst.setStart(0);
+        fst.setAccept(length,0);
+        for(int i=0;i<length;i++) {
+            for(int k=0;k<alternatives;k++) {
+                int label = rand()%100<specials_per_100 ? 1+rand()%4
+                                                        : random_label();
+                int to = i+1<length && rand()%4==0 ? i+2 : i+1;
+                fst.addTransition(i,to,label,random_cost(),label);
+            }
+            if(rand()%8==0) fst.addTransition(i,i+1,0,random_cost(),0);
+        }
+    }
+
+    // A language model: state 0 has an arc for every label, so that
+    // every lattice path is accepted somehow; every state accepts, and
+    // the others have an epsilon backoff arc to state 0, a few ordinary
+    // arcs, and sometimes (or always, if indexed) many, so that they get
+    // a label index. With specials, some arcs are labelled with the
+    // specials 1..4 as they are stored in files.
+    void random_lm(OcroFST &fst,int nstates,bool specials,
+                   bool indexed=false) {
+        for(int i=0;i<nstates;i++) fst.newState();
+        fst.setStart(0);
+        for(int label=first_label;label<first_label+nlabels;label++)
+            fst.addTransition(0,rand()%nstates,label,3*random_cost(),label);
+        for(int i=0;i<nstates;i++) {
+            fst.setAccept(i,2*random_cost());
+            if(i>0) fst.addTransition(i,0,0,random_cost(),0);
+            int narcs = indexed || rand()%5==0 ? 64+rand()%nlabels
+                                               : 1+rand()%6;
+            for(int k=0;k<narcs;k++) {
+                int label = random_label();
+                if(specials && rand()%10==0) label = 1+rand()%4;
+                fst.addTransition(i,rand()%nstates,label,random_cost(),label);
+            }
+        }
+    }
+
+    struct Result {
+        intarray vertices1,vertices2,inputs,outputs;
+        floatarray costs;
+    };
+
+    void search(Result &r,BeamSearchContext &context,OcroFST &fst1,
+                OcroFST &fst2,int beam_width,bool specials2=false) {
+        beam_search(context,r.vertices1,r.vertices2,r.inputs,r.outputs,
+                    r.costs,fst1,fst2,beam_width,1.0,specials2);
+    }
+
+    bool same(intarray &a,intarray &b) {
+        if(a.length()!=b.length()) return false;
+        for(int i=0;i<a.length();i++)
+            if(a[i]!=b[i]) return false;
+        return true;
+    }
+
+    bool same(floatarray &a,floatarray &b) {
+        if(a.length()!=b.length()) return false;
+        for(int i=0;i<a.length();i++)
+            if(a[i]!=b[i]) return false;
+        return true;
+    }
+
+    // the same path, with the same costs
+    void check_same(Result &a,Result &b) {
+        CHECK_CONDITION(same(a.vertices1,b.vertices1));
+        CHECK_CONDITION(same(a.vertices2,b.vertices2));
+        CHECK_CONDITION(same(a.inputs,b.inputs));
+        CHECK_CONDITION(same(a.outputs,b.outputs));
+        CHECK_CONDITION(same(a.costs,b.costs));
+    }
+}
+
+// Splitting the beam among threads must give exactly the result of
+// one thread; wide beams are split, narrow ones are not.
+void test_threads() {
+    autodel<BeamSearchContext> serial(make_BeamSearchContext(1));
+    autodel<BeamSearchContext> parallel(make_BeamSearchContext(4));
+    for(int trial=0;trial<40;trial++) {
+        autodel<OcroFST> lattice(make_OcroFST()), lm(make_OcroFST());
+        random_lattice(*lattice,5+rand()%20,1+rand()%6);
+        random_lm(*lm,10+rand()%200,false);
+        int widths[] = {5,100,1000};
+        for(int w=0;w<3;w++) {
+            Result a,b;
+            search(a,*serial,*lattice,*lm,widths[w]);
+            search(b,*parallel,*lattice,*lm,widths[w]);
+            check_same(a,b);
+        }
+    }
+}
+
+// All matchers make the same relax calls, so they find the same path;
+// the label index is really used for the states with many arcs.
+void test_matchers() {
+    int matchers[] = {
+        BeamSearchContext::MATCH_MERGE,
+        BeamSearchContext::MATCH_GALLOP,
+        BeamSearchContext::MATCH_INDEX
+    };
+    autodel<BeamSearchContext> contexts[3];
+    for(int m=0;m<3;m++) {
+        contexts[m] = make_BeamSearchContext(1);
+        contexts[m]->setMatcher(matchers[m]);
+    }
+    autodel<BeamSearchContext> automatic(make_BeamSearchContext(1));
+    for(int trial=0;trial<40;trial++) {
+        bool specials = trial%2;
+        autodel<OcroFST> lattice(make_OcroFST()), lm(make_OcroFST());
+        random_lattice(*lattice,5+rand()%20,1+rand()%6);
+        random_lm(*lm,10+rand()%200,specials);
+        Result expected;
+        search(expected,*automatic,*lattice,*lm,100,specials);
+        for(int m=0;m<3;m++) {
+            Result r;
+            search(r,*contexts[m],*lattice,*lm,100,specials);
+            check_same(r,expected);
+        }
+    }
+    intarray counts;
+    contexts[2]->getMatchCounts(counts);
+    CHECK_CONDITION(counts(BeamSearchContext::MATCH_INDEX)>0);
+    automatic->getMatchCounts(counts);
+    CHECK_CONDITION(counts(BeamSearchContext::MATCH_INDEX)>0);
+}
+
+// A context keeps the label index of fst2 between searches; it must
+// not reuse it when specials2 changes or when the labels of fst2 are
+// rewritten in place, so a reused context must agree with a new one.
+// An index built with specials2 leaves out the labels 1..4, so the
+// searches start with specials2 and then go without.
+void test_index_reuse() {
+    autodel<BeamSearchContext> reused(make_BeamSearchContext(1));
+    reused->setMatcher(BeamSearchContext::MATCH_INDEX);
+    for(int trial=0;trial<20;trial++) {
+        autodel<OcroFST> lattice(make_OcroFST()), lm(make_OcroFST());
+        random_lattice(*lattice,5+rand()%20,1+rand()%6,30);
+        random_lm(*lm,10+rand()%50,true,true);
+        bool specials[] = {true,false,false,true,false};
+        for(int k=0;k<5;k++) {
+            autodel<BeamSearchContext> fresh(make_BeamSearchContext(1));
+            fresh->setMatcher(BeamSearchContext::MATCH_INDEX);
+            Result a,b;
+            search(a,*reused,*lattice,*lm,100,specials[k]);
+            search(b,*fresh,*lattice,*lm,100,specials[k]);
+            check_same(a,b);
+        }
+        // rewriting the specials of fst2 is the same as specials2
+        autodel<BeamSearchContext> fresh(make_BeamSearchContext(1));
+        fresh->setMatcher(BeamSearchContext::MATCH_INDEX);
+        Result expected,a,b;
+        search(expected,*fresh,*lattice,*lm,100,true);
+        make_specials_neg(*lm,true,true);
+        search(a,*reused,*lattice,*lm,100);
+        search(b,*fresh,*lattice,*lm,100);
+        check_same(a,expected);
+        check_same(b,expected);
+    }
+}
+
+int main() {
+    srand(11);
+    test_threads();
+    test_matchers();
+    test_index_reuse();
+}
@@ -0,0 +1,190 @@
+// -*- C++ -*-
+
+// Copyright 2008-2009 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project: ocrofst
+// File: test-fst-compiled.cc
+// Purpose: check that compiled FSTs map back to what was written, and
+//          that damaged files are rejected
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include <stddef.h>
+#include <unistd.h>
+#include "ocropus.h"
+#include "fst-io.h"
+
+using namespace colib;
+using namespace ocropus;
+
+namespace {
+    char path[] = "/tmp/test-fst-compiledXXXXXX";
+
+    float random_cost() {
+        return rand()/float(RAND_MAX);
+    }
+
+    // some states accept, others can't reach an accept state at all
+    void random_fst(OcroFST &fst,int nstates,int narcs) {
+        for(int i=0;i<nstates;i++) fst.newState();
+        fst.setStart(rand()%nstates);
+        for(int k=0;k<narcs;k++) {
+            int label = rand()%5==0 ? 0 : 'a'+rand()%20;
+            fst.addTransition(rand()%nstates,rand()%nstates,label,
+                              random_cost(),rand()%3 ? label : 'a');
+        }
+        for(int i=0;i<nstates;i++)
+            if(rand()%3==0) fst.setAccept(i,random_cost());
+    }
+
+    void read_file(bytearray &data) {
+        stdio stream(path,"rb");
+        fseek(stream,0,SEEK_END);
+        data.resize(ftell(stream));
+        rewind(stream);
+        CHECK_CONDITION(fread(data.data,1,data.length(),stream)==size_t(data.length()));
+    }
+
+    void write_file(bytearray &data,int length) {
+        stdio stream(path,"wb");
+        CHECK_CONDITION(fwrite(data.data,1,length,stream)==size_t(length));
+    }
+
+    bool loads() {
+        autodel<OcroFST> fst(make_OcroFST());
+        try {
+            fst->load(path);
+        } catch(const char *error) {
+            return false;
+        }
+        return true;
+    }
+
+    template <class T>
+    void poke(bytearray &data,int64_t pos,T value) {
+        memcpy(&data[pos],&value,sizeof value);
+    }
+
+    CompiledFstHeader &header(bytearray &data) {
+        return *(CompiledFstHeader *) data.data;
+    }
+}
+
+// The mapped FST has the states, start, accept costs, arcs, sort flags
+// and heuristics of the one written, and searches the same.
+void test_roundtrip(int sorting) {
+    autodel<OcroFST> fst(make_OcroFST());
+    random_fst(*fst,1+rand()%50,rand()%300);
+    if(sorting==1) fst->sortByInput();
+    if(sorting==2) fst->sortByOutput();
+    fst_write_compiled(path,*fst);
+    CHECK_CONDITION(fst_is_compiled(path));
+
+    autodel<OcroFST> loaded(make_OcroFST());
+    loaded->load(path);
+    int n = fst->nStates(), m = fst->nArcs();
+    CHECK_CONDITION(loaded->nStates()==n);
+    CHECK_CONDITION(loaded->nArcs()==m);
+    CHECK_CONDITION(loaded->getStart()==fst->getStart());
+    for(int i=0;i<n;i++)
+        CHECK_CONDITION(loaded->getAcceptCost(i)==fst->getAcceptCost(i));
+    for(int i=0;i<=n;i++)
+        CHECK_CONDITION(loaded->arcOffsets()[i]==fst->arcOffsets()[i]);
+    for(int k=0;k<m;k++) {
+        CHECK_CONDITION(loaded->arcTargets()[k]==fst->arcTargets()[k]);
+        CHECK_CONDITION(loaded->arcInputs()[k]==fst->arcInputs()[k]);
+        CHECK_CONDITION(loaded->arcOutputs()[k]==fst->arcOutputs()[k]);
+        CHECK_CONDITION(loaded->arcCosts()[k]==fst->arcCosts()[k]);
+    }
+    CHECK_CONDITION(loaded->hasFlag(OcroFST::SORTED_BY_INPUT)==
+                    fst->hasFlag(OcroFST::SORTED_BY_INPUT));
+    CHECK_CONDITION(loaded->hasFlag(OcroFST::SORTED_BY_OUTPUT)==
+                    fst->hasFlag(OcroFST::SORTED_BY_OUTPUT));
+    CHECK_CONDITION(loaded->hasFlag(OcroFST::HAS_HEURISTICS));
+    floatarray &h = fst->heuristics(), &lh = loaded->heuristics();
+    CHECK_CONDITION(lh.length()==n);
+    for(int i=0;i<n;i++)
+        CHECK_CONDITION(lh[i]==h[i]);
+
+    ustrg s;
+    CHECK_CONDITION(a_star(s,*loaded)==a_star(s,*fst));
+}
+
+// Truncated files and damaged headers, offsets, start states and
+// targets are rejected when loading, instead of being read out of
+// bounds later.
+void test_rejection() {
+    autodel<OcroFST> fst(make_OcroFST());
+    random_fst(*fst,20,100);
+    fst_write_compiled(path,*fst);
+    bytearray good;
+    read_file(good);
+    CHECK_CONDITION(loads());
+    CompiledFstHeader &h = header(good);
+    int n = h.nstates, m = h.narcs;
+
+    int lengths[] = {
+        0,
+        sizeof(CompiledFstHeader)-1,
+        sizeof(CompiledFstHeader),
+        int(h.targets_pos),
+        good.length()-1
+    };
+    for(int i=0;i<int(sizeof lengths/sizeof lengths[0]);i++) {
+        write_file(good,lengths[i]);
+        CHECK_CONDITION(!loads());
+    }
+
+    for(int damage=0;damage<12;damage++) {
+        bytearray bad;
+        copy(bad,good);
+        CompiledFstHeader &b = header(bad);
+        switch(damage) {
+        case 0: b.version = COMPILED_FST_VERSION+1; break;
+        case 1: b.size = good.length()+8; break;
+        case 2: b.nstates = -1; break;
+        case 3: b.narcs = m+1; break;
+        case 4: b.start = n; break;
+        case 5: b.start = -2; break;
+        case 6: b.costs_pos += 2; break;
+        case 7: b.heuristics_pos = good.length(); break;
+        case 8: b.offsets_pos = 0; break;
+        case 9: poke(bad,h.offsets_pos+n*sizeof(int),m-1); break;
+        case 10: poke(bad,h.offsets_pos+(n/2)*sizeof(int),m+1); break;
+        case 11: poke(bad,h.targets_pos+(m/2)*sizeof(int),n); break;
+        }
+        write_file(bad,bad.length());
+        CHECK_CONDITION(!loads());
+    }
+
+    // the intact file still loads
+    write_file(good,good.length());
+    CHECK_CONDITION(loads());
+}
+
+int main() {
+    int fd = mkstemp(path);
+    CHECK_CONDITION(fd>=0);
+    close(fd);
+    srand(14);
+    for(int trial=0;trial<30;trial++)
+        test_roundtrip(trial%3);
+    test_rejection();
+    unlink(path);
+}
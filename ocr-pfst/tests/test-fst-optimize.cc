@@ -0,0 +1,204 @@
+// -*- C++ -*-
+
+// Copyright 2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: test-fst-optimize.cc
+// Purpose: check that epsilon removal, determinization and minimization
+//          keep the cost of every label pair sequence
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include "ocropus.h"
+
+using namespace colib;
+using namespace ocropus;
+
+namespace {
+    // the label pairs (input:output) of the random FSTs; 0:0 is epsilon
+    const int npairs = 5;
+    const int pair_inputs[npairs] = {1,2,3,0,2};
+    const int pair_outputs[npairs] = {1,2,3,1,0};
+
+    bool is_epsilon(FstArcs &a,int k) {
+        return a.inputs[k]==0 && a.outputs[k]==0;
+    }
+
+    // Relax the epsilon arcs until nothing changes (costs are not
+    // negative, so this terminates).
+    void epsilon_closure(OcroFST &fst,floatarray &d) {
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            for(int s=0;s<fst.nStates();s++) {
+                if(d[s]==INFINITY) continue;
+                FstArcs a;
+                fst.arcSpan(a,s);
+                for(int k=0;k<a.length;k++) {
+                    if(!is_epsilon(a,k)) continue;
+                    float c = d[s]+a.costs[k];
+                    if(c<d[a.targets[k]]) {
+                        d[a.targets[k]] = c;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    // The cost of the best accepted path whose non-epsilon arcs are
+    // labelled with the given pairs (INFINITY if there is none).
+    float path_cost(OcroFST &fst,intarray &pairs) {
+        int n = fst.nStates();
+        floatarray d(n);
+        fill(d,INFINITY);
+        d[fst.getStart()] = 0;
+        for(int step=0;;step++) {
+            epsilon_closure(fst,d);
+            if(step==pairs.length()) break;
+            int in = pair_inputs[pairs[step]];
+            int out = pair_outputs[pairs[step]];
+            floatarray e(n);
+            fill(e,INFINITY);
+            for(int s=0;s<n;s++) {
+                if(d[s]==INFINITY) continue;
+                FstArcs a;
+                fst.arcSpan(a,s);
+                for(int k=0;k<a.length;k++) {
+                    if(a.inputs[k]!=in || a.outputs[k]!=out) continue;
+                    e[a.targets[k]] = min(e[a.targets[k]],d[s]+a.costs[k]);
+                }
+            }
+            move(d,e);
+        }
+        float best = INFINITY;
+        for(int s=0;s<n;s++)
+            best = min(best,d[s]+fst.acceptCost(s));
+        return best;
+    }
+
+    // Arcs with costs in multiples of 1/2 (exact after the rounding to
+    // 1/1024 done by the optimizations); acyclic FSTs only have arcs to
+    // later states, so they can always be determinized.
+    void random_fst(OcroFST &fst,int nstates,int narcs,bool acyclic) {
+        for(int i=0;i<nstates;i++) fst.newState();
+        fst.setStart(0);
+        for(int k=0;k<narcs;k++) {
+            int from = rand()%nstates;
+            int to = rand()%nstates;
+            if(acyclic) {
+                if(from==nstates-1) continue;
+                to = from+1+rand()%(nstates-from-1);
+            }
+            int p = rand()%(npairs+1);
+            int in = p<npairs?pair_inputs[p]:0;
+            int out = p<npairs?pair_outputs[p]:0;
+            fst.addTransition(from,to,out,(rand()%8)*0.5,in);
+        }
+        for(int k=0;k<2;k++)
+            fst.setAccept(rand()%nstates,(rand()%4)*0.5);
+    }
+
+    // every label pair sequence up to length 3 must cost the same
+    void check_same_costs(OcroFST &a,OcroFST &b) {
+        intarray pairs;
+        for(int len=0;len<=3;len++) {
+            int total = 1;
+            for(int i=0;i<len;i++) total *= npairs;
+            pairs.resize(len);
+            for(int c=0;c<total;c++) {
+                int x = c;
+                for(int i=0;i<len;i++) {
+                    pairs[i] = x%npairs;
+                    x /= npairs;
+                }
+                float ca = path_cost(a,pairs);
+                float cb = path_cost(b,pairs);
+                CHECK_CONDITION(ca==cb || fabs(ca-cb)<1e-3);
+            }
+        }
+    }
+
+    void check_no_epsilons(OcroFST &fst) {
+        for(int s=0;s<fst.nStates();s++) {
+            FstArcs a;
+            fst.arcSpan(a,s);
+            for(int k=0;k<a.length;k++)
+                CHECK_CONDITION(!is_epsilon(a,k));
+        }
+    }
+
+    // at most one arc per label pair leaving each state
+    void check_deterministic(OcroFST &fst) {
+        for(int s=0;s<fst.nStates();s++) {
+            FstArcs a;
+            fst.arcSpan(a,s);
+            for(int i=0;i<a.length;i++)
+                for(int j=i+1;j<a.length;j++)
+                    CHECK_CONDITION(a.inputs[i]!=a.inputs[j] ||
+                                    a.outputs[i]!=a.outputs[j]);
+        }
+    }
+}
+
+void test_remove_epsilons() {
+    for(int trial=0;trial<200;trial++) {
+        autodel<OcroFST> src(make_OcroFST()), dst(make_OcroFST());
+        random_fst(*src,2+rand()%7,rand()%20,false);
+        fst_remove_epsilons(*dst,*src);
+        check_no_epsilons(*dst);
+        check_same_costs(*src,*dst);
+    }
+}
+
+void test_determinize_minimize() {
+    for(int trial=0;trial<200;trial++) {
+        autodel<OcroFST> src(make_OcroFST());
+        random_fst(*src,2+rand()%7,rand()%20,true);
+        autodel<OcroFST> e(make_OcroFST()), d(make_OcroFST()), m(make_OcroFST());
+        fst_remove_epsilons(*e,*src);
+        fst_determinize(*d,*e);
+        check_deterministic(*d);
+        check_same_costs(*src,*d);
+        fst_minimize(*m,*d);
+        check_deterministic(*m);
+        check_same_costs(*src,*m);
+        CHECK_CONDITION(m->nStates()<=d->nStates());
+    }
+}
+
+void test_optimize() {
+    for(int trial=0;trial<200;trial++) {
+        bool acyclic = trial%2==0;
+        autodel<OcroFST> src(make_OcroFST()), dst(make_OcroFST());
+        random_fst(*src,2+rand()%7,rand()%20,acyclic);
+        // cyclic FSTs may not be determinizable
+        fst_optimize(*dst,*src,acyclic,true);
+        check_no_epsilons(*dst);
+        if(acyclic) check_deterministic(*dst);
+        check_same_costs(*src,*dst);
+    }
+}
+
+int main() {
+    srand(11);
+    test_remove_epsilons();
+    test_determinize_minimize();
+    test_optimize();
+}
@@ -0,0 +1,236 @@
+// -*- C++ -*-
+
+// Copyright 2008-2009 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project: ocrofst
+// File: test-nbest-paths.cc
+// Purpose: check nbest_paths() and beam_search_nbest() against the list
+//          of all paths of small acyclic FSTs
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include "ocropus.h"
+
+using namespace colib;
+using namespace ocropus;
+
+namespace {
+    float random_cost() {
+        return rand()/float(RAND_MAX);
+    }
+
+    // a few labels, so that different paths often have the same output
+    int random_label() {
+        return rand()%6==0 ? 0 : 'a'+rand()%3;
+    }
+
+    // An acyclic FST: arcs only go to states with higher numbers, and
+    // some states accept. With tree, every state but the start has one
+    // incoming arc, so that no two paths meet.
+    void random_dag(OcroFST &fst,int nstates,bool tree) {
+        for(int i=0;i<nstates;i++) fst.newState();
+        fst.setStart(0);
+        for(int i=1;i<nstates;i++) {
+            int nin = tree ? 1 : 1+rand()%3;
+            for(int k=0;k<nin;k++) {
+                int from = rand()%i;
+                int label = random_label();
+                fst.addTransition(from,i,label,random_cost(),label);
+            }
+            if(rand()%3==0 || i==nstates-1)
+                fst.setAccept(i,random_cost());
+        }
+    }
+
+    // all paths: their total costs and outputs without epsilons
+    struct Paths {
+        floatarray totals;
+        objlist<intarray> outputs;
+    };
+
+    void enumerate(Paths &paths,OcroFST &fst,int v,float cost,intarray &out) {
+        float accept = fst.getAcceptCost(v);
+        if(accept<INFINITY) {
+            paths.totals.push(cost+accept);
+            copy(paths.outputs.push(),out);
+        }
+        FstArcs a;
+        fst.arcSpan(a,v);
+        for(int i=0;i<a.length;i++) {
+            if(a.outputs[i]) out.push(a.outputs[i]);
+            enumerate(paths,fst,a.targets[i],cost+a.costs[i],out);
+            if(a.outputs[i]) out.pop();
+        }
+    }
+
+    void remove_eps(intarray &result,intarray &labels) {
+        result.clear();
+        for(int i=0;i<labels.length();i++)
+            if(labels[i]) result.push(labels[i]);
+    }
+
+    bool same(intarray &a,intarray &b) {
+        if(a.length()!=b.length()) return false;
+        for(int i=0;i<a.length();i++)
+            if(a[i]!=b[i]) return false;
+        return true;
+    }
+
+    bool same_path(intarray &v1,intarray &in1,intarray &out1,floatarray &c1,
+                   intarray &v2,intarray &in2,intarray &out2,floatarray &c2) {
+        if(!same(v1,v2) || !same(in1,in2) || !same(out1,out2)) return false;
+        if(c1.length()!=c2.length()) return false;
+        for(int i=0;i<c1.length();i++)
+            if(c1[i]!=c2[i]) return false;
+        return true;
+    }
+
+    // the cheapest path with the given output, or INFINITY
+    float best_total(Paths &paths,intarray &out) {
+        float best = INFINITY;
+        for(int i=0;i<paths.totals.length();i++)
+            if(same(paths.outputs[i],out)) best = min(best,paths.totals[i]);
+        return best;
+    }
+
+    bool close(float a,float b) {
+        return fabs(a-b)<1e-4;
+    }
+
+    // The paths found, with or without unique outputs, are the first
+    // ones of all paths ordered by cost (or of the cheapest path for
+    // each output), each once.
+    void check_nbest(Paths &paths,objlist<intarray> &outputs,
+                     objlist<floatarray> &costs,int n,bool unique) {
+        floatarray expected;
+        for(int i=0;i<paths.totals.length();i++) {
+            bool first = true;
+            for(int j=0;unique && first && j<i;j++)
+                first = !same(paths.outputs[i],paths.outputs[j]) ||
+                        paths.totals[i]<paths.totals[j];
+            for(int j=i+1;unique && first && j<paths.totals.length();j++)
+                first = !same(paths.outputs[i],paths.outputs[j]) ||
+                        paths.totals[i]<=paths.totals[j];
+            if(first) expected.push(paths.totals[i]);
+        }
+        intarray permutation;
+        quicksort(permutation,expected);
+        CHECK_CONDITION(outputs.length()==min(n,expected.length()));
+        CHECK_CONDITION(costs.length()==outputs.length());
+        intarray out,other;
+        for(int k=0;k<outputs.length();k++) {
+            float total = sum(costs[k]);
+            CHECK_CONDITION(close(total,expected[permutation[k]]));
+            remove_eps(out,outputs[k]);
+            CHECK_CONDITION(best_total(paths,out)<=total+1e-4);
+            if(!unique) continue;
+            CHECK_CONDITION(close(best_total(paths,out),total));
+            for(int j=0;j<k;j++) {
+                remove_eps(other,outputs[j]);
+                CHECK_CONDITION(!same(out,other));
+            }
+        }
+    }
+}
+
+// nbest_paths(): every path is a path of the FST (vertex by vertex,
+// with the accept cost last), no path is reported twice, and the
+// totals are those of all paths in increasing order.
+void test_nbest_paths(int nstates,bool tree) {
+    autodel<OcroFST> fst(make_OcroFST());
+    random_dag(*fst,nstates,tree);
+    Paths paths;
+    intarray out;
+    enumerate(paths,*fst,0,0,out);
+    int all = paths.totals.length();
+    int ns[] = {1,3,all,all+5};
+    for(int t=0;t<4;t++) {
+        for(int unique=0;unique<2;unique++) {
+            objlist<intarray> inputs,vertices,outputs;
+            objlist<floatarray> costs;
+            int found = nbest_paths(inputs,vertices,outputs,costs,*fst,
+                                    ns[t],unique);
+            CHECK_CONDITION(found==outputs.length());
+            check_nbest(paths,outputs,costs,ns[t],unique);
+            for(int k=0;k<found;k++) {
+                intarray &v = vertices[k];
+                int len = v.length();
+                CHECK_CONDITION(len>0 && v[0]==fst->getStart());
+                CHECK_CONDITION(inputs[k].length()==len);
+                CHECK_CONDITION(costs[k].length()==len);
+                for(int i=0;i+1<len;i++) {
+                    FstArcs a;
+                    fst->arcSpan(a,v[i]);
+                    bool found_arc = false;
+                    for(int j=0;j<a.length;j++)
+                        found_arc = found_arc ||
+                            (a.targets[j]==v[i+1] &&
+                             a.inputs[j]==inputs[k][i] &&
+                             a.outputs[j]==outputs[k][i] &&
+                             a.costs[j]==costs[k][i]);
+                    CHECK_CONDITION(found_arc);
+                }
+                CHECK_CONDITION(costs[k][len-1]==fst->getAcceptCost(v[len-1]));
+                for(int j=0;j<k;j++)
+                    CHECK_CONDITION(!same_path(v,inputs[k],outputs[k],costs[k],
+                                               vertices[j],inputs[j],outputs[j],
+                                               costs[j]));
+            }
+        }
+    }
+}
+
+// beam_search_nbest() with a language model that accepts everything
+// for free, and a beam wide enough for all paths: on a tree, where no
+// two paths meet in the beam, it finds the same paths as nbest_paths().
+void test_beam_search_nbest(int nstates) {
+    autodel<OcroFST> fst(make_OcroFST()), lm(make_OcroFST());
+    random_dag(*fst,nstates,true);
+    lm->newState();
+    lm->setStart(0);
+    lm->setAccept(0,0);
+    for(int label='a';label<'a'+3;label++)
+        lm->addTransition(0,0,label,0,label);
+    Paths paths;
+    intarray out;
+    enumerate(paths,*fst,0,0,out);
+    int all = paths.totals.length();
+    autodel<BeamSearchContext> context(make_BeamSearchContext(1));
+    int ns[] = {1,3,all,all+5};
+    for(int t=0;t<4;t++) {
+        for(int unique=0;unique<2;unique++) {
+            objlist<intarray> v1,v2,inputs,outputs;
+            objlist<floatarray> costs;
+            int found = beam_search_nbest(*context,v1,v2,inputs,outputs,costs,
+                                          *fst,*lm,ns[t],1000,1.0,false,
+                                          unique);
+            CHECK_CONDITION(found==outputs.length());
+            check_nbest(paths,outputs,costs,ns[t],unique);
+        }
+    }
+}
+
+int main() {
+    srand(7);
+    for(int trial=0;trial<50;trial++) {
+        test_nbest_paths(2+rand()%10,false);
+        test_nbest_paths(2+rand()%15,true);
+        test_beam_search_nbest(2+rand()%15);
+    }
+}
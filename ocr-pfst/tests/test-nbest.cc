@@ -0,0 +1,142 @@
+// -*- C++ -*-
+
+// Copyright 2008 Deutsches Forschungszentrum fuer Kuenstliche Intelligenz
+// or its licensors, as applicable.
+//
+// You may not use this file except under the terms of the accompanying license.
+//
+// Licensed under the Apache License, Version 2.0 (the "License"); you
+// may not use this file except in compliance with the License. You may
+// obtain a copy of the License at http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Project:
+// File: test-nbest.cc
+// Purpose: check the heap/hash PriorityQueue against a linear n-best list
+// Responsible: mezhirov
+// Reviewer:
+// Primary Repository:
+// Web Sites:
+
+
+#include "ocropus.h"
+#include "fst-heap.h"
+
+using namespace colib;
+using namespace ocropus;
+
+namespace {
+    // The n best elements kept in plain arrays, searched linearly.
+    struct NaiveNBest {
+        int n;
+        intarray ids,tags;
+        floatarray values;
+        NaiveNBest(int n):n(n) {}
+        void clear() {
+            ids.clear(); tags.clear(); values.clear();
+        }
+        int find_id(int id) {
+            for(int i=0;i<ids.length();i++)
+                if(ids[i]==id) return i;
+            return -1;
+        }
+        bool add(int id,int tag,float value) {
+            if(ids.length()==n) {
+                if(n==0) return false;
+                int worst = 0;
+                for(int i=1;i<n;i++)
+                    if(values[i]<values[worst]) worst = i;
+                if(values[worst]>=value) return false;
+                ids[worst] = id; tags[worst] = tag; values[worst] = value;
+                return true;
+            }
+            ids.push(id); tags.push(tag); values.push(value);
+            return true;
+        }
+        bool add_replacing_id(int id,int tag,float value) {
+            int former = find_id(id);
+            if(former==-1) return add(id,tag,value);
+            if(values[former]>=value) return false;
+            tags[former] = tag;
+            values[former] = value;
+            return true;
+        }
+    };
+
+    // The queue and the reference must hold the same elements; since
+    // the lengths agree and ids are unique, finding every element of
+    // the reference in the queue is enough.
+    void check_same(PriorityQueue &pq,NaiveNBest &ref,int nids) {
+        CHECK_CONDITION(pq.length()==ref.ids.length());
+        for(int j=0;j<ref.ids.length();j++) {
+            int i = pq.find_id(ref.ids[j]);
+            CHECK_CONDITION(i>=0);
+            CHECK_CONDITION(pq[i]==ref.ids[j]);
+            CHECK_CONDITION(pq.tag(i)==ref.tags[j]);
+            CHECK_CONDITION(pq.value(i)==ref.values[j]);
+        }
+        int id = rand()%nids;
+        if(ref.find_id(id)<0) CHECK_CONDITION(pq.find_id(id)==-1);
+    }
+
+    // Values are distinct (multiplying by an odd number permutes the
+    // integers mod 2^24, which floats represent exactly), so which
+    // element is the worst is never ambiguous.
+    int value_counter = 0;
+    float fresh_value() {
+        value_counter++;
+        return (unsigned(value_counter)*7919u) & 0xffffffu;
+    }
+}
+
+void test_nbest(int n,int nids,int nops) {
+    PriorityQueue pq(n);
+    NaiveNBest ref(n);
+    for(int op=0;op<nops;op++) {
+        int r = rand()%100;
+        if(r<2) {
+            pq.clear();
+            ref.clear();
+        } else if(r<50) {
+            int id = rand()%nids;
+            if(ref.find_id(id)>=0) continue;
+            int tag = rand();
+            float value = fresh_value();
+            CHECK_CONDITION(pq.add(id,tag,value)==ref.add(id,tag,value));
+        } else {
+            int id = rand()%nids;
+            int tag = rand();
+            float value = fresh_value();
+            CHECK_CONDITION(pq.add_replacing_id(id,tag,value)==
+                            ref.add_replacing_id(id,tag,value));
+        }
+        check_same(pq,ref,nids);
+    }
+
+    // sort() ranks the same elements by decreasing value
+    int m = pq.length();
+    pq.sort();
+    CHECK_CONDITION(pq.length()==m);
+    for(int i=0;i<m;i++) {
+        int j = ref.find_id(pq[i]);
+        CHECK_CONDITION(j>=0);
+        CHECK_CONDITION(pq.tag(i)==ref.tags[j]);
+        CHECK_CONDITION(pq.value(i)==ref.values[j]);
+        if(i>0) CHECK_CONDITION(pq.value(i-1)>pq.value(i));
+    }
+}
+
+int main() {
+    srand(17);
+    test_nbest(0,10,100);
+    test_nbest(1,10,1000);
+    test_nbest(2,10,1000);
+    test_nbest(7,20,3000);
+    test_nbest(50,80,10000);
+    test_nbest(100,300,5000);
+}
@@ -2,18 +2,52 @@
 #include <iulib/iulib.h>
 #include "ocropus.h"
 #include "bookstore.h"
+#include "fst-io.h"
 
 using namespace colib;
 using namespace iulib;
 using namespace ocropus;
 
 namespace ocropus {
+    param_bool lattice_archive("lattice_archive",0,"write the lattices of each page into one archive (dir/PAGE.fsts)");
+
     struct OldBookStore : IBookStore {
         // FIXME make this OMP safe: allow parallel accesses etc.
 
         strg prefix;
         narray<intarray> lines;
 
+        // lattice archives by page; opened on first use
+        narray<FstArchiveReader *> archives;
+        bytearray archive_checked;
+
+        // lattices waiting for flushLattices(), by page
+        narray<intarray> pending_lines;
+        narray< objlist<bytearray> > pending_records;
+
+        // Callers should flushLattices() themselves to see errors; a
+        // destructor must not throw, so here they are only reported.
+        virtual ~OldBookStore() {
+            try {
+                flushLattices();
+            } catch(const char *s) {
+                fprintf(stderr,"bookstore: lattices of %s not written: %s\n",
+                        (const char *)prefix,s);
+            } catch(...) {
+                fprintf(stderr,"bookstore: lattices of %s not written\n",
+                        (const char *)prefix);
+            }
+            closeArchives();
+        }
+
+        void closeArchives() {
+            for(int i=0;i<archives.length();i++) {
+                delete archives[i];
+                archives[i] = 0;
+            }
+            fill(archive_checked,0);
+        }
+
         virtual int get_max_page(const char *fpattern) {
             int npages = -1;
             {
@@ -68,6 +102,9 @@ namespace ocropus {
 
         void setPrefix(const char *s) {
             {
+                // the pending lattices belong to the previous book
+                flushLattices();
+                closeArchives();
                 prefix = s;
                 int ndirs = get_max_page("[0-9][0-9][0-9][0-9]");
                 CHECK(ndirs<10000);
@@ -75,6 +112,12 @@ namespace ocropus {
                 CHECK(npngs<10000);
                 int npages = max(ndirs,npngs);
                 CHECK(npages<10000);
+                archives.resize(npages);
+                fill(archives,(FstArchiveReader*)0);
+                archive_checked.resize(npages);
+                fill(archive_checked,0);
+                pending_lines.resize(npages);
+                pending_records.resize(npages);
                 lines.resize(npages);
                 for(int i=0;i<npages;i++) {
                     get_lines_of_page(lines(i),i);
@@ -177,6 +220,88 @@ namespace ocropus {
             return lines.length();
         }
 
+        FstArchiveReader *getArchive(int page) {
+            FstArchiveReader *result = 0;
+#pragma omp critical (bookstore_archives)
+            {
+                if(page<archives.length()) {
+                    if(!archive_checked[page]) {
+                        strg s = path(page,-1,0,"fsts");
+                        try {
+                            if(file_exists(s)) archives[page] = make_FstArchiveReader(s);
+                        } catch(const char *error) {
+                            debugf("warn","%s\n",error);
+                        }
+                        archive_checked[page] = 1;
+                    }
+                    result = archives[page];
+                }
+            }
+            return result;
+        }
+
+        virtual void getLattice(IGenericFst &fst,int page,int line,const char *variant=0) {
+            if(!variant) {
+                FstArchiveReader *archive = getArchive(page);
+                int i = archive ? archive->find(line) : -1;
+                if(i>=0) {
+                    archive->read(fst,i);
+                    return;
+                }
+            }
+            fst.load(path(page,line,variant,"fst"));
+        }
+
+        virtual bool hasLattice(int page,int line,const char *variant=0) {
+            if(!variant) {
+                FstArchiveReader *archive = getArchive(page);
+                if(archive && archive->find(line)>=0) return true;
+            }
+            return IBookStore::hasLattice(page,line,variant);
+        }
+
+        virtual void putLattice(IGenericFst &fst,int page,int line,const char *variant=0) {
+            if(variant || !lattice_archive || page>=pending_lines.length()) {
+                fst.save(path(page,line,variant,"fst"));
+                return;
+            }
+            bytearray record;
+            fst_write(record,fst);
+#pragma omp critical (bookstore_pending)
+            {
+                pending_lines[page].push(line);
+                move(pending_records[page].push(),record);
+            }
+        }
+
+        // Merge the pending lattices of each page into its archive.
+        // This must not run in parallel with putLattice() or getLattice().
+        virtual void flushLattices() {
+            for(int page=0;page<pending_lines.length();page++) {
+                intarray &plines = pending_lines[page];
+                objlist<bytearray> &records = pending_records[page];
+                if(plines.length()==0) continue;
+                FstArchiveReader *archive = getArchive(page);
+                if(archive) {
+                    for(int i=0;i<archive->length();i++) {
+                        if(first_index_of(plines,archive->lineId(i))>=0) continue;
+                        plines.push(archive->lineId(i));
+                        archive->record(records.push(),i);
+                    }
+                }
+                strg s = path(page,-1,0,"fsts");
+                strg tmp = s;
+                tmp += ".tmp";
+                fst_archive_write(tmp,plines,records);
+                delete archives[page];
+                archives[page] = 0;
+                archive_checked[page] = 0;
+                if(rename(tmp,s)) throwf("%s: cannot rename to %s",tmp.c_str(),s.c_str());
+                plines.clear();
+                records.clear();
+            }
+        }
+
     };
 
     struct BookStore : OldBookStore {
@@ -248,6 +373,11 @@ namespace ocropus {
         virtual int numberOfPages() { return p->numberOfPages(); }
         virtual int linesOnPage(int i) { return p->linesOnPage(i); }
         virtual int getLineId(int i,int j) { return p->getLineId(i,j); }
+
+        virtual void getLattice(IGenericFst &fst,int page,int line,const char *variant=0) { p->getLattice(fst,page,line,variant); }
+        virtual void putLattice(IGenericFst &fst,int page,int line,const char *variant=0) { p->putLattice(fst,page,line,variant); }
+        virtual bool hasLattice(int page,int line,const char *variant=0) { return p->hasLattice(page,line,variant); }
+        virtual void flushLattices() { if(p) p->flushLattices(); }
     };
 
     IBookStore *make_OldBookStore() {
@@ -84,14 +84,26 @@ namespace ocropus {
             make_line_segmentation_black(image);
         }
 
-        void getLattice(IGenericFst &fst,int page,int line,const char *variant=0) {
+        // Line lattices are kept either in one file per line or, for the
+        // default variant, in a lattice archive per page (see fst-io.h).
+        // Lattices put into an archive are written by flushLattices().
+
+        virtual void getLattice(IGenericFst &fst,int page,int line,const char *variant=0) {
             strg s(path(page,line,variant,"fst"));
             fst.load(s);
         }
-        void putLattice(IGenericFst &fst,int page,int line,const char *variant=0) {
+        virtual void putLattice(IGenericFst &fst,int page,int line,const char *variant=0) {
             strg s(path(page,line,variant,"fst"));
             fst.save(s);
         }
+        virtual bool hasLattice(int page,int line,const char *variant=0) {
+            FILE *stream = open("r",page,line,variant,"fst");
+            if(!stream) return false;
+            fclose(stream);
+            return true;
+        }
+        virtual void flushLattices() {
+        }
 
     };
 
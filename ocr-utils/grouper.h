@@ -138,6 +138,56 @@ namespace ocropus {
 
     IGrouper *make_SimpleGrouper();
     IGrouper *make_StandardGrouper(); // synonymous
+
+    // Classes and space costs for the groups of a grouper, collected
+    // by one thread without locking and handed to the grouper at once
+    // with flush(). The classes of each group keep their order, so the
+    // lattice doesn't depend on how the groups were divided up.
+
+    struct GrouperBuffer {
+        intarray indexes;
+        narray<ustrg> classes;
+        floatarray costs;
+        intarray space_indexes;
+        floatarray space_yes;
+        floatarray space_no;
+
+        void setClass(int i,int cls,float cost) {
+            indexes.push(i);
+            classes.push().clear();
+            classes.last().push(nuchar(cls));
+            costs.push(cost);
+        }
+        void setClass(int i,ustrg &cls,float cost) {
+            indexes.push(i);
+            classes.push() = cls;
+            costs.push(cost);
+        }
+        void setSpaceCost(int i,float yes,float no) {
+            space_indexes.push(i);
+            space_yes.push(yes);
+            space_no.push(no);
+        }
+        void clear() {
+            indexes.clear();
+            classes.clear();
+            costs.clear();
+            space_indexes.clear();
+            space_yes.clear();
+            space_no.clear();
+        }
+
+        // Add everything to the grouper and clear the buffer.
+        // Only one thread at a time may flush into a grouper.
+
+        void flush(IGrouper &grouper) {
+            for(int i=0;i<indexes.length();i++)
+                grouper.setClass(indexes[i],classes[i],costs[i]);
+            for(int i=0;i<space_indexes.length();i++)
+                grouper.setSpaceCost(space_indexes[i],space_yes[i],space_no[i]);
+            clear();
+        }
+    };
 }
 
 